@@ -0,0 +1,601 @@
+/*
+ * fast-mem-loadgen: load generator for fast-mem-server
+ *
+ * Each thread keeps a number of connections busy with a fixed number of
+ * pipelined requests for random pages, or for the pages of a sequential
+ * scan, and records how long each one takes to come back in full.  At the
+ * end the throughput and latency percentiles of all threads are printed
+ * as key=value lines, with how much of what the server sent was useful.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+#include "contrib/fast-mem-server/fast-mem-server.h"
+
+#define LG_DEFAULT_ADDRESS      "127.0.0.1"
+#define LG_DEFAULT_DEPTH        8
+#define LG_DEFAULT_DURATION     10
+/* deeper than the server queue, so that its back-pressure gets tested */
+#define LG_MAX_DEPTH            (4 * FMS_CONN_QUEUE)
+#define LG_RX_SIZE              (256 * 1024)
+/* how long the responses still in flight get once the test is over */
+#define LG_DRAIN_NS             (5 * NANOSECONDS_PER_SECOND)
+
+/*
+ * Latency histogram: values below 2^LG_SUB_BITS ns have a bucket each,
+ * above that every power of two is split in 2^LG_SUB_BITS buckets, for a
+ * relative error under 1/2^LG_SUB_BITS.
+ */
+#define LG_SUB_BITS             5
+#define LG_SUB_BUCKETS          (1 << LG_SUB_BITS)
+#define LG_BUCKETS              ((64 - LG_SUB_BITS + 1) * LG_SUB_BUCKETS)
+
+typedef struct LgArgs {
+    const char *address;
+    uint16_t port;
+    unsigned threads;
+    unsigned conns;
+    unsigned depth;
+    unsigned npages;             /* 0 for offset-only requests */
+    bool adaptive;               /* let the server pick how many pages */
+    bool sequential;             /* scan the image instead of random pages */
+    uint64_t image_size;
+    unsigned duration;
+} LgArgs;
+
+typedef struct LgConn {
+    int fd;
+    uint64_t next;               /* next page of a sequential scan */
+    /* send times of the requests in flight, oldest first */
+    int64_t sent[LG_MAX_DEPTH];
+    unsigned head;
+    unsigned inflight;
+    /* the response being received */
+    uint8_t reply[sizeof(FmsReply)];
+    size_t reply_got;
+    size_t remaining;
+    /* requests not yet taken by the socket */
+    uint8_t tx[LG_MAX_DEPTH * sizeof(FmsRequest)];
+    size_t tx_len;
+} LgConn;
+
+typedef struct LgThread {
+    QemuThread thread;
+    const LgArgs *args;
+    uint64_t seed;
+    uint64_t requests;
+    uint64_t pages;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t stalled;
+    uint64_t hist[LG_BUCKETS];
+    int64_t max_ns;
+} LgThread;
+
+static bool lg_stop;
+
+static unsigned
+lg_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < LG_SUB_BUCKETS) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return (msb - LG_SUB_BITS + 1) * LG_SUB_BUCKETS +
+           ((ns >> (msb - LG_SUB_BITS)) & (LG_SUB_BUCKETS - 1));
+}
+
+/* upper bound of the values counted in @bucket */
+static uint64_t
+lg_bucket_value(unsigned bucket)
+{
+    unsigned shift = bucket / LG_SUB_BUCKETS;
+    uint64_t sub = bucket % LG_SUB_BUCKETS;
+
+    if (!shift) {
+        return sub;
+    }
+    shift--;
+    return ((LG_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static uint64_t
+lg_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static bool
+lg_has_header(const LgArgs *args)
+{
+    return args->npages || args->adaptive;
+}
+
+static void
+lg_queue_request(LgThread *t, LgConn *conn)
+{
+    const LgArgs *args = t->args;
+    unsigned npages = args->adaptive ? 1 : args->npages ?: FMS_LEGACY_PAGES;
+    uint64_t pages = args->image_size / FMS_PAGE_SIZE;
+    uint64_t offset = 0;
+    uint8_t *p = conn->tx + conn->tx_len;
+
+    if (args->sequential) {
+        if (conn->next + npages > pages) {
+            conn->next = 0;
+        }
+        offset = conn->next * FMS_PAGE_SIZE;
+        /* with -A, the reply tells how far the scan got */
+        if (!args->adaptive) {
+            conn->next += npages;
+        }
+    } else if (pages > npages) {
+        offset = lg_rand(&t->seed) % (pages - npages + 1) * FMS_PAGE_SIZE;
+    }
+    if (lg_has_header(args)) {
+        stl_be_p(p, FMS_MAGIC);
+        stl_be_p(p + 4, args->adaptive ? 0 : npages);
+        stq_be_p(p + 8, offset);
+        conn->tx_len += sizeof(FmsRequest);
+    } else {
+        stq_be_p(p, offset);
+        conn->tx_len += 8;
+    }
+    conn->sent[(conn->head + conn->inflight) % LG_MAX_DEPTH] = get_clock();
+    conn->inflight++;
+}
+
+static bool
+lg_flush(LgConn *conn)
+{
+    ssize_t n;
+
+    while (conn->tx_len) {
+        n = send(conn->fd, conn->tx, conn->tx_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->tx_len -= n;
+        memmove(conn->tx, conn->tx + n, conn->tx_len);
+    }
+    return true;
+}
+
+static void
+lg_complete(LgThread *t, LgConn *conn)
+{
+    int64_t ns = get_clock() - conn->sent[conn->head];
+
+    t->hist[lg_bucket(ns)]++;
+    t->max_ns = MAX(t->max_ns, ns);
+    t->requests++;
+    conn->head = (conn->head + 1) % LG_MAX_DEPTH;
+    conn->inflight--;
+    conn->reply_got = 0;
+    if (!atomic_read(&lg_stop)) {
+        lg_queue_request(t, conn);
+    }
+}
+
+/* Consume @len received bytes; returns false on a malformed response */
+static bool
+lg_receive(LgThread *t, LgConn *conn, const uint8_t *buf, size_t len)
+{
+    size_t n;
+
+    while (len) {
+        if (!conn->inflight) {
+            return false;
+        }
+        if (lg_has_header(t->args) && conn->reply_got < sizeof(FmsReply)) {
+            n = MIN(len, sizeof(FmsReply) - conn->reply_got);
+            memcpy(conn->reply + conn->reply_got, buf, n);
+            conn->reply_got += n;
+            buf += n;
+            len -= n;
+            if (conn->reply_got < sizeof(FmsReply)) {
+                break;
+            }
+            if (ldl_be_p(conn->reply) != FMS_MAGIC) {
+                return false;
+            }
+            conn->remaining = (size_t)ldl_be_p(conn->reply + 4) *
+                              FMS_PAGE_SIZE;
+            t->pages += ldl_be_p(conn->reply + 4);
+            if (t->args->sequential && t->args->adaptive) {
+                conn->next = ldq_be_p(conn->reply + 8) / FMS_PAGE_SIZE +
+                             ldl_be_p(conn->reply + 4);
+            }
+        } else if (!lg_has_header(t->args) && !conn->remaining &&
+                   !conn->reply_got) {
+            /* offset-only requests have no header */
+            conn->reply_got = 1;
+            conn->remaining = FMS_LEGACY_PAGES * FMS_PAGE_SIZE;
+            t->pages += FMS_LEGACY_PAGES;
+        }
+
+        n = MIN(len, conn->remaining);
+        conn->remaining -= n;
+        t->bytes += n;
+        buf += n;
+        len -= n;
+        if (!conn->remaining) {
+            lg_complete(t, conn);
+        }
+    }
+    return true;
+}
+
+static int
+lg_connect(const LgArgs *args)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(args->port),
+    };
+    int fd, one = 1;
+
+    if (!inet_aton(args->address, &addr.sin_addr)) {
+        fprintf(stderr, "invalid address %s\n", args->address);
+        return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "cannot connect to %s:%u: %s\n", args->address,
+                args->port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    qemu_set_nonblock(fd);
+    return fd;
+}
+
+static void *
+lg_thread(void *opaque)
+{
+    LgThread *t = opaque;
+    const LgArgs *args = t->args;
+    LgConn *conns = g_new0(LgConn, args->conns);
+    uint8_t *buf = g_malloc(LG_RX_SIZE);
+    struct epoll_event ev, *events = g_new(struct epoll_event, args->conns);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int64_t deadline = 0;
+    bool pending;
+    LgConn *conn;
+    unsigned i, j;
+    ssize_t n;
+    int nev;
+
+    for (i = 0; i < args->conns; i++) {
+        conn = &conns[i];
+        conn->fd = lg_connect(args);
+        if (conn->fd < 0) {
+            t->errors++;
+            continue;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+        if (args->sequential) {
+            conn->next = lg_rand(&t->seed) %
+                         (args->image_size / FMS_PAGE_SIZE);
+        }
+        for (j = 0; j < args->depth; j++) {
+            lg_queue_request(t, conn);
+        }
+    }
+
+    for (;;) {
+        pending = false;
+        for (i = 0; i < args->conns; i++) {
+            conn = &conns[i];
+            if (conn->fd >= 0 && !lg_flush(conn)) {
+                t->errors++;
+                close(conn->fd);
+                conn->fd = -1;
+            }
+            pending |= conn->fd >= 0 && (conn->inflight || conn->tx_len);
+        }
+        if (!pending) {
+            break;
+        }
+        if (atomic_read(&lg_stop)) {
+            if (!deadline) {
+                deadline = get_clock() + LG_DRAIN_NS;
+            } else if (get_clock() > deadline) {
+                break;
+            }
+        }
+
+        nev = epoll_wait(epfd, events, args->conns, 100);
+        for (i = 0; i < MAX(nev, 0); i++) {
+            conn = events[i].data.ptr;
+            n = recv(conn->fd, buf, LG_RX_SIZE, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0 || !lg_receive(t, conn, buf, n)) {
+                t->errors++;
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+    }
+
+    for (i = 0; i < args->conns; i++) {
+        if (conns[i].fd >= 0) {
+            /* the server never answered these */
+            t->stalled += conns[i].inflight;
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+    g_free(events);
+    g_free(buf);
+    g_free(conns);
+    return NULL;
+}
+
+/* Ask the server how much of what it sent was useful */
+static void
+lg_print_server_stats(const LgArgs *args)
+{
+    uint8_t req[sizeof(FmsRequest)] = { 0 };
+    FmsStatsReply reply;
+    uint64_t sent, useful;
+    size_t got = 0;
+    ssize_t n;
+    int fd;
+
+    fd = lg_connect(args);
+    if (fd < 0) {
+        return;
+    }
+    qemu_set_block(fd);
+    stl_be_p(req, FMS_STATS_MAGIC);
+    if (send(fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+        close(fd);
+        return;
+    }
+    while (got < sizeof(reply)) {
+        n = recv(fd, (uint8_t *)&reply + got, sizeof(reply) - got, 0);
+        if (n <= 0) {
+            close(fd);
+            return;
+        }
+        got += n;
+    }
+    close(fd);
+    if (ldl_be_p(&reply.magic) != FMS_STATS_MAGIC) {
+        return;
+    }
+
+    sent = ldq_be_p(&reply.bytes_sent);
+    useful = ldq_be_p(&reply.bytes_useful);
+    printf("server_bytes_sent=%" PRIu64 "\nserver_bytes_useful=%" PRIu64
+           "\nserver_useful_ratio=%.3f\n", sent, useful,
+           sent ? (double)useful / sent : 0.0);
+}
+
+static void
+lg_usage(const char *progname)
+{
+    printf("Usage: %s [OPTION]...\n"
+           "  -h: show this help\n"
+           "  -a <address>: IPv4 address of the server\n"
+           "     default " LG_DEFAULT_ADDRESS "\n"
+           "  -p <port>: port of the server\n"
+           "     default %u\n"
+           "  -s <size>: size of the image on the server\n"
+           "     suffixes K, M and G can be used, e.g. 1K means 1024\n"
+           "  -t <threads>: number of threads\n"
+           "     default 1\n"
+           "  -c <connections>: connections per thread\n"
+           "     default 1\n"
+           "  -d <depth>: requests in flight per connection, at most %u\n"
+           "     default %u; above %u the server stops reading requests\n"
+           "     until responses are read, and any left unanswered after\n"
+           "     the test make it fail\n"
+           "  -n <pages>: pages per request, at most %u\n"
+           "     default 0: offset-only requests for %u pages\n"
+           "  -A: let the server pick how many pages to send\n"
+           "  -S: scan the image sequentially instead of random pages\n"
+           "     with -A, one request in flight per connection\n"
+           "  -D <seconds>: duration of the test\n"
+           "     default %u\n",
+           progname, FMS_DEFAULT_PORT, LG_MAX_DEPTH, LG_DEFAULT_DEPTH,
+           FMS_CONN_QUEUE, FMS_MAX_PAGES, FMS_LEGACY_PAGES, LG_DEFAULT_DURATION);
+}
+
+static unsigned
+lg_parse_uint(const char *progname, const char *what, const char *str,
+              unsigned long long min, unsigned long long max)
+{
+    unsigned long long v;
+
+    if (parse_uint_full(str, &v, 0) < 0 || v < min || v > max) {
+        fprintf(stderr, "cannot parse %s\n"
+                "Try '%s -h' for more information.\n", what, progname);
+        exit(1);
+    }
+    return v;
+}
+
+static void
+lg_parse_args(LgArgs *args, int argc, char *argv[])
+{
+    Error *err = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "ha:p:s:t:c:d:n:ASD:")) != -1) {
+        switch (c) {
+        case 'h':
+            lg_usage(argv[0]);
+            exit(0);
+            break;
+        case 'a':
+            args->address = optarg;
+            break;
+        case 'p':
+            args->port = lg_parse_uint(argv[0], "port", optarg, 1,
+                                       UINT16_MAX);
+            break;
+        case 's':
+            parse_option_size("size", optarg, &args->image_size, &err);
+            if (err) {
+                error_report_err(err);
+                exit(1);
+            }
+            break;
+        case 't':
+            args->threads = lg_parse_uint(argv[0], "threads", optarg, 1,
+                                          4096);
+            break;
+        case 'c':
+            args->conns = lg_parse_uint(argv[0], "connections", optarg, 1,
+                                        65536);
+            break;
+        case 'd':
+            args->depth = lg_parse_uint(argv[0], "depth", optarg, 1,
+                                        LG_MAX_DEPTH);
+            break;
+        case 'n':
+            args->npages = lg_parse_uint(argv[0], "pages", optarg, 0,
+                                         FMS_MAX_PAGES);
+            break;
+        case 'A':
+            args->adaptive = true;
+            break;
+        case 'S':
+            args->sequential = true;
+            break;
+        case 'D':
+            args->duration = lg_parse_uint(argv[0], "duration", optarg, 1,
+                                           UINT_MAX);
+            break;
+        default:
+            lg_usage(argv[0]);
+            exit(1);
+            break;
+        }
+    }
+
+    if (!args->image_size) {
+        fprintf(stderr, "the size of the image (-s) is required\n");
+        exit(1);
+    }
+    /* the next offset of the scan is only known once the reply is in */
+    if (args->adaptive && args->sequential) {
+        args->depth = 1;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+    LgArgs args = {
+        .address = LG_DEFAULT_ADDRESS,
+        .port = FMS_DEFAULT_PORT,
+        .threads = 1,
+        .conns = 1,
+        .depth = LG_DEFAULT_DEPTH,
+        .duration = LG_DEFAULT_DURATION,
+    };
+    uint64_t hist[LG_BUCKETS] = { 0 };
+    uint64_t requests = 0, pages = 0, bytes = 0, errors = 0, stalled = 0;
+    uint64_t seen;
+    int64_t start, elapsed, max_ns = 0;
+    LgThread *threads;
+    unsigned i, b, p;
+    double secs;
+
+    lg_parse_args(&args, argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    threads = g_new0(LgThread, args.threads);
+    start = get_clock();
+    for (i = 0; i < args.threads; i++) {
+        threads[i].args = &args;
+        threads[i].seed = start ^ ((uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL);
+        qemu_thread_create(&threads[i].thread, "loadgen", lg_thread,
+                           &threads[i], QEMU_THREAD_JOINABLE);
+    }
+    g_usleep((uint64_t)args.duration * G_USEC_PER_SEC);
+    atomic_set(&lg_stop, true);
+
+    for (i = 0; i < args.threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+        requests += threads[i].requests;
+        pages += threads[i].pages;
+        bytes += threads[i].bytes;
+        errors += threads[i].errors;
+        stalled += threads[i].stalled;
+        max_ns = MAX(max_ns, threads[i].max_ns);
+        for (b = 0; b < LG_BUCKETS; b++) {
+            hist[b] += threads[i].hist[b];
+        }
+    }
+    elapsed = get_clock() - start;
+    secs = (double)elapsed / NANOSECONDS_PER_SECOND;
+
+    printf("threads=%u\nconnections=%u\ndepth=%u\n",
+           args.threads, args.threads * args.conns, args.depth);
+    if (args.adaptive) {
+        printf("pages_per_request=auto\n");
+    } else {
+        printf("pages_per_request=%u\n", args.npages ?: FMS_LEGACY_PAGES);
+    }
+    printf("pattern=%s\n", args.sequential ? "sequential" : "random");
+    printf("seconds=%.3f\nrequests=%" PRIu64 "\npages=%" PRIu64
+           "\nerrors=%" PRIu64 "\nstalled=%" PRIu64 "\n", secs, requests,
+           pages, errors, stalled);
+    printf("requests_per_sec=%.0f\npages_per_sec=%.0f\nmib_per_sec=%.1f\n",
+           requests / secs, pages / secs, bytes / secs / (1024 * 1024));
+
+    for (p = 0; p < ARRAY_SIZE(percentiles); p++) {
+        uint64_t rank = (uint64_t)(requests * percentiles[p] / 100);
+
+        seen = 0;
+        for (b = 0; b < LG_BUCKETS && requests; b++) {
+            seen += hist[b];
+            if (seen > rank || seen == requests) {
+                break;
+            }
+        }
+        printf("latency_p%g_us=%.1f\n", percentiles[p],
+               requests ? MIN(lg_bucket_value(b), max_ns) / 1000.0 : 0.0);
+    }
+    printf("latency_max_us=%.1f\n", max_ns / 1000.0);
+    lg_print_server_stats(&args);
+
+    g_free(threads);
+    return errors || stalled ? 1 : 0;
+}
@@ -0,0 +1,560 @@
+/*
+ * fast-mem-server: serve pages of a guest RAM image over TCP
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+
+#include "fast-mem-server.h"
+
+#define FMS_MAX_EVENTS          256
+#define FMS_LISTEN_BACKLOG      4096
+/* how often workers look at @quit and at stalled connections */
+#define FMS_TICK_MS             1000
+
+#define FMS_DEBUG(server, fmt, ...) do { \
+        if ((server)->verbose) {         \
+            printf(fmt, ## __VA_ARGS__); \
+        }                                \
+    } while (0)
+
+static void
+fms_conn_free(FmsWorker *worker, FmsConn *conn)
+{
+    FMS_DEBUG(worker->server, "worker %u: closing fd %d\n", worker->index,
+              conn->fd);
+    QLIST_REMOVE(conn, next);
+    close(conn->fd);
+    g_free(conn);
+}
+
+/*
+ * Send queued responses until the queue is empty or the socket is full.
+ * The pages go straight from the page cache to the socket with sendfile().
+ * Returns false if the connection is dead.
+ */
+static bool
+fms_conn_send(FmsWorker *worker, FmsConn *conn)
+{
+    static const uint8_t zeroes[FMS_PAGE_SIZE];
+    FmsResponse *resp;
+    ssize_t n;
+
+    while (conn->count) {
+        resp = &conn->queue[conn->head];
+        if (resp->reply_sent < resp->reply_len) {
+            n = send(conn->fd, (uint8_t *)&resp->reply + resp->reply_sent,
+                     resp->reply_len - resp->reply_sent,
+                     MSG_NOSIGNAL |
+                     (resp->remaining || resp->zeroes ? MSG_MORE : 0));
+            if (n > 0) {
+                resp->reply_sent += n;
+            }
+        } else if (resp->remaining) {
+            n = sendfile(conn->fd, worker->server->image_fd, &resp->offset,
+                         resp->remaining);
+            if (n == 0) {
+                /* the image was truncated under our feet */
+                return false;
+            }
+            if (n > 0) {
+                resp->remaining -= n;
+                worker->stats.bytes += n;
+            }
+        } else if (resp->zeroes) {
+            n = send(conn->fd, zeroes, MIN(resp->zeroes, sizeof(zeroes)),
+                     MSG_NOSIGNAL);
+            if (n > 0) {
+                resp->zeroes -= n;
+                worker->stats.bytes += n;
+            }
+        } else {
+            conn->head = (conn->head + 1) % FMS_CONN_QUEUE;
+            conn->count--;
+            continue;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!conn->stalled_since) {
+                    conn->stalled_since = get_clock();
+                }
+                return true;
+            }
+            return false;
+        }
+
+        conn->stalled_since = 0;
+    }
+    return true;
+}
+
+/*
+ * Find the stream of @conn that a request for @page continues, or the
+ * least recently used one, and decide how many pages to send: @npages,
+ * or as many as the stream suggests if @npages is 0, but no more than
+ * @avail. The client needs the first @asked of them for sure; the others
+ * count as useful once it asks for the pages that follow.
+ */
+static unsigned
+fms_conn_stream(FmsWorker *worker, FmsConn *conn, uint64_t page,
+                unsigned npages, unsigned asked, uint64_t avail)
+{
+    FmsStream *s = NULL, *lru = &conn->streams[0];
+    unsigned window = 1;
+    int i;
+
+    for (i = 0; i < FMS_STREAMS; i++) {
+        if (conn->streams[i].window && page >= conn->streams[i].start &&
+            page <= conn->streams[i].next) {
+            s = &conn->streams[i];
+            break;
+        }
+        if (conn->streams[i].used < lru->used) {
+            lru = &conn->streams[i];
+        }
+    }
+
+    if (!s) {
+        /* a new stream, or a random access */
+        s = lru;
+    } else if (page == s->next) {
+        worker->stats.useful += s->picked * FMS_PAGE_SIZE;
+        window = MIN(s->window * 2, worker->server->max_window);
+    } else {
+        /* the client wants pages it was sent already */
+        window = MAX(s->window / 2, 1);
+    }
+
+    window = MIN(npages ?: window, avail);
+    asked = MIN(asked, window);
+    worker->stats.useful += (uint64_t)asked * FMS_PAGE_SIZE;
+
+    s->start = page;
+    s->next = page + window;
+    s->window = MAX(window, 1);
+    s->picked = window - asked;
+    s->used = ++conn->stream_clock;
+    return window;
+}
+
+/*
+ * Turn the complete requests in the receive buffer into queued responses,
+ * as long as there is room in the queue. Returns false on a protocol
+ * error.
+ */
+static bool
+fms_conn_parse(FmsWorker *worker, FmsConn *conn)
+{
+    uint64_t image_size = worker->server->image_size;
+    uint64_t offset, npages, avail, bytes;
+    FmsResponse *resp;
+    FmsStats stats;
+    size_t pos = 0;
+    uint32_t magic;
+    uint8_t *p;
+
+    while (conn->count < FMS_CONN_QUEUE && conn->rx_len - pos >= 8) {
+        p = conn->rx + pos;
+        resp = &conn->queue[(conn->head + conn->count) % FMS_CONN_QUEUE];
+        resp->zeroes = 0;
+        magic = ldl_be_p(p);
+
+        if (magic == FMS_MAGIC || magic == FMS_STATS_MAGIC) {
+            if (conn->rx_len - pos < sizeof(FmsRequest)) {
+                break;
+            }
+            npages = ldl_be_p(p + 4);
+            offset = ldq_be_p(p + 8);
+            pos += sizeof(FmsRequest);
+        }
+
+        if (magic == FMS_STATS_MAGIC) {
+            fms_server_get_stats(worker->server, &stats);
+            memset(&resp->stats, 0, sizeof(resp->stats));
+            stl_be_p(&resp->stats.magic, FMS_STATS_MAGIC);
+            stq_be_p(&resp->stats.connections, stats.connections);
+            stq_be_p(&resp->stats.requests, stats.requests);
+            stq_be_p(&resp->stats.pages, stats.pages);
+            stq_be_p(&resp->stats.bytes_sent, stats.bytes);
+            stq_be_p(&resp->stats.bytes_useful, stats.useful);
+            stq_be_p(&resp->stats.timeouts, stats.timeouts);
+            resp->reply_len = sizeof(FmsStatsReply);
+            npages = 0;
+            bytes = 0;
+        } else if (magic == FMS_MAGIC) {
+            if (npages > FMS_MAX_PAGES) {
+                FMS_DEBUG(worker->server, "worker %u: fd %d asked for %"
+                          PRIu64 " pages\n", worker->index, conn->fd, npages);
+                return false;
+            }
+            avail = offset < image_size ?
+                    (image_size - offset) / FMS_PAGE_SIZE : 0;
+            npages = fms_conn_stream(worker, conn, offset / FMS_PAGE_SIZE,
+                                     npages, npages ?: 1, avail);
+            bytes = npages * FMS_PAGE_SIZE;
+
+            stl_be_p(&resp->reply.magic, FMS_MAGIC);
+            stl_be_p(&resp->reply.npages, npages);
+            stq_be_p(&resp->reply.offset, offset);
+            resp->reply_len = sizeof(FmsReply);
+        } else {
+            /* the client needs one page, and takes FMS_LEGACY_PAGES */
+            offset = ldq_be_p(p);
+            bytes = offset < image_size ?
+                    MIN(image_size - offset,
+                        FMS_LEGACY_PAGES * FMS_PAGE_SIZE) : 0;
+            npages = fms_conn_stream(worker, conn, offset / FMS_PAGE_SIZE,
+                                     FMS_LEGACY_PAGES, 1,
+                                     DIV_ROUND_UP(bytes, FMS_PAGE_SIZE));
+            resp->zeroes = FMS_LEGACY_PAGES * FMS_PAGE_SIZE - bytes;
+            resp->reply_len = 0;
+            pos += 8;
+        }
+
+        resp->reply_sent = 0;
+        resp->offset = offset;
+        resp->remaining = bytes;
+        conn->count++;
+        worker->stats.requests++;
+        worker->stats.pages += npages;
+    }
+
+    conn->rx_len -= pos;
+    memmove(conn->rx, conn->rx + pos, conn->rx_len);
+    return true;
+}
+
+/*
+ * Make as much progress as the socket allows. Connections are edge
+ * triggered, so this only returns once sending or receiving would block,
+ * or when the queue is full and the socket cannot take more responses,
+ * in which case EPOLLOUT brings us back. Returns false if the connection
+ * must be closed.
+ */
+static bool
+fms_conn_process(FmsWorker *worker, FmsConn *conn)
+{
+    ssize_t n;
+
+    for (;;) {
+        if (!fms_conn_send(worker, conn)) {
+            return false;
+        }
+        /*
+         * Requests received while the queue was full are still in the
+         * buffer, and no event is coming for them: queue them first.
+         */
+        if (!fms_conn_parse(worker, conn)) {
+            return false;
+        }
+        if (conn->count == FMS_CONN_QUEUE) {
+            if (conn->stalled_since) {
+                return true;
+            }
+            continue;
+        }
+
+        n = recv(conn->fd, conn->rx + conn->rx_len,
+                 sizeof(conn->rx) - conn->rx_len, 0);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->rx_len += n;
+        if (!fms_conn_parse(worker, conn)) {
+            return false;
+        }
+    }
+}
+
+static void
+fms_worker_accept(FmsWorker *worker)
+{
+    struct epoll_event ev;
+    FmsConn *conn;
+    int fd, one = 1;
+
+    for (;;) {
+        fd = accept4(worker->listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "worker %u: accept: %s\n", worker->index,
+                        strerror(errno));
+            }
+            return;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn = g_new0(FmsConn, 1);
+        conn->fd = fd;
+        QLIST_INSERT_HEAD(&worker->conns, conn, next);
+        worker->stats.connections++;
+        FMS_DEBUG(worker->server, "worker %u: new connection on fd %d\n",
+                  worker->index, fd);
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fprintf(stderr, "worker %u: epoll_ctl: %s\n", worker->index,
+                    strerror(errno));
+            fms_conn_free(worker, conn);
+        }
+    }
+}
+
+/* Drop the clients that have not read anything for a while */
+static void
+fms_worker_reap(FmsWorker *worker)
+{
+    int64_t now = get_clock();
+    FmsConn *conn, *next;
+
+    QLIST_FOREACH_SAFE(conn, &worker->conns, next, next) {
+        if (conn->stalled_since &&
+            now - conn->stalled_since > worker->server->stall_timeout_ns) {
+            worker->stats.timeouts++;
+            fms_conn_free(worker, conn);
+        }
+    }
+}
+
+static void
+fms_worker_pin(FmsWorker *worker)
+{
+#ifdef CONFIG_LINUX
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    if (ncpus <= 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(worker->index % ncpus, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "worker %u: cannot pin to CPU %ld: %s\n",
+                worker->index, worker->index % ncpus, strerror(errno));
+    }
+#endif
+}
+
+typedef struct FmsWorkerArgs {
+    FmsWorker *worker;
+    const bool *quit;
+} FmsWorkerArgs;
+
+static void *
+fms_worker_thread(void *opaque)
+{
+    FmsWorkerArgs *args = opaque;
+    FmsWorker *worker = args->worker;
+    struct epoll_event events[FMS_MAX_EVENTS];
+    int64_t next_reap = get_clock() + FMS_TICK_MS * SCALE_MS;
+    FmsConn *conn;
+    int i, n;
+
+    if (worker->server->pin) {
+        fms_worker_pin(worker);
+    }
+
+    while (!atomic_read(args->quit)) {
+        n = epoll_wait(worker->epoll_fd, events, FMS_MAX_EVENTS, FMS_TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "worker %u: epoll_wait: %s\n", worker->index,
+                    strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            conn = events[i].data.ptr;
+            if (!conn) {
+                fms_worker_accept(worker);
+            } else if ((events[i].events & EPOLLERR) ||
+                       !fms_conn_process(worker, conn)) {
+                fms_conn_free(worker, conn);
+            }
+        }
+
+        if (get_clock() >= next_reap) {
+            fms_worker_reap(worker);
+            next_reap = get_clock() + FMS_TICK_MS * SCALE_MS;
+        }
+    }
+    return NULL;
+}
+
+static int
+fms_worker_listen(FmsWorker *worker)
+{
+    FmsServer *server = worker->server;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(server->port),
+    };
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    int one = 1;
+
+    if (!inet_aton(server->address, &addr.sin_addr)) {
+        fprintf(stderr, "invalid address %s\n", server->address);
+        return -1;
+    }
+
+    worker->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                                        SOCK_CLOEXEC, 0);
+    if (worker->listen_fd < 0) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(worker->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+               sizeof(one));
+    if (setsockopt(worker->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one,
+                   sizeof(one)) < 0) {
+        fprintf(stderr, "SO_REUSEPORT: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(worker->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(worker->listen_fd, FMS_LISTEN_BACKLOG) < 0) {
+        fprintf(stderr, "cannot listen on %s:%u: %s\n", server->address,
+                server->port, strerror(errno));
+        return -1;
+    }
+
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epoll_fd < 0 ||
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd,
+                  &ev) < 0) {
+        fprintf(stderr, "epoll: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int
+fms_server_start(FmsServer *server)
+{
+    struct stat st;
+    unsigned i;
+
+    server->image_fd = open(server->image_path, O_RDONLY | O_CLOEXEC);
+    if (server->image_fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", server->image_path,
+                strerror(errno));
+        return -1;
+    }
+    if (fstat(server->image_fd, &st) < 0) {
+        fprintf(stderr, "cannot stat %s: %s\n", server->image_path,
+                strerror(errno));
+        goto err;
+    }
+    server->image_size = st.st_size;
+
+    /* accesses are random; pull the image into the page cache up front */
+    posix_fadvise(server->image_fd, 0, 0, POSIX_FADV_RANDOM);
+    posix_fadvise(server->image_fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    server->workers = g_new0(FmsWorker, server->n_workers);
+    for (i = 0; i < server->n_workers; i++) {
+        server->workers[i].server = server;
+        server->workers[i].index = i;
+        server->workers[i].listen_fd = -1;
+        server->workers[i].epoll_fd = -1;
+        QLIST_INIT(&server->workers[i].conns);
+        if (fms_worker_listen(&server->workers[i]) < 0) {
+            goto err;
+        }
+    }
+
+    FMS_DEBUG(server, "serving %s (%" PRIu64 " bytes) on %s:%u with %u "
+              "workers\n", server->image_path, server->image_size,
+              server->address, server->port, server->n_workers);
+    return 0;
+
+err:
+    fms_server_close(server);
+    return -1;
+}
+
+void
+fms_server_run(FmsServer *server, const bool *quit)
+{
+    FmsWorkerArgs *args = g_new(FmsWorkerArgs, server->n_workers);
+    unsigned i;
+
+    for (i = 0; i < server->n_workers; i++) {
+        args[i].worker = &server->workers[i];
+        args[i].quit = quit;
+        qemu_thread_create(&server->workers[i].thread, "fms-worker",
+                           fms_worker_thread, &args[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < server->n_workers; i++) {
+        qemu_thread_join(&server->workers[i].thread);
+    }
+    g_free(args);
+}
+
+void
+fms_server_close(FmsServer *server)
+{
+    FmsWorker *worker;
+    FmsConn *conn, *next;
+    unsigned i;
+
+    for (i = 0; server->workers && i < server->n_workers; i++) {
+        worker = &server->workers[i];
+        QLIST_FOREACH_SAFE(conn, &worker->conns, next, next) {
+            fms_conn_free(worker, conn);
+        }
+        if (worker->epoll_fd >= 0) {
+            close(worker->epoll_fd);
+        }
+        if (worker->listen_fd >= 0) {
+            close(worker->listen_fd);
+        }
+    }
+    g_free(server->workers);
+    server->workers = NULL;
+
+    if (server->image_fd >= 0) {
+        close(server->image_fd);
+        server->image_fd = -1;
+    }
+}
+
+void
+fms_server_get_stats(FmsServer *server, FmsStats *stats)
+{
+    FmsStats *s;
+    unsigned i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < server->n_workers; i++) {
+        s = &server->workers[i].stats;
+        stats->connections += s->connections;
+        stats->requests += s->requests;
+        stats->pages += s->pages;
+        stats->bytes += s->bytes;
+        stats->useful += s->useful;
+        stats->timeouts += s->timeouts;
+    }
+}
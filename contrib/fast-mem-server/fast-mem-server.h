@@ -0,0 +1,196 @@
+/*
+ * fast-mem-server: serve pages of a guest RAM image over TCP
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#ifndef FAST_MEM_SERVER_H
+#define FAST_MEM_SERVER_H
+
+/**
+ * A client sends requests and reads the responses back in the same
+ * order; it may have any number of requests in flight. There are three
+ * kinds of request, and a client may mix them:
+ *
+ * - a big-endian 64-bit byte offset into the image. The response is
+ *   the FMS_LEGACY_PAGES pages starting there, without any header; the
+ *   pages past the end of the image, if any, are zeroes. This is what
+ *   the first version of the server understood.
+ * - an FmsRequest, which starts with FMS_MAGIC and asks for any number
+ *   of pages up to FMS_MAX_PAGES, or for 0 to let the server pick. The
+ *   response is an FmsReply with the number of pages actually sent,
+ *   followed by those pages.
+ * - an FmsRequest that starts with FMS_STATS_MAGIC, whose other fields
+ *   are ignored. The response is an FmsStatsReply.
+ *
+ * The magic numbers have their top bit set, so no offset into an image
+ * can be taken for the start of an FmsRequest. All fields are big-endian.
+ *
+ * When it picks, the server sends the requested page and as many of the
+ * following ones as the client is likely to need. It follows up to
+ * FMS_STREAMS sequential streams per connection: a request right after
+ * the pages last sent for a stream doubles its window, up to the
+ * server's maximum, and a request anywhere else starts a stream with a
+ * window of one page. Random accesses thus get one page each, and scans
+ * get ever larger responses.
+ */
+
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+
+#define FMS_DEFAULT_PORT        9999
+#define FMS_PAGE_SIZE           4096
+#define FMS_LEGACY_PAGES        32
+#define FMS_MAX_PAGES           1024
+#define FMS_MAGIC               0xfa570001
+#define FMS_STATS_MAGIC         0xfa570002
+
+typedef struct FmsRequest {
+    uint32_t magic;
+    uint32_t npages;
+    uint64_t offset;
+} QEMU_PACKED FmsRequest;
+
+typedef struct FmsReply {
+    uint32_t magic;
+    uint32_t npages;             /**< pages that follow, 0 past the end */
+    uint64_t offset;
+} QEMU_PACKED FmsReply;
+
+/**
+ * Counters of the whole server since it started. A page the server
+ * picked on its own counts as useful once the client asks for the pages
+ * right after it, so a stream that stops early counts as waste.
+ */
+typedef struct FmsStatsReply {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t connections;
+    uint64_t requests;
+    uint64_t pages;
+    uint64_t bytes_sent;
+    uint64_t bytes_useful;
+    uint64_t timeouts;
+} QEMU_PACKED FmsStatsReply;
+
+/**
+ * Responses a connection may have queued before the server stops reading
+ * its requests, until the client reads some responses back
+ */
+#define FMS_CONN_QUEUE          64
+
+typedef struct FmsResponse {
+    union {
+        FmsReply reply;
+        FmsStatsReply stats;
+    };
+    unsigned reply_len;          /**< 0 for an offset-only request */
+    unsigned reply_sent;
+    off_t offset;                /**< of the next byte to send */
+    size_t remaining;            /**< bytes of the image still to send */
+    size_t zeroes;               /**< then bytes of padding */
+} FmsResponse;
+
+/** Sequential streams followed per connection */
+#define FMS_STREAMS             4
+
+typedef struct FmsStream {
+    uint64_t start;              /**< first page last sent */
+    uint64_t next;               /**< page after the last one sent */
+    uint32_t window;             /**< pages last sent */
+    uint32_t picked;             /**< of which the server picked */
+    uint64_t used;               /**< for LRU replacement */
+} FmsStream;
+
+typedef struct FmsConn {
+    QLIST_ENTRY(FmsConn) next;
+    int fd;
+    uint8_t rx[sizeof(FmsRequest) * FMS_CONN_QUEUE];
+    size_t rx_len;
+    FmsResponse queue[FMS_CONN_QUEUE];
+    unsigned head;
+    unsigned count;
+    int64_t stalled_since;       /**< ns, 0 unless the socket is full */
+    FmsStream streams[FMS_STREAMS];
+    uint64_t stream_clock;
+} FmsConn;
+
+/**
+ * Each worker updates its own counters; a stats request adds them up
+ * without locking, so it may miss the latest updates of other workers.
+ */
+typedef struct FmsStats {
+    uint64_t connections;
+    uint64_t requests;
+    uint64_t pages;
+    uint64_t bytes;
+    uint64_t useful;             /**< bytes the client asked for */
+    uint64_t timeouts;
+} FmsStats;
+
+typedef struct FmsServer FmsServer;
+
+/**
+ * One thread, with its own listening socket and epoll instance. The
+ * kernel spreads new connections over the sockets of all workers, which
+ * share the port with SO_REUSEPORT, and a connection stays with the
+ * worker that accepted it.
+ */
+typedef struct FmsWorker {
+    FmsServer *server;
+    QemuThread thread;
+    unsigned index;
+    int listen_fd;
+    int epoll_fd;
+    QLIST_HEAD(, FmsConn) conns;
+    FmsStats stats;
+} FmsWorker;
+
+struct FmsServer {
+    const char *image_path;
+    int image_fd;
+    uint64_t image_size;
+    const char *address;
+    uint16_t port;
+    unsigned n_workers;
+    unsigned max_window;         /**< most pages the server picks to send */
+    bool pin;                    /**< pin worker N to host CPU N */
+    int64_t stall_timeout_ns;    /**< drop clients that stop reading */
+    bool verbose;
+    FmsWorker *workers;
+};
+
+/**
+ * Open the image and bind one listening socket per worker
+ *
+ * @server: The server, with the configuration fields filled in
+ *
+ * Returns: 0 on success, or a negative value on error
+ */
+int fms_server_start(FmsServer *server);
+
+/**
+ * Run the workers until @quit becomes true
+ *
+ * @server: A server started with fms_server_start()
+ * @quit:   Checked by each worker at least once a second
+ */
+void fms_server_run(FmsServer *server, const bool *quit);
+
+/**
+ * Close all connections, the listening sockets and the image
+ *
+ * @server: The server
+ */
+void fms_server_close(FmsServer *server);
+
+/**
+ * Add up the statistics of all workers
+ *
+ * @server: The server
+ * @stats:  Filled with the totals
+ */
+void fms_server_get_stats(FmsServer *server, FmsStats *stats);
+
+#endif /* FAST_MEM_SERVER_H */
@@ -0,0 +1,190 @@
+/*
+ * fast-mem-server: serve pages of a guest RAM image over TCP
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+
+#include "fast-mem-server.h"
+
+#define FMS_DEFAULT_IMAGE           "physical_ram.img"
+#define FMS_DEFAULT_ADDRESS         "0.0.0.0"
+#define FMS_DEFAULT_STALL_TIMEOUT   5
+#define FMS_DEFAULT_WINDOW          FMS_MAX_PAGES
+#define FMS_MAX_WINDOW              65536
+
+/* set by SIGINT and SIGTERM, read by every worker */
+static bool fms_quit;
+
+static void
+fms_usage(const char *progname)
+{
+    printf("Usage: %s [OPTION]...\n"
+           "  -h: show this help\n"
+           "  -v: verbose mode\n"
+           "  -f <image>: guest RAM image to serve\n"
+           "     default " FMS_DEFAULT_IMAGE "\n"
+           "  -a <address>: IPv4 address to listen on\n"
+           "     default " FMS_DEFAULT_ADDRESS "\n"
+           "  -p <port>: TCP port to listen on\n"
+           "     default %u\n"
+           "  -t <threads>: number of worker threads\n"
+           "     default: one per online CPU\n"
+           "  -P: do not pin worker threads to CPUs\n"
+           "  -T <seconds>: drop clients that read nothing for that long\n"
+           "     default %u\n"
+           "  -w <pages>: most pages sent when the client lets the server pick\n"
+           "     default %u, at most %u\n",
+           progname, FMS_DEFAULT_PORT, FMS_DEFAULT_STALL_TIMEOUT,
+           FMS_DEFAULT_WINDOW, FMS_MAX_WINDOW);
+}
+
+static void
+fms_help(const char *progname)
+{
+    fprintf(stderr, "Try '%s -h' for more information.\n", progname);
+}
+
+/* parse the program arguments, exit on error */
+static void
+fms_parse_args(FmsServer *server, int argc, char *argv[])
+{
+    unsigned long long v;
+    int c;
+
+    while ((c = getopt(argc, argv, "hvf:a:p:t:PT:w:")) != -1) {
+        switch (c) {
+        case 'h': /* help */
+            fms_usage(argv[0]);
+            exit(0);
+            break;
+
+        case 'v': /* verbose */
+            server->verbose = true;
+            break;
+
+        case 'f': /* image */
+            server->image_path = optarg;
+            break;
+
+        case 'a': /* listen address */
+            server->address = optarg;
+            break;
+
+        case 'p': /* port */
+            if (parse_uint_full(optarg, &v, 0) < 0 || !v || v > UINT16_MAX) {
+                fprintf(stderr, "cannot parse port\n");
+                fms_help(argv[0]);
+                exit(1);
+            }
+            server->port = v;
+            break;
+
+        case 't': /* worker threads */
+            if (parse_uint_full(optarg, &v, 0) < 0 || !v || v > 4096) {
+                fprintf(stderr, "cannot parse number of threads\n");
+                fms_help(argv[0]);
+                exit(1);
+            }
+            server->n_workers = v;
+            break;
+
+        case 'P': /* no pinning */
+            server->pin = false;
+            break;
+
+        case 'T': /* stall timeout */
+            if (parse_uint_full(optarg, &v, 0) < 0 || !v) {
+                fprintf(stderr, "cannot parse timeout\n");
+                fms_help(argv[0]);
+                exit(1);
+            }
+            server->stall_timeout_ns = v * NANOSECONDS_PER_SECOND;
+            break;
+
+        case 'w': /* largest window */
+            if (parse_uint_full(optarg, &v, 0) < 0 || !v ||
+                v > FMS_MAX_WINDOW) {
+                fprintf(stderr, "cannot parse window\n");
+                fms_help(argv[0]);
+                exit(1);
+            }
+            server->max_window = v;
+            break;
+
+        default:
+            fms_usage(argv[0]);
+            exit(1);
+            break;
+        }
+    }
+}
+
+static void
+fms_quit_cb(int signum)
+{
+    atomic_set(&fms_quit, true);
+}
+
+int
+main(int argc, char *argv[])
+{
+    FmsServer server = {
+        .image_path = FMS_DEFAULT_IMAGE,
+        .image_fd = -1,
+        .address = FMS_DEFAULT_ADDRESS,
+        .port = FMS_DEFAULT_PORT,
+        .max_window = FMS_DEFAULT_WINDOW,
+        .pin = true,
+        .stall_timeout_ns = FMS_DEFAULT_STALL_TIMEOUT *
+                            NANOSECONDS_PER_SECOND,
+    };
+    struct sigaction sa, sa_quit;
+    FmsStats stats;
+    long ncpus;
+
+    fms_parse_args(&server, argc, argv);
+    if (!server.n_workers) {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        server.n_workers = ncpus > 0 ? ncpus : 1;
+    }
+
+    /* responses go out with MSG_NOSIGNAL, but sendfile() has no such flag */
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    if (sigemptyset(&sa.sa_mask) == -1 ||
+        sigaction(SIGPIPE, &sa, 0) == -1) {
+        perror("failed to ignore SIGPIPE; sigaction");
+        return 1;
+    }
+
+    sa_quit.sa_handler = fms_quit_cb;
+    sa_quit.sa_flags = 0;
+    if (sigemptyset(&sa_quit.sa_mask) == -1 ||
+        sigaction(SIGTERM, &sa_quit, 0) == -1 ||
+        sigaction(SIGINT, &sa_quit, 0) == -1) {
+        perror("failed to add SIGTERM handler; sigaction");
+        return 1;
+    }
+
+    if (fms_server_start(&server) < 0) {
+        fprintf(stderr, "cannot start server\n");
+        return 1;
+    }
+    printf("serving %s on %s:%u, %u workers\n", server.image_path,
+           server.address, server.port, server.n_workers);
+
+    fms_server_run(&server, &fms_quit);
+
+    fms_server_get_stats(&server, &stats);
+    printf("%" PRIu64 " connections, %" PRIu64 " requests, %" PRIu64
+           " pages, %" PRIu64 " bytes sent, %" PRIu64 " useful, %" PRIu64
+           " timeouts\n", stats.connections, stats.requests, stats.pages,
+           stats.bytes, stats.useful, stats.timeouts);
+    fms_server_close(&server);
+    return 0;
+}
@@ -43,6 +43,7 @@
 #include "exec/exec-all.h"
 
 #include "qemu/thread.h"
+#include "qemu/thread-barrier.h"
 #include "sysemu/cpus.h"
 #include "sysemu/qtest.h"
 #include "qemu/main-loop.h"
@@ -51,6 +52,7 @@
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
+#include "trace.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -85,8 +87,6 @@ static unsigned int throttle_percentage;
 #define CPU_THROTTLE_PCT_MAX 99
 #define CPU_THROTTLE_TIMESLICE_NS 10000000
 
-static int wait_remote_cpu_count = 0;
-
 bool cpu_is_stopped(CPUState *cpu)
 {
     return cpu->stopped || !runstate_is_running();
@@ -563,19 +563,28 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+static int cpu_throttle_get_effective_percentage(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               atomic_read(&cpu->throttle_percentage));
+}
+
+/*
+ * The timer ticks every CPU_THROTTLE_TIMESLICE_NS of running time of the
+ * most throttled vcpu; each vcpu sleeps for its own share of that period.
+ */
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
-    double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_get_effective_percentage(cpu)) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    pct = (double)cpu_throttle_get_effective_percentage(cpu)/100;
+    sleeptime_ns = (long)(pct * opaque.host_ulong);
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
@@ -587,21 +596,29 @@ static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
     double pct;
+    int max_pct = 0;
+    unsigned long period_ns;
 
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, cpu_throttle_get_effective_percentage(cpu));
+    }
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!max_pct) {
         return;
     }
+
+    pct = (double)max_pct/100;
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1-pct);
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_get_effective_percentage(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_ULONG(period_ns));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -616,9 +633,32 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, 0);
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    if (new_throttle_pct && !timer_pending(throttle_timer)) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return atomic_read(&cpu->throttle_percentage);
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
@@ -911,19 +951,63 @@ static QemuCond qemu_cpu_cond;
 /* system init */
 static QemuCond qemu_pause_cond;
 
-/* for remote CPU 
- * Remote CPU threads would wait this until specific event occured
+/* for remote CPU
+ * Remote CPU threads park on this barrier until specific event occured.
+ * wake_remote_cpu() goes through it twice: once to release them and once
+ * to learn that they have all looked at the shutdown and reset flags.
+ */
+static QemuBarrier remote_cpu_barrier;
+/*
+ * Serializes callers of wake_remote_cpu(), which may not hold the BQL, and
+ * the threads joining remote_cpu_barrier: one that joined between the two
+ * waits of a wakeup would be out of step with every later one.
  */
-static QemuCond qemu_remote_cpu_cond;
 static QemuMutex qemu_remote_mutex;
 
+/*
+ * Resume latency.  resume_all_vcpus() marks every local vCPU pending and
+ * the last one to get back into KVM_RUN records the time it took; the
+ * wake_remote_cpu() round trip is recorded separately.  Protected by the
+ * BQL, except the remote_* fields of @stats, which are protected by
+ * qemu_remote_mutex.
+ */
+static struct {
+    int64_t start;
+    int pending;
+    int cpus;
+    CpuResumeStats stats;
+} cpu_resume_stats;
+
+/* Called by a vCPU thread with the BQL held, right before KVM_RUN */
+static void cpu_resume_done(CPUState *cpu)
+{
+    CpuResumeStats *stats = &cpu_resume_stats.stats;
+    int64_t ns;
+
+    if (!cpu->resume_pending) {
+        return;
+    }
+    cpu->resume_pending = false;
+    if (--cpu_resume_stats.pending) {
+        return;
+    }
+
+    ns = get_clock() - cpu_resume_stats.start;
+    stats->resumes++;
+    stats->last_ns = ns;
+    stats->max_ns = MAX(stats->max_ns, ns);
+    stats->total_ns += ns;
+    trace_cpu_resume_all(ns, cpu_resume_stats.cpus);
+}
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
-    qemu_cond_init(&qemu_remote_cpu_cond);
+    /* the caller of wake_remote_cpu(); remote vCPU threads join later */
+    qemu_barrier_init(&remote_cpu_barrier, 1, QEMU_BARRIER_SPIN_DEFAULT);
     qemu_mutex_init(&qemu_remote_mutex);
 
     qemu_mutex_init(&qemu_global_mutex);
@@ -1014,35 +1098,57 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     cpu->created = true;
     qemu_cond_signal(&qemu_cpu_cond);
 
-    /* deal with different CPU */
-    if (cpu->local) {
-        do {
-            if (cpu_can_run(cpu)) {
-                r = kvm_cpu_exec(cpu);
-                if (r == EXCP_DEBUG) {
-                    cpu_handle_guest_debug(cpu);
+    /*
+     * deal with different CPU. A vCPU can move between instances while the
+     * guest runs, see router-vcpu.c: the instance it leaves parks its
+     * thread, the one it moves to wakes it up.
+     */
+    while (1) {
+        if (cpu->local) {
+            do {
+                if (cpu_can_run(cpu)) {
+                    cpu_resume_done(cpu);
+                    r = kvm_cpu_exec(cpu);
+                    if (r == EXCP_DEBUG) {
+                        cpu_handle_guest_debug(cpu);
+                    }
                 }
+                qemu_kvm_wait_io_event(cpu);
+            } while (cpu->local && (!cpu->unplug || cpu_can_run(cpu)));
+            if (cpu->local) {
+                break;
             }
-            qemu_kvm_wait_io_event(cpu);
-        } while (!cpu->unplug || cpu_can_run(cpu));
-    }
-    else {
+        }
+
         printf("CPU %d is remote CPU, pause\n", cpu->cpu_index);
-        qemu_mutex_unlock_iothread();
-        /* use a new lock since qemu_global_mutex may cause deadlock */
+        /* not in the middle of a wake_remote_cpu() */
         qemu_mutex_lock(&qemu_remote_mutex);
+        qemu_barrier_join(&remote_cpu_barrier);
+        qemu_mutex_unlock(&qemu_remote_mutex);
+        /* the waker may hold qemu_global_mutex, so wait without it */
+        qemu_mutex_unlock_iothread();
         while (1) {
-            qemu_cond_wait(&qemu_remote_cpu_cond, &qemu_remote_mutex);
-            wait_remote_cpu_count--;
+            qemu_barrier_wait(&remote_cpu_barrier);
             if (qemu_shutdown_requested_get()) {
                 cpu->stopped = true;
+                qemu_barrier_leave(&remote_cpu_barrier);
+                break;
+            }
+            if (atomic_read(&cpu->local)) {
+                /* moved in, the waker has loaded its state */
+                qemu_barrier_leave(&remote_cpu_barrier);
                 break;
             }
             if (qemu_reset_requested_get()) {
                 cpu->stopped = true;
             }
+            qemu_barrier_wait(&remote_cpu_barrier);
         }
-        qemu_mutex_unlock(&qemu_remote_mutex);
+        qemu_mutex_lock_iothread();
+        if (qemu_shutdown_requested_get()) {
+            break;
+        }
+        cpu_synchronize_post_init(cpu);
     }
 
     qemu_kvm_destroy_vcpu(cpu);
@@ -1359,7 +1465,8 @@ static bool all_vcpus_paused(void)
     CPUState *cpu;
 
     CPU_FOREACH(cpu) {
-        if (!cpu->stopped) {
+        /* remote vCPU threads are parked, they do not answer cpu->stop */
+        if (cpu->local && !cpu->stopped) {
             return false;
         }
     }
@@ -1408,11 +1515,30 @@ void resume_all_vcpus(void)
     CPUState *cpu;
 
     qemu_clock_enable(QEMU_CLOCK_VIRTUAL, true);
+    cpu_resume_stats.start = get_clock();
+    cpu_resume_stats.pending = 0;
+    CPU_FOREACH(cpu) {
+        if (kvm_enabled() && cpu->local) {
+            cpu->resume_pending = true;
+            cpu_resume_stats.pending++;
+        }
+    }
+    cpu_resume_stats.cpus = cpu_resume_stats.pending;
     CPU_FOREACH(cpu) {
         cpu_resume(cpu);
     }
 }
 
+CpuResumeStats *qmp_query_cpu_resume_stats(Error **errp)
+{
+    CpuResumeStats *stats;
+
+    qemu_mutex_lock(&qemu_remote_mutex);
+    stats = g_memdup(&cpu_resume_stats.stats, sizeof(CpuResumeStats));
+    qemu_mutex_unlock(&qemu_remote_mutex);
+    return stats;
+}
+
 void cpu_remove(CPUState *cpu)
 {
     cpu->stop = true;
@@ -1731,10 +1857,26 @@ void dump_drift_info(FILE *f, fprintf_function cpu_fprintf)
     }
 }
 
-void wake_remote_cpu(void) {
-    qemu_cond_broadcast(&qemu_remote_cpu_cond);
-    wait_remote_cpu_count = smp_cpus - local_cpus;
-    while (wait_remote_cpu_count > 0) {
-        /*wait all remote cpu thread to change CPU status */
+void wake_remote_cpu(void)
+{
+    CpuResumeStats *stats = &cpu_resume_stats.stats;
+    int64_t start, ns;
+
+    if (local_cpus == smp_cpus) {
+        return;
     }
+
+    qemu_mutex_lock(&qemu_remote_mutex);
+    start = get_clock();
+    /* release the remote vCPU threads ... */
+    qemu_barrier_wait(&remote_cpu_barrier);
+    /* ... and wait for all of them to change CPU status */
+    qemu_barrier_wait(&remote_cpu_barrier);
+    ns = get_clock() - start;
+
+    stats->remote_wakeups++;
+    stats->remote_last_ns = ns;
+    stats->remote_max_ns = MAX(stats->remote_max_ns, ns);
+    trace_wake_remote_cpu(ns, smp_cpus - local_cpus);
+    qemu_mutex_unlock(&qemu_remote_mutex);
 }
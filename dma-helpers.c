@@ -95,14 +95,46 @@ static void reschedule_dma(void *opaque)
     dma_blk_cb(dbs, 0);
 }
 
+/*
+ * Pin everything in dbs->iov with as few ioctls as possible.  The mappings
+ * start at byte @byte of entry @index of the scatter-gather list, and each
+ * covers part of a single entry.
+ */
+static void dma_blk_pin(DMAAIOCB *dbs, int index, dma_addr_t byte)
+{
+    DSMPinList pins;
+    int i;
+
+    dsm_pin_list_init(&pins, dbs->sg->as, false, &dbs->sg->as->dsm_pin);
+    for (i = 0; i < dbs->iov.niov; ++i) {
+        dsm_pin_list_add(&pins, dbs->sg->sg[index].base + byte,
+                         dbs->iov.iov[i].iov_base, dbs->iov.iov[i].iov_len,
+                         dbs->dir == DMA_DIRECTION_FROM_DEVICE);
+        byte += dbs->iov.iov[i].iov_len;
+        if (byte == dbs->sg->sg[index].len) {
+            byte = 0;
+            ++index;
+        }
+    }
+    dsm_pin_list_flush(&pins);
+}
+
 static void dma_blk_unmap(DMAAIOCB *dbs)
 {
+    DSMPinList pins;
     int i;
 
+    dsm_pin_list_init(&pins, dbs->sg->as, true, &dbs->sg->as->dsm_pin);
+    for (i = 0; i < dbs->iov.niov; ++i) {
+        dsm_pin_list_add(&pins, 0, dbs->iov.iov[i].iov_base,
+                         dbs->iov.iov[i].iov_len,
+                         dbs->dir == DMA_DIRECTION_FROM_DEVICE);
+    }
+    dsm_pin_list_flush(&pins);
     for (i = 0; i < dbs->iov.niov; ++i) {
-        dma_memory_unmap(dbs->sg->as, dbs->iov.iov[i].iov_base,
-                         dbs->iov.iov[i].iov_len, dbs->dir,
-                         dbs->iov.iov[i].iov_len);
+        dma_memory_unmap_internal(dbs->sg->as, dbs->iov.iov[i].iov_base,
+                                  dbs->iov.iov[i].iov_len, dbs->dir,
+                                  dbs->iov.iov[i].iov_len, false);
     }
     qemu_iovec_reset(&dbs->iov);
 }
@@ -126,7 +158,8 @@ static void dma_complete(DMAAIOCB *dbs, int ret)
 static void dma_blk_cb(void *opaque, int ret)
 {
     DMAAIOCB *dbs = (DMAAIOCB *)opaque;
-    dma_addr_t cur_addr, cur_len;
+    dma_addr_t cur_addr, cur_len, start_byte;
+    int start_index;
     void *mem;
 
     trace_dma_blk_cb(dbs, ret);
@@ -140,10 +173,13 @@ static void dma_blk_cb(void *opaque, int ret)
     }
     dma_blk_unmap(dbs);
 
+    start_index = dbs->sg_cur_index;
+    start_byte = dbs->sg_cur_byte;
     while (dbs->sg_cur_index < dbs->sg->nsg) {
         cur_addr = dbs->sg->sg[dbs->sg_cur_index].base + dbs->sg_cur_byte;
         cur_len = dbs->sg->sg[dbs->sg_cur_index].len - dbs->sg_cur_byte;
-        mem = dma_memory_map(dbs->sg->as, cur_addr, &cur_len, dbs->dir);
+        mem = dma_memory_map_internal(dbs->sg->as, cur_addr, &cur_len,
+                                      dbs->dir, false, NULL);
         if (!mem)
             break;
         qemu_iovec_add(&dbs->iov, mem, cur_len);
@@ -165,6 +201,7 @@ static void dma_blk_cb(void *opaque, int ret)
         qemu_iovec_discard_back(&dbs->iov,
                                 QEMU_ALIGN_DOWN(dbs->iov.size, dbs->align));
     }
+    dma_blk_pin(dbs, start_index, start_byte);
 
     dbs->acb = dbs->io_func(dbs->offset, &dbs->iov,
                             dma_blk_cb, dbs, dbs->io_func_opaque);
@@ -1,166 +1,1400 @@
-/* 
- * GiantVM Frontier High-Performance Memory Server 
- * Feature: SO_REUSEPORT included for Multi-Process Scaling
- * Compile: gcc -O3 -o fast_mem_server fast_mem_server.c -lpthread
- * Usage: Run 8 instances of this program in background.
+/*
+ * Distributed shared memory of a distributed VM
+ *
+ * Every QEMU instance of a VM distributed with -local-cpu has its own copy
+ * of guest RAM, which a DSM keeps coherent. With the GiantVM KVM module the
+ * kernel does that (KVM_CAP_X86_DSM). On a stock kernel QEMU does it
+ * itself, as follows.
+ *
+ * Pages are 4 KiB. Each page of a RAM block has a home node; the block is
+ * split evenly between the nodes, in order, like the NUMA nodes that
+ * describe the instances to the guest. The home keeps the directory entry
+ * of the page: nobody has it yet (it is all zeroes), a set of nodes share
+ * it read-only, or one node owns it. A node's copy of a page is:
+ *
+ * - invalid: not mapped. The RAM block is registered with userfaultfd, so
+ *   any access, by a vCPU through KVM or by QEMU itself, waits for the DSM
+ *   thread to map the page.
+ * - shared: mapped write protected with userfaultfd; a write waits until
+ *   the node owns the page.
+ * - owned: mapped writable. A node that reads a page nobody has gets it
+ *   exclusively, so it can write it later without asking (the E of MESI).
+ *
+ * A node that faults asks the home (DSM_MSG_GET_S or DSM_MSG_GET_M), which
+ * serves the requests for one page one at a time: it recalls the page from
+ * its owner or invalidates the sharers, waits for their acknowledgements,
+ * and grants access with DSM_MSG_DATA. When a page goes from owned to
+ * shared the home takes a copy too, so it can serve later readers itself.
+ * A read fault also asks for the next dsm_prefetch pages, which the home
+ * grants along if it can do so without asking anybody else.
+ *
+ * All of this runs in one thread per instance, which never touches a page
+ * it has not mapped. Messages go through a DSMTransport; see
+ * dsm_transport.h.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
  */
-#include <endian.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/socket.h>
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/util.h"
+#include "qmp-commands.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
+#include "exec/address-spaces.h"
+#include "interrupt-router.h"
+#include "dsm_backend.h"
+#include "dsm_transport.h"
+
+#ifdef CONFIG_LINUX
+#include <linux/kvm.h>
 #include <sys/epoll.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <sys/mman.h>
-#include <errno.h>
-#include <time.h>
-#include <signal.h>
-
-#define _GNU_SOURCE 
-#include <endian.h>
-
-#define MAX_EVENTS 10240
-#define PORT 9999
-#define PAGE_SIZE 4096
-#define PREFETCH 32
-#define MEM_FILE "physical_ram.img"
-
-int set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) return -1;
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
-int main() {
-    signal(SIGPIPE, SIG_IGN);
-    int listen_sock, conn_sock, nfds, epollfd;
-    struct epoll_event ev, events[MAX_EVENTS];
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-
-    int fd_mem = open(MEM_FILE, O_RDONLY);
-    if (fd_mem < 0) { perror("Open memory file"); return 1; }
-    off_t file_size = lseek(fd_mem, 0, SEEK_END);
-    char *mem_ptr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd_mem, 0);
-    if (mem_ptr == MAP_FAILED) { perror("mmap"); return 1; }
-
-    /* [Frontier] 开启大页与预读优化 */
-    /* 作用：将 TLB Miss 减少 99%，防止 CPU 卡在页表查找上 */
-    madvise(mem_ptr, file_size, MADV_HUGEPAGE); 
-    madvise(mem_ptr, file_size, MADV_RANDOM);   // 告诉内核：这是随机访问，别做顺序预读
-    madvise(mem_ptr, file_size, MADV_WILLNEED); // 告诉内核：我会用到这些内存，尽快换入
-
-    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-    
-    /* [Frontier] 开启 SO_REUSEPORT，允许开启多个进程绑定同一端口 */
-    int opt = 1;
-    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
-    
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
-
-    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
-    if (listen(listen_sock, 20000) < 0) { perror("listen"); return 1; }
-
-    epollfd = epoll_create1(0);
-    ev.events = EPOLLIN;
-    ev.data.fd = listen_sock;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_sock, &ev) == -1) { perror("epoll_ctl: listen_sock"); return 1; }
-
-    printf("[*] High-Perf Memory Server running on port %d (PID: %d)\n", PORT, getpid());
-
-    while (1) {
-        nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
-        if (nfds == -1) { perror("epoll_wait"); break; }
-
-        for (int n = 0; n < nfds; ++n) {
-            if (events[n].data.fd == listen_sock) {
-                while (1) {
-                    conn_sock = accept(listen_sock, (struct sockaddr *)&addr, &addrlen);
-                    if (conn_sock == -1) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) break; // 处理完了
-                        perror("accept"); break;
-                    }
-        
-                    set_nonblocking(conn_sock);
-                    int flag = 1;
-                    setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-
-                    ev.events = EPOLLIN | EPOLLET; // 保持边缘触发
-                    ev.data.fd = conn_sock;
-                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn_sock, &ev) == -1) {
-                        close(conn_sock);
-                    }
-                }
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
+
+/* fault latency histogram, see router_latency_bucket() */
+#define DSM_LATENCY_BUCKETS     ROUTER_LATENCY_BUCKETS
+#define DSM_HOT_PAGES_DEFAULT   10
+#define DSM_HOT_PAGES_MAX       1000
+
+DsmMode dsm_mode = DSM_MODE_NONE;
+uint16_t dsm_port = DSM_PORT_DEFAULT;
+uint32_t dsm_prefetch = DSM_PREFETCH_DEFAULT;
+
+/* -1 to use the kernel DSM if there is one */
+static int dsm_mode_requested = -1;
+
+int parse_dsm_mode(const char *mode)
+{
+    Error *err = NULL;
+    int ret;
+
+    if (mode == NULL) {
+        return 0;
+    }
+
+    ret = qapi_enum_parse(DsmMode_lookup, mode, DSM_MODE__MAX, -1, &err);
+    if (ret == DSM_MODE_NONE) {
+        error_setg(&err, "dsm must be 'kernel' or 'user'");
+    }
+    if (err) {
+        error_report_err(err);
+        return -EINVAL;
+    }
+    dsm_mode_requested = ret;
+    return 0;
+}
+
+/* the vCPU faults query-dsm-stats returned last time, and when */
+static uint64_t *dsm_vcpu_faults_last;
+static int64_t dsm_vcpu_faults_last_ns;
+
+/*
+ * The faults of each vCPU of this instance, given by cpu_index in
+ * @faults, and their rate since the previous query
+ */
+static DsmVcpuStatsList *dsm_vcpu_stats(const uint64_t *faults)
+{
+    DsmVcpuStatsList *head = NULL, **tail = &head, *elem;
+    int64_t ns = get_clock();
+    int64_t elapsed = ns - dsm_vcpu_faults_last_ns;
+    uint64_t *last;
+    CPUState *cpu;
+
+    if (!dsm_vcpu_faults_last) {
+        dsm_vcpu_faults_last = g_new0(uint64_t, max_cpus);
+    }
+    last = dsm_vcpu_faults_last;
+    CPU_FOREACH(cpu) {
+        if (!cpu->local) {
+            continue;
+        }
+        elem = g_new0(DsmVcpuStatsList, 1);
+        elem->value = g_new0(DsmVcpuStats, 1);
+        elem->value->cpu_index = cpu->cpu_index;
+        elem->value->faults = faults[cpu->cpu_index];
+        if (dsm_vcpu_faults_last_ns && elapsed > 0) {
+            elem->value->fault_rate =
+                muldiv64(faults[cpu->cpu_index] - last[cpu->cpu_index],
+                         NANOSECONDS_PER_SECOND, elapsed);
+        }
+        last[cpu->cpu_index] = faults[cpu->cpu_index];
+        *tail = elem;
+        tail = &elem->next;
+    }
+    dsm_vcpu_faults_last_ns = ns;
+    return head;
+}
+
+#if defined(CONFIG_LINUX) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+
+#define DSM_MAX_BLOCKS          64
+#define DSM_EVENTS              64
+
+/* the copy of a page at this node */
+enum {
+    DSM_LOCAL_INVALID,
+    DSM_LOCAL_SHARED,
+    DSM_LOCAL_OWNED,
+};
+#define DSM_LOCAL_STATE         0x0f
+/* this node asked the home for the page and waits for DSM_MSG_DATA */
+#define DSM_LOCAL_PENDING       0x80
+
+/* the directory entry of a page, at its home */
+enum {
+    DSM_DIR_NONE,
+    DSM_DIR_SHARED,
+    DSM_DIR_OWNED,
+};
+
+typedef struct DSMDirEntry {
+    uint64_t sharers;
+    uint8_t state;
+    uint8_t owner;
+    uint32_t transfers;         /* times taken back from a node */
+} DSMDirEntry;
+
+typedef struct DSMBlock {
+    uint8_t *host;
+    uint64_t pages;
+    uint64_t home_pages;        /* node N is home of [N, N + 1) * this */
+    uint64_t home_start;        /* first page homed here */
+    uint8_t *local;             /* DSM_LOCAL_*, per page */
+    DSMDirEntry *dir;           /* per page homed here */
+} DSMBlock;
+
+/* A request the home is serving, and those queued behind it */
+typedef struct DSMTxn {
+    uint64_t key;
+    int requester;
+    uint8_t type;
+    uint32_t npages;
+    int acks;                   /* INV_ACK and RECALL_ACK still to come */
+    bool have_data;
+    uint8_t data[DSM_PAGE_SIZE];
+    GQueue waiting;             /* of DSMMsg */
+} DSMTxn;
+
+/* A message for a RAM block this node has not registered yet */
+typedef struct DSMDeferred {
+    int from;
+    DSMMsg msg;
+    uint8_t page[];
+} DSMDeferred;
+
+/* A fault waiting for the home, to measure how long it takes */
+typedef struct DSMFault {
+    uint64_t key;
+    int64_t start_ns;
+} DSMFault;
+
+typedef struct DSMNodeCounters {
+    uint64_t read_faults;       /* on pages homed at the node */
+    uint64_t write_faults;
+    uint64_t pages_in;          /* page contents received from the node */
+    uint64_t pages_out;
+    uint64_t revoked;           /* pages the node took back from us */
+} DSMNodeCounters;
+
+/* Written by the DSM thread only, read by query-dsm-stats as they are */
+typedef struct DSMUserStats {
+    uint64_t faults;
+    uint64_t latency_us[DSM_LATENCY_BUCKETS];
+    DSMNodeCounters nodes[DSM_MAX_NODES];
+    /* by cpu_index; NULL if the kernel does not say which thread faulted */
+    uint64_t *vcpu_faults;
+} DSMUserStats;
+
+typedef struct DSMUser {
+    int uffd;
+    int epoll_fd;
+    int wakeup_fd;              /* a block was registered */
+    QemuThread thread;
+    DSMTransport transport;
+    DSMBlock blocks[DSM_MAX_BLOCKS];
+    int n_blocks;               /* registered, written by the main thread */
+    int n_ready;                /* of which the DSM thread knows */
+    GHashTable *txns;           /* page key -> DSMTxn */
+    GQueue deferred;            /* of DSMDeferred */
+    GHashTable *faults;         /* page key -> DSMFault, while pending */
+    GHashTable *vcpu_threads;   /* thread id -> cpu_index + 1 */
+    DSMUserStats stats;
+} DSMUser;
+
+static DSMUser dsm;
+static const uint8_t dsm_zero_page[DSM_PAGE_SIZE] QEMU_ALIGNED(DSM_PAGE_SIZE);
+
+static inline uint64_t dsm_key(int block, uint64_t page)
+{
+    return (uint64_t)block << 48 | page;
+}
+
+static inline int dsm_home(DSMBlock *b, uint64_t page)
+{
+    return MIN(page / b->home_pages, dsm.transport.nodes - 1);
+}
+
+static inline DSMDirEntry *dsm_dir(DSMBlock *b, uint64_t page)
+{
+    return &b->dir[page - b->home_start];
+}
+
+static inline void *dsm_host(DSMBlock *b, uint64_t page)
+{
+    return b->host + (page << DSM_PAGE_BITS);
+}
+
+static void dsm_send(int node, const DSMMsg *msg, const void *page)
+{
+    assert(node != dsm.transport.self);
+    if (msg->flags & DSM_MSG_F_PAYLOAD) {
+        dsm.stats.nodes[node].pages_out++;
+    }
+    if (dsm.transport.ops->send(&dsm.transport, node, msg, page) < 0) {
+        error_report("dsm: lost connection to node %d", node);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* userfaultfd operations on one page */
+
+static void dsm_uffd_copy(void *host, const void *data, bool wp)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)host,
+        .src = (uintptr_t)(data ? data : dsm_zero_page),
+        .len = DSM_PAGE_SIZE,
+        .mode = wp ? UFFDIO_COPY_MODE_WP : 0,
+    };
+
+    while (ioctl(dsm.uffd, UFFDIO_COPY, &copy) < 0) {
+        if (errno == EEXIST) {
+            return;
+        }
+        if (errno != EAGAIN) {
+            error_report("dsm: UFFDIO_COPY failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        copy.copy = 0;
+    }
+}
+
+static void dsm_uffd_protect(void *host, bool wp)
+{
+    struct uffdio_writeprotect prot = {
+        .range.start = (uintptr_t)host,
+        .range.len = DSM_PAGE_SIZE,
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    while (ioctl(dsm.uffd, UFFDIO_WRITEPROTECT, &prot) < 0) {
+        if (errno != EAGAIN) {
+            error_report("dsm: UFFDIO_WRITEPROTECT failed: %s",
+                         strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void dsm_uffd_wake(void *host)
+{
+    struct uffdio_range range = {
+        .start = (uintptr_t)host,
+        .len = DSM_PAGE_SIZE,
+    };
+
+    ioctl(dsm.uffd, UFFDIO_WAKE, &range);
+}
+
+/* Node side */
+
+/* A fault was answered, account for how long it waited */
+static void dsm_fault_done(uint64_t key)
+{
+    DSMFault *fault = g_hash_table_lookup(dsm.faults, &key);
+    uint64_t us;
+
+    if (!fault) {
+        return;
+    }
+    us = (get_clock() - fault->start_ns) / SCALE_US;
+    dsm.stats.latency_us[router_latency_bucket(us)]++;
+    g_hash_table_remove(dsm.faults, &key);
+}
+
+/* Map a page granted by the home, and wake whoever waits for it */
+static void dsm_node_grant(DSMBlock *b, uint64_t page, const DSMMsg *msg,
+                           const void *data)
+{
+    uint8_t *local = &b->local[page];
+    int state = *local & DSM_LOCAL_STATE;
+    bool excl = msg->flags & DSM_MSG_F_EXCLUSIVE;
+    void *host = dsm_host(b, page);
+
+    if (msg->flags & (DSM_MSG_F_PAYLOAD | DSM_MSG_F_ZERO)) {
+        if (state == DSM_LOCAL_INVALID) {
+            dsm_uffd_copy(host, msg->flags & DSM_MSG_F_PAYLOAD ? data : NULL,
+                          !excl);
+            state = excl ? DSM_LOCAL_OWNED : DSM_LOCAL_SHARED;
+        } else if (excl && state == DSM_LOCAL_SHARED) {
+            dsm_uffd_protect(host, false);
+            state = DSM_LOCAL_OWNED;
+        }
+    } else if (state == DSM_LOCAL_INVALID) {
+        error_report("dsm: granted page %" PRIu64 " of block %u that is "
+                     "not here", page, msg->block);
+    } else if (excl && state == DSM_LOCAL_SHARED) {
+        dsm_uffd_protect(host, false);
+        state = DSM_LOCAL_OWNED;
+    } else {
+        dsm_uffd_wake(host);
+    }
+
+    *local = (*local & DSM_LOCAL_PENDING) | state;
+    if (!(msg->flags & DSM_MSG_F_PREFETCH) && (*local & DSM_LOCAL_PENDING)) {
+        *local &= ~DSM_LOCAL_PENDING;
+        dsm_fault_done(dsm_key(le32_to_cpu(msg->block), page));
+    }
+}
+
+/*
+ * Give up a page for the home: write protect it so that nobody changes it
+ * behind our back, copy its contents to @copy_to if not NULL, and drop it
+ * unless we may keep a shared copy.
+ */
+static void dsm_node_revoke(DSMBlock *b, uint64_t page, bool drop,
+                            uint8_t *copy_to)
+{
+    uint8_t *local = &b->local[page];
+    int state = *local & DSM_LOCAL_STATE;
+    void *host = dsm_host(b, page);
+
+    if (state == DSM_LOCAL_INVALID) {
+        error_report("dsm: revoked page %" PRIu64 " that is not here", page);
+        if (copy_to) {
+            memset(copy_to, 0, DSM_PAGE_SIZE);
+        }
+        return;
+    }
+    dsm.stats.nodes[dsm_home(b, page)].revoked++;
+    if (state == DSM_LOCAL_OWNED) {
+        dsm_uffd_protect(host, true);
+    }
+    if (copy_to) {
+        memcpy(copy_to, host, DSM_PAGE_SIZE);
+    }
+    if (drop) {
+        qemu_madvise(host, DSM_PAGE_SIZE, QEMU_MADV_DONTNEED);
+        /* a writer waiting for the upgrade faults again, as a miss */
+        dsm_uffd_wake(host);
+        state = DSM_LOCAL_INVALID;
+    } else {
+        state = DSM_LOCAL_SHARED;
+    }
+    *local = (*local & DSM_LOCAL_PENDING) | state;
+}
+
+static void dsm_node_handle_revoke(int from, DSMBlock *b, const DSMMsg *msg)
+{
+    static uint8_t buf[DSM_PAGE_SIZE];
+    DSMMsg reply = {
+        .from = cpu_to_le16(dsm.transport.self),
+        .block = msg->block,
+        .page = msg->page,
+    };
+    uint64_t page = le64_to_cpu(msg->page);
+
+    if (msg->type == DSM_MSG_INV) {
+        dsm_node_revoke(b, page, true, NULL);
+        reply.type = DSM_MSG_INV_ACK;
+        dsm_send(from, &reply, NULL);
+    } else {
+        dsm_node_revoke(b, page, msg->flags & DSM_MSG_F_EXCLUSIVE, buf);
+        reply.type = DSM_MSG_RECALL_ACK;
+        reply.flags = DSM_MSG_F_PAYLOAD;
+        dsm_send(from, &reply, buf);
+    }
+}
+
+/* Home side */
+
+/* Grant @page to @node, directly if that is us */
+static void dsm_home_grant(DSMBlock *b, int block, uint64_t page, int node,
+                           uint8_t flags, const void *data)
+{
+    DSMMsg msg = {
+        .type = DSM_MSG_DATA,
+        .flags = flags,
+        .from = cpu_to_le16(dsm.transport.self),
+        .block = cpu_to_le32(block),
+        .page = cpu_to_le64(page),
+    };
+
+    if (node == dsm.transport.self) {
+        dsm_node_grant(b, page, &msg, data);
+    } else {
+        dsm_send(node, &msg, data);
+    }
+}
+
+/*
+ * Send along the neighbours of @page that @node does not have and that
+ * nobody else needs to give up: those nobody has, and shared ones.
+ */
+static void dsm_home_prefetch(DSMBlock *b, int block, uint64_t page,
+                              int node, uint32_t npages)
+{
+    uint64_t end = MIN(page + npages, b->home_start + b->home_pages);
+    uint64_t bit = 1ULL << node;
+    DSMDirEntry *d;
+    uint64_t key;
+
+    end = MIN(end, b->pages);
+    for (page++; page < end; page++) {
+        d = dsm_dir(b, page);
+        key = dsm_key(block, page);
+        if (g_hash_table_contains(dsm.txns, &key)) {
+            continue;
+        }
+        if (d->state == DSM_DIR_NONE) {
+            d->state = DSM_DIR_OWNED;
+            d->owner = node;
+            dsm_home_grant(b, block, page, node, DSM_MSG_F_ZERO |
+                           DSM_MSG_F_EXCLUSIVE | DSM_MSG_F_PREFETCH, NULL);
+        } else if (d->state == DSM_DIR_SHARED && !(d->sharers & bit)) {
+            d->sharers |= bit;
+            dsm_home_grant(b, block, page, node, DSM_MSG_F_PAYLOAD |
+                           DSM_MSG_F_PREFETCH, dsm_host(b, page));
+        }
+    }
+}
+
+/* All acknowledgements are in: grant the page and update the directory */
+static void dsm_home_finish(DSMBlock *b, int block, uint64_t page,
+                            DSMTxn *txn)
+{
+    DSMDirEntry *d = dsm_dir(b, page);
+    int self = dsm.transport.self;
+    int r = txn->requester;
+    uint8_t flags = txn->have_data ? DSM_MSG_F_PAYLOAD : 0;
+
+    if (txn->type == DSM_MSG_GET_M) {
+        d->state = DSM_DIR_OWNED;
+        d->owner = r;
+        d->sharers = 0;
+        dsm_home_grant(b, block, page, r, flags | DSM_MSG_F_EXCLUSIVE,
+                       txn->data);
+        return;
+    }
+
+    /* the owner kept a shared copy; so do we */
+    assert(d->state == DSM_DIR_OWNED && txn->have_data);
+    if (d->owner != self && r != self) {
+        dsm_uffd_copy(dsm_host(b, page), txn->data, true);
+        b->local[page] = (b->local[page] & DSM_LOCAL_PENDING) |
+                         DSM_LOCAL_SHARED;
+    }
+    d->state = DSM_DIR_SHARED;
+    d->sharers = 1ULL << d->owner | 1ULL << r | 1ULL << self;
+    dsm_home_grant(b, block, page, r, flags, txn->data);
+    if (txn->npages > 1) {
+        dsm_home_prefetch(b, block, page, r, txn->npages);
+    }
+}
+
+/*
+ * Serve the request in @txn as far as possible. Returns true if it is
+ * done, false if it waits for acknowledgements.
+ */
+static bool dsm_home_start(DSMBlock *b, int block, uint64_t page,
+                           DSMTxn *txn)
+{
+    DSMDirEntry *d = dsm_dir(b, page);
+    int self = dsm.transport.self;
+    int r = txn->requester;
+    uint64_t bit = 1ULL << r, others;
+    bool excl = txn->type == DSM_MSG_GET_M;
+    DSMMsg msg = {
+        .from = cpu_to_le16(self),
+        .block = cpu_to_le32(block),
+        .page = cpu_to_le64(page),
+    };
+    int node;
+
+    txn->acks = 0;
+    txn->have_data = false;
+
+    switch (d->state) {
+    case DSM_DIR_NONE:
+        d->state = DSM_DIR_OWNED;
+        d->owner = r;
+        dsm_home_grant(b, block, page, r,
+                       DSM_MSG_F_ZERO | DSM_MSG_F_EXCLUSIVE, NULL);
+        break;
+
+    case DSM_DIR_OWNED:
+        if (d->owner == r) {
+            dsm_home_grant(b, block, page, r, DSM_MSG_F_EXCLUSIVE, NULL);
+            return true;
+        }
+        d->transfers++;
+        if (d->owner == self) {
+            dsm_node_revoke(b, page, excl, txn->data);
+            txn->have_data = true;
+            dsm_home_finish(b, block, page, txn);
+            return true;
+        }
+        msg.type = DSM_MSG_RECALL;
+        msg.flags = excl ? DSM_MSG_F_EXCLUSIVE : 0;
+        dsm_send(d->owner, &msg, NULL);
+        txn->acks = 1;
+        return false;
+
+    case DSM_DIR_SHARED:
+        /* the home always has a copy of a shared page */
+        assert(d->sharers & (1ULL << self));
+        if (!excl) {
+            if (d->sharers & bit) {
+                dsm_home_grant(b, block, page, r, 0, NULL);
+            } else {
+                d->sharers |= bit;
+                dsm_home_grant(b, block, page, r, DSM_MSG_F_PAYLOAD,
+                               dsm_host(b, page));
+            }
+            break;
+        }
+        if (!(d->sharers & bit)) {
+            memcpy(txn->data, dsm_host(b, page), DSM_PAGE_SIZE);
+            txn->have_data = true;
+        }
+        others = d->sharers & ~bit;
+        if (others) {
+            d->transfers++;
+        }
+        msg.type = DSM_MSG_INV;
+        for (node = 0; others; node++, others >>= 1) {
+            if (!(others & 1)) {
+                continue;
+            }
+            if (node == self) {
+                dsm_node_revoke(b, page, true, NULL);
             } else {
-                int fd = events[n].data.fd;
-                /* [CRITICAL FIX] 循环读取直到 EAGAIN */
-                while (1) {
-                    uint64_t req_addr_be;
-                    ssize_t count = recv(fd, &req_addr_be, 8, MSG_WAITALL);
-                    
-                    if (count == 8) {
-                        uint64_t base = be64toh(req_addr_be);
-                        if (base + PAGE_SIZE * PREFETCH > file_size) base = 0; 
-                        
-                        size_t total_to_send = PAGE_SIZE * PREFETCH;
-                        size_t sent_total = 0;
-                        char *send_ptr = mem_ptr + base;
-
-                        /* 基于时间的宽容超时逻辑 */
-                        struct timespec ts_start = {0}, ts_now;
-                        
-                        while(sent_total < total_to_send) {
-                            ssize_t s = send(fd, send_ptr + sent_total, total_to_send - sent_total, 0);
-                            if (s < 0) {
-                                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                                    /* 第一次遇到阻塞时，记录当前时间 */
-                                    if (ts_start.tv_sec == 0) {
-                                        clock_gettime(CLOCK_MONOTONIC, &ts_start);
-                                    }
-                                    
-                                    /* 检查是否超时 */
-                                    clock_gettime(CLOCK_MONOTONIC, &ts_now);
-                                    if (ts_now.tv_sec - ts_start.tv_sec > 5) {
-                                        // 阻塞超过 5 秒，判定为死链接，断开
-                                        close(fd); goto next_event; 
-                                    }
-                                    
-                                    /* 增加睡眠时间到 50us，避免 CPU 空转过热 */
-                                    usleep(50); 
-                                    continue; 
-                                }
-                                // 其他错误直接断开
-                                close(fd); goto next_event;
-                            }
-                            
-                            sent_total += s;
-                            /* 只要成功发送了数据，重置超时计时器，给下一次发送机会 */
-                            ts_start.tv_sec = 0; 
-                        }
-                    } else if (count < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) break; // 读空了，退出循环等待下一次事件
-                        close(fd); 
-                        break;
-                    } else if (count == 0) {
-                        close(fd); // 对端关闭
-                        break;
-                    } else {
-                        // 读到了半截数据(小于8字节)，这在 TCP流中极少见但理论存在
-                        // 简单处理：关连接。复杂处理：维护个 buffer 拼包。
-                        // 鉴于这是高性能场景，视为协议错误关闭即可。
-                        close(fd);
-                        break;
-                    }
-                }
-                next_event:;
+                dsm_send(node, &msg, NULL);
+                txn->acks++;
+            }
+        }
+        if (txn->acks) {
+            return false;
+        }
+        dsm_home_finish(b, block, page, txn);
+        return true;
+    }
+
+    if (!excl && txn->npages > 1) {
+        dsm_home_prefetch(b, block, page, r, txn->npages);
+    }
+    return true;
+}
+
+/*
+ * Move @txn on to the next request queued for its page. Returns false,
+ * after freeing @txn, if there is none.
+ */
+static bool dsm_home_next(DSMTxn *txn)
+{
+    DSMMsg *next = g_queue_pop_head(&txn->waiting);
+
+    if (!next) {
+        g_hash_table_remove(dsm.txns, &txn->key);
+        g_free(txn);
+        return false;
+    }
+    txn->requester = le16_to_cpu(next->from);
+    txn->type = next->type;
+    txn->npages = le32_to_cpu(next->npages);
+    g_free(next);
+    return true;
+}
+
+/* Serve the requests for the page of @txn until one has to wait */
+static void dsm_home_run(DSMBlock *b, int block, uint64_t page, DSMTxn *txn)
+{
+    do {
+        if (!dsm_home_start(b, block, page, txn)) {
+            return;
+        }
+    } while (dsm_home_next(txn));
+}
+
+static void dsm_home_request(DSMBlock *b, const DSMMsg *msg)
+{
+    int block = le32_to_cpu(msg->block);
+    uint64_t page = le64_to_cpu(msg->page);
+    uint64_t key = dsm_key(block, page);
+    DSMTxn *txn;
+
+    txn = g_hash_table_lookup(dsm.txns, &key);
+    if (txn) {
+        g_queue_push_tail(&txn->waiting, g_memdup(msg, sizeof(*msg)));
+        return;
+    }
+
+    txn = g_new0(DSMTxn, 1);
+    txn->key = key;
+    txn->requester = le16_to_cpu(msg->from);
+    txn->type = msg->type;
+    txn->npages = le32_to_cpu(msg->npages);
+    g_queue_init(&txn->waiting);
+    g_hash_table_insert(dsm.txns, &txn->key, txn);
+    dsm_home_run(b, block, page, txn);
+}
+
+static void dsm_home_ack(DSMBlock *b, const DSMMsg *msg, const void *data)
+{
+    int block = le32_to_cpu(msg->block);
+    uint64_t page = le64_to_cpu(msg->page);
+    uint64_t key = dsm_key(block, page);
+    DSMTxn *txn = g_hash_table_lookup(dsm.txns, &key);
+
+    if (!txn || !txn->acks) {
+        error_report("dsm: unexpected acknowledgement for page %" PRIu64,
+                     page);
+        return;
+    }
+    if (msg->type == DSM_MSG_RECALL_ACK) {
+        memcpy(txn->data, data, DSM_PAGE_SIZE);
+        txn->have_data = true;
+    }
+    if (--txn->acks) {
+        return;
+    }
+
+    dsm_home_finish(b, block, page, txn);
+    if (dsm_home_next(txn)) {
+        dsm_home_run(b, block, page, txn);
+    }
+}
+
+/* Dispatch */
+
+static void dsm_handle(int from, DSMMsg *msg, const void *data)
+{
+    int block = le32_to_cpu(msg->block);
+    DSMBlock *b;
+    DSMDeferred *d;
+
+    if (block >= dsm.n_ready) {
+        d = g_malloc(sizeof(*d) + DSM_PAGE_SIZE);
+        d->from = from;
+        d->msg = *msg;
+        if (msg->flags & DSM_MSG_F_PAYLOAD) {
+            memcpy(d->page, data, DSM_PAGE_SIZE);
+        }
+        g_queue_push_tail(&dsm.deferred, d);
+        return;
+    }
+    b = &dsm.blocks[block];
+    if (le64_to_cpu(msg->page) >= b->pages) {
+        error_report("dsm: node %d sent bad page %" PRIu64, from,
+                     le64_to_cpu(msg->page));
+        return;
+    }
+
+    if ((msg->flags & DSM_MSG_F_PAYLOAD) && from != dsm.transport.self) {
+        dsm.stats.nodes[from].pages_in++;
+    }
+
+    switch (msg->type) {
+    case DSM_MSG_GET_S:
+    case DSM_MSG_GET_M:
+        dsm_home_request(b, msg);
+        break;
+    case DSM_MSG_DATA:
+        dsm_node_grant(b, le64_to_cpu(msg->page), msg, data);
+        break;
+    case DSM_MSG_INV:
+    case DSM_MSG_RECALL:
+        dsm_node_handle_revoke(from, b, msg);
+        break;
+    case DSM_MSG_INV_ACK:
+    case DSM_MSG_RECALL_ACK:
+        dsm_home_ack(b, msg, data);
+        break;
+    default:
+        error_report("dsm: node %d sent unknown message %d", from, msg->type);
+    }
+}
+
+static void dsm_deliver(DSMTransport *t, int node, DSMMsg *msg,
+                        const void *data)
+{
+    dsm_handle(node, msg, data);
+}
+
+/* Catch up with the blocks registered since last time */
+static void dsm_blocks_ready(void)
+{
+    GQueue queue;
+    DSMDeferred *d;
+    uint64_t count;
+
+    if (read(dsm.wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        error_report("dsm: wakeup read failed: %s", strerror(errno));
+    }
+    dsm.n_ready = atomic_mb_read(&dsm.n_blocks);
+
+    /* messages for blocks still missing are deferred again, in order */
+    queue = dsm.deferred;
+    g_queue_init(&dsm.deferred);
+    while ((d = g_queue_pop_head(&queue)) != NULL) {
+        dsm_handle(d->from, &d->msg, d->page);
+        g_free(d);
+    }
+}
+
+static DSMBlock *dsm_find_block(uint64_t addr, int *index)
+{
+    int i, n = atomic_mb_read(&dsm.n_blocks);
+
+    for (i = 0; i < n; i++) {
+        DSMBlock *b = &dsm.blocks[i];
+
+        if (addr >= (uintptr_t)b->host &&
+            addr < (uintptr_t)b->host + (b->pages << DSM_PAGE_BITS)) {
+            *index = i;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/* Count a fault of the vCPU that runs in thread @ptid, if it is one */
+static void dsm_fault_vcpu(uint32_t ptid)
+{
+    gpointer index;
+    CPUState *cpu;
+
+    if (!dsm.stats.vcpu_faults) {
+        return;
+    }
+    index = g_hash_table_lookup(dsm.vcpu_threads, GUINT_TO_POINTER(ptid));
+    if (!index) {
+        /* the first fault of this thread; vCPU threads stay around */
+        CPU_FOREACH(cpu) {
+            if (cpu->local && cpu->thread_id == ptid) {
+                index = GINT_TO_POINTER(cpu->cpu_index + 1);
+                g_hash_table_insert(dsm.vcpu_threads, GUINT_TO_POINTER(ptid),
+                                    index);
+                break;
             }
         }
+        if (!index) {
+            /* an I/O thread, or the main loop */
+            return;
+        }
+    }
+    dsm.stats.vcpu_faults[GPOINTER_TO_INT(index) - 1]++;
+}
+
+static void dsm_fault(uint64_t addr, uint64_t flags, uint32_t ptid)
+{
+    bool wp = flags & UFFD_PAGEFAULT_FLAG_WP;
+    bool write = wp || (flags & UFFD_PAGEFAULT_FLAG_WRITE);
+    DSMMsg msg = {
+        .type = write ? DSM_MSG_GET_M : DSM_MSG_GET_S,
+        .from = cpu_to_le16(dsm.transport.self),
+        .npages = cpu_to_le32(write ? 1 : 1 + dsm_prefetch),
+    };
+    DSMNodeCounters *counters;
+    DSMFault *fault;
+    uint8_t *local;
+    uint64_t page;
+    DSMBlock *b;
+    int block, state, home;
+
+    b = dsm_find_block(addr, &block);
+    if (!b) {
+        error_report("dsm: fault at 0x%" PRIx64 " outside guest RAM", addr);
+        return;
+    }
+    page = (addr - (uintptr_t)b->host) >> DSM_PAGE_BITS;
+    local = &b->local[page];
+    state = *local & DSM_LOCAL_STATE;
+
+    /* the reply to the request in flight wakes this one too */
+    if (*local & DSM_LOCAL_PENDING) {
+        return;
+    }
+    /* raced with a grant */
+    if (state == DSM_LOCAL_OWNED || (state == DSM_LOCAL_SHARED && !write)) {
+        dsm_uffd_wake(dsm_host(b, page));
+        return;
     }
+
+    home = dsm_home(b, page);
+    counters = &dsm.stats.nodes[home];
+    if (write) {
+        counters->write_faults++;
+    } else {
+        counters->read_faults++;
+    }
+    dsm.stats.faults++;
+    dsm_fault_vcpu(ptid);
+    fault = g_new(DSMFault, 1);
+    fault->key = dsm_key(block, page);
+    fault->start_ns = get_clock();
+    g_hash_table_insert(dsm.faults, &fault->key, fault);
+
+    *local |= DSM_LOCAL_PENDING;
+    msg.block = cpu_to_le32(block);
+    msg.page = cpu_to_le64(page);
+    if (home == dsm.transport.self) {
+        dsm_handle(home, &msg, NULL);
+    } else {
+        dsm_send(home, &msg, NULL);
+    }
+}
+
+static void dsm_read_faults(void)
+{
+    struct uffd_msg msgs[DSM_EVENTS];
+    ssize_t n;
+    int i;
+
+    for (;;) {
+        n = read(dsm.uffd, msgs, sizeof(msgs));
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                error_report("dsm: userfaultfd read failed: %s",
+                             strerror(errno));
+            }
+            return;
+        }
+        for (i = 0; i < n / sizeof(msgs[0]); i++) {
+            if (msgs[i].event == UFFD_EVENT_PAGEFAULT) {
+                dsm_fault(msgs[i].arg.pagefault.address,
+                          msgs[i].arg.pagefault.flags,
+                          msgs[i].arg.pagefault.feat.ptid);
+            }
+        }
+        if (n < sizeof(msgs)) {
+            return;
+        }
+    }
+}
+
+static void *dsm_thread(void *opaque)
+{
+    struct epoll_event events[DSM_EVENTS];
+    int i, n;
+
+    for (;;) {
+        n = epoll_wait(dsm.epoll_fd, events, DSM_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("dsm: epoll_wait failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &dsm.uffd) {
+                dsm_read_faults();
+            } else if (ptr == &dsm.wakeup_fd) {
+                dsm_blocks_ready();
+            } else if (dsm.transport.ops->event(&dsm.transport, ptr,
+                                                events[i].events) < 0) {
+                error_report("dsm: lost connection to a node");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int dsm_epoll_add(int fd, void *ptr, Error **errp)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = ptr,
+    };
+
+    if (epoll_ctl(dsm.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        error_setg_errno(errp, errno, "dsm: epoll_ctl");
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Open a userfaultfd with @features. The kernel fails UFFDIO_API if it
+ * lacks any of them, and only takes it once per file.
+ */
+static int dsm_uffd_open(uint64_t features)
+{
+    struct uffdio_api api = {
+        .api = UFFD_API,
+        .features = features,
+    };
+    int fd, err;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (ioctl(fd, UFFDIO_API, &api) < 0) {
+        err = errno;
+        close(fd);
+        return -err;
+    }
+    if ((api.features & features) != features) {
+        close(fd);
+        return -ENOSYS;
+    }
+    return fd;
+}
+
+static int dsm_user_start(Error **errp)
+{
+    uint32_t n_hosts;
+    char **hosts;
+    int ret;
+
+    dsm.transport.nodes = router_instances();
+    dsm.transport.self = router_local_index();
+    if (dsm.transport.nodes > DSM_MAX_NODES) {
+        error_setg(errp, "at most %d instances are supported",
+                   DSM_MAX_NODES);
+        return -EINVAL;
+    }
+
+    /* the thread IDs are only for the faults of each vCPU */
+    dsm.uffd = dsm_uffd_open(UFFD_FEATURE_PAGEFAULT_FLAG_WP |
+                             UFFD_FEATURE_THREAD_ID);
+    if (dsm.uffd >= 0) {
+        dsm.stats.vcpu_faults = g_new0(uint64_t, max_cpus);
+        dsm.vcpu_threads = g_hash_table_new(NULL, NULL);
+    } else {
+        dsm.uffd = dsm_uffd_open(UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+    }
+    if (dsm.uffd == -ENOSYS || dsm.uffd == -EINVAL) {
+        error_setg(errp, "userfaultfd write protection not supported, "
+                   "Linux 5.7 or later is needed");
+        return -ENOSYS;
+    }
+    if (dsm.uffd < 0) {
+        error_setg_errno(errp, -dsm.uffd, "userfaultfd not available");
+        return dsm.uffd;
+    }
+
+    dsm.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    dsm.wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (dsm.epoll_fd < 0 || dsm.wakeup_fd < 0) {
+        error_setg_errno(errp, errno, "dsm: cannot create fds");
+        return -errno;
+    }
+    ret = dsm_epoll_add(dsm.uffd, &dsm.uffd, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = dsm_epoll_add(dsm.wakeup_fd, &dsm.wakeup_fd, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    hosts = get_cluster_iplist(&n_hosts);
+    dsm.transport.ops = &dsm_transport_tcp;
+    dsm.transport.hosts = n_hosts >= dsm.transport.nodes ? hosts : NULL;
+    dsm.transport.port = dsm_port;
+    dsm.transport.deliver = dsm_deliver;
+    ret = dsm.transport.ops->start(&dsm.transport, dsm.epoll_fd, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    dsm.txns = g_hash_table_new(g_int64_hash, g_int64_equal);
+    dsm.faults = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                       g_free);
+    g_queue_init(&dsm.deferred);
+    qemu_thread_create(&dsm.thread, "dsm", dsm_thread, NULL,
+                       QEMU_THREAD_DETACHED);
     return 0;
 }
+
+static void dsm_user_register(void *ptr, size_t size)
+{
+    struct uffdio_register reg = {
+        .range.start = (uintptr_t)ptr,
+        .range.len = ROUND_UP(size, DSM_PAGE_SIZE),
+        .mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP,
+    };
+    uint64_t needed = 1ULL << _UFFDIO_COPY | 1ULL << _UFFDIO_WRITEPROTECT;
+    int nodes = dsm.transport.nodes, self = dsm.transport.self;
+    DSMBlock *b;
+    uint64_t one = 1;
+
+    if (dsm.n_blocks == DSM_MAX_BLOCKS) {
+        error_report("dsm: too many RAM blocks");
+        exit(EXIT_FAILURE);
+    }
+    assert(QEMU_IS_ALIGNED((uintptr_t)ptr, DSM_PAGE_SIZE));
+
+    /* whatever was written before is stale, the home has the real thing */
+    qemu_madvise(ptr, reg.range.len, QEMU_MADV_NOHUGEPAGE);
+    qemu_madvise(ptr, reg.range.len, QEMU_MADV_DONTNEED);
+    if (ioctl(dsm.uffd, UFFDIO_REGISTER, &reg) < 0 ||
+        (reg.ioctls & needed) != needed) {
+        error_report("dsm: cannot register RAM with userfaultfd (%s); the "
+                     "userspace DSM needs anonymous, private guest RAM",
+                     strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    b = &dsm.blocks[dsm.n_blocks];
+    b->host = ptr;
+    b->pages = reg.range.len >> DSM_PAGE_BITS;
+    b->home_pages = DIV_ROUND_UP(b->pages, nodes);
+    b->home_start = MIN(b->home_pages * self, b->pages);
+    b->local = g_new0(uint8_t, b->pages);
+    b->dir = g_new0(DSMDirEntry, MIN(b->home_pages,
+                                     b->pages - b->home_start));
+    atomic_mb_set(&dsm.n_blocks, dsm.n_blocks + 1);
+
+    if (write(dsm.wakeup_fd, &one, sizeof(one)) < 0) {
+        error_report("dsm: wakeup write failed: %s", strerror(errno));
+    }
+}
+
+static bool dsm_user_sends(void *host, uint64_t page)
+{
+    /* the bitmap sync calls this from several threads at once */
+    static __thread DSMBlock *last;
+    DSMBlock *b = last;
+    DSMDirEntry *d;
+    int i, n;
+
+    if (!b || b->host != host) {
+        b = NULL;
+        n = atomic_mb_read(&dsm.n_blocks);
+        for (i = 0; i < n && !b; i++) {
+            if (dsm.blocks[i].host == host) {
+                b = &dsm.blocks[i];
+            }
+        }
+        if (!b) {
+            /* not shared, every instance sends its own */
+            return true;
+        }
+        last = b;
+    }
+
+    if ((b->local[page] & DSM_LOCAL_STATE) == DSM_LOCAL_OWNED) {
+        return true;
+    }
+    if (dsm_home(b, page) != dsm.transport.self) {
+        return false;
+    }
+    /* the home has a copy of every shared page */
+    d = dsm_dir(b, page);
+    return d->state == DSM_DIR_SHARED;
+}
+
+typedef struct DSMHotPage {
+    void *host;
+    uint32_t transfers;
+} DSMHotPage;
+
+/* Find the @top pages homed here that moved most, most moved first */
+static int dsm_user_hot_pages(DSMHotPage *hot, int top)
+{
+    int i, j, n = 0, n_blocks = atomic_mb_read(&dsm.n_blocks);
+    uint64_t page, homed;
+    uint32_t transfers;
+
+    for (i = 0; i < n_blocks && top; i++) {
+        DSMBlock *b = &dsm.blocks[i];
+
+        homed = MIN(b->home_pages, b->pages - b->home_start);
+        for (page = 0; page < homed; page++) {
+            transfers = atomic_read(&b->dir[page].transfers);
+            if (!transfers) {
+                continue;
+            }
+            if (n < top) {
+                n++;
+            } else if (transfers <= hot[n - 1].transfers) {
+                continue;
+            }
+            for (j = n - 1; j > 0 && hot[j - 1].transfers < transfers; j--) {
+                hot[j] = hot[j - 1];
+            }
+            hot[j].host = dsm_host(b, b->home_start + page);
+            hot[j].transfers = transfers;
+        }
+    }
+    return n;
+}
+
+static void dsm_user_stats(DsmStats *stats, int top)
+{
+    DSMHotPage *hot = g_new(DSMHotPage, top);
+    DsmNodeStatsList *node;
+    DsmHotPageList *entry;
+    int i, n;
+
+    stats->faults = dsm.stats.faults;
+    stats->latency_us = router_latency_list(dsm.stats.latency_us,
+                                            DSM_LATENCY_BUCKETS);
+    for (i = dsm.transport.nodes - 1; i >= 0; i--) {
+        DSMNodeCounters *c = &dsm.stats.nodes[i];
+
+        node = g_new0(DsmNodeStatsList, 1);
+        node->value = g_new0(DsmNodeStats, 1);
+        node->value->node = i;
+        node->value->read_faults = c->read_faults;
+        node->value->write_faults = c->write_faults;
+        node->value->pages_in = c->pages_in;
+        node->value->pages_out = c->pages_out;
+        node->value->revoked = c->revoked;
+        node->next = stats->nodes;
+        stats->nodes = node;
+        stats->bytes_in += c->pages_in * DSM_PAGE_SIZE;
+        stats->bytes_out += c->pages_out * DSM_PAGE_SIZE;
+    }
+
+    n = dsm_user_hot_pages(hot, top);
+    for (i = n - 1; i >= 0; i--) {
+        entry = g_new0(DsmHotPageList, 1);
+        entry->value = g_new0(DsmHotPage, 1);
+        entry->value->transfers = hot[i].transfers;
+        entry->value->has_gpa =
+            address_space_addr_from_host(&address_space_memory, hot[i].host,
+                                         &entry->value->gpa);
+        entry->next = stats->hot_pages;
+        stats->hot_pages = entry;
+    }
+    g_free(hot);
+
+    if (dsm.stats.vcpu_faults) {
+        stats->vcpus = dsm_vcpu_stats(dsm.stats.vcpu_faults);
+    }
+}
+
+#else
+
+static int dsm_user_start(Error **errp)
+{
+    error_setg(errp, "the userspace DSM needs userfaultfd");
+    return -ENOSYS;
+}
+
+static void dsm_user_register(void *ptr, size_t size)
+{
+}
+
+static void dsm_user_stats(DsmStats *stats, int top)
+{
+}
+
+static bool dsm_user_sends(void *host, uint64_t page)
+{
+    return true;
+}
+
+#endif
+
+void dsm_universal_init(void)
+{
+    Error *err = NULL;
+
+    if (local_cpus == smp_cpus || shm_path) {
+        return;
+    }
+
+#ifdef CONFIG_LINUX
+    if (dsm_mode_requested != DSM_MODE_USER && kvm_enabled() &&
+        kvm_check_extension(kvm_state, KVM_CAP_X86_DSM)) {
+        dsm_mode = DSM_MODE_KERNEL;
+        return;
+    }
+#endif
+    if (dsm_mode_requested == DSM_MODE_KERNEL) {
+        error_report("Could not start distributed QEMU: DSM not supported.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (dsm_user_start(&err) < 0) {
+        error_reportf_err(err, "Could not start the userspace DSM: ");
+        exit(EXIT_FAILURE);
+    }
+    dsm_mode = DSM_MODE_USER;
+}
+
+void dsm_universal_register(void *ptr, size_t size)
+{
+    if (dsm_mode == DSM_MODE_USER) {
+        dsm_user_register(ptr, size);
+    }
+}
+
+bool dsm_migration_stripe(uint64_t pages, uint64_t *first, uint64_t *end)
+{
+    uint64_t stripe;
+
+    if (dsm_mode != DSM_MODE_KERNEL) {
+        return false;
+    }
+    stripe = DIV_ROUND_UP(pages, router_instances());
+    *first = MIN(stripe * router_local_index(), pages);
+    *end = MIN(*first + stripe, pages);
+    return true;
+}
+
+bool dsm_migration_sends(void *host, uint64_t pages, uint64_t page)
+{
+    uint64_t first, end;
+
+    switch (dsm_mode) {
+    case DSM_MODE_KERNEL:
+        dsm_migration_stripe(pages, &first, &end);
+        return page >= first && page < end;
+    case DSM_MODE_USER:
+        return dsm_user_sends(host, page);
+    default:
+        return true;
+    }
+}
+
+#ifdef CONFIG_LINUX
+/* The faults of each vCPU, which the kernel has by vcpu_id */
+static void dsm_kernel_vcpu_stats(DsmStats *stats)
+{
+    struct kvm_dsm_vcpu_stats ks;
+    uint64_t *by_id, *faults;
+    unsigned long id, n_ids = 0;
+    CPUState *cpu;
+
+    /* vcpu_id is the APIC ID, which the topology may leave sparse */
+    CPU_FOREACH(cpu) {
+        n_ids = MAX(n_ids, kvm_arch_vcpu_id(cpu) + 1);
+    }
+    by_id = g_new0(uint64_t, n_ids);
+    faults = g_new0(uint64_t, max_cpus);
+    memset(&ks, 0, sizeof(ks));
+    ks.nr_vcpus = n_ids;
+    ks.faults = (uintptr_t)by_id;
+    /* an older module: leave the list empty */
+    if (kvm_dsm_get_vcpu_stats(&ks) < 0) {
+        goto out;
+    }
+    CPU_FOREACH(cpu) {
+        id = kvm_arch_vcpu_id(cpu);
+        if (cpu->local && id < ks.nr_vcpus) {
+            faults[cpu->cpu_index] = by_id[id];
+        }
+    }
+    stats->vcpus = dsm_vcpu_stats(faults);
+
+out:
+    g_free(by_id);
+    g_free(faults);
+}
+
+static void dsm_kernel_stats(DsmStats *stats, int top)
+{
+    int nodes = router_instances();
+    struct kvm_dsm_node_stats *counters;
+    struct kvm_dsm_hot_page *hot;
+    struct kvm_dsm_stats ks;
+    DsmNodeStatsList *node;
+    DsmHotPageList *entry;
+    int i;
+
+    QEMU_BUILD_BUG_ON(DSM_LATENCY_BUCKETS != KVM_DSM_LATENCY_BUCKETS);
+
+    counters = g_new0(struct kvm_dsm_node_stats, nodes);
+    hot = g_new0(struct kvm_dsm_hot_page, top);
+    memset(&ks, 0, sizeof(ks));
+    ks.nr_nodes = nodes;
+    ks.nr_hot = top;
+    ks.nodes = (uintptr_t)counters;
+    ks.hot = (uintptr_t)hot;
+    /* an older module: leave the statistics empty */
+    if (kvm_dsm_get_stats(&ks) < 0) {
+        goto out;
+    }
+
+    stats->faults = ks.faults;
+    stats->latency_us = router_latency_list((uint64_t *)ks.latency_us,
+                                            DSM_LATENCY_BUCKETS);
+    stats->bytes_in = ks.bytes_in;
+    stats->bytes_out = ks.bytes_out;
+    for (i = MIN(ks.nr_nodes, nodes) - 1; i >= 0; i--) {
+        node = g_new0(DsmNodeStatsList, 1);
+        node->value = g_new0(DsmNodeStats, 1);
+        node->value->node = i;
+        node->value->read_faults = counters[i].read_faults;
+        node->value->write_faults = counters[i].write_faults;
+        node->value->pages_in = counters[i].pages_in;
+        node->value->pages_out = counters[i].pages_out;
+        node->value->revoked = counters[i].revoked;
+        node->next = stats->nodes;
+        stats->nodes = node;
+    }
+    for (i = MIN(ks.nr_hot, top) - 1; i >= 0; i--) {
+        entry = g_new0(DsmHotPageList, 1);
+        entry->value = g_new0(DsmHotPage, 1);
+        entry->value->has_gpa = true;
+        entry->value->gpa = hot[i].gfn << DSM_PAGE_BITS;
+        entry->value->transfers = hot[i].transfers;
+        entry->next = stats->hot_pages;
+        stats->hot_pages = entry;
+    }
+    dsm_kernel_vcpu_stats(stats);
+
+out:
+    g_free(counters);
+    g_free(hot);
+}
+#endif
+
+DsmStats *qmp_query_dsm_stats(bool has_top, int64_t top, Error **errp)
+{
+    DsmStats *stats;
+
+    if (!has_top) {
+        top = DSM_HOT_PAGES_DEFAULT;
+    }
+    if (top < 0 || top > DSM_HOT_PAGES_MAX) {
+        error_setg(errp, "top must be between 0 and %d", DSM_HOT_PAGES_MAX);
+        return NULL;
+    }
+
+    stats = g_new0(DsmStats, 1);
+    stats->mode = dsm_mode;
+    switch (dsm_mode) {
+    case DSM_MODE_KERNEL:
+#ifdef CONFIG_LINUX
+        dsm_kernel_stats(stats, top);
+#endif
+        break;
+    case DSM_MODE_USER:
+        dsm_user_stats(stats, top);
+        break;
+    default:
+        break;
+    }
+    stats->router = router_query_message_stats();
+    return stats;
+}
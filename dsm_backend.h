@@ -1,7 +1,83 @@
+/*
+ * Distributed shared memory of a distributed VM
+ *
+ * The guest RAM of a VM distributed with -local-cpu is kept coherent
+ * between the QEMU instances by either the DSM of the GiantVM KVM module
+ * or, on a stock kernel, by QEMU itself: see dsm_backend.c.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
 #ifndef DSM_BACKEND_H
 #define DSM_BACKEND_H
-#include <stddef.h>
-#include <stdint.h>
+
+#include "qapi-types.h"
+
+/* the DSM in use, valid after dsm_universal_init() */
+extern DsmMode dsm_mode;
+
+extern uint16_t dsm_port;
+extern uint32_t dsm_prefetch;
+
+#define DSM_PORT_DEFAULT        7100
+#define DSM_PREFETCH_DEFAULT    8
+
+/**
+ * parse_dsm_mode: Parse the dsm option of -local-cpu
+ *
+ * @mode: "kernel", "user", or %NULL to pick one at startup
+ *
+ * Returns: 0 on success, or a negative errno value after reporting the
+ * error.
+ */
+int parse_dsm_mode(const char *mode);
+
+/**
+ * dsm_universal_init: Pick and start the DSM
+ *
+ * Called once the accelerator is configured and before any RAM is
+ * allocated. Exits if the VM is distributed and no DSM can be started.
+ */
 void dsm_universal_init(void);
+
+/**
+ * dsm_universal_register: Keep a RAM block coherent
+ *
+ * Does nothing unless the userspace DSM is in use. Every instance must
+ * register the same blocks in the same order.
+ *
+ * @ptr: host address of the block, page aligned
+ * @size: its maximum size
+ */
 void dsm_universal_register(void *ptr, size_t size);
+
+/**
+ * dsm_migration_sends: Whether this instance migrates a page
+ *
+ * When a distributed VM is migrated, each instance sends part of the guest
+ * RAM: with the userspace DSM the pages it has the only copy of, and the
+ * shared pages it is home of; with the kernel DSM, whose directory QEMU
+ * cannot see, an equal stripe of every RAM block. Either way each page
+ * that was ever touched is sent by exactly one instance.
+ *
+ * @host: host address of the RAM block
+ * @pages: its size in pages
+ * @page: index of the page in the block
+ */
+bool dsm_migration_sends(void *host, uint64_t pages, uint64_t page);
+
+/**
+ * dsm_migration_stripe: The pages of a RAM block this instance migrates,
+ * if they are one contiguous range
+ *
+ * With the kernel DSM the share of an instance is a stripe, which callers
+ * can handle as a whole instead of asking dsm_migration_sends() page by
+ * page. Returns false, leaving @first and @end alone, otherwise.
+ *
+ * @pages: size of the block in pages
+ * @first: set to the index of the first page of the stripe
+ * @end: set to the index of the page after its last one
+ */
+bool dsm_migration_stripe(uint64_t pages, uint64_t *first, uint64_t *end);
+
 #endif
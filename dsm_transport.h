@@ -0,0 +1,91 @@
+/*
+ * Userspace DSM: messages and transports
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#ifndef DSM_TRANSPORT_H
+#define DSM_TRANSPORT_H
+
+#include "qapi/error.h"
+
+/*
+ * Every message is a fixed 24 byte DSMMsg, followed by DSM_PAGE_SIZE bytes
+ * of page contents if it has DSM_MSG_F_PAYLOAD. All multi-byte fields are
+ * little endian. A transport delivers the messages from one node to
+ * another in the order they were sent.
+ */
+
+#define DSM_PAGE_SIZE           4096
+#define DSM_PAGE_BITS           12
+/* at most this many nodes, the sharers of a page are a 64-bit mask */
+#define DSM_MAX_NODES           64
+
+enum DSMMsgType {
+    /* requester -> home: a copy to read, npages - 1 neighbours wanted too */
+    DSM_MSG_GET_S = 1,
+    /* requester -> home: the only copy, to write */
+    DSM_MSG_GET_M,
+    /* home -> requester: access granted, with the page unless it is up to
+     * date at the requester already */
+    DSM_MSG_DATA,
+    /* home -> sharer: drop the copy, reply INV_ACK */
+    DSM_MSG_INV,
+    /* home -> owner: write protect or drop the page, reply RECALL_ACK with
+     * its contents */
+    DSM_MSG_RECALL,
+    DSM_MSG_INV_ACK,
+    DSM_MSG_RECALL_ACK,
+};
+
+#define DSM_MSG_F_PAYLOAD       0x01    /* the page contents follow */
+#define DSM_MSG_F_ZERO          0x02    /* the page is all zeroes */
+#define DSM_MSG_F_EXCLUSIVE     0x04    /* DATA: writable; RECALL: drop */
+#define DSM_MSG_F_PREFETCH      0x08    /* DATA: not asked for */
+
+typedef struct QEMU_PACKED DSMMsg {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t from;
+    uint32_t block;             /* index of the registered RAM block */
+    uint64_t page;              /* page index in the block */
+    uint32_t npages;            /* GET_S: pages wanted, with neighbours */
+    uint32_t pad;
+} DSMMsg;
+
+typedef struct DSMTransport DSMTransport;
+
+typedef struct DSMTransportOps {
+    const char *name;
+    /*
+     * Connect to every other node, waiting for them as long as needed, and
+     * add the connections to @epoll_fd with the connection as data.ptr
+     */
+    int (*start)(DSMTransport *t, int epoll_fd, Error **errp);
+    /* Queue @msg, and @page if it has DSM_MSG_F_PAYLOAD; never blocks */
+    int (*send)(DSMTransport *t, int node, const DSMMsg *msg,
+                const void *page);
+    /*
+     * Handle @events on connection @conn: deliver what arrived, write out
+     * what is queued. Returns a negative errno value if the peer is gone.
+     */
+    int (*event)(DSMTransport *t, void *conn, uint32_t events);
+    void (*stop)(DSMTransport *t);
+} DSMTransportOps;
+
+struct DSMTransport {
+    const DSMTransportOps *ops;
+    int self;
+    int nodes;
+    /* host of each node, NULL for localhost */
+    char **hosts;
+    uint16_t port;              /* node N listens on port + N */
+    /* called for every message received, in order */
+    void (*deliver)(DSMTransport *t, int node, DSMMsg *msg,
+                    const void *page);
+    void *opaque;               /* the transport's own state */
+};
+
+extern const DSMTransportOps dsm_transport_tcp;
+
+#endif
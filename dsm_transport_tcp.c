@@ -0,0 +1,383 @@
+/*
+ * Userspace DSM: TCP transport
+ *
+ * Node N listens on port + N. Every node connects to the nodes with a
+ * lower index and accepts connections from those with a higher index, so
+ * that each pair of nodes shares one connection; a node names itself with
+ * a DSMTcpHello first. Several instances can run on one host, each with
+ * its own port.
+ *
+ * After setup the sockets are non-blocking. Messages that do not fit in
+ * the socket are queued per connection and written out when epoll says
+ * the socket is writable again, so the DSM thread never blocks on a peer
+ * that is itself busy sending.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/bswap.h"
+#include "qemu/sockets.h"
+#include "dsm_transport.h"
+
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+#define DSM_TCP_MAGIC           0x44534d31      /* "DSM1" */
+#define DSM_TCP_RETRY_MS        100
+#define DSM_TCP_RX_SIZE         (256 * 1024)
+
+typedef struct QEMU_PACKED DSMTcpHello {
+    uint32_t magic;
+    uint32_t node;
+} DSMTcpHello;
+
+typedef struct DSMTcpConn {
+    DSMTransport *t;
+    int node;
+    int fd;
+    uint8_t *rx;
+    size_t rx_len;
+    uint8_t *tx;                /* bytes queued, from tx_off to tx_len */
+    size_t tx_off;
+    size_t tx_len;
+    size_t tx_size;
+    bool want_out;
+    int epoll_fd;
+} DSMTcpConn;
+
+typedef struct DSMTcp {
+    int listen_fd;
+    DSMTcpConn *conns;          /* one per node, unused for self */
+} DSMTcp;
+
+static int dsm_tcp_write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -errno;
+        }
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int dsm_tcp_read_full(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n ? -errno : -ECONNRESET;
+        }
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int dsm_tcp_connect(DSMTransport *t, int node, Error **errp)
+{
+    const char *host = t->hosts && t->hosts[node] ? t->hosts[node]
+                                                   : "127.0.0.1";
+    DSMTcpHello hello = {
+        .magic = cpu_to_le32(DSM_TCP_MAGIC),
+        .node = cpu_to_le32(t->self),
+    };
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(t->port + node),
+    };
+    bool waiting = false;
+    int fd, ret;
+
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        error_setg(errp, "dsm: bad address '%s' for node %d", host, node);
+        return -EINVAL;
+    }
+
+    for (;;) {
+        fd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            error_setg_errno(errp, errno, "dsm: socket");
+            return -errno;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        ret = -errno;
+        close(fd);
+        if (ret != -ECONNREFUSED && ret != -ETIMEDOUT &&
+            ret != -EHOSTUNREACH && ret != -ENETUNREACH) {
+            error_setg_errno(errp, -ret, "dsm: cannot connect to node %d "
+                             "at %s:%u", node, host, t->port + node);
+            return ret;
+        }
+        if (!waiting) {
+            error_report("dsm: waiting for node %d at %s:%u", node, host,
+                         t->port + node);
+            waiting = true;
+        }
+        g_usleep(DSM_TCP_RETRY_MS * 1000);
+    }
+
+    ret = dsm_tcp_write_full(fd, &hello, sizeof(hello));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "dsm: cannot greet node %d", node);
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+/* Accept one connection from a node with a higher index */
+static int dsm_tcp_accept(DSMTransport *t, DSMTcp *s, Error **errp)
+{
+    DSMTcpHello hello;
+    uint32_t node;
+    int fd, ret;
+
+    do {
+        fd = qemu_accept(s->listen_fd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "dsm: accept");
+        return -errno;
+    }
+
+    ret = dsm_tcp_read_full(fd, &hello, sizeof(hello));
+    node = le32_to_cpu(hello.node);
+    if (ret < 0 || le32_to_cpu(hello.magic) != DSM_TCP_MAGIC ||
+        node <= t->self || node >= t->nodes || s->conns[node].fd >= 0) {
+        /* not one of ours; keep waiting for the real ones */
+        error_report("dsm: dropping unexpected connection");
+        close(fd);
+        return 0;
+    }
+    s->conns[node].fd = fd;
+    return 1;
+}
+
+static int dsm_tcp_start(DSMTransport *t, int epoll_fd, Error **errp)
+{
+    DSMTcp *s = g_new0(DSMTcp, 1);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(t->port + t->self),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    struct epoll_event ev;
+    int i, fd, accepted, ret, one = 1;
+
+    t->opaque = s;
+    s->conns = g_new0(DSMTcpConn, t->nodes);
+    for (i = 0; i < t->nodes; i++) {
+        s->conns[i].t = t;
+        s->conns[i].node = i;
+        s->conns[i].fd = -1;
+        s->conns[i].epoll_fd = epoll_fd;
+    }
+
+    s->listen_fd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+    if (s->listen_fd < 0) {
+        error_setg_errno(errp, errno, "dsm: socket");
+        return -errno;
+    }
+    setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s->listen_fd, t->nodes) < 0) {
+        error_setg_errno(errp, errno, "dsm: cannot listen on port %u",
+                         t->port + t->self);
+        return -errno;
+    }
+
+    for (i = 0; i < t->self; i++) {
+        fd = dsm_tcp_connect(t, i, errp);
+        if (fd < 0) {
+            return fd;
+        }
+        s->conns[i].fd = fd;
+    }
+    for (accepted = 0; accepted < t->nodes - 1 - t->self; accepted += ret) {
+        ret = dsm_tcp_accept(t, s, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    close(s->listen_fd);
+    s->listen_fd = -1;
+
+    for (i = 0; i < t->nodes; i++) {
+        DSMTcpConn *c = &s->conns[i];
+
+        if (i == t->self) {
+            continue;
+        }
+        qemu_set_nonblock(c->fd);
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->rx = g_malloc(DSM_TCP_RX_SIZE);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+            error_setg_errno(errp, errno, "dsm: epoll_ctl");
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static void dsm_tcp_want_out(DSMTcpConn *c, bool want)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | (want ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+
+    if (c->want_out != want) {
+        epoll_ctl(c->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = want;
+    }
+}
+
+/* Write out as much of the queue as the socket takes */
+static int dsm_tcp_flush(DSMTcpConn *c)
+{
+    ssize_t n;
+
+    while (c->tx_off < c->tx_len) {
+        n = send(c->fd, c->tx + c->tx_off, c->tx_len - c->tx_off,
+                 MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (n <= 0) {
+            return -errno;
+        }
+        c->tx_off += n;
+    }
+    if (c->tx_off == c->tx_len) {
+        c->tx_off = c->tx_len = 0;
+    }
+    dsm_tcp_want_out(c, c->tx_len != 0);
+    return 0;
+}
+
+static void dsm_tcp_queue(DSMTcpConn *c, const void *buf, size_t len)
+{
+    if (c->tx_len + len > c->tx_size) {
+        if (c->tx_off) {
+            memmove(c->tx, c->tx + c->tx_off, c->tx_len - c->tx_off);
+            c->tx_len -= c->tx_off;
+            c->tx_off = 0;
+        }
+        if (c->tx_len + len > c->tx_size) {
+            c->tx_size = MAX(c->tx_size * 2, c->tx_len + len);
+            c->tx = g_realloc(c->tx, c->tx_size);
+        }
+    }
+    memcpy(c->tx + c->tx_len, buf, len);
+    c->tx_len += len;
+}
+
+static int dsm_tcp_send(DSMTransport *t, int node, const DSMMsg *msg,
+                        const void *page)
+{
+    DSMTcp *s = t->opaque;
+    DSMTcpConn *c = &s->conns[node];
+    bool idle = c->tx_len == 0;
+
+    dsm_tcp_queue(c, msg, sizeof(*msg));
+    if (msg->flags & DSM_MSG_F_PAYLOAD) {
+        dsm_tcp_queue(c, page, DSM_PAGE_SIZE);
+    }
+    /* if the socket was full already, wait for epoll to say otherwise */
+    return idle ? dsm_tcp_flush(c) : 0;
+}
+
+static int dsm_tcp_event(DSMTransport *t, void *opaque, uint32_t events)
+{
+    DSMTcpConn *c = opaque;
+    size_t off, need;
+    DSMMsg *msg;
+    ssize_t n;
+    int ret;
+
+    if (events & EPOLLOUT) {
+        ret = dsm_tcp_flush(c);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return 0;
+    }
+
+    n = read(c->fd, c->rx + c->rx_len, DSM_TCP_RX_SIZE - c->rx_len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return n ? -errno : -ECONNRESET;
+    }
+    c->rx_len += n;
+
+    for (off = 0; c->rx_len - off >= sizeof(DSMMsg); off += need) {
+        msg = (DSMMsg *)(c->rx + off);
+        need = sizeof(DSMMsg) +
+               (msg->flags & DSM_MSG_F_PAYLOAD ? DSM_PAGE_SIZE : 0);
+        if (c->rx_len - off < need) {
+            break;
+        }
+        t->deliver(t, c->node, msg, msg + 1);
+    }
+    memmove(c->rx, c->rx + off, c->rx_len - off);
+    c->rx_len -= off;
+    return 0;
+}
+
+static void dsm_tcp_stop(DSMTransport *t)
+{
+    DSMTcp *s = t->opaque;
+    int i;
+
+    if (!s) {
+        return;
+    }
+    for (i = 0; i < t->nodes; i++) {
+        if (s->conns[i].fd >= 0) {
+            close(s->conns[i].fd);
+        }
+        g_free(s->conns[i].rx);
+        g_free(s->conns[i].tx);
+    }
+    if (s->listen_fd >= 0) {
+        close(s->listen_fd);
+    }
+    g_free(s->conns);
+    g_free(s);
+    t->opaque = NULL;
+}
+
+const DSMTransportOps dsm_transport_tcp = {
+    .name = "tcp",
+    .start = dsm_tcp_start,
+    .send = dsm_tcp_send,
+    .event = dsm_tcp_event,
+    .stop = dsm_tcp_stop,
+};
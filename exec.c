@@ -21,9 +21,9 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
-#include "dsm_backend.h"
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qmp-commands.h"
 #ifndef _WIN32
 #endif
 
@@ -68,6 +68,7 @@
 #ifndef _WIN32
 #include "qemu/mmap-alloc.h"
 #endif
+#include "dsm_backend.h"
 
 //#define DEBUG_SUBPAGE
 
@@ -1784,6 +1785,7 @@ static void reclaim_ramblock(RAMBlock *block)
     } else {
         qemu_anon_ram_free(block->host, block->max_length);
     }
+    g_free(block->clear_bmap);
     g_free(block);
 }
 
@@ -2574,6 +2576,65 @@ static bool prepare_mmio_access(MemoryRegion *mr)
     return release_lock;
 }
 
+static inline bool dsm_active(void)
+{
+    return dsm_mode == DSM_MODE_KERNEL;
+}
+
+/*
+ * The RAM chunks of one access, copied with a single KVM_DSM_MEMCPY_VEC.
+ * Pending copies are flushed before any MMIO access, so that devices see
+ * RAM and MMIO in program order.
+ */
+#define DSM_COPY_MAX 16
+
+typedef struct DSMCopyList {
+    int n;
+    struct kvm_dsm_memcpy cpys[DSM_COPY_MAX];
+    /* for writes, what to mark dirty once the data is in */
+    MemoryRegion *mr[DSM_COPY_MAX];
+    hwaddr addr[DSM_COPY_MAX];
+} DSMCopyList;
+
+static void dsm_copy_flush(DSMCopyList *list)
+{
+    int i, ret;
+
+    if (!list->n) {
+        return;
+    }
+    ret = kvm_dsm_memcpy_vec(list->cpys, list->n);
+    if (ret < 0) {
+        fprintf(stderr, "KVM_DSM_MEMCPY failed %d\n", ret);
+    }
+    for (i = 0; i < list->n; i++) {
+        if (list->cpys[i].write) {
+            invalidate_and_set_dirty(list->mr[i], list->addr[i],
+                                     list->cpys[i].length);
+        }
+    }
+    list->n = 0;
+}
+
+static void dsm_copy_add(DSMCopyList *list, bool write, void *ptr,
+                         const uint8_t *buf, hwaddr l, MemoryRegion *mr,
+                         hwaddr addr1)
+{
+    struct kvm_dsm_memcpy *cpy;
+
+    if (list->n == DSM_COPY_MAX) {
+        dsm_copy_flush(list);
+    }
+    cpy = &list->cpys[list->n];
+    cpy->write = write;
+    cpy->host_virt_addr = (__u64)ptr;
+    cpy->userspace_addr = (__u64)buf;
+    cpy->length = l;
+    list->mr[list->n] = mr;
+    list->addr[list->n] = addr1;
+    list->n++;
+}
+
 /* Called within RCU critical section.  */
 static MemTxResult address_space_write_continue(AddressSpace *as, hwaddr addr,
                                                 MemTxAttrs attrs,
@@ -2583,12 +2644,13 @@ static MemTxResult address_space_write_continue(AddressSpace *as, hwaddr addr,
 {
     uint8_t *ptr;
     uint64_t val;
-    int ret;
     MemTxResult result = MEMTX_OK;
     bool release_lock = false;
+    DSMCopyList copies = { .n = 0 };
 
     for (;;) {
         if (!memory_access_is_direct(mr, true)) {
+            dsm_copy_flush(&copies);
             release_lock |= prepare_mmio_access(mr);
             l = memory_access_size(mr, l, addr1);
             /* XXX: could force current_cpu to NULL to avoid
@@ -2624,22 +2686,12 @@ static MemTxResult address_space_write_continue(AddressSpace *as, hwaddr addr,
         } else {
             /* RAM case */
             ptr = qemu_map_ram_ptr(mr->ram_block, addr1);
-            if (kvm_enabled() && local_cpus != smp_cpus && !shm_path) {
-                struct kvm_dsm_memcpy cpy = {
-                    .write = true,
-                    .host_virt_addr = (__u64)ptr,
-                    .userspace_addr = (__u64)buf,
-                    .length = l,
-                };
-                ret = kvm_vm_ioctl(kvm_state, KVM_DSM_MEMCPY, &cpy);
-                if (ret < 0) {
-                    fprintf(stderr, "KVM_DSM_MEMCPY failed %d\n", ret);
-                }
-            }
-            else {
+            if (dsm_active()) {
+                dsm_copy_add(&copies, true, ptr, buf, l, mr, addr1);
+            } else {
                 memcpy(ptr, buf, l);
+                invalidate_and_set_dirty(mr, addr1, l);
             }
-            invalidate_and_set_dirty(mr, addr1, l);
         }
 
         if (release_lock) {
@@ -2659,6 +2711,7 @@ static MemTxResult address_space_write_continue(AddressSpace *as, hwaddr addr,
         mr = address_space_translate(as, addr, &addr1, &l, true);
     }
 
+    dsm_copy_flush(&copies);
     return result;
 }
 
@@ -2691,12 +2744,13 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
     uint8_t *ptr;
     uint64_t val;
     MemTxResult result = MEMTX_OK;
-    int ret;
     bool release_lock = false;
+    DSMCopyList copies = { .n = 0 };
 
     for (;;) {
         if (!memory_access_is_direct(mr, false)) {
             /* I/O case */
+            dsm_copy_flush(&copies);
             release_lock |= prepare_mmio_access(mr);
             l = memory_access_size(mr, l, addr1);
             switch (l) {
@@ -2730,19 +2784,9 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
         } else {
             /* RAM case */
             ptr = qemu_map_ram_ptr(mr->ram_block, addr1);
-            if (kvm_enabled() && local_cpus != smp_cpus && !shm_path) {
-                struct kvm_dsm_memcpy cpy = {
-                    .write = false,
-                    .host_virt_addr = (__u64)ptr,
-                    .userspace_addr = (__u64)buf,
-                    .length = l,
-                };
-                ret = kvm_vm_ioctl(kvm_state, KVM_DSM_MEMCPY, &cpy);
-                if (ret < 0) {
-                    fprintf(stderr, "KVM_DSM_MEMCPY failed %d\n", ret);
-                }
-            }
-            else {
+            if (dsm_active()) {
+                dsm_copy_add(&copies, false, ptr, buf, l, mr, addr1);
+            } else {
                 memcpy(buf, ptr, l);
             }
         }
@@ -2764,6 +2808,7 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
         mr = address_space_translate(as, addr, &addr1, &l, false);
     }
 
+    dsm_copy_flush(&copies);
     return result;
 }
 
@@ -3052,20 +3097,15 @@ void *address_space_map(AddressSpace *as,
     *plen = done;
     ptr = qemu_ram_ptr_length(mr->ram_block, base, plen);
 
-    if (is_dsm && kvm_enabled() && local_cpus != smp_cpus && !shm_path)
+    if (is_dsm && dsm_active()) {
         *is_dsm = true;
-    if (kvm_enabled() && dsm_pin && local_cpus != smp_cpus && !shm_path) {
-        int ret;
-        struct kvm_dsm_mempin pin = {
-            .write = is_write,
-            .unpin = false,
-            .host_virt_addr = (__u64)ptr,
-            .length = *plen,
-        };
-        ret = kvm_vm_ioctl(kvm_state, KVM_DSM_MEMPIN, &pin);
-        if (ret < 0) {
-            fprintf(stderr, "KVM_DSM_MEMPIN failed %d\n", ret);
-        }
+    }
+    if (dsm_pin && dsm_active()) {
+        DSMPinList pins;
+
+        dsm_pin_list_init(&pins, as, false, &as->dsm_pin);
+        dsm_pin_list_add(&pins, addr - done, ptr, *plen, is_write);
+        dsm_pin_list_flush(&pins);
     }
     rcu_read_unlock();
 
@@ -3091,18 +3131,12 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         if (xen_enabled()) {
             xen_invalidate_map_cache_entry(buffer);
         }
-        if (kvm_enabled() && dsm_unpin && local_cpus != smp_cpus && !shm_path) {
-            int ret;
-            struct kvm_dsm_mempin pin = {
-                .write = is_write,
-                .unpin = true,
-                .host_virt_addr = (__u64)buffer,
-                .length = len,
-            };
-            ret = kvm_vm_ioctl(kvm_state, KVM_DSM_MEMPIN, &pin);
-            if (ret < 0) {
-                fprintf(stderr, "KVM_DSM_MEMPIN failed %d\n", ret);
-            }
+        if (dsm_unpin && dsm_active()) {
+            DSMPinList pins;
+
+            dsm_pin_list_init(&pins, as, true, &as->dsm_pin);
+            dsm_pin_list_add(&pins, 0, buffer, len, is_write);
+            dsm_pin_list_flush(&pins);
         }
         memory_region_unref(mr);
         return;
@@ -3118,6 +3152,531 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
     cpu_notify_map_clients();
 }
 
+static QemuMutex dsm_pin_lock;
+static QTAILQ_HEAD(, DSMPinCounters) dsm_pin_counters =
+    QTAILQ_HEAD_INITIALIZER(dsm_pin_counters);
+
+static void __attribute__((__constructor__)) dsm_pin_init(void)
+{
+    qemu_mutex_init(&dsm_pin_lock);
+}
+
+void dsm_pin_counters_register(DSMPinCounters *counters, const char *name)
+{
+    counters->name = name;
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_INSERT_TAIL(&dsm_pin_counters, counters, next);
+    qemu_mutex_unlock(&dsm_pin_lock);
+}
+
+void dsm_pin_counters_unregister(DSMPinCounters *counters)
+{
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_REMOVE(&dsm_pin_counters, counters, next);
+    qemu_mutex_unlock(&dsm_pin_lock);
+}
+
+DsmPinStatsList *qmp_query_dsm_pin_stats(Error **errp)
+{
+    DsmPinStatsList *head = NULL, **tail = &head, *elem;
+    DSMPinCounters *c;
+    DsmPinStats *info;
+
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_FOREACH(c, &dsm_pin_counters, next) {
+        if (!atomic_read(&c->calls)) {
+            continue;
+        }
+        info = g_new0(DsmPinStats, 1);
+        info->device = g_strdup(c->name);
+        info->calls = atomic_read(&c->calls);
+        info->ranges = atomic_read(&c->ranges);
+        info->bytes = atomic_read(&c->bytes);
+
+        elem = g_new0(DsmPinStatsList, 1);
+        elem->value = info;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    qemu_mutex_unlock(&dsm_pin_lock);
+    return head;
+}
+
+/*
+ * Pages an address space keeps pinned in the DSM, keyed by guest-physical
+ * page.  A page stays pinned while a mapping uses it and, up to
+ * dsm_pin_cache_pages pages per address space, after the last mapping is
+ * gone: rings and command lists that are mapped and unmapped for every
+ * request are then only pinned once.
+ *
+ * An idle page is unpinned when the cache is over budget, when the kernel
+ * reports that another node is waiting for a page this process holds
+ * (KVM_CAP_X86_DSM_REVOKE) or, if the kernel cannot report that, once it
+ * has been idle for DSM_PIN_CACHE_IDLE_MS.
+ */
+#define DSM_PIN_CACHE_IDLE_MS   10
+
+uint64_t dsm_pin_cache_pages = DSM_PIN_CACHE_PAGES_DEFAULT;
+
+typedef struct DSMPinCacheEntry {
+    hwaddr addr;                /* guest-physical, page aligned */
+    void *host;                 /* page aligned */
+    bool write;                 /* pinned for writing */
+    unsigned refs;              /* mappings using the page */
+    int64_t idle_since;         /* ns, when refs dropped to 0 */
+    QTAILQ_ENTRY(DSMPinCacheEntry) idle;
+} DSMPinCacheEntry;
+
+struct DSMPinCache {
+    AddressSpace *as;
+    QemuMutex lock;
+    GHashTable *pages;          /* guest-physical page -> entry */
+    GHashTable *host_pages;     /* host page -> entry, the pinned pages */
+    QTAILQ_HEAD(, DSMPinCacheEntry) idle;  /* refs == 0, oldest first */
+    uint64_t n_idle;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t revocations;
+    QTAILQ_ENTRY(DSMPinCache) next;
+};
+
+/* all caches, protected by dsm_pin_lock */
+static QTAILQ_HEAD(, DSMPinCache) dsm_pin_caches =
+    QTAILQ_HEAD_INITIALIZER(dsm_pin_caches);
+static bool dsm_pin_revoke_init_done;
+static bool dsm_pin_revoke;
+static bool dsm_pin_cache_suspended;
+static EventNotifier dsm_pin_revoke_notifier;
+static QEMUTimer *dsm_pin_idle_timer;
+
+/* Unpin an idle page and forget it */
+static void dsm_pin_cache_drop(DSMPinCache *cache, DSMPinCacheEntry *e,
+                               DSMPinList *unpins)
+{
+    if (g_hash_table_lookup(cache->pages, &e->addr) == e) {
+        g_hash_table_remove(cache->pages, &e->addr);
+    }
+    g_hash_table_remove(cache->host_pages, e->host);
+    QTAILQ_REMOVE(&cache->idle, e, idle);
+    cache->n_idle--;
+    dsm_pin_list_add(unpins, e->addr, e->host, TARGET_PAGE_SIZE, e->write);
+    g_free(e);
+}
+
+/*
+ * Unpin the pages that went idle before @before, or all idle pages if
+ * @before is 0, and then the oldest ones until the cache is within budget
+ */
+static void dsm_pin_cache_evict(DSMPinCache *cache, int64_t before,
+                                uint64_t *counter)
+{
+    DSMPinCacheEntry *e;
+    DSMPinList unpins;
+
+    dsm_pin_list_init(&unpins, NULL, true, &cache->as->dsm_pin);
+    while ((e = QTAILQ_FIRST(&cache->idle)) != NULL) {
+        if (cache->n_idle <= dsm_pin_cache_pages &&
+            before && e->idle_since >= before) {
+            break;
+        }
+        dsm_pin_cache_drop(cache, e, &unpins);
+        (*counter)++;
+    }
+    dsm_pin_list_flush(&unpins);
+}
+
+static void dsm_pin_revoke_cb(EventNotifier *n)
+{
+    DSMPinCache *cache;
+
+    if (!event_notifier_test_and_clear(n)) {
+        return;
+    }
+    /* the kernel does not say which page is wanted; let go of all of them */
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_FOREACH(cache, &dsm_pin_caches, next) {
+        qemu_mutex_lock(&cache->lock);
+        dsm_pin_cache_evict(cache, 0, &cache->revocations);
+        qemu_mutex_unlock(&cache->lock);
+    }
+    qemu_mutex_unlock(&dsm_pin_lock);
+}
+
+static void dsm_pin_idle_cb(void *opaque)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    DSMPinCache *cache;
+    bool idle = false;
+
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_FOREACH(cache, &dsm_pin_caches, next) {
+        qemu_mutex_lock(&cache->lock);
+        dsm_pin_cache_evict(cache, now - DSM_PIN_CACHE_IDLE_MS * SCALE_MS,
+                            &cache->evictions);
+        idle |= cache->n_idle != 0;
+        qemu_mutex_unlock(&cache->lock);
+    }
+    qemu_mutex_unlock(&dsm_pin_lock);
+
+    if (idle) {
+        timer_mod(dsm_pin_idle_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                      DSM_PIN_CACHE_IDLE_MS);
+    }
+}
+
+/* Called with dsm_pin_lock held */
+static void dsm_pin_revoke_init(void)
+{
+    int ret;
+
+    dsm_pin_revoke_init_done = true;
+    if (event_notifier_init(&dsm_pin_revoke_notifier, false) < 0) {
+        return;
+    }
+    ret = kvm_dsm_revoke_notify(
+                event_notifier_get_fd(&dsm_pin_revoke_notifier));
+    if (ret < 0) {
+        event_notifier_cleanup(&dsm_pin_revoke_notifier);
+        dsm_pin_idle_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                          dsm_pin_idle_cb, NULL);
+        return;
+    }
+    event_notifier_set_handler(&dsm_pin_revoke_notifier, false,
+                               dsm_pin_revoke_cb);
+    dsm_pin_revoke = true;
+}
+
+static DSMPinCache *dsm_pin_cache_get(AddressSpace *as)
+{
+    DSMPinCache *cache = atomic_rcu_read(&as->dsm_pin_cache);
+
+    if (cache || !dsm_pin_cache_pages) {
+        return cache;
+    }
+
+    qemu_mutex_lock(&dsm_pin_lock);
+    cache = as->dsm_pin_cache;
+    if (!cache) {
+        if (!dsm_pin_revoke_init_done) {
+            dsm_pin_revoke_init();
+        }
+        cache = g_new0(DSMPinCache, 1);
+        cache->as = as;
+        qemu_mutex_init(&cache->lock);
+        cache->pages = g_hash_table_new(g_int64_hash, g_int64_equal);
+        cache->host_pages = g_hash_table_new(NULL, NULL);
+        QTAILQ_INIT(&cache->idle);
+        QTAILQ_INSERT_TAIL(&dsm_pin_caches, cache, next);
+        atomic_rcu_set(&as->dsm_pin_cache, cache);
+    }
+    qemu_mutex_unlock(&dsm_pin_lock);
+    return cache;
+}
+
+void dsm_pin_cache_destroy(AddressSpace *as)
+{
+    DSMPinCache *cache = as->dsm_pin_cache;
+    DSMPinCacheEntry *e;
+    GHashTableIter iter;
+    DSMPinList unpins;
+
+    if (!cache) {
+        return;
+    }
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_REMOVE(&dsm_pin_caches, cache, next);
+    qemu_mutex_unlock(&dsm_pin_lock);
+
+    dsm_pin_list_init(&unpins, NULL, true, NULL);
+    g_hash_table_iter_init(&iter, cache->host_pages);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+        dsm_pin_list_add(&unpins, e->addr, e->host, TARGET_PAGE_SIZE,
+                         e->write);
+        g_free(e);
+    }
+    dsm_pin_list_flush(&unpins);
+
+    g_hash_table_destroy(cache->pages);
+    g_hash_table_destroy(cache->host_pages);
+    qemu_mutex_destroy(&cache->lock);
+    g_free(cache);
+    as->dsm_pin_cache = NULL;
+}
+
+void dsm_pin_cache_suspend(void)
+{
+    DSMPinCache *cache;
+
+    qemu_mutex_lock(&dsm_pin_lock);
+    atomic_set(&dsm_pin_cache_suspended, true);
+    QTAILQ_FOREACH(cache, &dsm_pin_caches, next) {
+        qemu_mutex_lock(&cache->lock);
+        dsm_pin_cache_evict(cache, 0, &cache->evictions);
+        qemu_mutex_unlock(&cache->lock);
+    }
+    qemu_mutex_unlock(&dsm_pin_lock);
+}
+
+void dsm_pin_cache_resume(void)
+{
+    DSMPinCacheEntry *e;
+    DSMPinCache *cache;
+    GHashTableIter iter;
+    DSMPinList pins;
+
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_FOREACH(cache, &dsm_pin_caches, next) {
+        /* all in use, since idle pages went at once */
+        dsm_pin_list_init(&pins, NULL, false, NULL);
+        qemu_mutex_lock(&cache->lock);
+        g_hash_table_iter_init(&iter, cache->host_pages);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+            dsm_pin_list_add(&pins, e->addr, e->host, TARGET_PAGE_SIZE,
+                             e->write);
+        }
+        dsm_pin_list_flush(&pins);
+        qemu_mutex_unlock(&cache->lock);
+    }
+    atomic_set(&dsm_pin_cache_suspended, false);
+    qemu_mutex_unlock(&dsm_pin_lock);
+}
+
+/*
+ * The entry for @addr, which is mapped at @host.  The guest may have moved
+ * RAM around since the page was pinned, or @addr may alias a page pinned
+ * under another address: the host page is what is pinned, so trust that.
+ */
+static DSMPinCacheEntry *dsm_pin_cache_lookup(DSMPinCache *cache,
+                                              hwaddr addr, void *host)
+{
+    DSMPinCacheEntry *e = g_hash_table_lookup(cache->pages, &addr);
+
+    if (e && e->host == host) {
+        return e;
+    }
+    e = g_hash_table_lookup(cache->host_pages, host);
+    if (e) {
+        if (g_hash_table_lookup(cache->pages, &e->addr) == e) {
+            g_hash_table_remove(cache->pages, &e->addr);
+        }
+        e->addr = addr;
+        g_hash_table_replace(cache->pages, &e->addr, e);
+    }
+    return e;
+}
+
+/* Take a reference to every page of @list, pin those that are not yet */
+static void dsm_pin_cache_pin(DSMPinCache *cache, DSMPinList *list)
+{
+    DSMPinCacheEntry *e;
+    DSMPinList pins;
+    hwaddr addr, end, offset;
+    bool is_write, hit;
+    uint8_t *host;
+    int i;
+
+    dsm_pin_list_init(&pins, NULL, false, list->counters);
+    qemu_mutex_lock(&cache->lock);
+    for (i = 0; i < list->n; i++) {
+        offset = list->ranges[i].addr & ~TARGET_PAGE_MASK;
+        addr = list->ranges[i].addr - offset;
+        end = list->ranges[i].addr + list->ranges[i].len;
+        host = (uint8_t *)list->ranges[i].host - offset;
+
+        for (; addr < end; addr += TARGET_PAGE_SIZE, host += TARGET_PAGE_SIZE) {
+            is_write = list->ranges[i].is_write;
+            e = dsm_pin_cache_lookup(cache, addr, host);
+            hit = e && (e->write || !is_write);
+            if (!e && atomic_read(&dsm_pin_cache_suspended)) {
+                /* unpinned directly too, see dsm_pin_cache_unpin() */
+                cache->misses++;
+                dsm_pin_list_add(&pins, addr, host, TARGET_PAGE_SIZE,
+                                 is_write);
+                continue;
+            }
+            if (!e) {
+                e = g_new0(DSMPinCacheEntry, 1);
+                e->addr = addr;
+                e->host = host;
+                g_hash_table_replace(cache->pages, &e->addr, e);
+                g_hash_table_insert(cache->host_pages, host, e);
+            } else if (!e->refs) {
+                QTAILQ_REMOVE(&cache->idle, e, idle);
+                cache->n_idle--;
+            }
+            e->refs++;
+
+            if (hit) {
+                cache->hits++;
+                continue;
+            }
+            /* a page pinned for reading is pinned again for writing */
+            cache->misses++;
+            e->write |= is_write;
+            dsm_pin_list_add(&pins, addr, host, TARGET_PAGE_SIZE, is_write);
+        }
+    }
+    dsm_pin_list_flush(&pins);
+    qemu_mutex_unlock(&cache->lock);
+}
+
+/* Drop a reference to every page of @list, and trim the cache */
+static void dsm_pin_cache_unpin(DSMPinCache *cache, DSMPinList *list)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    DSMPinCacheEntry *e;
+    DSMPinList unpins;
+    uint8_t *host, *end;
+    bool idle;
+    int i;
+
+    dsm_pin_list_init(&unpins, NULL, true, list->counters);
+    qemu_mutex_lock(&cache->lock);
+    for (i = 0; i < list->n; i++) {
+        host = (uint8_t *)((uintptr_t)list->ranges[i].host & TARGET_PAGE_MASK);
+        end = (uint8_t *)list->ranges[i].host + list->ranges[i].len;
+
+        for (; host < end; host += TARGET_PAGE_SIZE) {
+            e = g_hash_table_lookup(cache->host_pages, host);
+            if (!e) {
+                /* not pinned through the cache */
+                dsm_pin_list_add(&unpins, 0, host, TARGET_PAGE_SIZE,
+                                 list->ranges[i].is_write);
+                continue;
+            }
+            assert(e->refs);
+            if (!--e->refs) {
+                e->idle_since = now;
+                QTAILQ_INSERT_TAIL(&cache->idle, e, idle);
+                cache->n_idle++;
+            }
+        }
+    }
+    dsm_pin_list_flush(&unpins);
+    if (atomic_read(&dsm_pin_cache_suspended)) {
+        dsm_pin_cache_evict(cache, 0, &cache->evictions);
+    } else if (cache->n_idle > dsm_pin_cache_pages) {
+        dsm_pin_cache_evict(cache, INT64_MIN, &cache->evictions);
+    }
+    idle = cache->n_idle != 0;
+    qemu_mutex_unlock(&cache->lock);
+
+    if (idle && dsm_pin_idle_timer && !timer_pending(dsm_pin_idle_timer)) {
+        timer_mod(dsm_pin_idle_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                      DSM_PIN_CACHE_IDLE_MS);
+    }
+}
+
+DsmPinCacheInfoList *qmp_query_dsm_pin_cache(Error **errp)
+{
+    DsmPinCacheInfoList *head = NULL, **tail = &head, *elem;
+    DsmPinCacheInfo *info;
+    DSMPinCache *cache;
+
+    qemu_mutex_lock(&dsm_pin_lock);
+    QTAILQ_FOREACH(cache, &dsm_pin_caches, next) {
+        qemu_mutex_lock(&cache->lock);
+        info = g_new0(DsmPinCacheInfo, 1);
+        info->address_space = g_strdup(cache->as->name);
+        info->pinned = g_hash_table_size(cache->host_pages);
+        info->idle = cache->n_idle;
+        info->hits = cache->hits;
+        info->misses = cache->misses;
+        info->evictions = cache->evictions;
+        info->revocations = cache->revocations;
+        qemu_mutex_unlock(&cache->lock);
+
+        elem = g_new0(DsmPinCacheInfoList, 1);
+        elem->value = info;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    qemu_mutex_unlock(&dsm_pin_lock);
+    return head;
+}
+
+void dsm_pin_list_init(DSMPinList *list, AddressSpace *as, bool unpin,
+                       DSMPinCounters *counters)
+{
+    list->as = as;
+    list->counters = counters;
+    list->unpin = unpin;
+    list->n = 0;
+}
+
+void dsm_pin_list_add(DSMPinList *list, hwaddr addr, void *host, hwaddr len,
+                      bool is_write)
+{
+    int last = list->n - 1;
+
+    if (!dsm_active() || host == bounce.buffer || !len) {
+        return;
+    }
+    /* merge with the previous range if it is contiguous */
+    if (last >= 0 &&
+        (uint8_t *)list->ranges[last].host + list->ranges[last].len == host &&
+        (list->unpin || list->ranges[last].addr + list->ranges[last].len ==
+                        addr) &&
+        list->ranges[last].is_write == is_write) {
+        list->ranges[last].len += len;
+        return;
+    }
+    if (list->n == DSM_PIN_LIST_MAX) {
+        dsm_pin_list_flush(list);
+    }
+    list->ranges[list->n].addr = addr;
+    list->ranges[list->n].host = host;
+    list->ranges[list->n].len = len;
+    list->ranges[list->n].is_write = is_write;
+    list->n++;
+}
+
+/* Pin or unpin the ranges of @list without going through a cache */
+static void dsm_pin_list_issue(DSMPinList *list)
+{
+    struct kvm_dsm_mempin pins[DSM_PIN_LIST_MAX];
+    uint64_t bytes = 0;
+    int i, ret;
+
+    for (i = 0; i < list->n; i++) {
+        pins[i].write = list->ranges[i].is_write;
+        pins[i].unpin = list->unpin;
+        pins[i].host_virt_addr = (__u64)list->ranges[i].host;
+        pins[i].length = list->ranges[i].len;
+        bytes += list->ranges[i].len;
+    }
+
+    ret = kvm_dsm_mempin_vec(pins, list->n);
+    if (ret < 0) {
+        fprintf(stderr, "KVM_DSM_MEMPIN failed %d\n", ret);
+    } else if (list->counters) {
+        atomic_add(&list->counters->calls, ret);
+        if (!list->unpin) {
+            atomic_add(&list->counters->ranges, list->n);
+            atomic_add(&list->counters->bytes, bytes);
+        }
+    }
+}
+
+void dsm_pin_list_flush(DSMPinList *list)
+{
+    DSMPinCache *cache;
+
+    if (!list->n) {
+        return;
+    }
+    cache = list->as ? dsm_pin_cache_get(list->as) : NULL;
+    if (!cache) {
+        dsm_pin_list_issue(list);
+    } else if (list->unpin) {
+        dsm_pin_cache_unpin(cache, list);
+    } else {
+        dsm_pin_cache_pin(cache, list);
+    }
+    list->n = 0;
+}
+
 void *cpu_physical_memory_map(hwaddr addr,
                               hwaddr *plen,
                               int is_write)
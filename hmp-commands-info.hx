@@ -799,6 +799,24 @@ STEXI
 @item info hotpluggable-cpus
 @findex hotpluggable-cpus
 Show information about hotpluggable CPUs
+ETEXI
+
+    {
+        .name       = "dsm",
+        .args_type  = "top:i?",
+        .params     = "[top]",
+        .help       = "show the coherence traffic of the distributed shared "
+                      "memory, with the top hottest pages",
+        .cmd        = hmp_info_dsm,
+    },
+
+STEXI
+@item info dsm [@var{top}]
+@findex dsm
+Show the faults, fault latencies and page traffic of the distributed shared
+memory of this instance, the @var{top} pages homed here that moved most
+(10 by default), the faults of each vCPU here and their rate since the last
+query, and the messages of the router by type.
 ETEXI
 
 STEXI
@@ -154,6 +154,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
 {
     MigrationInfo *info;
     MigrationCapabilityStatusList *caps, *cap;
+    XBZRLEBlockStatsList *block;
+    VcpuDirtyRateList *rate;
 
     info = qmp_query_migrate(NULL);
     caps = qmp_query_migrate_capabilities(NULL);
@@ -246,6 +248,24 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        for (block = info->xbzrle_cache->blocks; block; block = block->next) {
+            monitor_printf(mon, "xbzrle cache %s: %" PRIu64 " hits %" PRIu64
+                           " misses\n", block->value->block,
+                           block->value->cache_hit, block->value->cache_miss);
+        }
+    }
+
+    if (info->has_compression) {
+        monitor_printf(mon, "compression codec: %s\n",
+                       MigrationCompressCodec_lookup[info->compression->codec]);
+        monitor_printf(mon, "compressed pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+        monitor_printf(mon, "compress time: %" PRIu64 " milliseconds\n",
+                       info->compression->compress_time);
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -253,6 +273,13 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    for (rate = info->vcpu_dirty_rates; rate; rate = rate->next) {
+        monitor_printf(mon, "vcpu %" PRId64 " dirty rate: %" PRIu64
+                       " kbytes/s, throttle percentage: %" PRIu64 "\n",
+                       rate->value->cpu_index, rate->value->dirty_rate >> 10,
+                       rate->value->throttle_percentage);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -322,6 +349,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
             params->x_checkpoint_delay);
+        assert(params->has_ram_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_RAM_CHANNELS],
+            params->ram_channels);
+        assert(params->has_compress_codec);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_CODEC],
+            MigrationCompressCodec_lookup[params->compress_codec]);
+        assert(params->has_vcpu_dirty_limit);
+        monitor_printf(mon, " %s: %" PRId64 " MB/s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT],
+            params->vcpu_dirty_limit);
         monitor_printf(mon, "\n");
     }
 
@@ -1394,6 +1433,23 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.has_x_checkpoint_delay = true;
                 use_int_value = true;
                 break;
+            case MIGRATION_PARAMETER_RAM_CHANNELS:
+                p.has_ram_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_CODEC:
+                p.has_compress_codec = true;
+                p.compress_codec =
+                    qapi_enum_parse(MigrationCompressCodec_lookup, valuestr,
+                                    MIGRATION_COMPRESS_CODEC__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                break;
+            case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+                p.has_vcpu_dirty_limit = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1411,6 +1467,8 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.cpu_throttle_increment = valueint;
                 p.downtime_limit = valueint;
                 p.x_checkpoint_delay = valueint;
+                p.ram_channels = valueint;
+                p.vcpu_dirty_limit = valueint;
             }
 
             qmp_migrate_set_parameters(&p, &err);
@@ -2527,6 +2585,96 @@ void hmp_info_dump(Monitor *mon, const QDict *qdict)
     qapi_free_DumpQueryResult(result);
 }
 
+void hmp_info_dsm(Monitor *mon, const QDict *qdict)
+{
+    bool has_top = qdict_haskey(qdict, "top");
+    int64_t top = qdict_get_try_int(qdict, "top", 0);
+    Error *err = NULL;
+    DsmStats *stats = qmp_query_dsm_stats(has_top, top, &err);
+    DsmNodeStatsList *node;
+    DsmHotPageList *page;
+    DsmVcpuStatsList *vcpu;
+    RouterMessageStatsList *msg;
+    intList *bucket;
+    int i;
+
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "DSM: %s\n", DsmMode_lookup[stats->mode]);
+    monitor_printf(mon, "faults: %" PRId64 ", received: %" PRId64
+                   " bytes, sent: %" PRId64 " bytes\n",
+                   stats->faults, stats->bytes_in, stats->bytes_out);
+
+    if (stats->latency_us) {
+        monitor_printf(mon, "fault latency:\n");
+    }
+    for (bucket = stats->latency_us, i = 0; bucket;
+         bucket = bucket->next, i++) {
+        if (bucket->value) {
+            monitor_printf(mon, "  < %" PRIu64 " us: %" PRId64 "\n",
+                           (uint64_t)1 << i, bucket->value);
+        }
+    }
+
+    if (stats->nodes) {
+        monitor_printf(mon, "%-6s %12s %12s %12s %12s %12s\n", "node",
+                       "read-faults", "write-faults", "pages-in",
+                       "pages-out", "revoked");
+    }
+    for (node = stats->nodes; node; node = node->next) {
+        DsmNodeStats *n = node->value;
+
+        monitor_printf(mon, "%-6" PRId64 " %12" PRId64 " %12" PRId64
+                       " %12" PRId64 " %12" PRId64 " %12" PRId64 "\n",
+                       n->node, n->read_faults, n->write_faults, n->pages_in,
+                       n->pages_out, n->revoked);
+    }
+
+    if (stats->hot_pages) {
+        monitor_printf(mon, "hot pages:\n");
+    }
+    for (page = stats->hot_pages; page; page = page->next) {
+        if (page->value->has_gpa) {
+            monitor_printf(mon, "  0x%016" PRIx64, page->value->gpa);
+        } else {
+            monitor_printf(mon, "  %-18s", "unmapped");
+        }
+        monitor_printf(mon, " moved %" PRId64 " times\n",
+                       page->value->transfers);
+    }
+
+    if (stats->vcpus) {
+        monitor_printf(mon, "%-6s %12s %12s\n", "vcpu", "faults",
+                       "faults/s");
+    }
+    for (vcpu = stats->vcpus; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "%-6" PRId64 " %12" PRId64 " %12" PRId64 "\n",
+                       vcpu->value->cpu_index, vcpu->value->faults,
+                       vcpu->value->fault_rate);
+    }
+
+    monitor_printf(mon, "router messages:\n");
+    for (msg = stats->router; msg; msg = msg->next) {
+        RouterMessageStats *m = msg->value;
+
+        monitor_printf(mon, "  %-12s sent %" PRId64 " (%" PRId64 "/s), "
+                       "received %" PRId64 " (%" PRId64 "/s)\n", m->type,
+                       m->sent, m->sent_rate, m->received, m->received_rate);
+        for (bucket = m->latency_us, i = 0; bucket;
+             bucket = bucket->next, i++) {
+            if (bucket->value) {
+                monitor_printf(mon, "    reply < %" PRIu64 " us: %" PRId64
+                               "\n", (uint64_t)1 << i, bucket->value);
+            }
+        }
+    }
+
+    qapi_free_DsmStats(stats);
+}
+
 void hmp_hotpluggable_cpus(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
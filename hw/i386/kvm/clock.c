@@ -40,6 +40,9 @@ typedef struct KVMClockState {
     bool clock_valid;
 } KVMClockState;
 
+/* number of times this instance has set the kvmclock */
+static uint32_t kvmclock_generation;
+
 struct pvclock_vcpu_time_info {
     uint32_t   version;
     uint32_t   pad0;
@@ -97,16 +100,12 @@ static void kvmclock_vm_state_change(void *opaque, int running,
 
         s->clock_valid = false;
 
-        /* BSP should get AP kvmclock and apply it to its own kvmclock */
+        /*
+         * APs follow the kvmclock of BSP. The clock sync service normally
+         * has an estimate of it at hand, already corrected for transit time.
+         */
         if (local_cpus != smp_cpus && local_cpu_start_index != 0) {
-            struct timespec begin_ts, end_ts;
-            clock_gettime(CLOCK_MONOTONIC, &begin_ts);
             kvmclock_fetching(&time_at_migration);
-            clock_gettime(CLOCK_MONOTONIC, &end_ts);
-            uint64_t rtt = (end_ts.tv_sec - begin_ts.tv_sec) * 1000000000 + end_ts.tv_nsec - begin_ts.tv_nsec;
-            printf("kvmclock sync RTT[%lu]\n", rtt);
-
-            time_at_migration += rtt / 2;
         }
 
         /* We can't rely on the migrated clock value, just discard it */
@@ -122,6 +121,11 @@ static void kvmclock_vm_state_change(void *opaque, int running,
             abort();
         }
 
+        /* estimates the other instances have of our clock are void now */
+        if (local_cpus != smp_cpus && local_cpu_start_index == 0) {
+            kvmclock_step_forwarding(atomic_inc_fetch(&kvmclock_generation));
+        }
+
         if (!cap_clock_ctrl) {
             return;
         }
@@ -160,6 +164,11 @@ static void kvmclock_vm_state_change(void *opaque, int running,
     }
 }
 
+uint32_t kvmclock_get_generation(void)
+{
+    return atomic_read(&kvmclock_generation);
+}
+
 uint64_t kvmclock_getclock(void) {
     struct kvm_clock_data data;
     int ret;
@@ -72,6 +72,7 @@
 #include "exec/ram_addr.h"
 #include "sys/mman.h"
 #include "interrupt-router.h"
+#include "dsm_backend.h"
 
 /* debug PC/ISA interrupts */
 //#define DEBUG_IRQ
@@ -1242,6 +1243,64 @@ static void rtc_set_cpus_count(ISADevice *rtc, uint16_t cpus_count)
     }
 }
 
+/* pinned at a time while taking ownership of a NUMA node's RAM */
+#define PC_DSM_PREHOME_CHUNK (2 * 1024 * 1024)
+
+static void pc_dsm_prehome_range(uint8_t *host, uint64_t size)
+{
+    struct kvm_dsm_mempin pin = { .write = true };
+    uint64_t done;
+    int ret;
+
+    for (done = 0; done < size; done += pin.length) {
+        pin.host_virt_addr = (__u64)(host + done);
+        pin.length = MIN(size - done, PC_DSM_PREHOME_CHUNK);
+        pin.unpin = false;
+        ret = kvm_vm_ioctl(kvm_state, KVM_DSM_MEMPIN, &pin);
+        if (ret < 0) {
+            error_report("warning: could not take ownership of RAM: %s",
+                         strerror(-ret));
+            return;
+        }
+        pin.unpin = true;
+        kvm_vm_ioctl(kvm_state, KVM_DSM_MEMPIN, &pin);
+    }
+}
+
+/*
+ * In the DSM a page belongs to whoever wrote it last, so before the guest
+ * runs, each instance pins for writing the RAM of the NUMA nodes whose
+ * vCPUs it runs. The guest then finds its node-local memory already local.
+ */
+static void pc_dsm_prehome_ram(void)
+{
+    RAMBlock *block = qemu_ram_block_by_name("pc.ram");
+    uint64_t offset, start = 0;
+    MemoryRegion *mr;
+    uint8_t *host;
+    int i, cpu;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        offset = start;
+        start += numa_info[i].node_mem;
+
+        cpu = find_first_bit(numa_info[i].node_cpu, max_cpus);
+        if (cpu >= max_cpus || router_cpu_home(cpu) != router_local_index()) {
+            continue;
+        }
+        if (numa_info[i].node_memdev) {
+            mr = host_memory_backend_get_memory(numa_info[i].node_memdev,
+                                                &error_abort);
+            host = memory_region_get_ram_ptr(mr);
+        } else if (block) {
+            host = qemu_map_ram_ptr(block, offset);
+        } else {
+            continue;
+        }
+        pc_dsm_prehome_range(host, numa_info[i].node_mem);
+    }
+}
+
 static
 void pc_machine_done(Notifier *notifier, void *data)
 {
@@ -1289,6 +1348,10 @@ void pc_machine_done(Notifier *notifier, void *data)
             exit(EXIT_FAILURE);
         }
     }
+
+    if (dsm_mode == DSM_MODE_KERNEL) {
+        pc_dsm_prehome_ram();
+    }
 }
 
 void pc_guest_info_init(PCMachineState *pcms)
@@ -1385,21 +1448,16 @@ void pc_memory_init(PCMachineState *pcms,
     linux_boot = (machine->kernel_filename != NULL);
 
     /* Start DSM */
-    if (local_cpus != smp_cpus && !shm_path) {
-        if (kvm_enabled() && kvm_check_extension(kvm_state, KVM_CAP_X86_DSM)) {
-            params.dsm_index = local_cpu_start_index / local_cpus;
-            params.cluster_iplist = (void *) get_cluster_iplist(&params.cluster_iplist_len);
-            int ret = kvm_vm_ioctl(kvm_state, KVM_DSM_ENABLE, &params);
-            if (ret < 0) {
-                error_report("Enable kernel DSM failed: %s", strerror(-ret));
-                exit(EXIT_FAILURE);
-            }
-            printf("start kvm dsm server, total memory size: %lu\n",
-                    machine->ram_size);
-        } else {
-            error_report("Could not start distributed QEMU: DSM not supported.");
+    if (dsm_mode == DSM_MODE_KERNEL) {
+        params.dsm_index = router_local_index();
+        params.cluster_iplist = (void *) get_cluster_iplist(&params.cluster_iplist_len);
+        int ret = kvm_vm_ioctl(kvm_state, KVM_DSM_ENABLE, &params);
+        if (ret < 0) {
+            error_report("Enable kernel DSM failed: %s", strerror(-ret));
             exit(EXIT_FAILURE);
         }
+        printf("start kvm dsm server, total memory size: %lu\n",
+                machine->ram_size);
     }
 
     /* Allocate RAM.  We allocate it as a single memory region and use
@@ -2017,7 +2075,7 @@ static void pc_cpu_pre_plug(HotplugHandler *hotplug_dev,
     cs->cpu_index = idx;
 
     // binss: local cpu
-    if (idx < local_cpu_start_index || idx > local_cpu_start_index + local_cpus - 1) {
+    if (router_cpu_home(idx) != router_local_index()) {
         cs->local = false;
     }
 }
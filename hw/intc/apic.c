@@ -220,8 +220,7 @@ static void apic_external_nmi(APICCommonState *s)
 static void cpu_interrupt_remote(CPUState *cpu, int mask)
 {
     int index = cpu->cpu_index;
-    if (local_cpus != smp_cpus && (index < local_cpu_start_index ||
-                index >= local_cpu_start_index + local_cpus)) {
+    if (local_cpus != smp_cpus && !cpu->local) {
         special_interrupt_forwarding(index, mask);
     } else {
         cpu_interrupt(cpu, mask);
@@ -237,8 +236,7 @@ void apic_set_irq_detour(CPUState *cpu, int vector_num, int trigger_mode) {
 static void apic_set_irq_remote(APICCommonState *s, int vector_num, int trigger_mode)
 {
     int index = (CPU(s->cpu))->cpu_index;
-    if (local_cpus != smp_cpus && (index < local_cpu_start_index ||
-                index >= local_cpu_start_index + local_cpus)) {
+    if (local_cpus != smp_cpus && !CPU(s->cpu)->local) {
         irq_forwarding(index, vector_num, trigger_mode);
     } else {
         apic_set_irq(s, vector_num, trigger_mode);
@@ -447,7 +445,7 @@ static void apic_eoi(APICCommonState *s)
         return;
     apic_reset_bit(s->isr, isrv);
     if (!(s->spurious_vec & APIC_SV_DIRECTED_IO) && apic_get_bit(s->tmr, isrv)) {
-        if (local_cpus != smp_cpus && local_cpu_start_index != 0) {
+        if (local_cpus != smp_cpus) {
             eoi_forwarding(isrv);
         } else {
             ioapic_eoi_broadcast(isrv);
@@ -537,8 +535,7 @@ void apic_startup(CPUState *cpu, int vector_num)
 static void apic_startup_remote(CPUState *cpu, int vector_num)
 {
     int index = cpu->cpu_index;
-    if (local_cpus != smp_cpus && (index < local_cpu_start_index ||
-                index >= local_cpu_start_index + local_cpus)) {
+    if (local_cpus != smp_cpus && !cpu->local) {
         startup_forwarding(index, vector_num);
     } else {
         apic_startup(cpu, vector_num);
@@ -560,8 +557,7 @@ void apic_sipi(DeviceState *dev)
 static void apic_init_level_deassert_remote(APICCommonState *s)
 {
     int index = (CPU(s->cpu))->cpu_index;
-    if (local_cpus != smp_cpus && (index < local_cpu_start_index ||
-                index >= local_cpu_start_index + local_cpus)) {
+    if (local_cpus != smp_cpus && !CPU(s->cpu)->local) {
         init_level_deassert_forwarding(index);
     } else {
         s->arb_id = s->id;
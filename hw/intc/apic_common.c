@@ -436,6 +436,27 @@ static const VMStateDescription vmstate_apic_common = {
     }
 };
 
+/* The APIC of a vCPU that moves to another instance, see router-vcpu.c */
+void apic_save_cpu_state(CPUState *cpu, QEMUFile *f)
+{
+    DeviceState *apic = X86_CPU(cpu)->apic_state;
+
+    if (apic) {
+        vmstate_save_state(f, &vmstate_apic_common, APIC_COMMON(apic), NULL);
+    }
+}
+
+int apic_load_cpu_state(CPUState *cpu, QEMUFile *f)
+{
+    DeviceState *apic = X86_CPU(cpu)->apic_state;
+
+    if (!apic) {
+        return 0;
+    }
+    return vmstate_load_state(f, &vmstate_apic_common, APIC_COMMON(apic),
+                              vmstate_apic_common.version_id);
+}
+
 static Property apic_properties_common[] = {
     DEFINE_PROP_UINT8("version", APICCommonState, version, 0x14),
     DEFINE_PROP_BIT("vapic", APICCommonState, vapic_control, VAPIC_ENABLE_BIT,
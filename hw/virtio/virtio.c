@@ -243,24 +243,36 @@ int virtio_queue_empty(VirtQueue *vq)
 static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
                                unsigned int len)
 {
+    DSMPinList pins;
     unsigned int offset;
     int i;
 
+    /* Drop the pins of the whole element at once */
+    dsm_pin_list_init(&pins, &address_space_memory, true, &vq->vdev->dsm_pin);
+    for (i = 0; i < elem->in_num; i++) {
+        dsm_pin_list_add(&pins, elem->in_addr[i], elem->in_sg[i].iov_base,
+                         elem->in_sg[i].iov_len, true);
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        dsm_pin_list_add(&pins, elem->out_addr[i], elem->out_sg[i].iov_base,
+                         elem->out_sg[i].iov_len, false);
+    }
+    dsm_pin_list_flush(&pins);
+
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
 
-        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
-                                  elem->in_sg[i].iov_len,
-                                  1, size);
+        address_space_unmap(&address_space_memory, elem->in_sg[i].iov_base,
+                            elem->in_sg[i].iov_len, 1, size, false);
 
         offset += size;
     }
 
     for (i = 0; i < elem->out_num; i++)
-        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
-                                  elem->out_sg[i].iov_len,
-                                  0, elem->out_sg[i].iov_len);
+        address_space_unmap(&address_space_memory, elem->out_sg[i].iov_base,
+                            elem->out_sg[i].iov_len, 0,
+                            elem->out_sg[i].iov_len, false);
 }
 
 /* virtqueue_detach_element:
@@ -534,7 +546,7 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
 static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
                                hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
-                               hwaddr pa, size_t sz)
+                               hwaddr pa, size_t sz, DSMPinList *pins)
 {
     bool ok = false;
     unsigned num_sg = *p_num_sg;
@@ -554,11 +566,13 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
             goto out;
         }
 
-        iov[num_sg].iov_base = cpu_physical_memory_map(pa, &len, is_write);
+        iov[num_sg].iov_base = address_space_map(&address_space_memory, pa,
+                                                 &len, is_write, false, NULL);
         if (!iov[num_sg].iov_base) {
             virtio_error(vdev, "virtio: bogus descriptor or out of resources");
             goto out;
         }
+        dsm_pin_list_add(pins, pa, iov[num_sg].iov_base, len, is_write);
 
         iov[num_sg].iov_len = len;
         addr[num_sg] = pa;
@@ -593,14 +607,15 @@ static void virtqueue_undo_map_desc(unsigned int out_num, unsigned int in_num,
 
 static void virtqueue_map_iovec(struct iovec *sg, hwaddr *addr,
                                 unsigned int *num_sg,
-                                int is_write)
+                                int is_write, DSMPinList *pins)
 {
     unsigned int i;
     hwaddr len;
 
     for (i = 0; i < *num_sg; i++) {
         len = sg[i].iov_len;
-        sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
+        sg[i].iov_base = address_space_map(&address_space_memory, addr[i],
+                                           &len, is_write, false, NULL);
         if (!sg[i].iov_base) {
             error_report("virtio: error trying to map MMIO memory");
             exit(1);
@@ -609,13 +624,19 @@ static void virtqueue_map_iovec(struct iovec *sg, hwaddr *addr,
             error_report("virtio: unexpected memory split");
             exit(1);
         }
+        dsm_pin_list_add(pins, addr[i], sg[i].iov_base, len, is_write);
     }
 }
 
 void virtqueue_map(VirtQueueElement *elem)
 {
-    virtqueue_map_iovec(elem->in_sg, elem->in_addr, &elem->in_num, 1);
-    virtqueue_map_iovec(elem->out_sg, elem->out_addr, &elem->out_num, 0);
+    DSMPinList pins;
+
+    dsm_pin_list_init(&pins, &address_space_memory, false, NULL);
+    virtqueue_map_iovec(elem->in_sg, elem->in_addr, &elem->in_num, 1, &pins);
+    virtqueue_map_iovec(elem->out_sg, elem->out_addr, &elem->out_num, 0,
+                        &pins);
+    dsm_pin_list_flush(&pins);
 }
 
 static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
@@ -649,6 +670,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
     VRingDesc desc;
+    DSMPinList pins;
     int rc;
 
     if (unlikely(vdev->broken)) {
@@ -663,6 +685,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
 
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
+    dsm_pin_list_init(&pins, &address_space_memory, false, &vdev->dsm_pin);
 
     max = vq->vring.num;
 
@@ -702,7 +725,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
-                                        desc.addr, desc.len);
+                                        desc.addr, desc.len, &pins);
         } else {
             if (in_num) {
                 virtio_error(vdev, "Incorrect order for descriptors");
@@ -710,7 +733,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             }
             map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
-                                        desc.addr, desc.len);
+                                        desc.addr, desc.len, &pins);
         }
         if (!map_ok) {
             goto err_undo_map;
@@ -728,6 +751,8 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     if (rc == VIRTQUEUE_READ_DESC_ERROR) {
         goto err_undo_map;
     }
+    /* Pin every descriptor of the chain in one go */
+    dsm_pin_list_flush(&pins);
 
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
@@ -747,6 +772,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     return elem;
 
 err_undo_map:
+    dsm_pin_list_flush(&pins);
     virtqueue_undo_map_desc(out_num, in_num, iov);
     return NULL;
 }
@@ -2111,6 +2137,7 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
+    DeviceState *proxy;
     Error *err = NULL;
 
     /* Devices should either use vmsd or the load/save methods */
@@ -2129,6 +2156,11 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    /* Account DSM pins to the transport, which is what -device names */
+    proxy = qdev_get_parent_bus(dev)->parent;
+    dsm_pin_counters_register(&vdev->dsm_pin,
+                              (proxy && proxy->id) ? proxy->id : vdev->name);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -2137,6 +2169,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    dsm_pin_counters_unregister(&vdev->dsm_pin);
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
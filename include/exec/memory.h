@@ -247,6 +247,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -264,6 +265,20 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link_as;
 };
 
+/*
+ * Requests made to the distributed shared memory to pin guest RAM on
+ * behalf of a device or an address space.  Listed by query-dsm-pin-stats.
+ */
+typedef struct DSMPinCounters {
+    const char *name;
+    uint64_t calls;             /* ioctls, pinning and unpinning */
+    uint64_t ranges;            /* ranges pinned */
+    uint64_t bytes;             /* bytes pinned */
+    QTAILQ_ENTRY(DSMPinCounters) next;
+} DSMPinCounters;
+
+typedef struct DSMPinCache DSMPinCache;
+
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
@@ -285,6 +300,8 @@ struct AddressSpace {
     MemoryListener dispatch_listener;
     QTAILQ_HEAD(memory_listeners_as, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+    DSMPinCounters dsm_pin;
+    DSMPinCache *dsm_pin_cache;
 };
 
 /**
@@ -791,6 +808,21 @@ void memory_region_set_fd(MemoryRegion *mr, int fd);
  */
 MemoryRegion *memory_region_from_host(void *ptr, ram_addr_t *offset);
 
+/**
+ * address_space_addr_from_host: Find where a pointer into guest RAM is
+ * mapped in an address space.
+ *
+ * Follows aliases, so that a pointer into the RAM of a PC finds its
+ * address below or above 4 GiB.
+ *
+ * Returns true and sets @addr if @ptr is mapped in @as.
+ *
+ * @as: the address space, e.g. &address_space_memory
+ * @ptr: the host pointer
+ * @addr: set to the address of @ptr in @as
+ */
+bool address_space_addr_from_host(AddressSpace *as, void *ptr, hwaddr *addr);
+
 /**
  * memory_region_get_ram_ptr: Get a pointer into a RAM memory region.
  *
@@ -888,6 +920,23 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm the dirty logging of a range of
+ *                                   a region in any external TLBs (e.g. kvm)
+ *
+ * Accelerators that leave the dirty log armed after a sync until it is
+ * cleared explicitly (e.g. kvm with manual dirty log protection) start
+ * tracking writes to the pages again that the last sync found dirty.  This
+ * may be called without the iothread lock, so that the caller can clear
+ * the log in small chunks right before it reads the pages.
+ *
+ * @mr: the region being cleared.
+ * @start: the start of the subrange being cleared.
+ * @len: the size of the subrange being cleared.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -965,6 +1014,44 @@ void memory_region_add_coalescing(MemoryRegion *mr,
  */
 void memory_region_clear_coalescing(MemoryRegion *mr);
 
+/**
+ * memory_region_has_coalescing: check whether writes to a region may be
+ *                               coalesced
+ *
+ * Returns %true if memory_region_set_coalescing() or
+ * memory_region_add_coalescing() was called for the region.
+ *
+ * @mr: the memory region being queried
+ */
+static inline bool memory_region_has_coalescing(MemoryRegion *mr)
+{
+    return !QTAILQ_EMPTY(&mr->coalesced);
+}
+
+/**
+ * memory_region_get_flush_coalesced: check whether pending coalesced MMIO
+ *                                    must be flushed before accesses
+ *
+ * @mr: the memory region being queried
+ */
+static inline bool memory_region_get_flush_coalesced(MemoryRegion *mr)
+{
+    return mr->flush_coalesced_mmio;
+}
+
+/**
+ * memory_region_has_ioeventfds: check whether a region has ioeventfds
+ *
+ * Returns %true if writes to some address of the region only signal an
+ * eventfd, as is the case for doorbell and notify registers.
+ *
+ * @mr: the memory region being queried
+ */
+static inline bool memory_region_has_ioeventfds(MemoryRegion *mr)
+{
+    return mr->ioeventfd_nb > 0;
+}
+
 /**
  * memory_region_set_flush_coalesced: Enforce memory coalescing flush before
  *                                    accesses.
@@ -1478,6 +1565,105 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len, bool dsm_unpin);
 
+#define DSM_PIN_LIST_MAX 64
+
+/*
+ * A scatter-gather list of buffers returned by address_space_map() with
+ * @dsm_pin false, to be pinned or unpinned in the distributed shared
+ * memory with as few ioctls as possible.
+ */
+typedef struct DSMPinList {
+    AddressSpace *as;
+    DSMPinCounters *counters;
+    bool unpin;
+    int n;
+    struct {
+        hwaddr addr;
+        void *host;
+        hwaddr len;
+        bool is_write;
+    } ranges[DSM_PIN_LIST_MAX];
+} DSMPinList;
+
+/**
+ * dsm_pin_list_init: Start a list of buffers to pin or unpin
+ *
+ * @list: the list
+ * @as: the address space the buffers were mapped from, whose pin cache
+ *      to go through, or %NULL to bypass the cache
+ * @unpin: whether the buffers are to be unpinned rather than pinned
+ * @counters: where to account the requests, usually those of the device
+ */
+void dsm_pin_list_init(DSMPinList *list, AddressSpace *as, bool unpin,
+                       DSMPinCounters *counters);
+
+/**
+ * dsm_pin_list_add: Add a buffer to a list
+ *
+ * Does nothing unless the distributed shared memory is in use.  Bounce
+ * buffers are skipped, and a buffer that follows the previous one is
+ * merged with it.  A full list is flushed first.
+ *
+ * @list: the list
+ * @addr: the address @host was mapped from; only used when pinning
+ * @host: a buffer returned by address_space_map()
+ * @len: its length
+ * @is_write: whether the buffer was mapped for writing
+ */
+void dsm_pin_list_add(DSMPinList *list, hwaddr addr, void *host, hwaddr len,
+                      bool is_write);
+
+/**
+ * dsm_pin_list_flush: Pin or unpin all buffers of a list, and empty it
+ *
+ * @list: the list
+ */
+void dsm_pin_list_flush(DSMPinList *list);
+
+/**
+ * dsm_pin_counters_register: List counters in query-dsm-pin-stats
+ *
+ * @counters: the counters, zeroed by the caller
+ * @name: name to show them under, must outlive the registration
+ */
+void dsm_pin_counters_register(DSMPinCounters *counters, const char *name);
+
+/**
+ * dsm_pin_counters_unregister: Stop listing counters
+ *
+ * @counters: counters registered with dsm_pin_counters_register()
+ */
+void dsm_pin_counters_unregister(DSMPinCounters *counters);
+
+#define DSM_PIN_CACHE_PAGES_DEFAULT 4096
+
+/* Idle pages each address space may keep pinned, 0 disables the cache */
+extern uint64_t dsm_pin_cache_pages;
+
+/**
+ * dsm_pin_cache_destroy: Unpin all pages cached for an address space
+ *
+ * @as: the address space, which is going away
+ */
+void dsm_pin_cache_destroy(AddressSpace *as);
+
+/**
+ * dsm_pin_cache_suspend: Stop caching pins until dsm_pin_cache_resume()
+ *
+ * Unpins every idle page of every cache.  Until resumed, a page is only
+ * kept pinned while a mapping uses it, and a page that is not yet in a
+ * cache is pinned and unpinned directly, so that the caches hold as few
+ * pages as possible while someone else pins and unpins them.
+ */
+void dsm_pin_cache_suspend(void);
+
+/**
+ * dsm_pin_cache_resume: Cache pins again
+ *
+ * Pins again the pages that mappings still use, in case whoever suspended
+ * the caches unpinned them.
+ */
+void dsm_pin_cache_resume(void);
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
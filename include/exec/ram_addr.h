@@ -37,6 +37,11 @@ struct RAMBlock {
     QLIST_ENTRY(RAMBlock) next;
     int fd;
     size_t page_size;
+    /* XBZRLE cache lookups for the pages of the block, by migration */
+    uint64_t xbzrle_hits;
+    uint64_t xbzrle_misses;
+    /* chunks whose dirty log migration has still to clear, see ram.c */
+    unsigned long *clear_bmap;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -40,4 +40,8 @@ void apic_lapic_write(CPUState *cpu, hwaddr addr, uint32_t val);
 void apic_mem_writel(void *opaque, hwaddr addr, uint32_t val);
 void apic_set_irq_detour(CPUState *cpu, int vector_num, int trigger_mode);
 void apic_startup(CPUState *cpu, int vector_num);
+
+/* apic_common.c */
+void apic_save_cpu_state(CPUState *cpu, QEMUFile *f);
+int apic_load_cpu_state(CPUState *cpu, QEMUFile *f);
 #endif
@@ -20,6 +20,7 @@
 void kvmclock_create(void);
 
 uint64_t kvmclock_getclock(void);
+uint32_t kvmclock_get_generation(void);
 
 #else /* CONFIG_KVM */
 
@@ -28,5 +29,6 @@ static inline void kvmclock_create(void)
 }
 
 uint64_t kvmclock_getclock(void);
+uint32_t kvmclock_get_generation(void);
 
 #endif /* !CONFIG_KVM */
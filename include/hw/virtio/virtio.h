@@ -90,6 +90,7 @@ struct VirtIODevice
     bool broken; /* device in invalid state, needs reset */
     VMChangeStateEntry *vmstate;
     char *bus_name;
+    DSMPinCounters dsm_pin;
     uint8_t device_endian;
     bool use_guest_notifier_mask;
     QLIST_HEAD(, VirtQueue) *vector_queues;
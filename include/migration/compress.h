@@ -0,0 +1,125 @@
+/*
+ * Migration compression: codecs and the job queue of the compression
+ * threads
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/**
+ * migration_codec_available: whether QEMU was built with @codec
+ */
+bool migration_codec_available(MigrationCompressCodec codec);
+
+/**
+ * migration_codec_max_level: the highest compress-level @codec takes
+ */
+int migration_codec_max_level(MigrationCompressCodec codec);
+
+/**
+ * migration_compress_bound: the most @len bytes compress to with @codec
+ */
+size_t migration_compress_bound(MigrationCompressCodec codec, size_t len);
+
+/**
+ * migration_compress: compress @len bytes from @src into @dst
+ *
+ * Returns the compressed length, or -1 on error.
+ *
+ * @codec: the codec to use
+ * @level: the compress-level parameter, 0 for the codec's default
+ * @dst_len: the size of @dst, at least migration_compress_bound(@len)
+ */
+ssize_t migration_compress(MigrationCompressCodec codec, int level,
+                           const uint8_t *src, size_t len,
+                           uint8_t *dst, size_t dst_len);
+
+/**
+ * migration_decompress: decompress @len bytes from @src into @dst
+ *
+ * Returns the decompressed length, or -1 on error.
+ */
+ssize_t migration_decompress(MigrationCompressCodec codec,
+                             const uint8_t *src, size_t len,
+                             uint8_t *dst, size_t dst_len);
+
+/**
+ * migration_compress_thread_init: set up the calling thread to run
+ * migration_compress()
+ *
+ * Returns 0, or -1 with @errp set.
+ */
+int migration_compress_thread_init(Error **errp);
+
+/**
+ * migration_decompress_thread_init: set up the calling thread to run
+ * migration_decompress()
+ *
+ * Returns 0, or -1 with @errp set.
+ */
+int migration_decompress_thread_init(Error **errp);
+
+/*
+ * A ring of jobs, filled by one thread and run by a pool of worker
+ * threads; the filling thread takes them back in the order it queued
+ * them. Handing a job over or taking it back takes no lock.
+ */
+typedef struct CompressQueue CompressQueue;
+typedef void CompressJobFunc(void *job);
+typedef int CompressThreadInit(Error **errp);
+
+/**
+ * compress_queue_new: start @threads workers running @func on the jobs
+ *
+ * Returns NULL with @errp set if @init failed in one of the workers.
+ *
+ * @depth: the number of jobs that can be queued or done at once
+ * @job_size: the size of a job
+ * @init: if not NULL, run by every worker before its first job
+ */
+CompressQueue *compress_queue_new(const char *name, int threads, int depth,
+                                  size_t job_size, CompressThreadInit *init,
+                                  CompressJobFunc *func, Error **errp);
+
+/**
+ * compress_queue_free: stop the workers once the queued jobs are run
+ *
+ * @cleanup: if not NULL, called on every job slot before the slots are
+ *           freed, for what the jobs point to
+ */
+void compress_queue_free(CompressQueue *q, CompressJobFunc *cleanup);
+
+/**
+ * compress_queue_job: the @i-th job slot of @q, 0 <= @i < depth
+ */
+void *compress_queue_job(CompressQueue *q, int i);
+
+/**
+ * compress_queue_reserve: the next free job, NULL if the ring is full
+ */
+void *compress_queue_reserve(CompressQueue *q);
+
+/**
+ * compress_queue_submit: hand the job compress_queue_reserve() returned
+ * over to the workers
+ */
+void compress_queue_submit(CompressQueue *q);
+
+/**
+ * compress_queue_oldest: the oldest job not taken back yet, NULL if there
+ * is none, or if it is still running and @wait is false
+ */
+void *compress_queue_oldest(CompressQueue *q, bool wait);
+
+/**
+ * compress_queue_release: take back the job compress_queue_oldest()
+ * returned, its slot can be reserved again
+ */
+void compress_queue_release(CompressQueue *q);
+
+#endif
@@ -28,6 +28,8 @@
 #include "qemu/coroutine_int.h"
 
 #define QEMU_VM_FILE_MAGIC           0x5145564d
+/* the first word of a RAM channel, see migration/ram.c */
+#define RAM_CHANNEL_MAGIC            0x52414d43 /* "RAMC" */
 #define QEMU_VM_FILE_VERSION_COMPAT  0x00000002
 #define QEMU_VM_FILE_VERSION         0x00000003
 
@@ -227,6 +229,10 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+QIOChannel *socket_send_channel_create(Error **errp);
+
+void socket_incoming_migration_end(void);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
@@ -252,14 +258,20 @@ bool migration_in_postcopy(MigrationState *);
 bool migration_in_postcopy_after_devices(MigrationState *);
 MigrationState *migrate_get_current(void);
 
-void migrate_compress_threads_create(void);
+int migrate_compress_threads_create(Error **errp);
 void migrate_compress_threads_join(void);
-void migrate_decompress_threads_create(void);
+int migrate_decompress_threads_create(Error **errp);
 void migrate_decompress_threads_join(void);
+void migrate_ram_channels_create(void);
+void migrate_ram_channels_join(void);
+void migrate_ram_channels_shutdown(void);
+void migrate_ram_channels_recv_join(void);
+void ram_channel_process_incoming(QIOChannel *ioc);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 void free_xbzrle_decoded_buf(void);
+void ram_dsm_unpin(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -274,6 +286,12 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+XBZRLEBlockStatsList *xbzrle_mig_block_stats(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+double compress_mig_compression_rate(void);
+uint64_t compress_mig_time_ns(void);
+VcpuDirtyRateList *vcpu_dirty_rates(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -306,6 +324,8 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/* for the tests: switch the encoder to the next slower ISA, false if none */
+bool xbzrle_test_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -314,9 +334,13 @@ bool migrate_colo_enabled(void);
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
+bool migrate_use_compress_frames(void);
 int migrate_compress_level(void);
+MigrationCompressCodec migrate_compress_codec(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+int migrate_ram_channels(void);
+int64_t migrate_vcpu_dirty_limit(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -0,0 +1,123 @@
+/*
+ * Bounded lock-free multi-producer/single-consumer ring of pointers
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ *
+ * Each slot carries a sequence number so that producers can claim a slot
+ * with a single compare-and-swap on the tail and publish it with a release
+ * store, without ever taking a lock.  The consumer only touches the head,
+ * which it owns exclusively.
+ *
+ * Assumptions:
+ * - NULL cannot be pushed.
+ * - Only one thread calls mpsc_ring_pop() at a time.
+ */
+#ifndef QEMU_MPSC_RING_H
+#define QEMU_MPSC_RING_H
+
+#include "qemu/atomic.h"
+
+typedef struct MPSCRingSlot {
+    unsigned long seq;
+    void *data;
+} MPSCRingSlot;
+
+typedef struct MPSCRing {
+    MPSCRingSlot *slots;
+    unsigned long mask;
+    /* producers and the consumer are kept on separate cache lines */
+    unsigned long tail QEMU_ALIGNED(64);
+    unsigned long head QEMU_ALIGNED(64);
+} MPSCRing;
+
+/**
+ * mpsc_ring_init - Initialize an MPSC ring
+ * @ring: ring to be initialized
+ * @size: number of slots, rounded up to a power of two
+ */
+void mpsc_ring_init(MPSCRing *ring, size_t size);
+
+/**
+ * mpsc_ring_destroy - Free the slots of an MPSC ring
+ * @ring: ring to be destroyed
+ *
+ * Call only when there are no producers or consumer left.  Entries still
+ * queued are not freed.
+ */
+void mpsc_ring_destroy(MPSCRing *ring);
+
+/**
+ * mpsc_ring_push - Enqueue a pointer
+ * @ring: ring to enqueue into
+ * @data: non-NULL pointer
+ *
+ * May be called concurrently from any number of threads.
+ *
+ * Returns true on success, false if the ring is full.
+ */
+static inline bool mpsc_ring_push(MPSCRing *ring, void *data)
+{
+    MPSCRingSlot *slot;
+    unsigned long pos = atomic_read(&ring->tail);
+    long diff;
+
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        diff = (long)(atomic_load_acquire(&slot->seq) - pos);
+        if (diff == 0) {
+            unsigned long old = atomic_cmpxchg(&ring->tail, pos, pos + 1);
+
+            if (old == pos) {
+                break;
+            }
+            pos = old;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_read(&ring->tail);
+        }
+    }
+
+    slot->data = data;
+    atomic_store_release(&slot->seq, pos + 1);
+    return true;
+}
+
+/**
+ * mpsc_ring_pop - Dequeue a pointer
+ * @ring: ring to dequeue from
+ *
+ * Must only be called by the single consumer.
+ *
+ * Returns the oldest published pointer, or NULL if the ring is empty.
+ */
+static inline void *mpsc_ring_pop(MPSCRing *ring)
+{
+    unsigned long pos = ring->head;
+    MPSCRingSlot *slot = &ring->slots[pos & ring->mask];
+    void *data;
+
+    if ((long)(atomic_load_acquire(&slot->seq) - (pos + 1)) < 0) {
+        return NULL;
+    }
+    data = slot->data;
+    ring->head = pos + 1;
+    atomic_store_release(&slot->seq, pos + ring->mask + 1);
+    return data;
+}
+
+/**
+ * mpsc_ring_empty - Check whether there is nothing left to dequeue
+ * @ring: ring to check
+ *
+ * Only meaningful when called by the consumer.
+ */
+static inline bool mpsc_ring_empty(MPSCRing *ring)
+{
+    MPSCRingSlot *slot = &ring->slots[ring->head & ring->mask];
+
+    return (long)(atomic_load_acquire(&slot->seq) - (ring->head + 1)) < 0;
+}
+
+#endif /* QEMU_MPSC_RING_H */
@@ -0,0 +1,78 @@
+/*
+ * Sense-reversing thread barrier with a spin-then-sleep wait policy
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ *
+ * The participant count, the number of threads that have arrived and the
+ * generation of the current phase share one word, so arriving, joining and
+ * leaving are a single compare-and-swap each.  The thread that completes a
+ * phase bumps the generation and publishes it in a separate futex word;
+ * the others spin on it for a while and then sleep in the kernel.
+ *
+ * Unlike pthread_barrier_t, the number of participants can change while
+ * the barrier is in use: a thread that stops taking part calls
+ * qemu_barrier_leave() and, if everybody else was already waiting for it,
+ * opens the current phase on the way out.
+ */
+#ifndef QEMU_THREAD_BARRIER_H
+#define QEMU_THREAD_BARRIER_H
+
+#include "qemu/thread.h"
+
+#define QEMU_BARRIER_MAX_THREADS    0xfff
+
+/* cpu_relax() iterations before sleeping; a few microseconds on x86 */
+#define QEMU_BARRIER_SPIN_DEFAULT   2000
+
+typedef struct QemuBarrier {
+    unsigned state;     /* generation:8, participants:12, arrived:12 */
+    unsigned phase;     /* last generation opened, the futex word */
+    unsigned spin;
+#ifndef __linux__
+    QemuMutex lock;
+    QemuCond cond;
+#endif
+} QemuBarrier;
+
+/**
+ * qemu_barrier_init - Initialize a barrier
+ * @b: barrier to be initialized
+ * @count: number of participants, at most QEMU_BARRIER_MAX_THREADS
+ * @spin: number of cpu_relax() iterations a waiter spins before sleeping
+ */
+void qemu_barrier_init(QemuBarrier *b, unsigned count, unsigned spin);
+
+/**
+ * qemu_barrier_destroy - Tear down a barrier nobody is waiting on
+ * @b: barrier to be destroyed
+ */
+void qemu_barrier_destroy(QemuBarrier *b);
+
+/**
+ * qemu_barrier_wait - Wait for all participants to arrive
+ * @b: barrier to wait on
+ *
+ * Returns true in exactly one of the threads released by each phase, the
+ * one whose arrival completed it.
+ */
+bool qemu_barrier_wait(QemuBarrier *b);
+
+/**
+ * qemu_barrier_join - Add a participant
+ * @b: barrier to join
+ *
+ * The new participant is counted starting from the current phase.
+ */
+void qemu_barrier_join(QemuBarrier *b);
+
+/**
+ * qemu_barrier_leave - Remove a participant
+ * @b: barrier to leave
+ *
+ * Must not be called by a thread that is waiting on @b.  If all remaining
+ * participants have already arrived, the current phase is opened.
+ */
+void qemu_barrier_leave(QemuBarrier *b);
+
+#endif
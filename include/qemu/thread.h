@@ -50,6 +50,8 @@ void qemu_event_init(QemuEvent *ev, bool init);
 void qemu_event_set(QemuEvent *ev);
 void qemu_event_reset(QemuEvent *ev);
 void qemu_event_wait(QemuEvent *ev);
+/* like qemu_event_wait, but gives up after @ns nanoseconds */
+void qemu_event_timedwait(QemuEvent *ev, int64_t ns);
 void qemu_event_destroy(QemuEvent *ev);
 
 void qemu_thread_create(QemuThread *thread, const char *name,
@@ -369,6 +369,10 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    /* pages the vCPU dirtied, counted by the KVM dirty ring */
+    uint64_t kvm_dirty_pages;
 
     /*
      * Used for events with 'vcpu' and *without* the 'disabled' properties.
@@ -391,6 +395,8 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* throttle percentage of this vcpu alone, see cpu_throttle_set_vcpu */
+    int throttle_percentage;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -399,6 +405,8 @@ struct CPUState {
     uint32_t tcg_exit_req;
 
     bool local;
+    /* set by resume_all_vcpus() until the vCPU is back in the guest */
+    bool resume_pending;
 };
 
 QTAILQ_HEAD(CPUTailQ, CPUState);
@@ -733,10 +741,29 @@ bool cpu_exists(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time, 0 to stop. Valid range is 0 to 99.
+ *
+ * Throttles one vcpu the way cpu_throttle_set throttles all of them. A vcpu
+ * sleeps for the larger of its own percentage and the global one.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu.
+ *
+ * Returns: The percentage set by cpu_throttle_set_vcpu, 0 if none.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -198,6 +198,10 @@ extern bool kvm_msi_use_devid;
 struct kvm_run;
 struct kvm_lapic_state;
 struct kvm_irq_routing_entry;
+struct kvm_dsm_mempin;
+struct kvm_dsm_memcpy;
+struct kvm_dsm_stats;
+struct kvm_dsm_vcpu_stats;
 
 typedef struct KVMCapabilityInfo {
     const char *name;
@@ -222,6 +226,61 @@ int kvm_has_pit_state2(void);
 int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
 int kvm_has_intx_set_mask(void);
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dsm_mempin_vec - pin or unpin guest RAM in the distributed shared memory
+ * @pins: the ranges, each with its own direction and pin/unpin flag
+ * @n: number of ranges
+ *
+ * Uses a single KVM_DSM_MEMPIN_VEC ioctl if the kernel supports it, and
+ * one KVM_DSM_MEMPIN per range otherwise.
+ *
+ * Returns the number of ioctls issued, or a negative errno value.
+ */
+int kvm_dsm_mempin_vec(struct kvm_dsm_mempin *pins, int n);
+
+/**
+ * kvm_dsm_memcpy_vec - copy to or from guest RAM in the distributed shared
+ * memory
+ * @cpys: the copies
+ * @n: number of copies
+ *
+ * Like kvm_dsm_mempin_vec(), for KVM_DSM_MEMCPY.
+ */
+int kvm_dsm_memcpy_vec(struct kvm_dsm_memcpy *cpys, int n);
+
+/**
+ * kvm_dsm_revoke_notify - ask to be told when pinned pages are wanted
+ * @fd: an eventfd
+ *
+ * The kernel signals @fd whenever another node of the distributed VM
+ * waits for a page that this QEMU keeps pinned.
+ *
+ * Returns 0 on success, -ENOSYS if the kernel cannot do it, or another
+ * negative errno value.
+ */
+int kvm_dsm_revoke_notify(int fd);
+
+/**
+ * kvm_dsm_get_stats - read the coherence statistics of the kernel DSM
+ * @stats: the nr_nodes, nodes, nr_hot and hot fields say where to put the
+ * per-node counters and the hottest pages, the rest is filled in
+ *
+ * Returns 0 on success, -ENOSYS if the kernel cannot do it, or another
+ * negative errno value.
+ */
+int kvm_dsm_get_stats(struct kvm_dsm_stats *stats);
+
+/**
+ * kvm_dsm_get_vcpu_stats - read the DSM faults of each vCPU
+ * @stats: nr_vcpus and faults say where to put the counters, which are
+ * indexed by vcpu_id
+ *
+ * Returns 0 on success, -ENOSYS if the kernel cannot do it, or another
+ * negative errno value.
+ */
+int kvm_dsm_get_vcpu_stats(struct kvm_dsm_vcpu_stats *stats);
 
 int kvm_init_vcpu(CPUState *cpu);
 int kvm_cpu_exec(CPUState *cpu);
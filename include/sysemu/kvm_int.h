@@ -20,6 +20,8 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* the dirty log from the last KVM_GET_DIRTY_LOG, not cleared yet */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
@@ -1,10 +1,13 @@
 #include "qemu/osdep.h"
 #include <linux/kvm.h>
+#include <math.h>
 
 #include "qemu-common.h"
 #include "sysemu/sysemu.h"
 
 #include "qapi/error.h"
+#include "qapi/util.h"
+#include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
@@ -16,77 +19,281 @@
 
 #include "include/exec/memory.h"
 #include "exec/address-spaces.h"
+#include "qemu/mpsc-ring.h"
+#include "qemu/timer.h"
+#include "qemu/rcu.h"
 
 #include "interrupt-router.h"
+#include "router-proto.h"
 
 #define ROUTER_BUFFER_SIZE 1024
-// #define ROUTER_CONNECTION_UNIX_SOCKET
-#define ROUTER_CONNECTION_TCP
 //#define ROUTER_CONNECTION_RDMA
 
-/* Unix socket */
-#define ROUTER_SOCKET_PREFIX "/home/binss/work/qemu-io-router-socket"
+/* Unix socket, in router_socket_dir */
+#define ROUTER_SOCKET_NAME "qemu-io-router-socket"
+
+/* Shared memory, bytes per direction */
+#define ROUTER_SHM_RING_SIZE (1024 * 1024)
 
 /* TCP */
 #define ROUTER_HOST_LOCALHOST "127.0.0.1"
-#define ROUTER_DEFAULT_PORT 40000
-#define ROUTER_MAX_INDEX 63
 #define CPU_INDEX_ANY -1
 
+/* Forwarding queues */
+#define ROUTER_RING_SIZE 1024
+#define ROUTER_MAX_TAGS 256
+#define ROUTER_TAG_NONE 0
+#define ROUTER_ARENA_SIZE (256 * 1024)
+#define ROUTER_WORK_RING_SIZE 1024
+/* writes per COALESCED_MMIO frame */
+#define ROUTER_COALESCED_MAX 64
+/* yields a batching send thread spins for before it sleeps */
+#define ROUTER_BATCH_SPINS 16
+
+/* Clock sync */
+#define ROUTER_CLOCK_SAMPLES 8
+/* standard errors of the fitted drift allowed for in the error bound */
+#define ROUTER_CLOCK_ERR_SIGMAS 3
+/* local kvmclock reads must be this good, else ask QEMU 0 */
+#define ROUTER_CLOCK_MAX_ERROR_NS 250000
+
 /* RDMA */
 //#define ROUTER_RDMA_DEBUG
-static char **router_hosts = NULL;
-static uint32_t router_hosts_num = 0;
+static RouterConn **req_conns = NULL;
 
+#ifdef ROUTER_CONNECTION_RDMA
 static QEMUFile **req_files = NULL;
 static QEMUFile **rsp_files = NULL;
 static QEMUFile **listen_req_files = NULL;
 static QEMUFile **listen_rsp_files = NULL;
+#endif
+
+/* how long the send thread may hold back posted messages to batch them */
+uint64_t router_batch_window_us = 0;
+
+RouterTransport router_transport = ROUTER_TRANSPORT_TCP;
+const char *router_socket_dir = NULL;
+/* how long a shm reader busy-polls before it sleeps on the doorbell */
+uint64_t router_poll_us = 0;
 
 QemuMutex ipi_mutex;
-QemuMutex io_forwarding_mutex;
 
-int parse_cluster_iplist(const char *cluster_iplist)
+/*
+ * A caller blocked on the reply of a forwarded request. It lives on the
+ * caller's stack and is completed by the response thread of the peer.
+ */
+typedef struct RouterRequest {
+    QemuEvent done;
+    uint8_t *buf;
+    uint32_t len;
+    bool failed;
+    int64_t start_ns;
+} RouterRequest;
+
+/*
+ * Per-destination forwarding state. Any vCPU thread may enqueue frames into
+ * @ring; only @send_thread dequeues and writes to @conn, and only
+ * @rsp_thread reads from it, so no lock is held across a network round trip.
+ */
+typedef struct RouterPeer {
+    int index;
+    RouterConn *conn;
+
+    MPSCRing ring;
+    QemuEvent send_ev;
+    QemuThread send_thread;
+    QemuThread rsp_thread;
+    bool closing;
+
+    /* number of frames enqueued and put on the wire, for router_flush */
+    uint64_t queued;
+    uint64_t sent;
+    QemuEvent sent_ev;
+    /* number of writes the frames above took, and their size */
+    uint64_t batches;
+    uint64_t bytes;
+
+    uint32_t next_tag;
+    RouterRequest *pending[ROUTER_MAX_TAGS];
+    /* a tag was freed */
+    QemuEvent tag_ev;
+    /* the reply stream is gone, requests fail at once */
+    bool dead;
+} RouterPeer;
+
+/* One incoming connection and its receive thread */
+struct io_router_loop_arg {
+    RouterConn *conn;
+    QIOChannel *channel;
+    RouterArena arena;
+    /* serializes replies, which come from the I/O workers too */
+    QemuMutex reply_lock;
+};
+
+/* A received frame waiting to be handled by a worker or a vCPU thread */
+typedef struct RouterWork {
+    struct io_router_loop_arg *rx;
+    uint8_t frame[];
+} RouterWork;
+
+/* Handles forwarded device I/O without blocking the receive threads */
+typedef struct RouterWorker {
+    MPSCRing ring;
+    QemuEvent ev;
+    QemuThread thread;
+} RouterWorker;
+
+static RouterWorker *router_workers;
+uint32_t router_io_threads = ROUTER_IO_THREADS_DEFAULT;
+
+typedef struct RouterClockSample {
+    int64_t mid;        /* local time the remote clock was read at */
+    int64_t offset;     /* remote kvmclock - local monotonic clock */
+    int64_t rtt;
+} RouterClockSample;
+
+/* Estimate of the kvmclock of QEMU 0, see kvmclock_fetching() */
+typedef struct RouterClockSync {
+    QemuMutex lock;
+    bool enabled;
+    QemuThread thread;
+    /* posted to stop the thread */
+    QemuSemaphore stop;
+
+    RouterClockSample samples[ROUTER_CLOCK_SAMPLES];
+    int n;
+    int next;
+    uint32_t generation;
+
+    /* the estimate: offset at ref, changing by drift ns per ns */
+    int64_t ref;
+    int64_t offset;
+    int64_t rtt;
+    double drift;
+    /* bound on the error of @drift, from the residuals of the fit */
+    double drift_err;
+
+    uint64_t steps;
+    uint64_t local_reads;
+    uint64_t remote_reads;
+} RouterClockSync;
+
+/*
+ * COALESCED_MMIO frames being filled, one per peer. Only touched by
+ * kvm_flush_coalesced_mmio_buffer(), which runs under the BQL.
+ */
+static RouterFrame **coalesced_frames;
+
+static RouterClockSync router_clock;
+uint64_t router_clock_interval_ms = ROUTER_CLOCK_INTERVAL_DEFAULT;
+
+/* describe each instance to the guest as a NUMA node */
+bool router_numa = true;
+
+/* from this many instances on, broadcasts are relayed over a tree */
+uint32_t router_broadcast_tree = ROUTER_BROADCAST_TREE_DEFAULT;
+
+/* Messages by forward_type; REPLY is counted at index 0 */
+#define ROUTER_MSG_TYPES (EXIT + 1)
+
+typedef struct RouterMsgCounters {
+    uint64_t sent;
+    uint64_t received;
+    /* round trips of the requests that waited for a reply */
+    uint64_t latency_us[ROUTER_LATENCY_BUCKETS];
+} RouterMsgCounters;
+
+static RouterMsgCounters router_msgs[ROUTER_MSG_TYPES];
+/* what router_query_message_stats() returned last time, and when */
+static RouterMsgCounters router_msgs_last[ROUTER_MSG_TYPES];
+static int64_t router_msgs_last_ns;
+
+static const char *const router_msg_names[ROUTER_MSG_TYPES] = {
+    [0] = "reply",
+    [PIO] = "pio",
+    [MMIO] = "mmio",
+    [LAPIC] = "lapic",
+    [SPECIAL_INT] = "special-int",
+    [SIPI] = "sipi",
+    [INIT_LEVEL_DEASSERT] = "init-level-deassert",
+    [FIXED_INT] = "fixed-int",
+    [IOAPIC] = "ioapic",
+    [KVMCLOCK] = "kvmclock",
+    [CLOCK_STEP] = "clock-step",
+    [DEVICE_PLACE] = "device-place",
+    [COALESCED_MMIO] = "coalesced-mmio",
+    [VM_STOP] = "vm-stop",
+    [VM_CONT] = "vm-cont",
+    [MIGRATE] = "migrate",
+    [MIGRATION_STATUS] = "migration-status",
+    [VCPU_OWNER] = "vcpu-owner",
+    [VCPU_STATE] = "vcpu-state",
+    [VCPU_MOVE] = "vcpu-move",
+    [SHUTDOWN] = "shutdown",
+    [RESET] = "reset",
+    [EXIT] = "exit",
+};
+
+static inline void router_count_msg(uint8_t type, bool sent)
 {
-    int ret = 0, ip_num = 0, i;
+    unsigned i = type == REPLY ? 0 : type;
 
-    if (cluster_iplist == NULL) {
-        ret = -EINVAL;
-        goto out;
+    if (i < ROUTER_MSG_TYPES) {
+        atomic_inc(sent ? &router_msgs[i].sent : &router_msgs[i].received);
     }
+}
 
-    for (i = 0; cluster_iplist[i] != '\0'; i++) {
-        if (isspace(cluster_iplist[i]))
-            ip_num++;
-        else if (!(isdigit(cluster_iplist[i]) || cluster_iplist[i] == '.')) {
-            ret = -EINVAL;
-            goto out;
-        }
+static inline void router_count_latency(uint8_t type, int64_t ns)
+{
+    if (type < ROUTER_MSG_TYPES) {
+        atomic_inc(&router_msgs[type].latency_us[
+                   router_latency_bucket(ns / SCALE_US)]);
     }
-    router_hosts_num = ++ip_num;
+}
 
-    router_hosts = (char **)g_malloc0(sizeof(char *) * ip_num);
+intList *router_latency_list(const uint64_t *buckets, int n)
+{
+    intList *list = NULL, *entry;
+    int i = n;
 
-    char *temp_iplist = (char *)g_malloc(strlen(cluster_iplist) + 1);
-    strcpy(temp_iplist, cluster_iplist);
-    char *parse_ip = strtok(temp_iplist, " ");
-    i = 0;
-    while (parse_ip != NULL) {
-        char *ip = (char *)g_malloc(20);
-        strcpy(ip, parse_ip);
-        router_hosts[i++] = ip;
-        parse_ip = strtok(NULL, " ");
+    while (i > 0 && !atomic_read(&buckets[i - 1])) {
+        i--;
     }
-    g_free(temp_iplist);
-
-out:
-    return ret;
+    while (i-- > 0) {
+        entry = g_new0(intList, 1);
+        entry->value = atomic_read(&buckets[i]);
+        entry->next = list;
+        list = entry;
+    }
+    return list;
 }
 
-char **get_cluster_iplist(uint32_t *len)
+static void router_clock_step(uint32_t generation);
+static void router_start_clock(void);
+static void router_stop_clock(void);
+static void router_enqueue(RouterPeer *peer, RouterFrame *frame);
+static inline RouterPeer *router_peer(int index);
+static void router_tree_relay(const RouterWireHdr *hdr);
+
+static RouterPeer *peers = NULL;
+
+int parse_router_transport(const char *transport)
 {
-    *len = router_hosts_num;
-    return router_hosts;
+    Error *err = NULL;
+    int ret;
+
+    if (transport == NULL) {
+        return 0;
+    }
+
+    ret = qapi_enum_parse(RouterTransport_lookup, transport,
+                          ROUTER_TRANSPORT__MAX, -1, &err);
+    if (ret < 0) {
+        error_report_err(err);
+        return -EINVAL;
+    }
+    router_transport = ret;
+    return 0;
 }
 
 int pr_debug_log = 1;
@@ -106,22 +313,6 @@ int pr_debug(const char *format, ...)
 }
 
 
-enum forward_type {
-    PIO = 1,
-    MMIO,
-    LAPIC,
-    SPECIAL_INT,
-    SIPI,
-    INIT_LEVEL_DEASSERT,
-    FIXED_INT,
-    IOAPIC,
-    KVMCLOCK,
-    /* IO_ROUTER_EXIT */
-    SHUTDOWN,
-    RESET,
-    EXIT,
-};
-
 enum rdma_role {
     RDMA_LISTEN,
     RDMA_LISTEN_REVERSE,
@@ -143,128 +334,391 @@ static void kvm_handle_remote_io(uint16_t port, MemTxAttrs attrs, void *data, in
     }
 }
 
-static void *io_router_loop(void *arg)
+/* Reply to a tagged request; the tag lets the requester match replies */
+static void io_router_reply(struct io_router_loop_arg *rx, uint32_t tag,
+                            void *data, uint32_t len)
+{
+    RouterWireHdr hdr;
+    struct iovec iov[2];
+
+    router_hdr_init(&hdr, REPLY, CPU_INDEX_ANY, tag, len);
+    router_count_msg(REPLY, true);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+
+    /* workers and the receive thread may reply on the same connection */
+    qemu_mutex_lock(&rx->reply_lock);
+    rx->conn->writev(rx->conn, iov, 2);
+    qemu_mutex_unlock(&rx->reply_lock);
+}
+
+/* A received frame, copied out of the receive arena */
+static RouterWork *router_work_new(struct io_router_loop_arg *rx,
+                                   RouterWireHdr *hdr)
+{
+    uint32_t size = router_frame_size(hdr);
+    RouterWork *work = g_malloc(sizeof(RouterWork) + size);
+
+    work->rx = rx;
+    memcpy(work->frame, hdr, size);
+    return work;
+}
+
+/*
+ * Device I/O, run by an I/O worker. address_space_rw() takes the iothread
+ * lock by itself for the regions that need it; everything else here needs
+ * it explicitly.
+ */
+static void router_handle_io(RouterWork *work)
+{
+    RouterWireHdr *hdr = (RouterWireHdr *)work->frame;
+    uint8_t *body = router_frame_body(hdr);
+    int cpu_index = le32_to_cpu(hdr->cpu_index);
+    uint32_t tag = le32_to_cpu(hdr->tag);
+    uint32_t len = le32_to_cpu(hdr->len);
+    RouterPioArgs *pio;
+    RouterMmioArgs *mmio;
+    RouterLapicArgs *lapic;
+    RouterIntArgs *ints;
+    RouterCoalescedWrite *write;
+    uint32_t data_len;
+
+    /*
+     * indicate which cpu we are currently operating on, especially
+     * for apic_mem_readl / apic_mem_writel => cpu_get_current_apic
+     */
+    current_cpu = cpu_index != CPU_INDEX_ANY ? qemu_get_cpu(cpu_index) : NULL;
+
+    switch (hdr->type) {
+    case PIO:
+        /* from a vCPU of another instance, we own the device */
+        pio = (RouterPioArgs *)body;
+        data_len = len - sizeof(*pio);
+        kvm_handle_remote_io(le16_to_cpu(pio->port),
+                             router_attrs_from_wire(pio->attrs),
+                             pio + 1, pio->direction, pio->size,
+                             le32_to_cpu(pio->count));
+        if (tag) {
+            /* reads, and writes the sender waits for */
+            io_router_reply(work->rx, tag, pio + 1,
+                            pio->direction == KVM_EXIT_IO_IN ? data_len : 0);
+        }
+        if (pio->direction == KVM_EXIT_IO_OUT && router_local_index() == 0 &&
+            router_broadcast_port(le16_to_cpu(pio->port)) && current_cpu) {
+            /* keep the BARs of every instance in sync, see kvm_handle_io */
+            pio_forwarding(ROUTER_BROADCAST, le16_to_cpu(pio->port),
+                           router_attrs_from_wire(pio->attrs), pio + 1,
+                           pio->direction, pio->size,
+                           le32_to_cpu(pio->count));
+        }
+        break;
+    case MMIO:
+        /* from a vCPU of another instance, we own the device */
+        mmio = (RouterMmioArgs *)body;
+        data_len = len - sizeof(*mmio);
+        address_space_rw(&address_space_memory, le64_to_cpu(mmio->addr),
+                         router_attrs_from_wire(mmio->attrs),
+                         (uint8_t *)(mmio + 1), data_len, mmio->is_write);
+        if (tag) {
+            io_router_reply(work->rx, tag, mmio + 1,
+                            mmio->is_write ? 0 : data_len);
+        }
+        break;
+    case COALESCED_MMIO:
+        for (write = (RouterCoalescedWrite *)body;
+             (uint8_t *)(write + 1) <= body + len; write++) {
+            address_space_rw(&address_space_memory, le64_to_cpu(write->addr),
+                             MEMTXATTRS_UNSPECIFIED, write->data,
+                             MIN(le32_to_cpu(write->len),
+                                 sizeof(write->data)), true);
+        }
+        break;
+    case LAPIC:
+        /* shadow APIC state of a CPU that runs elsewhere */
+        lapic = (RouterLapicArgs *)body;
+        qemu_mutex_lock_iothread();
+        apic_lapic_write(current_cpu, le64_to_cpu(lapic->addr),
+                         le32_to_cpu(lapic->val));
+        qemu_mutex_unlock_iothread();
+        break;
+    case IOAPIC:
+        /* EOI from a vCPU of another instance */
+        ints = (RouterIntArgs *)body;
+        qemu_mutex_lock_iothread();
+        ioapic_eoi_broadcast(le32_to_cpu(ints->arg0));
+        qemu_mutex_unlock_iothread();
+        break;
+    case DEVICE_PLACE:
+        ints = (RouterIntArgs *)body;
+        body[len - 1] = '\0';
+        qemu_mutex_lock_iothread();
+        router_place_device_remote((char *)(ints + 1),
+                                   le32_to_cpu(ints->arg0));
+        qemu_mutex_unlock_iothread();
+        break;
+    case VM_STOP:
+        qemu_mutex_lock_iothread();
+        router_migration_stop();
+        qemu_mutex_unlock_iothread();
+        io_router_reply(work->rx, tag, NULL, 0);
+        break;
+    case VM_CONT:
+        qemu_mutex_lock_iothread();
+        router_migration_cont();
+        qemu_mutex_unlock_iothread();
+        break;
+    case MIGRATE:
+        body[len - 1] = '\0';
+        router_migration_start((char *)body);
+        break;
+    case VCPU_STATE:
+        ints = (RouterIntArgs *)body;
+        qemu_mutex_lock_iothread();
+        ints->arg0 = cpu_to_le32(router_vcpu_arrive(cpu_index,
+                                                    le32_to_cpu(ints->arg0),
+                                                    ints + 1,
+                                                    len - sizeof(*ints)));
+        qemu_mutex_unlock_iothread();
+        ints->arg1 = 0;
+        io_router_reply(work->rx, tag, ints, sizeof(*ints));
+        break;
+    case VCPU_MOVE:
+        ints = (RouterIntArgs *)body;
+        qemu_mutex_lock_iothread();
+        router_vcpu_move_remote(cpu_index, le32_to_cpu(ints->arg0));
+        qemu_mutex_unlock_iothread();
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    current_cpu = NULL;
+}
+
+static void *io_router_worker_thread(void *arg)
+{
+    RouterWorker *worker = arg;
+    RouterWork *work;
+
+    while (1) {
+        qemu_event_reset(&worker->ev);
+        while ((work = mpsc_ring_pop(&worker->ring)) != NULL) {
+            router_handle_io(work);
+            g_free(work);
+        }
+        qemu_event_wait(&worker->ev);
+    }
+    return NULL;
+}
+
+/*
+ * Everything from one source vCPU goes to the same worker, so its posted
+ * writes are done before a later read from it is.
+ */
+static void router_queue_io(RouterWork *work, int cpu_index)
+{
+    RouterWorker *worker;
+
+    worker = &router_workers[(cpu_index == CPU_INDEX_ANY ? 0 : cpu_index) %
+                             router_io_threads];
+    while (!mpsc_ring_push(&worker->ring, work)) {
+        qemu_event_set(&worker->ev);
+        sched_yield();
+    }
+    qemu_event_set(&worker->ev);
+}
+
+/* Interrupt delivery, run by the target vCPU thread */
+static void router_cpu_work(CPUState *cpu, run_on_cpu_data data)
+{
+    RouterWork *work = data.host_ptr;
+    RouterWireHdr *hdr = (RouterWireHdr *)work->frame;
+    RouterLapicArgs *lapic;
+    RouterIntArgs *ints = router_frame_body(hdr);
+    RouterPeer *peer;
+
+    if (!cpu->local && hdr->type != LAPIC) {
+        /*
+         * Queued while the vCPU was moving in, whose state never came, see
+         * router_vcpu_arrive(): it is still run by the instance it was to
+         * leave.
+         */
+        peer = router_peer(router_cpu_owner(cpu->cpu_index));
+        if (peer) {
+            router_enqueue(peer, g_memdup(hdr, router_frame_size(hdr)));
+        }
+        g_free(work);
+        return;
+    }
+
+    switch (hdr->type) {
+    case LAPIC:
+        lapic = router_frame_body(hdr);
+        apic_lapic_write(cpu, le64_to_cpu(lapic->addr),
+                         le32_to_cpu(lapic->val));
+        break;
+    case SPECIAL_INT:
+        /* Any CPU send to target CPUs of a multicast/broadcast of SMI/NMI/INIT */
+        cpu_interrupt(cpu, le32_to_cpu(ints->arg0));
+        break;
+    case SIPI:
+        /* Any CPU send to target CPUs of a multicast/broadcast of SIPI */
+        apic_startup(cpu, le32_to_cpu(ints->arg0));
+        break;
+    case INIT_LEVEL_DEASSERT:
+        /* Any CPU send to target CPUs of a multicast/broadcast of INIT Level De-assert */
+        apic_init_level_deassert(cpu);
+        break;
+    case FIXED_INT:
+        /* Any CPU send to target CPU(s) a lowest-priority/multicast/broadcast interrupt */
+        apic_set_irq_detour(cpu, le32_to_cpu(ints->arg0),
+                            le32_to_cpu(ints->arg1));
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    g_free(work);
+}
+
+/*
+ * An interrupt, or a shadow LAPIC write, for @cpu. The vCPUs this instance
+ * runs, and those moving in, take it from their work queue; shadow writes
+ * for the others go to the I/O workers, and interrupts for a vCPU that has
+ * moved away follow it. The owner is read in the same RCU critical section
+ * that queues the work, see router_vcpu_move().
+ */
+static void router_dispatch_cpu(struct io_router_loop_arg *rx,
+                                RouterWireHdr *hdr, CPUState *cpu)
 {
+    RouterPeer *peer;
+    int owner;
+
+    rcu_read_lock();
+    owner = router_cpu_owner(cpu->cpu_index);
+    if (owner == router_local_index()) {
+        async_run_on_cpu(cpu, router_cpu_work,
+                         RUN_ON_CPU_HOST_PTR(router_work_new(rx, hdr)));
+    } else if (hdr->type == LAPIC) {
+        router_queue_io(router_work_new(rx, hdr), cpu->cpu_index);
+    } else if ((peer = router_peer(owner)) != NULL) {
+        router_enqueue(peer, g_memdup(hdr, router_frame_size(hdr)));
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Demultiplex one received batch. Interrupts go straight to the queue of
+ * the target vCPU, which is kicked; device I/O goes to the I/O workers. So
+ * a peer's slow device accesses never delay its interrupts.
+ */
+static int io_router_dispatch(struct io_router_loop_arg *rx)
+{
+    RouterWireHdr *hdr;
+    RouterPioArgs *pio;
+    RouterMigrationStatusArgs *status;
+    CPUState *cpu;
     uint8_t type;
     int cpu_index;
+    uint32_t len;
+    int ret;
 
-    /* PIO */
-    uint16_t port;
-    MemTxAttrs attrs;
-    int direction;
-    int size;
-    uint32_t count;
-
-    /* MMIO */
-    hwaddr addr;
-    bool is_write;
-    int len;
-
-    /* Interrupts */
-    uint32_t val; /* LAPIC */
-    int mask; /* SPECIAL_INT */
-    int vector_num; /* SIPI & FIXED_INT */
-    int trigger_mode; /* FIXED_INT */
-    int isrv; /* IOAPIC */
-
-    uint64_t kvmclock;
-
-    void *data;
-    struct io_router_loop_arg *argp = (struct io_router_loop_arg *)arg;
-    QEMUFile *req_file = argp->req_file;
-    QEMUFile *rsp_file = argp->rsp_file;
-
-    while(1) {
-        type = qemu_get_be16(req_file);
-        if(!type) {
-            break;
+    RouterClockReply clock;
+
+    while ((ret = router_arena_next(&rx->arena, &hdr)) > 0) {
+        type = hdr->type;
+        cpu_index = le32_to_cpu(hdr->cpu_index);
+        len = le32_to_cpu(hdr->len);
+        if (len < router_args_size(type)) {
+            return -EPROTO;
         }
+        router_count_msg(type, false);
 
-        cpu_index = qemu_get_sbe32(req_file);
-        if (cpu_index != CPU_INDEX_ANY) {
-            current_cpu = qemu_get_cpu(cpu_index);
+        if (le16_to_cpu(hdr->flags) & ROUTER_FLAG_TREE) {
+            if ((le16_to_cpu(hdr->flags) & ROUTER_FLAG_ROOT_MASK) >=
+                qemu_nums) {
+                return -EPROTO;
+            }
+            router_tree_relay(hdr);
         }
+
         switch(type)
         {
             case PIO:
-                /* AP forward to BSP */
-
-                /*
-                 * indicate which cpu we are currently operating on, especially
-                 * for apic_mem_readl / apic_mem_writel => cpu_get_current_apic
-                 */
-                port = qemu_get_be16(req_file);
-                qemu_get_buffer(req_file, (uint8_t *)&attrs, sizeof(attrs));
-                direction = qemu_get_sbe32(req_file);
-                size = qemu_get_sbe32(req_file);
-                count = qemu_get_be32(req_file);
-                data = malloc(count * size);
-                qemu_get_buffer(req_file, data, count * size);
-
-                kvm_handle_remote_io(port, attrs, data, direction, size, count);
-
-                if (direction == KVM_EXIT_IO_IN) {
-                    qemu_put_buffer(rsp_file, data, count * size);
-                    qemu_fflush(rsp_file);
+                pio = router_frame_body(hdr);
+                if (len - sizeof(*pio) != le32_to_cpu(pio->count) * pio->size) {
+                    return -EPROTO;
                 }
-                free(data);
-                break;
-
+                /* fall through */
             case MMIO:
-                /* AP forward to BSP */
-                addr = qemu_get_be64(req_file);
-                qemu_get_buffer(req_file, (uint8_t *)&attrs, sizeof(attrs));
-                len = qemu_get_sbe32(req_file);
-                is_write = qemu_get_sbe32(req_file) ? true : false;
-                data = malloc(len);
-                qemu_get_buffer(req_file, data, len);
-
-                address_space_rw(&address_space_memory, addr, attrs, data, len, is_write);
-
-               if (!is_write) {
-                    qemu_put_buffer(rsp_file, data, len);
-                    qemu_fflush(rsp_file);
+            case IOAPIC:
+                router_queue_io(router_work_new(rx, hdr), cpu_index);
+                break;
+            case DEVICE_PLACE:
+                if (len <= sizeof(RouterIntArgs)) {
+                    return -EPROTO;
                 }
-
-                free(data);
+                router_queue_io(router_work_new(rx, hdr), cpu_index);
+                break;
+            case COALESCED_MMIO:
+                if (len % sizeof(RouterCoalescedWrite)) {
+                    return -EPROTO;
+                }
+                router_queue_io(router_work_new(rx, hdr), cpu_index);
+                break;
+            case MIGRATE:
+                if (!len) {
+                    return -EPROTO;
+                }
+                /* fall through */
+            case VM_STOP:
+            case VM_CONT:
+                router_queue_io(router_work_new(rx, hdr), cpu_index);
+                break;
+            case MIGRATION_STATUS:
+                status = router_frame_body(hdr);
+                router_migration_status(le32_to_cpu(status->instance),
+                                        le32_to_cpu(status->status),
+                                        status->incoming);
+                break;
+            case VCPU_OWNER:
+                router_set_cpu_owner(cpu_index, le32_to_cpu(((RouterIntArgs *)
+                                                             (hdr + 1))->arg0));
+                break;
+            case VCPU_STATE:
+                if (len == sizeof(RouterIntArgs) || !hdr->tag ||
+                    !qemu_get_cpu(cpu_index)) {
+                    return -EPROTO;
+                }
+                /* fall through */
+            case VCPU_MOVE:
+                router_queue_io(router_work_new(rx, hdr), cpu_index);
                 break;
 
             case LAPIC:
-                /* Any CPU broadcast to others */
-                addr = qemu_get_be64(req_file);
-                val = qemu_get_be32(req_file);
-                apic_lapic_write(current_cpu, addr, val);
-                break;
             case SPECIAL_INT:
-                /* Any CPU send to target CPUs of a multicast/broadcast of SMI/NMI/INIT */
-                mask = qemu_get_sbe32(req_file);
-                cpu_interrupt(current_cpu, mask);
-                break;
             case SIPI:
-                /* Any CPU send to target CPUs of a multicast/broadcast of SIPI */
-                vector_num = qemu_get_sbe32(req_file);
-                apic_startup(current_cpu, vector_num);
-                break;
             case INIT_LEVEL_DEASSERT:
-                /* Any CPU send to target CPUs of a multicast/broadcast of INIT Level De-assert */
-                apic_init_level_deassert(current_cpu);
-                break;
             case FIXED_INT:
-                /* Any CPU send to target CPU(s) a lowest-priority/multicast/broadcast interrupt */
-                vector_num = qemu_get_sbe32(req_file);
-                trigger_mode = qemu_get_sbe32(req_file);
-                apic_set_irq_detour(current_cpu, vector_num, trigger_mode);
-                break;
-            case IOAPIC:
-                /* AP forward to BSP */
-                isrv = qemu_get_sbe32(req_file);
-                ioapic_eoi_broadcast(isrv);
+                cpu = qemu_get_cpu(cpu_index);
+                if (!cpu) {
+                    error_report("io router: message %u for unknown CPU %d",
+                                 type, cpu_index);
+                    break;
+                }
+                router_dispatch_cpu(rx, hdr, cpu);
                 break;
 
             case KVMCLOCK:
-                kvmclock = kvmclock_getclock();
-                qemu_put_be64(rsp_file, kvmclock);
-                qemu_fflush(rsp_file);
+                clock.clock = cpu_to_le64(kvmclock_getclock());
+                clock.generation = cpu_to_le32(kvmclock_get_generation());
+                clock.pad = 0;
+                io_router_reply(rx, le32_to_cpu(hdr->tag), &clock,
+                                sizeof(clock));
+                break;
+            case CLOCK_STEP:
+                router_clock_step(le32_to_cpu(((RouterIntArgs *)
+                                               (hdr + 1))->arg0));
                 break;
 
             case SHUTDOWN:
@@ -283,16 +737,100 @@ static void *io_router_loop(void *arg)
         }
 
         if (type >= SHUTDOWN) {
+            return 0;
+        }
+    }
+    return ret ? ret : 1;
+}
+
+static void *io_router_loop(void *arg)
+{
+    struct io_router_loop_arg *rx = (struct io_router_loop_arg *)arg;
+    ssize_t ret;
+
+    /* router_vcpu_move() waits for the readers of the vCPU owners */
+    rcu_register_thread();
+    router_arena_init(&rx->arena, ROUTER_ARENA_SIZE);
+    qemu_mutex_init(&rx->reply_lock);
+
+    while (1) {
+        ret = router_arena_fill(&rx->arena, rx->conn);
+        if (ret <= 0) {
+            break;
+        }
+        ret = io_router_dispatch(rx);
+        if (ret <= 0) {
             break;
         }
     }
-    if (argp->channel) {
-        qio_channel_close(argp->channel, NULL);
+    if (ret < 0) {
+        error_report("io router: connection closed: %s", strerror(-ret));
+    }
+
+    /*
+     * Workers may still reply on this connection, so @rx and its
+     * connection stay around; only the receive buffer goes.
+     */
+    router_arena_destroy(&rx->arena);
+    if (rx->channel) {
+        qio_channel_close(rx->channel, NULL);
     }
     return NULL;
 }
 
 #ifdef ROUTER_CONNECTION_RDMA
+/* RDMA connections come as a pair of simplex QEMUFiles */
+typedef struct RouterConnFile {
+    RouterConn conn;
+    QEMUFile *in;
+    QEMUFile *out;
+} RouterConnFile;
+
+static ssize_t router_conn_file_read(RouterConn *conn, uint8_t *buf,
+                                     size_t min, size_t max)
+{
+    RouterConnFile *c = container_of(conn, RouterConnFile, conn);
+    size_t ret = qemu_get_buffer(c->in, buf, min);
+
+    if (qemu_file_get_error(c->in)) {
+        return qemu_file_get_error(c->in);
+    }
+    return ret;
+}
+
+static int router_conn_file_writev(RouterConn *conn, struct iovec *iov,
+                                   int iovcnt)
+{
+    RouterConnFile *c = container_of(conn, RouterConnFile, conn);
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        qemu_put_buffer(c->out, iov[i].iov_base, iov[i].iov_len);
+    }
+    qemu_fflush(c->out);
+    return qemu_file_get_error(c->out);
+}
+
+static void router_conn_file_shutdown(RouterConn *conn)
+{
+    RouterConnFile *c = container_of(conn, RouterConnFile, conn);
+
+    qemu_file_shutdown(c->in);
+    qemu_file_shutdown(c->out);
+}
+
+static RouterConn *router_conn_new_file(QEMUFile *in, QEMUFile *out)
+{
+    RouterConnFile *c = g_new0(RouterConnFile, 1);
+
+    c->in = in;
+    c->out = out;
+    c->conn.read = router_conn_file_read;
+    c->conn.writev = router_conn_file_writev;
+    c->conn.shutdown = router_conn_file_shutdown;
+    return &c->conn;
+}
+
 /* TODO: Do real router address resolve */
 static int get_rdma_router_address(int target, int role, struct router_address *addr)
 {
@@ -304,11 +842,11 @@ static int get_rdma_router_address(int target, int role, struct router_address *
         return -EINVAL;
     }
 
-    if (target < 0 || target > ROUTER_MAX_INDEX) {
+    if (target < 0 || target >= router_instances()) {
         return -EINVAL;
     }
 
-    qemu_index = local_cpu_start_index / local_cpus;
+    qemu_index = router_local_index();
 
     switch (role) {
         case RDMA_LISTEN:
@@ -332,8 +870,9 @@ static int get_rdma_router_address(int target, int role, struct router_address *
             return -EINVAL;
     }
 
-    sprintf(addr->host, "%s", router_hosts[host]);
-    sprintf(addr->port, "%d", ROUTER_DEFAULT_PORT + port);
+    snprintf(addr->host, sizeof(addr->host), "%s",
+             router_instance_host(host));
+    sprintf(addr->port, "%d", router_instance_port(0) + port);
     addr->target = target;
     return 0;
 }
@@ -347,7 +886,7 @@ static void qemu_io_router_thread_run_rdma(void)
 
     // we build 2x connection since the connection is simplex
     for (i = 0; i < qemu_nums; i++) {
-        if (i == local_cpu_start_index / local_cpus) {
+        if (i == router_local_index()) {
             continue;
         }
         ret = get_rdma_router_address(i, RDMA_LISTEN, &addr);
@@ -372,8 +911,8 @@ static void qemu_io_router_thread_run_rdma(void)
             if (listen_req_files[i]) {
                 struct io_router_loop_arg *arg = (struct io_router_loop_arg *)g_malloc0(sizeof(struct io_router_loop_arg));
                 memset(arg, 0, sizeof(struct io_router_loop_arg));
-                arg->req_file = listen_rsp_files[i];
-                arg->rsp_file = listen_req_files[i];
+                arg->conn = router_conn_new_file(listen_rsp_files[i],
+                                                 listen_req_files[i]);
 
                 QemuThread *thread = g_malloc0(sizeof(QemuThread));
                 qemu_thread_create(thread, "io-router-connection", io_router_loop,
@@ -391,7 +930,7 @@ static void connect_io_router_rdma(void)
     int ret;
     int i = 0;
     int done = 0;
-    int local_index = local_cpu_start_index / local_cpus;
+    int local_index = router_local_index();
 
     // we build 2x connection since the connection is simplex
     for (i = 0; i < qemu_nums; i ++) {
@@ -422,6 +961,8 @@ static void connect_io_router_rdma(void)
         for (i = 0; i < qemu_nums; i++) {
             if (rsp_files[i] && !done_list[i]) {
                 done_list[i] = true;
+                req_conns[i] = router_conn_new_file(rsp_files[i],
+                                                    req_files[i]);
                 done++;
                 printf("connect io router %d done\n", i);
             }
@@ -432,23 +973,84 @@ static void connect_io_router_rdma(void)
 
 #else /* ROUTER_CONNECTION_RDMA */
 
-#ifdef ROUTER_CONNECTION_TCP
-static int get_router_address(int target, struct router_address *addr)
+/* Where QEMU @index listens, for the transport in use */
+static SocketAddress *router_socket_address(int index)
 {
-    if (addr == NULL) {
-        return -EINVAL;
+    SocketAddress *saddr = g_new0(SocketAddress, 1);
+
+    if (router_transport == ROUTER_TRANSPORT_TCP) {
+        if (index < 0 || index >= router_instances() ||
+            !router_instance_host(index)) {
+            qapi_free_SocketAddress(saddr);
+            return NULL;
+        }
+        saddr->type = SOCKET_ADDRESS_KIND_INET;
+        saddr->u.inet.data = g_new(InetSocketAddress, 1);
+        *saddr->u.inet.data = (InetSocketAddress) {
+            .host = g_strdup(router_instance_host(index)),
+            .port = g_strdup_printf("%d", router_instance_port(index)),
+        };
+    } else {
+        /* unix and shm both rendezvous on a Unix socket */
+        saddr->type = SOCKET_ADDRESS_KIND_UNIX;
+        saddr->u.q_unix.data = g_new0(UnixSocketAddress, 1);
+        saddr->u.q_unix.data->path =
+            g_strdup_printf("%s/%s-%d",
+                            router_socket_dir ?: g_get_tmp_dir(),
+                            ROUTER_SOCKET_NAME, index);
     }
+    return saddr;
+}
 
-    if (target < 0 || target > ROUTER_MAX_INDEX) {
-        return -EINVAL;
+/*
+ * shm: the connecting side creates the rings and hands the memfd and the
+ * doorbells over the rendezvous socket; nothing else goes over the socket.
+ */
+static RouterConn *router_shm_connect(QIOChannel *channel, Error **errp)
+{
+    RouterConn *conn;
+    int fds[ROUTER_SHM_NFDS];
+    char c = 0;
+    struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+
+    conn = router_conn_shm_new(ROUTER_SHM_RING_SIZE,
+                               router_poll_us * SCALE_US, fds, errp);
+    if (!conn) {
+        return NULL;
     }
+    if (qio_channel_writev_full(channel, &iov, 1, fds, ROUTER_SHM_NFDS,
+                                errp) < 0) {
+        return NULL;
+    }
+    return conn;
+}
 
-    memcpy(addr->host, router_hosts[target], strlen(router_hosts[target]));
-    sprintf(addr->port, "%d", ROUTER_DEFAULT_PORT + target);
-    addr->target = target;
-    return 0;
+static RouterConn *router_shm_accept(QIOChannel *channel, Error **errp)
+{
+    RouterConn *conn = NULL;
+    int *fds = NULL;
+    size_t nfds = 0;
+    char c;
+    struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+    size_t i;
+
+    if (qio_channel_readv_full(channel, &iov, 1, &fds, &nfds, errp) < 0) {
+        return NULL;
+    }
+    if (nfds == ROUTER_SHM_NFDS) {
+        conn = router_conn_shm_attach(fds, router_poll_us * SCALE_US, errp);
+    } else {
+        error_setg(errp, "io router: expected %d descriptors, got %zu",
+                   ROUTER_SHM_NFDS, nfds);
+    }
+    if (!conn) {
+        for (i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+    }
+    g_free(fds);
+    return conn;
 }
-#endif
 
 static gboolean io_router_accept_connection(QIOChannel *ioc,
                                                  GIOCondition condition,
@@ -472,8 +1074,16 @@ static gboolean io_router_accept_connection(QIOChannel *ioc,
     QemuThread *thread = g_malloc0(sizeof(QemuThread));
     struct io_router_loop_arg *arg = (struct io_router_loop_arg *)g_malloc0(sizeof(struct io_router_loop_arg));
     memset(arg, 0, sizeof(struct io_router_loop_arg));
-    arg->req_file = qemu_fopen_channel_input(channel);
-    arg->rsp_file = qemu_file_get_return_path(arg->req_file);
+    if (router_transport == ROUTER_TRANSPORT_SHM) {
+        arg->conn = router_shm_accept(channel, &err);
+        if (!arg->conn) {
+            error_report_err(err);
+            exit(1);
+        }
+    } else {
+        qio_channel_set_delay(channel, false);
+        arg->conn = router_conn_new_fd(sioc->fd);
+    }
     arg->channel = channel;
 
     qemu_thread_create(thread, "io-router-connection", io_router_loop,
@@ -486,37 +1096,15 @@ static void connect_io_router_single(int index)
 {
     QIOChannel *channel;
     SocketAddress *connect_addr;
+    Error *err = NULL;
 
-    connect_addr = g_new0(SocketAddress, 1);
-
-#ifdef ROUTER_CONNECTION_UNIX_SOCKET
-    char sockpath[30];
-    sprintf(sockpath, "%s-%d", ROUTER_SOCKET_PREFIX, index);
-
-    connect_addr->type = SOCKET_ADDRESS_KIND_UNIX;
-    connect_addr->u.q_unix.data = g_new0(UnixSocketAddress, 1);
-    connect_addr->u.q_unix.data->path = g_strdup(sockpath);
-    printf("connect socket_path: %s\n", sockpath);
-#endif
-
-#ifdef ROUTER_CONNECTION_TCP
-    int ret;
-    struct router_address addr;
-    memset(&addr, 0, sizeof(addr));
-
-    ret = get_router_address(index, &addr);
-    if (ret) {
-        printf("get_router_address failed, ret: %d\n", ret);
+    connect_addr = router_socket_address(index);
+    if (!connect_addr) {
+        printf("get_router_address failed for QEMU %d\n", index);
         return;
     }
-    connect_addr->type = SOCKET_ADDRESS_KIND_INET;
-    connect_addr->u.inet.data = g_new(InetSocketAddress, 1);
-    *connect_addr->u.inet.data = (InetSocketAddress) {
-        .host = g_strdup(addr.host),
-        .port = g_strdup(addr.port), /* NULL == Auto-select */
-    };
-    printf("connecting %s:%s\n", addr.host, addr.port);
-#endif
+    printf("connecting %s transport to QEMU %d\n",
+           RouterTransport_lookup[router_transport], index);
 
     channel = QIO_CHANNEL(qio_channel_socket_new());
     qio_channel_set_name(QIO_CHANNEL(channel), "io-send");
@@ -531,11 +1119,18 @@ static void connect_io_router_single(int index)
         }
         usleep(100000);
     }
+    qapi_free_SocketAddress(connect_addr);
 
-    qio_channel_set_delay(channel, false);
-
-    req_files[index] = qemu_fopen_channel_output(channel);
-    rsp_files[index] = qemu_file_get_return_path(req_files[index]);
+    if (router_transport == ROUTER_TRANSPORT_SHM) {
+        req_conns[index] = router_shm_connect(channel, &err);
+        if (!req_conns[index]) {
+            error_report_err(err);
+            exit(1);
+        }
+    } else {
+        qio_channel_set_delay(channel, false);
+        req_conns[index] = router_conn_new_fd(QIO_CHANNEL_SOCKET(channel)->fd);
+    }
     printf("connecting io router done\n");
 }
 #endif /* ROUTER_CONNECTION_RDMA */
@@ -548,41 +1143,18 @@ static void *qemu_io_router_thread_run(void *arg)
 #ifdef ROUTER_CONNECTION_RDMA
     qemu_io_router_thread_run_rdma();
 #else
-    int ret;
     SocketAddress *listen_addr;
     QIOChannelSocket *lioc;
     Error *local_err = NULL;
-    listen_addr = g_new0(SocketAddress, 1);
-    int index = local_cpu_start_index / local_cpus;
-
-#ifdef ROUTER_CONNECTION_UNIX_SOCKET
-    char sockpath[30];
-    sprintf(sockpath, "%s-%d", ROUTER_SOCKET_PREFIX, index);
-
-    listen_addr->type = SOCKET_ADDRESS_KIND_UNIX;
-    listen_addr->u.q_unix.data = g_new0(UnixSocketAddress, 1);
-    listen_addr->u.q_unix.data->path = g_strdup(sockpath);
-
-    printf("QEMU %d listen on Unix socket %s\n", index, sockpath);
-#endif
-
-#ifdef ROUTER_CONNECTION_TCP
-    struct router_address addr;
-    memset(&addr, 0, sizeof(addr));
+    int index = router_local_index();
 
-    ret = get_router_address(index, &addr);
-    if (ret) {
-        printf("get_router_address failed, ret: %d\n", ret);
+    listen_addr = router_socket_address(index);
+    if (!listen_addr) {
+        printf("get_router_address failed for QEMU %d\n", index);
         return NULL;
     }
-    listen_addr->type = SOCKET_ADDRESS_KIND_INET;
-    listen_addr->u.inet.data = g_new(InetSocketAddress, 1);
-    *listen_addr->u.inet.data = (InetSocketAddress) {
-        .host = g_strdup(addr.host),
-        .port = g_strdup(addr.port), /* NULL == Auto-select */
-    };
-    printf("QEMU %d listen on TCP socket %s:%s\n", index, addr.host, addr.port);
-#endif
+    printf("QEMU %d listen on %s transport\n", index,
+           RouterTransport_lookup[router_transport]);
 
     lioc = qio_channel_socket_new();
     qio_channel_set_name(QIO_CHANNEL(lioc), "io-router-listener-channel");
@@ -612,7 +1184,7 @@ static void connect_io_router(void)
 #ifdef ROUTER_CONNECTION_RDMA
     connect_io_router_rdma();
 #else
-    int index = local_cpu_start_index / local_cpus;
+    int index = router_local_index();
 
     int i;
     for (i = 0; i < qemu_nums; i++) {
@@ -625,340 +1197,1185 @@ static void connect_io_router(void)
 
 }
 
-void disconnect_io_router(void)
+/*
+ * Returns: the tag of @req, or ROUTER_TAG_NONE if @peer is dead. With all
+ * tags in use, waits for a reply to free one.
+ */
+static uint32_t router_alloc_tag(RouterPeer *peer, RouterRequest *req)
 {
-    if (local_cpus == smp_cpus)
-        return;
-
-    QEMUFile *io_connect_file;
-    QEMUFile *io_connect_return_file;
-
+    uint32_t idx;
     int i;
-    for (i = 0; i < qemu_nums; i++) {
-        io_connect_file = req_files[i];
-        io_connect_return_file = rsp_files[i];
 
-        if (io_connect_file && io_connect_return_file) {
-            qemu_file_shutdown(io_connect_file);
-            qemu_file_shutdown(io_connect_return_file);
+    for (;;) {
+        qemu_event_reset(&peer->tag_ev);
+        for (i = 0; i < ROUTER_MAX_TAGS; i++) {
+            idx = atomic_fetch_inc(&peer->next_tag) % ROUTER_MAX_TAGS;
+            if (atomic_cmpxchg(&peer->pending[idx], NULL, req) == NULL) {
+                return idx + 1;
+            }
         }
-        g_free(router_hosts[i]);
+        if (atomic_mb_read(&peer->dead)) {
+            return ROUTER_TAG_NONE;
+        }
+        qemu_event_wait(&peer->tag_ev);
     }
-    g_free(req_files);
-    g_free(rsp_files);
-    g_free(listen_req_files);
-    g_free(listen_rsp_files);
-    g_free(router_hosts);
 }
 
-void start_io_router(void)
+/* Called once, by the response thread, after setting peer->dead */
+static void router_fail_pending(RouterPeer *peer)
 {
-    IORouter router;
-    router.thread_id = -1;
-    int size;
-
-    if (local_cpus == smp_cpus)
-        return;
+    RouterRequest *req;
+    int i;
 
-    qemu_nums = (smp_cpus + local_cpus - 1) / local_cpus;
-    if (router_hosts_num != qemu_nums) {
-        error_report("invalid number of cluster iplist");
-        exit(1);
+    for (i = 0; i < ROUTER_MAX_TAGS; i++) {
+        req = atomic_xchg(&peer->pending[i], NULL);
+        if (req) {
+            req->failed = true;
+            qemu_event_set(&req->done);
+        }
     }
-    printf("QEMU nums: %d, Total CPU nums: %d, CPU per QEMU: %d\n", qemu_nums, smp_cpus, local_cpus);
-
-    size = qemu_nums * sizeof(QEMUFile *);
-    req_files = (QEMUFile **)g_malloc0(size);
-    rsp_files = (QEMUFile **)g_malloc0(size);
-    listen_req_files = (QEMUFile **)g_malloc0(size);
-    listen_rsp_files = (QEMUFile **)g_malloc0(size);
-
-    qemu_mutex_init(&io_forwarding_mutex);
-    qemu_mutex_init(&ipi_mutex);
-
-    qemu_thread_create(&(router.thread), "io-router-listener", qemu_io_router_thread_run,
-                   &router, QEMU_THREAD_JOINABLE);
-
-    connect_io_router();
+    qemu_event_set(&peer->tag_ev);
 }
 
 /*
- * Currently we put all devices on QEMU 0, so we only need to forward PIOs on
- * APs to BSP. (except for PIOs to PCI configuration space)
- * TODO: support the conceptial "Virtual PCI-e Bus". @jinzhang
+ * The only writer of peer->conn. Whatever has piled up in the ring while the
+ * previous batch was on the wire goes out with a single writev(). With
+ * router_batch_window_us set, a batch of posted frames is held back for up
+ * to that long waiting for more, spinning briefly and then sleeping on
+ * send_ev; a frame somebody waits a reply for is never held back.
  */
-void pio_forwarding(uint16_t port, MemTxAttrs attrs, void *data, int direction,
-                          int size, uint32_t count, bool broadcast)
+static void *io_router_send_thread(void *arg)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-
-    QEMUFile *io_connect_file;
-    QEMUFile *io_connect_return_file;
-
-    if (broadcast) {
-        int i;
-        for (i = 0; i < qemu_nums; i++) {
-            io_connect_file = req_files[i];
-            io_connect_return_file = rsp_files[i];
-
-            if (io_connect_file && io_connect_return_file) {
-                qemu_put_be16(io_connect_file, PIO);
-                /*
-                 * indicate which cpu we are currently operating on, especially
-                 * for apic_mem_readl / apic_mem_writel => cpu_get_current_apic
-                 */
-                qemu_put_sbe32(io_connect_file, current_cpu->cpu_index);
-                qemu_put_be16(io_connect_file, port);
-                qemu_put_buffer(io_connect_file, (uint8_t *)&attrs, sizeof(attrs));
-                qemu_put_sbe32(io_connect_file, direction);
-                qemu_put_sbe32(io_connect_file, size);
-                qemu_put_be32(io_connect_file, count);
-                qemu_put_buffer(io_connect_file, data, count * size);
-
-                qemu_fflush(io_connect_file);
-
-                if (direction == KVM_EXIT_IO_IN) {
-                    qemu_get_buffer(io_connect_return_file, data, count * size);
-                }
-
+    RouterPeer *peer = arg;
+    RouterFrame *frames[ROUTER_BATCH_MAX];
+    RouterFrame *frame;
+    RouterBatch batch;
+    int64_t deadline, now;
+    bool sync;
+    int n, i, ret, spins;
+
+    router_batch_init(&batch);
+    while (!atomic_read(&peer->closing)) {
+        qemu_event_reset(&peer->send_ev);
+
+        n = 0;
+        sync = false;
+        deadline = 0;
+        spins = 0;
+        while (1) {
+            while (n < ROUTER_BATCH_MAX &&
+                   (frame = mpsc_ring_pop(&peer->ring)) != NULL) {
+                frames[n++] = frame;
+                router_batch_add(&batch, &frame->hdr);
+                sync |= frame->hdr.tag != ROUTER_TAG_NONE;
+            }
+            if (!n || sync || n == ROUTER_BATCH_MAX ||
+                !router_batch_window_us) {
+                break;
+            }
+            now = get_clock();
+            if (!deadline) {
+                deadline = now + router_batch_window_us * SCALE_US;
+            } else if (now >= deadline) {
+                break;
+            }
+            if (spins < ROUTER_BATCH_SPINS) {
+                spins++;
+                sched_yield();
+                continue;
+            }
+            /* router_enqueue() sets send_ev after pushing a frame */
+            qemu_event_reset(&peer->send_ev);
+            if (mpsc_ring_empty(&peer->ring)) {
+                qemu_event_timedwait(&peer->send_ev, deadline - now);
             }
         }
-    } else {
-        /* @unicast: AP -> BSP (i.e. QEMU[0]) */
-        io_connect_file = req_files[0];
-        io_connect_return_file = rsp_files[0];
-
-        qemu_put_be16(io_connect_file, PIO);
-        /*
-         * indicate which cpu we are currently operating on, especially for
-         * apic_mem_readl / apic_mem_writel => cpu_get_current_apic
-         */
-        qemu_put_sbe32(io_connect_file, current_cpu->cpu_index);
-        qemu_put_be16(io_connect_file, port);
-        qemu_put_buffer(io_connect_file, (uint8_t *)&attrs, sizeof(attrs));
-        qemu_put_sbe32(io_connect_file, direction);
-        qemu_put_sbe32(io_connect_file, size);
-        qemu_put_be32(io_connect_file, count);
-        qemu_put_buffer(io_connect_file, data, count * size);
-
-        qemu_fflush(io_connect_file);
+        if (!n) {
+            qemu_event_wait(&peer->send_ev);
+            continue;
+        }
 
-        if (direction == KVM_EXIT_IO_IN) {
-            qemu_get_buffer(io_connect_return_file, data, count * size);
+        atomic_add(&peer->bytes, batch.bytes);
+        ret = router_batch_send(&batch, peer->conn);
+        if (ret < 0 && !atomic_read(&peer->closing)) {
+            error_report("io router: send to QEMU %d failed: %s",
+                         peer->index, strerror(-ret));
+        }
+        for (i = 0; i < n; i++) {
+            g_free(frames[i]);
         }
+        atomic_inc(&peer->batches);
+        atomic_add(&peer->sent, n);
+        qemu_event_set(&peer->sent_ev);
     }
-
-    qemu_mutex_unlock(&io_forwarding_mutex);
+    return NULL;
 }
 
-/*
- * @unicast: AP -> BSP (i.e. QEMU[0])
- *
- * Currently we put all devices on QEMU 0, so we only need to forward MMIOs on APs to BSP.
- * TODO: support the conceptial "Virtual PCI-e Bus". @jinzhang
+/* The only reader of peer->conn; replies may arrive in any order */
+static void *io_router_rsp_thread(void *arg)
+{
+    RouterPeer *peer = arg;
+    RouterRequest *req;
+    RouterArena arena;
+    RouterWireHdr *hdr;
+    uint32_t tag, len;
+    int ret = 0;
+
+    router_arena_init(&arena, ROUTER_ARENA_SIZE);
+    while (router_arena_fill(&arena, peer->conn) > 0) {
+        while ((ret = router_arena_next(&arena, &hdr)) > 0) {
+            tag = le32_to_cpu(hdr->tag);
+            len = le32_to_cpu(hdr->len);
+            if (hdr->type != REPLY || tag == ROUTER_TAG_NONE ||
+                tag > ROUTER_MAX_TAGS) {
+                error_report("io router: bad reply type %u tag %u "
+                             "from QEMU %d", hdr->type, tag, peer->index);
+                goto out;
+            }
+
+            router_count_msg(REPLY, false);
+            req = atomic_xchg(&peer->pending[tag - 1], NULL);
+            if (!req || req->len != len) {
+                error_report("io router: unexpected reply tag %u len %u "
+                             "from QEMU %d", tag, len, peer->index);
+                if (req) {
+                    req->failed = true;
+                    qemu_event_set(&req->done);
+                }
+                goto out;
+            }
+            memcpy(req->buf, router_frame_body(hdr), len);
+            qemu_event_set(&req->done);
+            qemu_event_set(&peer->tag_ev);
+        }
+        if (ret < 0) {
+            error_report("io router: malformed reply stream from QEMU %d",
+                         peer->index);
+            break;
+        }
+    }
+
+out:
+    router_arena_destroy(&arena);
+    if (!atomic_read(&peer->closing)) {
+        error_report("io router: lost the replies from QEMU %d, requests "
+                     "to it fail from now on", peer->index);
+    }
+    atomic_mb_set(&peer->dead, true);
+    router_fail_pending(peer);
+    return NULL;
+}
+
+static void router_enqueue(RouterPeer *peer, RouterFrame *frame)
+{
+    /* the send thread may free @frame as soon as it is pushed */
+    router_count_msg(frame->hdr.type, true);
+    while (!mpsc_ring_push(&peer->ring, frame)) {
+        /* ring full: make sure the sender is awake and let it catch up */
+        qemu_event_set(&peer->send_ev);
+        sched_yield();
+    }
+    atomic_inc(&peer->queued);
+    qemu_event_set(&peer->send_ev);
+}
+
+/*
+ * Queue @frame to @peer; its @len byte reply will be stored in @buf. If
+ * @peer is dead, @frame is freed and router_call_wait() fails at once.
  */
-void mmio_forwarding(hwaddr addr, MemTxAttrs attrs, uint8_t *data, int len, bool is_write)
+static void router_call_start(RouterPeer *peer, RouterFrame *frame,
+                              RouterRequest *req, void *buf, uint32_t len)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
+    uint32_t tag;
+
+    req->buf = buf;
+    req->len = len;
+    req->failed = false;
+    req->start_ns = get_clock();
+    qemu_event_init(&req->done, false);
+
+    if (!atomic_mb_read(&peer->dead)) {
+        tag = router_alloc_tag(peer, req);
+        if (tag != ROUTER_TAG_NONE && !atomic_mb_read(&peer->dead)) {
+            frame->hdr.tag = cpu_to_le32(tag);
+            router_enqueue(peer, frame);
+            return;
+        }
+        /*
+         * The reply stream died meanwhile: either router_fail_pending()
+         * has seen @req and completes it, or we take it back.
+         */
+        if (tag != ROUTER_TAG_NONE &&
+            atomic_cmpxchg(&peer->pending[tag - 1], req, NULL) != req) {
+            g_free(frame);
+            return;
+        }
+    }
+    req->failed = true;
+    qemu_event_set(&req->done);
+    g_free(frame);
+}
 
-    QEMUFile *io_connect_file = req_files[0];
-    QEMUFile *io_connect_return_file = rsp_files[0];
+/* Returns: 0, or -EIO if @peer did not reply; then @buf is untouched */
+static int router_call_wait(RouterPeer *peer, RouterRequest *req,
+                            uint8_t type)
+{
+    qemu_event_wait(&req->done);
+    qemu_event_destroy(&req->done);
 
-    qemu_put_be16(io_connect_file, MMIO);
-    /*
-     * indicate which cpu we are currently operating on, especially for
-     * apic_mem_readl / apic_mem_writel => cpu_get_current_apic
-     */
-    qemu_put_sbe32(io_connect_file, current_cpu->cpu_index);
-    qemu_put_be64(io_connect_file, addr);
-    qemu_put_buffer(io_connect_file, (uint8_t *)&attrs, sizeof(attrs));
-    qemu_put_sbe32(io_connect_file, len);
-    if (is_write) {
-        qemu_put_sbe32(io_connect_file, 1);
+    if (req->failed) {
+        /* the response thread reported why */
+        return -EIO;
     }
-    else {
-        qemu_put_sbe32(io_connect_file, 0);
+    router_count_latency(type, get_clock() - req->start_ns);
+    return 0;
+}
+
+/*
+ * Queue @frame to @peer and wait for the @len byte reply, which is stored in
+ * @buf. Only the caller waits: frames queued by other vCPUs behind this one
+ * go out without waiting for the reply.
+ */
+static int router_call(RouterPeer *peer, RouterFrame *frame, void *buf,
+                       uint32_t len)
+{
+    RouterRequest req;
+    uint8_t type = frame->hdr.type;
+
+    router_call_start(peer, frame, &req, buf, len);
+    return router_call_wait(peer, &req, type);
+}
+
+/* Wait until everything queued to @peer so far has been written out */
+static void router_flush(RouterPeer *peer)
+{
+    uint64_t target = atomic_read(&peer->queued);
+
+    while (atomic_read(&peer->sent) < target &&
+           !atomic_read(&peer->closing)) {
+        qemu_event_reset(&peer->sent_ev);
+        if (atomic_read(&peer->sent) >= target) {
+            break;
+        }
+        qemu_event_wait(&peer->sent_ev);
     }
-    qemu_put_buffer(io_connect_file, data, len);
+}
+
+static inline RouterPeer *router_peer(int index)
+{
+    RouterPeer *peer = &peers[index];
 
-    qemu_fflush(io_connect_file);
+    return peer->conn ? peer : NULL;
+}
 
+static void router_start_peers(void)
+{
+    RouterPeer *peer;
+    int i;
 
-    if (!is_write) {
-        qemu_get_buffer(io_connect_return_file, data, len);
+    peers = g_new0(RouterPeer, qemu_nums);
+    for (i = 0; i < qemu_nums; i++) {
+        peer = &peers[i];
+        peer->index = i;
+        if (!req_conns[i]) {
+            continue;
+        }
+
+        mpsc_ring_init(&peer->ring, ROUTER_RING_SIZE);
+        qemu_event_init(&peer->send_ev, false);
+        qemu_event_init(&peer->sent_ev, false);
+        qemu_event_init(&peer->tag_ev, false);
+        peer->conn = req_conns[i];
+
+        qemu_thread_create(&peer->send_thread, "io-router-send",
+                           io_router_send_thread, peer,
+                           QEMU_THREAD_JOINABLE);
+        qemu_thread_create(&peer->rsp_thread, "io-router-reply",
+                           io_router_rsp_thread, peer,
+                           QEMU_THREAD_JOINABLE);
     }
+}
 
-    qemu_mutex_unlock(&io_forwarding_mutex);
+static void router_start_workers(void)
+{
+    RouterWorker *worker;
+    int i;
+
+    router_io_threads = MAX(router_io_threads, 1);
+    router_workers = g_new0(RouterWorker, router_io_threads);
+    for (i = 0; i < router_io_threads; i++) {
+        worker = &router_workers[i];
+        mpsc_ring_init(&worker->ring, ROUTER_WORK_RING_SIZE);
+        qemu_event_init(&worker->ev, false);
+        qemu_thread_create(&worker->thread, "io-router-worker",
+                           io_router_worker_thread, worker,
+                           QEMU_THREAD_DETACHED);
+    }
 }
 
-/* @broadcast */
-void lapic_forwarding(int cpu_index, hwaddr addr, uint32_t val)
+void disconnect_io_router(void)
+{
+    if (local_cpus == smp_cpus)
+        return;
+
+    RouterPeer *peer;
+
+    int i;
+    for (i = 0; i < qemu_nums; i++) {
+        peer = router_peer(i);
+
+        if (peer) {
+            router_flush(peer);
+            atomic_set(&peer->closing, true);
+            qemu_event_set(&peer->send_ev);
+            peer->conn->shutdown(peer->conn);
+        }
+    }
+    router_stop_clock();
+    g_free(req_conns);
+#ifdef ROUTER_CONNECTION_RDMA
+    g_free(req_files);
+    g_free(rsp_files);
+    g_free(listen_req_files);
+    g_free(listen_rsp_files);
+#endif
+}
+
+void start_io_router(void)
+{
+    IORouter router;
+    router.thread_id = -1;
+
+    if (local_cpus == smp_cpus)
+        return;
+
+    /* router_topology_init() has checked the addresses */
+    qemu_nums = router_instances();
+    printf("QEMU nums: %d, Total CPU nums: %d, CPU on this QEMU: %d\n", qemu_nums, smp_cpus, local_cpus);
+
+    req_conns = g_new0(RouterConn *, qemu_nums);
+    coalesced_frames = g_new0(RouterFrame *, qemu_nums);
+    router_io_init();
+    router_migration_init();
+    router_vcpu_init();
+#ifdef ROUTER_CONNECTION_RDMA
+    req_files = g_new0(QEMUFile *, qemu_nums);
+    rsp_files = g_new0(QEMUFile *, qemu_nums);
+    listen_req_files = g_new0(QEMUFile *, qemu_nums);
+    listen_rsp_files = g_new0(QEMUFile *, qemu_nums);
+#endif
+
+    qemu_mutex_init(&ipi_mutex);
+    router_start_workers();
+
+    qemu_thread_create(&(router.thread), "io-router-listener", qemu_io_router_thread_run,
+                   &router, QEMU_THREAD_JOINABLE);
+
+    connect_io_router();
+    router_start_peers();
+    router_start_clock();
+}
+
+/* Queue a copy of @frame to every other instance */
+static void router_broadcast_all(RouterFrame *frame)
+{
+    RouterPeer *peer;
+    int i;
+
+    for (i = 0; i < qemu_nums; i++) {
+        peer = router_peer(i);
+        if (peer) {
+            router_enqueue(peer, g_memdup(frame,
+                                          router_frame_size(&frame->hdr)));
+        }
+    }
+    g_free(frame);
+}
+
+/*
+ * The children of this instance in the broadcast tree rooted at @root: the
+ * instances are numbered from the root on, and the children of the Nth are
+ * N * ROUTER_BROADCAST_FANOUT + 1 and the following ones.
+ */
+static int router_tree_children(int root, int *children)
+{
+    int rank = (router_local_index() - root + qemu_nums) % qemu_nums;
+    int child, n = 0;
+
+    for (child = rank * ROUTER_BROADCAST_FANOUT + 1;
+         child <= rank * ROUTER_BROADCAST_FANOUT + ROUTER_BROADCAST_FANOUT &&
+         child < qemu_nums; child++) {
+        children[n++] = (child + root) % qemu_nums;
+    }
+    return n;
+}
+
+/* Queue a copy of the tree broadcast @hdr to our children in the tree */
+static int router_tree_send(const RouterWireHdr *hdr, int *children)
+{
+    int root = le16_to_cpu(hdr->flags) & ROUTER_FLAG_ROOT_MASK;
+    RouterPeer *peer;
+    int i, n;
+
+    n = router_tree_children(root, children);
+    for (i = 0; i < n; i++) {
+        peer = router_peer(children[i]);
+        if (peer) {
+            router_enqueue(peer, g_memdup(hdr, router_frame_size(hdr)));
+        }
+    }
+    return n;
+}
+
+/*
+ * Relay a broadcast that came over the tree, before handling it: EXIT is
+ * handled by leaving, so it must be on the wire first.
+ */
+static void router_tree_relay(const RouterWireHdr *hdr)
+{
+    int children[ROUTER_BROADCAST_FANOUT];
+    int i, n;
+
+    n = router_tree_send(hdr, children);
+    if (hdr->type != EXIT) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (router_peer(children[i])) {
+            router_flush(router_peer(children[i]));
+        }
+    }
+}
+
+/*
+ * Broadcasts that must reach every instance before the unicast messages
+ * and calls sent after them: PCI configuration writes move BARs that the
+ * next MMIO goes to, LAPIC writes update the shadow of a register the next
+ * IPI depends on, a device placement changes where its accesses go, and
+ * a VM_CONT must not arrive after the VM_STOP call that follows it.
+ */
+static bool router_broadcast_ordered(uint8_t type)
+{
+    switch (type) {
+    case PIO:
+    case LAPIC:
+    case DEVICE_PLACE:
+    case VM_CONT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Send @frame to every other instance. In a cluster of at least
+ * router_broadcast_tree instances this only sends it to
+ * ROUTER_BROADCAST_FANOUT of them, which pass it on, so that neither the
+ * sender nor anybody else sends more than that many copies and every
+ * instance has it after O(log N) hops. Relayed broadcasts from one
+ * instance stay in order with each other, but not with its unicast
+ * messages, which take the direct route; so those that are ordered with
+ * unicasts, see router_broadcast_ordered(), always take it too.
+ */
+static void router_broadcast(RouterFrame *frame)
+{
+    int children[ROUTER_BROADCAST_FANOUT];
+
+    if (!router_broadcast_tree || qemu_nums < router_broadcast_tree ||
+        router_broadcast_ordered(frame->hdr.type)) {
+        router_broadcast_all(frame);
+        return;
+    }
+    frame->hdr.flags = cpu_to_le16(ROUTER_FLAG_TREE | router_local_index());
+    router_tree_send(&frame->hdr, children);
+    g_free(frame);
+}
+
+/*
+ * Send @frame to every other instance at once and wait for all replies;
+ * @buf gets the @len byte reply of the last instance.
+ *
+ * Returns: 0, or -EIO if an instance did not reply; then @buf is untouched
+ */
+static int router_broadcast_call(RouterFrame *frame, void *buf, uint32_t len)
+{
+    RouterRequest *reqs = g_new(RouterRequest, qemu_nums);
+    uint8_t *replies = g_malloc(MAX(len, 1) * qemu_nums);
+    uint8_t type = frame->hdr.type;
+    int i, last = -1, ret = 0;
+
+    for (i = 0; i < qemu_nums; i++) {
+        if (router_peer(i)) {
+            router_call_start(router_peer(i),
+                              g_memdup(frame, router_frame_size(&frame->hdr)),
+                              &reqs[i], replies + i * len, len);
+            last = i;
+        }
+    }
+    for (i = 0; i < qemu_nums; i++) {
+        if (router_peer(i) &&
+            router_call_wait(router_peer(i), &reqs[i], type) < 0) {
+            ret = -EIO;
+        }
+    }
+    if (!ret && last >= 0 && len) {
+        memcpy(buf, replies + last * len, len);
+    }
+    g_free(replies);
+    g_free(reqs);
+    g_free(frame);
+    return ret;
+}
+
+/* A frame carrying only the RouterIntArgs of an interrupt */
+static RouterFrame *router_int_frame(uint8_t type, int cpu_index,
+                                     int arg0, int arg1)
+{
+    RouterFrame *frame = router_frame_new(type, cpu_index,
+                                          sizeof(RouterIntArgs));
+    RouterIntArgs *args = (RouterIntArgs *)frame->body;
+
+    args->arg0 = cpu_to_le32(arg0);
+    args->arg1 = cpu_to_le32(arg1);
+    return frame;
+}
+
+/*
+ * @unicast: to the instance that owns the device behind @port, see
+ * router-placement.c
+ * @broadcast: writes to the PCI configuration space, so that every
+ * instance has the same view of the PCI bus
+ */
+void pio_forwarding(int target, uint16_t port, MemTxAttrs attrs, void *data,
+                    int direction, int size, uint32_t count)
+{
+    RouterPeer *peer;
+    RouterFrame *frame;
+    RouterPioArgs *args;
+    uint32_t len = count * size;
+
+    frame = router_frame_new(PIO, current_cpu->cpu_index,
+                             sizeof(*args) + len);
+    args = (RouterPioArgs *)frame->body;
+    args->port = cpu_to_le16(port);
+    args->direction = direction;
+    args->size = size;
+    args->count = cpu_to_le32(count);
+    args->attrs = router_attrs_to_wire(attrs);
+    memcpy(args + 1, data, len);
+
+    if (target != ROUTER_BROADCAST) {
+        peer = router_peer(target);
+        if (direction == KVM_EXIT_IO_IN) {
+            router_io_classify(true, port, false, false);
+            if (router_call(peer, frame, data, len) < 0) {
+                /* as from a port nothing decodes */
+                memset(data, 0xff, len);
+            }
+        } else if (router_io_classify(true, port, true, false) ==
+                   ROUTERIO_SEMANTICS_SYNC) {
+            router_call(peer, frame, NULL, 0);
+        } else {
+            /* posted, the vCPU does not wait for the peer */
+            router_enqueue(peer, frame);
+        }
+        return;
+    }
+
+    if (direction != KVM_EXIT_IO_IN) {
+        router_broadcast(frame);
+        return;
+    }
+    if (router_broadcast_call(frame, data, len) < 0) {
+        memset(data, 0xff, len);
+    }
+}
+
+/* @unicast: to the instance that owns the device behind @addr */
+void mmio_forwarding(int target, hwaddr addr, MemTxAttrs attrs, uint8_t *data,
+                     int len, bool is_write)
+{
+    RouterPeer *peer = router_peer(target);
+    RouterFrame *frame;
+    RouterMmioArgs *args;
+
+    frame = router_frame_new(MMIO, current_cpu->cpu_index,
+                             sizeof(*args) + len);
+    args = (RouterMmioArgs *)frame->body;
+    args->addr = cpu_to_le64(addr);
+    args->attrs = router_attrs_to_wire(attrs);
+    args->is_write = is_write;
+    memset(args->pad, 0, sizeof(args->pad));
+    memcpy(args + 1, data, len);
+
+    if (router_io_classify(false, addr, is_write, false) ==
+        ROUTERIO_SEMANTICS_SYNC || !is_write) {
+        if (router_call(peer, frame, is_write ? NULL : data,
+                        is_write ? 0 : len) < 0 && !is_write) {
+            /* as from an unassigned address */
+            memset(data, 0xff, len);
+        }
+    } else {
+        /* posted, the vCPU does not wait for the peer */
+        router_enqueue(peer, frame);
+    }
+}
+
+/*
+ * @unicast: a write KVM coalesced, to the instance that owns the device.
+ * Writes to the same instance share a frame until coalesced_mmio_flush().
+ */
+void coalesced_mmio_forwarding(int target, hwaddr addr, const void *data,
+                               int len)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file;
+    RouterFrame *frame = coalesced_frames[target];
+    RouterCoalescedWrite *write;
+    uint32_t n;
 
+    router_io_classify(false, addr, true, true);
+    if (!frame) {
+        /*
+         * The ring is shared by all vCPUs, so the writes cannot be tied to
+         * the vCPU that made them; at least keep them in order with the
+         * accesses of the one that flushes.
+         */
+        frame = router_frame_new(COALESCED_MMIO,
+                                 current_cpu ? current_cpu->cpu_index :
+                                 CPU_INDEX_ANY,
+                                 ROUTER_COALESCED_MAX * sizeof(*write));
+        frame->hdr.len = 0;
+        coalesced_frames[target] = frame;
+    }
+
+    n = le32_to_cpu(frame->hdr.len) / sizeof(*write);
+    write = (RouterCoalescedWrite *)frame->body + n;
+    write->addr = cpu_to_le64(addr);
+    write->len = cpu_to_le32(len);
+    write->pad = 0;
+    memset(write->data, 0, sizeof(write->data));
+    memcpy(write->data, data, MIN(len, sizeof(write->data)));
+    frame->hdr.len = cpu_to_le32((n + 1) * sizeof(*write));
+
+    if (n + 1 == ROUTER_COALESCED_MAX) {
+        router_enqueue(router_peer(target), frame);
+        coalesced_frames[target] = NULL;
+    }
+}
+
+/* Post the COALESCED_MMIO frames filled so far */
+void coalesced_mmio_flush(void)
+{
     int i;
+
     for (i = 0; i < qemu_nums; i++) {
-        io_connect_file = req_files[i];
-        if (io_connect_file) {
-            qemu_put_be16(io_connect_file, LAPIC);
-            /*
-             * indicate which cpu we are currently operating on, especially for
-             * apic_mem_readl / apic_mem_writel => cpu_get_current_apic
-             */
-            qemu_put_sbe32(io_connect_file, cpu_index);
-            qemu_put_be64(io_connect_file, addr);
-            qemu_put_be32(io_connect_file, val);
-            qemu_fflush(io_connect_file);
+        if (coalesced_frames[i]) {
+            router_enqueue(router_peer(i), coalesced_frames[i]);
+            coalesced_frames[i] = NULL;
         }
     }
+}
+
+/* @broadcast */
+void lapic_forwarding(int cpu_index, hwaddr addr, uint32_t val)
+{
+    RouterFrame *frame = router_frame_new(LAPIC, cpu_index,
+                                          sizeof(RouterLapicArgs));
+    RouterLapicArgs *args = (RouterLapicArgs *)frame->body;
 
-    qemu_mutex_unlock(&io_forwarding_mutex);
+    args->addr = cpu_to_le64(addr);
+    args->val = cpu_to_le32(val);
+    router_broadcast(frame);
+}
+
+/*
+ * Send @frame to the instance that runs the vCPU it is for. That may be
+ * this one, for a vCPU that is moving in: then it waits in the work queue
+ * of the vCPU until its state is there, see router_vcpu_arrive().
+ */
+static void router_send_cpu(RouterFrame *frame)
+{
+    int cpu_index = le32_to_cpu(frame->hdr.cpu_index);
+    int owner;
+
+    rcu_read_lock();
+    owner = router_cpu_owner(cpu_index);
+    if (owner == router_local_index()) {
+        async_run_on_cpu(qemu_get_cpu(cpu_index), router_cpu_work,
+                         RUN_ON_CPU_HOST_PTR(router_work_new(NULL,
+                                                             &frame->hdr)));
+        g_free(frame);
+    } else {
+        router_enqueue(router_peer(owner), frame);
+    }
+    rcu_read_unlock();
 }
 
 /* @unicast: current CPU -> dest CPU (CPU No. cpu_index) */
 void special_interrupt_forwarding(int cpu_index, int mask)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file = req_files[cpu_index / local_cpus];
-
-    qemu_put_be16(io_connect_file, SPECIAL_INT);
     /* Indicate which CPU we want to forward this interrupt to */
-    qemu_put_sbe32(io_connect_file, cpu_index);
-    qemu_put_sbe32(io_connect_file, mask);
-    qemu_fflush(io_connect_file);
-
-    qemu_mutex_unlock(&io_forwarding_mutex);
+    router_send_cpu(router_int_frame(SPECIAL_INT, cpu_index, mask, 0));
 }
 
 /* @unicast: current CPU -> dest CPU (CPU No. cpu_index) */
 void startup_forwarding(int cpu_index, int vector_num)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file = req_files[cpu_index / local_cpus];
-
-    qemu_put_be16(io_connect_file, SIPI);
     /* Indicate which CPU we want to forward this interrupt to */
-    qemu_put_sbe32(io_connect_file, cpu_index);
-    qemu_put_sbe32(io_connect_file, vector_num);
-    qemu_fflush(io_connect_file);
-
-    qemu_mutex_unlock(&io_forwarding_mutex);
+    router_send_cpu(router_int_frame(SIPI, cpu_index, vector_num, 0));
 }
 
 /* @unicast: current CPU -> dest CPU (CPU No. cpu_index) */
 void init_level_deassert_forwarding(int cpu_index)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file = req_files[cpu_index / local_cpus];
-
-    qemu_put_be16(io_connect_file, INIT_LEVEL_DEASSERT);
     /* Indicate which CPU we want to forward this interrupt to */
-    qemu_put_sbe32(io_connect_file, cpu_index);
-    qemu_fflush(io_connect_file);
-
-    qemu_mutex_unlock(&io_forwarding_mutex);
+    router_send_cpu(router_frame_new(INIT_LEVEL_DEASSERT, cpu_index, 0));
 }
 
 /* @unicast: current CPU -> dest CPU (CPU No. cpu_index) */
 void irq_forwarding(int cpu_index, int vector_num, int trigger_mode)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file = req_files[cpu_index / local_cpus];
-
-    qemu_put_be16(io_connect_file, FIXED_INT);
     /* Indicate which CPU we want to forward this interrupt to */
-    qemu_put_sbe32(io_connect_file, cpu_index);
-    qemu_put_sbe32(io_connect_file, vector_num);
-    qemu_put_sbe32(io_connect_file, trigger_mode);
-    qemu_fflush(io_connect_file);
-
-    qemu_mutex_unlock(&io_forwarding_mutex);
+    router_send_cpu(router_int_frame(FIXED_INT, cpu_index, vector_num,
+                                     trigger_mode));
 }
 
-/* @unicast: AP -> BSP (i.e. QEMU[0]) */
+/*
+ * @multicast: to every instance that owns devices, including this one,
+ * since the IOAPIC of each of them may be waiting for this EOI
+ */
 void eoi_forwarding(int isrv)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file = req_files[0];
+    int i;
 
-    qemu_put_be16(io_connect_file, IOAPIC);
-    qemu_put_sbe32(io_connect_file, CPU_INDEX_ANY);
-    qemu_put_sbe32(io_connect_file, isrv);
-    qemu_fflush(io_connect_file);
+    for (i = 0; i < qemu_nums; i++) {
+        if (!router_device_owner(i)) {
+            continue;
+        }
+        if (i == router_local_index()) {
+            ioapic_eoi_broadcast(isrv);
+        } else {
+            router_enqueue(router_peer(i),
+                           router_int_frame(IOAPIC, CPU_INDEX_ANY, isrv, 0));
+        }
+    }
+}
 
-    qemu_mutex_unlock(&io_forwarding_mutex);
+/* @broadcast */
+void device_place_forwarding(const char *id, int instance)
+{
+    size_t len = strlen(id) + 1;
+    RouterFrame *frame = router_frame_new(DEVICE_PLACE, CPU_INDEX_ANY,
+                                          sizeof(RouterIntArgs) + len);
+    RouterIntArgs *args = (RouterIntArgs *)frame->body;
+
+    args->arg0 = cpu_to_le32(instance);
+    args->arg1 = 0;
+    memcpy(args + 1, id, len);
+    router_broadcast(frame);
 }
 
 /* @broadcast */
 void shutdown_forwarding(void)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file;
+    router_broadcast(router_frame_new(SHUTDOWN, CPU_INDEX_ANY, 0));
+}
+
+/* @broadcast */
+void reset_forwarding(void)
+{
+    router_broadcast(router_frame_new(RESET, CPU_INDEX_ANY, 0));
+}
 
+/* @broadcast */
+void exit_forwarding(void)
+{
     int i;
+
+    router_broadcast(router_frame_new(EXIT, CPU_INDEX_ANY, 0));
+
+    /* the caller exits right away, so make sure the message is out */
     for (i = 0; i < qemu_nums; i++) {
-        io_connect_file = req_files[i];
-        if (io_connect_file) {
-            qemu_put_be16(io_connect_file, SHUTDOWN);
-            qemu_put_sbe32(io_connect_file, CPU_INDEX_ANY);
-            qemu_fflush(io_connect_file);
+        if (router_peer(i)) {
+            router_flush(router_peer(i));
         }
     }
+}
 
-    qemu_mutex_unlock(&io_forwarding_mutex);
+/* @broadcast: pause every other instance, and wait until they are */
+void vm_stop_forwarding(void)
+{
+    router_broadcast_call(router_frame_new(VM_STOP, CPU_INDEX_ANY, 0),
+                          NULL, 0);
 }
 
 /* @broadcast */
-void reset_forwarding(void)
+void vm_cont_forwarding(void)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file;
+    router_broadcast(router_frame_new(VM_CONT, CPU_INDEX_ANY, 0));
+}
 
-    int i;
-    for (i = 0; i < qemu_nums; i++) {
-        io_connect_file = req_files[i];
-        if (io_connect_file) {
-            qemu_put_be16(io_connect_file, RESET);
-            qemu_put_sbe32(io_connect_file, CPU_INDEX_ANY);
-            qemu_fflush(io_connect_file);
-        }
+/* @unicast */
+void migrate_forwarding(int instance, const char *uri)
+{
+    size_t len = strlen(uri) + 1;
+    RouterFrame *frame = router_frame_new(MIGRATE, CPU_INDEX_ANY, len);
+
+    memcpy(frame->body, uri, len);
+    router_enqueue(router_peer(instance), frame);
+}
+
+/* @unicast: to QEMU 0 */
+void migration_status_forwarding(int status, bool incoming)
+{
+    RouterFrame *frame;
+    RouterMigrationStatusArgs *args;
+
+    if (!peers || !router_peer(0)) {
+        return;
     }
+    frame = router_frame_new(MIGRATION_STATUS, CPU_INDEX_ANY,
+                             sizeof(RouterMigrationStatusArgs));
+    args = (RouterMigrationStatusArgs *)frame->body;
+    args->instance = cpu_to_le32(router_local_index());
+    args->status = cpu_to_le32(status);
+    args->incoming = incoming;
+    memset(args->pad, 0, sizeof(args->pad));
+    router_enqueue(router_peer(0), frame);
+}
 
-    qemu_mutex_unlock(&io_forwarding_mutex);
+/*
+ * @broadcast: @instance runs vCPU @cpu_index from now on. Sent directly,
+ * so that it gets to @instance before the state of the vCPU does.
+ */
+void vcpu_owner_forwarding(int cpu_index, int instance)
+{
+    router_broadcast_all(router_int_frame(VCPU_OWNER, cpu_index, instance,
+                                          0));
 }
 
-/* @broadcast */
-void exit_forwarding(void)
+/*
+ * @unicast: the state of vCPU @cpu_index, to the instance that runs it now
+ *
+ * Returns: 0 once @instance runs the vCPU, or a negative errno
+ */
+int vcpu_state_forwarding(int cpu_index, int instance, const void *state,
+                          uint32_t len)
+{
+    RouterFrame *frame = router_frame_new(VCPU_STATE, cpu_index,
+                                          sizeof(RouterIntArgs) + len);
+    RouterIntArgs *args = (RouterIntArgs *)frame->body;
+    RouterIntArgs reply;
+    int ret;
+
+    args->arg0 = cpu_to_le32(router_local_index());
+    args->arg1 = 0;
+    memcpy(args + 1, state, len);
+    ret = router_call(router_peer(instance), frame, &reply, sizeof(reply));
+    return ret < 0 ? ret : (int32_t)le32_to_cpu(reply.arg0);
+}
+
+/* @unicast: to the instance that runs vCPU @cpu_index */
+void vcpu_move_forwarding(int cpu_index, int instance)
+{
+    router_enqueue(router_peer(router_cpu_owner(cpu_index)),
+                   router_int_frame(VCPU_MOVE, cpu_index, instance, 0));
+}
+
+/* @broadcast: QEMU 0 has set its kvmclock to @generation */
+void kvmclock_step_forwarding(uint32_t generation)
+{
+    router_broadcast(router_int_frame(CLOCK_STEP, CPU_INDEX_ANY,
+                                      generation, 0));
+}
+
+/*
+ * Clock sync
+ *
+ * Instances other than QEMU 0 keep an estimate of the kvmclock of QEMU 0 as
+ * an offset from their own monotonic clock, fed by periodic NTP-style
+ * samples: the request goes out at t0, the reply comes back at t1 and the
+ * remote clock is assumed to have been read at (t0 + t1) / 2, with an
+ * error of at most (t1 - t0) / 2. The sample with the smallest round trip
+ * gives the offset; a least squares fit over all samples gives the drift,
+ * and the scatter of the samples around the fit how far off it may be.
+ */
+static void router_clock_reset(void)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
-    QEMUFile *io_connect_file;
+    router_clock.n = 0;
+    router_clock.next = 0;
+    router_clock.drift = 0;
+    router_clock.drift_err = 0;
+}
 
+/* Recompute the estimate from the samples; called with the lock held */
+static void router_clock_update(void)
+{
+    RouterClockSample *best = NULL, *sample;
+    double mean_t = 0, mean_o = 0, stt = 0, sto = 0, srr = 0, dt, r, sigma;
     int i;
-    for (i = 0; i < qemu_nums; i++) {
-        io_connect_file = req_files[i];
-        if (io_connect_file) {
-            qemu_put_be16(io_connect_file, EXIT);
-            qemu_put_sbe32(io_connect_file, CPU_INDEX_ANY);
-            qemu_fflush(io_connect_file);
+
+    for (i = 0; i < router_clock.n; i++) {
+        sample = &router_clock.samples[i];
+        if (!best || sample->rtt < best->rtt) {
+            best = sample;
         }
+        mean_t += sample->mid - router_clock.samples[0].mid;
+        mean_o += sample->offset - router_clock.samples[0].offset;
+    }
+    router_clock.ref = best->mid;
+    router_clock.offset = best->offset;
+    router_clock.rtt = best->rtt;
+
+    if (router_clock.n < 2) {
+        return;
+    }
+    mean_t /= router_clock.n;
+    mean_o /= router_clock.n;
+    for (i = 0; i < router_clock.n; i++) {
+        sample = &router_clock.samples[i];
+        dt = sample->mid - router_clock.samples[0].mid - mean_t;
+        stt += dt * dt;
+        sto += dt * (sample->offset - router_clock.samples[0].offset - mean_o);
+    }
+    if (!stt) {
+        router_clock.drift = 0;
+        router_clock.drift_err = 0;
+        return;
     }
+    router_clock.drift = sto / stt;
+
+    for (i = 0; i < router_clock.n; i++) {
+        sample = &router_clock.samples[i];
+        dt = sample->mid - router_clock.samples[0].mid - mean_t;
+        r = sample->offset - router_clock.samples[0].offset - mean_o -
+            router_clock.drift * dt;
+        srr += r * r;
+    }
+    /*
+     * Two samples always fit exactly, and a few may happen to: no sample
+     * is known better than half the best round trip.
+     */
+    sigma = router_clock.n > 2 ? sqrt(srr / (router_clock.n - 2)) : 0;
+    sigma = MAX(sigma, best->rtt / 2.0);
+    router_clock.drift_err = ROUTER_CLOCK_ERR_SIGMAS * sigma / sqrt(stt);
+}
+
+/* Error bound of a read served locally at @now; called with the lock held */
+static int64_t router_clock_error(int64_t now)
+{
+    double err;
+
+    /* a single sample says nothing about the drift */
+    if (router_clock.n < 2 || !router_clock.drift_err) {
+        return INT64_MAX;
+    }
+    err = router_clock.rtt / 2 +
+          llabs(now - router_clock.ref) * router_clock.drift_err;
+    return err < INT64_MAX ? (int64_t)err : INT64_MAX;
+}
+
+static int64_t router_clock_predict(int64_t now)
+{
+    return router_clock.offset + router_clock.drift * (now - router_clock.ref);
+}
 
-    qemu_mutex_unlock(&io_forwarding_mutex);
+/*
+ * One round trip to QEMU 0; stores its kvmclock as of now in @kvmclock.
+ * Returns: 0, or -EIO if QEMU 0 did not reply
+ */
+static int router_clock_sample(uint64_t *kvmclock)
+{
+    RouterFrame *frame = router_frame_new(KVMCLOCK, CPU_INDEX_ANY, 0);
+    RouterClockReply reply;
+    RouterClockSample sample;
+    uint32_t generation;
+    int64_t t0, t1;
+    uint64_t clock;
+
+    memset(&reply, 0, sizeof(reply));
+    t0 = get_clock();
+    if (router_call(router_peer(0), frame, &reply, sizeof(reply)) < 0) {
+        return -EIO;
+    }
+    t1 = get_clock();
+
+    clock = le64_to_cpu(reply.clock);
+    generation = le32_to_cpu(reply.generation);
+    sample.mid = t0 + (t1 - t0) / 2;
+    sample.offset = clock - sample.mid;
+    sample.rtt = t1 - t0;
+
+    qemu_mutex_lock(&router_clock.lock);
+    if (generation != router_clock.generation) {
+        router_clock_reset();
+        router_clock.generation = generation;
+    } else if (router_clock_error(sample.mid) != INT64_MAX &&
+               llabs(sample.offset - router_clock_predict(sample.mid)) >
+               router_clock_error(sample.mid) + sample.rtt / 2) {
+        /* the remote clock jumped without telling us */
+        router_clock_reset();
+        router_clock.steps++;
+    }
+    if (router_clock.n < ROUTER_CLOCK_SAMPLES) {
+        router_clock.n++;
+    }
+    router_clock.samples[router_clock.next] = sample;
+    router_clock.next = (router_clock.next + 1) % ROUTER_CLOCK_SAMPLES;
+    router_clock_update();
+    qemu_mutex_unlock(&router_clock.lock);
+
+    if (kvmclock) {
+        *kvmclock = clock + (t1 - t0) / 2;
+    }
+    return 0;
 }
 
+/* CLOCK_STEP: samples taken before QEMU 0 set its clock are worthless */
+static void router_clock_step(uint32_t generation)
+{
+    qemu_mutex_lock(&router_clock.lock);
+    if (generation != router_clock.generation) {
+        router_clock_reset();
+        router_clock.generation = generation;
+        router_clock.steps++;
+    }
+    qemu_mutex_unlock(&router_clock.lock);
+}
+
+static void *router_clock_thread(void *arg)
+{
+    int ms = MIN(router_clock_interval_ms, INT_MAX);
+
+    while (qemu_sem_timedwait(&router_clock.stop, ms) < 0) {
+        router_clock_sample(NULL);
+    }
+    return NULL;
+}
+
+static void router_start_clock(void)
+{
+    qemu_mutex_init(&router_clock.lock);
+    if (local_cpu_start_index == 0 || !router_clock_interval_ms) {
+        return;
+    }
+
+    router_clock.enabled = true;
+    qemu_sem_init(&router_clock.stop, 0);
+    router_clock_sample(NULL);
+    qemu_thread_create(&router_clock.thread, "io-router-clock",
+                       router_clock_thread, NULL, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Called once the connections are shut down, so that a sample in flight
+ * fails instead of waiting for its reply.
+ */
+static void router_stop_clock(void)
+{
+    if (!router_clock.enabled) {
+        return;
+    }
+    qemu_sem_post(&router_clock.stop);
+    qemu_thread_join(&router_clock.thread);
+    qemu_sem_destroy(&router_clock.stop);
+
+    qemu_mutex_lock(&router_clock.lock);
+    router_clock.enabled = false;
+    qemu_mutex_unlock(&router_clock.lock);
+}
+
+/*
+ * Read the kvmclock of QEMU 0. Served from the local estimate while that is
+ * good to ROUTER_CLOCK_MAX_ERROR_NS, otherwise with a round trip.
+ */
 void kvmclock_fetching(uint64_t *kvmclock)
 {
-    qemu_mutex_lock(&io_forwarding_mutex);
+    int64_t now = get_clock();
+
+    qemu_mutex_lock(&router_clock.lock);
+    if (router_clock.enabled &&
+        router_clock_error(now) <= ROUTER_CLOCK_MAX_ERROR_NS) {
+        *kvmclock = now + router_clock_predict(now);
+        router_clock.local_reads++;
+        qemu_mutex_unlock(&router_clock.lock);
+        return;
+    }
+    router_clock.remote_reads++;
+    qemu_mutex_unlock(&router_clock.lock);
+
+    if (router_clock_sample(kvmclock) < 0) {
+        /* QEMU 0 is gone, the estimate is the best there is */
+        qemu_mutex_lock(&router_clock.lock);
+        *kvmclock = now + router_clock_predict(now);
+        qemu_mutex_unlock(&router_clock.lock);
+    }
+}
 
-    QEMUFile *io_connect_file = req_files[0];
-    QEMUFile *io_connect_return_file = rsp_files[0];
+RouterClockInfo *qmp_query_router_clock(Error **errp)
+{
+    RouterClockInfo *info = g_new0(RouterClockInfo, 1);
+    int64_t now = get_clock();
 
-    qemu_put_be16(io_connect_file, KVMCLOCK);
-    qemu_put_sbe32(io_connect_file, CPU_INDEX_ANY);
-    qemu_fflush(io_connect_file);
+    if (!peers) {
+        /* not a distributed VM */
+        return info;
+    }
+
+    qemu_mutex_lock(&router_clock.lock);
+    info->enabled = router_clock.enabled;
+    info->samples = router_clock.n;
+    if (router_clock.n) {
+        info->offset = router_clock_predict(now);
+        info->drift = router_clock.drift * NANOSECONDS_PER_SECOND;
+        info->error = router_clock_error(now);
+        info->rtt = router_clock.rtt;
+    }
+    info->generation = router_clock.generation;
+    info->steps = router_clock.steps;
+    info->local_reads = router_clock.local_reads;
+    info->remote_reads = router_clock.remote_reads;
+    qemu_mutex_unlock(&router_clock.lock);
 
-    *kvmclock = qemu_get_be64(io_connect_return_file);
-    qemu_mutex_unlock(&io_forwarding_mutex);
+    return info;
 }
 
+RouterMessageStatsList *router_query_message_stats(void)
+{
+    RouterMessageStatsList *head = NULL, *entry;
+    RouterMessageStats *stats;
+    RouterMsgCounters now;
+    int64_t ns = get_clock();
+    int64_t elapsed = ns - router_msgs_last_ns;
+    int i;
+
+    for (i = ROUTER_MSG_TYPES - 1; i >= 0; i--) {
+        now.sent = atomic_read(&router_msgs[i].sent);
+        now.received = atomic_read(&router_msgs[i].received);
+        memset(now.latency_us, 0, sizeof(now.latency_us));
+        if (!router_msg_names[i] || (!now.sent && !now.received)) {
+            continue;
+        }
+
+        stats = g_new0(RouterMessageStats, 1);
+        stats->type = g_strdup(router_msg_names[i]);
+        stats->sent = now.sent;
+        stats->received = now.received;
+        stats->latency_us = router_latency_list(router_msgs[i].latency_us,
+                                                ROUTER_LATENCY_BUCKETS);
+        if (router_msgs_last_ns && elapsed > 0) {
+            stats->sent_rate = muldiv64(now.sent - router_msgs_last[i].sent,
+                                        NANOSECONDS_PER_SECOND, elapsed);
+            stats->received_rate = muldiv64(now.received -
+                                            router_msgs_last[i].received,
+                                            NANOSECONDS_PER_SECOND, elapsed);
+        }
+        router_msgs_last[i] = now;
+
+        entry = g_new0(RouterMessageStatsList, 1);
+        entry->value = stats;
+        entry->next = head;
+        head = entry;
+    }
+    router_msgs_last_ns = ns;
+    return head;
+}
@@ -2,16 +2,142 @@
 #define INTERRUPT_ROUTER_H
 
 #include "qemu/thread.h"
+#include "qemu/host-utils.h"
 #include "exec/memattrs.h"
 #include "io/channel-socket.h"
+#include "qapi-types.h"
+#include "hw/qdev-core.h"
+#include "sysemu/sysemu.h"
 
 extern QemuMutex ipi_mutex;
 extern int pr_debug_log;
+extern uint64_t router_batch_window_us;
+extern RouterTransport router_transport;
+extern const char *router_socket_dir;
+extern uint64_t router_poll_us;
+extern uint32_t router_io_threads;
+
+#define ROUTER_IO_THREADS_DEFAULT 4
+
+extern uint64_t router_clock_interval_ms;
+
+#define ROUTER_CLOCK_INTERVAL_DEFAULT 1000
+
+extern bool router_numa;
+extern uint32_t router_broadcast_tree;
+
+/* clusters of at least this many instances relay broadcasts over a tree */
+#define ROUTER_BROADCAST_TREE_DEFAULT 16
+#define ROUTER_BROADCAST_FANOUT 4
+
+int parse_router_transport(const char *transport);
+
+int pr_debug(const char *format, ...);
+
+#define ROUTER_BROADCAST -1
+
+#define ROUTER_DEFAULT_PORT 40000
+#define ROUTER_MAX_INSTANCES 256
+
+/*
+ * The instances of the VM, the vCPUs they start with and their addresses,
+ * see router-topology.c. router_topology_init() takes -local-cpu, or the
+ * topology file, and sets local_cpus and local_cpu_start_index.
+ */
+extern const char *router_topology_file;
+extern int router_topology_index;
+extern int router_index;
 
 int parse_cluster_iplist(const char *cluster_iplist);
 char **get_cluster_iplist(uint32_t *len);
+bool router_topology_init(Error **errp);
+int router_instances(void);
+int router_cpu_home(int cpu_index);
+const char *router_instance_host(int instance);
+int router_instance_port(int instance);
 
-int pr_debug(const char *format, ...);
+/* index of this instance, QEMU 0 is the one with the BSP */
+static inline int router_local_index(void)
+{
+    return router_index;
+}
+
+/*
+ * PIO writes that QEMU 0 broadcasts: the PCI configuration space (0xCF8,
+ * 0xCFC, 0xCFE) and the vapic port (126), see kvm_handle_io()
+ */
+static inline bool router_broadcast_port(uint16_t port)
+{
+    return port == 0xCF8 || port == 0xCFC || port == 0xCFE || port == 126;
+}
+
+/* Device placement, see router-placement.c */
+int router_io_owner(bool pio, uint64_t addr);
+bool router_device_owner(int instance);
+void router_place_device(DeviceState *dev, int instance, Error **errp);
+void router_place_device_remote(const char *id, int instance);
+
+/*
+ * Forwarded accesses, see router-io.c. Classify an access by the write
+ * semantics of its MemoryRegion and count it; @coalesced is for writes
+ * taken from the KVM coalesced MMIO ring.
+ */
+void router_io_init(void);
+RouterIOSemantics router_io_classify(bool pio, hwaddr addr, bool is_write,
+                                     bool coalesced);
+
+/*
+ * Coordinated migration of the whole distributed VM, see
+ * router-migration.c. The hooks are called by the migration code and the
+ * router; router_migration_sends_state() says whether the vmstate section
+ * of @opaque is part of this instance's migration stream.
+ */
+void router_migration_init(void);
+void router_migration_stop(void);
+void router_migration_cont(void);
+void router_migration_start(const char *uri);
+void router_migration_status(int instance, int status, bool incoming);
+void router_migration_set_state(int status, bool incoming);
+bool router_migration_sends_state(void *opaque);
+bool router_migration_defer_start(void);
+
+/*
+ * Moving vCPUs between instances, see router-vcpu.c. router_cpu_owner()
+ * is the instance that runs a vCPU, or that it is moving to; callers that
+ * queue work for the vCPU based on it do both under rcu_read_lock().
+ */
+void router_vcpu_init(void);
+int router_cpu_owner(int cpu_index);
+void router_set_cpu_owner(int cpu_index, int instance);
+int router_vcpu_arrive(int cpu_index, int from, const void *state,
+                       uint32_t len);
+void router_vcpu_move_remote(int cpu_index, int instance);
+
+/*
+ * A placement policy returns the instance that @cpu, one of the vCPUs of
+ * this instance, should run on, e.g. the one that owns most of its working
+ * set. It is asked about every vCPU once a second, and the first one that
+ * should run elsewhere is moved there.
+ */
+typedef int (*RouterVcpuPolicy)(CPUState *cpu, void *opaque);
+void router_vcpu_set_policy(RouterVcpuPolicy policy, void *opaque);
+
+/*
+ * Messages sent and received by type, with their rates since the previous
+ * call, for query-dsm-stats
+ */
+RouterMessageStatsList *router_query_message_stats(void);
+
+/* latency histograms: bucket N counts [2^(N-1), 2^N) microseconds */
+#define ROUTER_LATENCY_BUCKETS 24
+
+static inline int router_latency_bucket(uint64_t us)
+{
+    return MIN(us ? 64 - clz64(us) : 0, ROUTER_LATENCY_BUCKETS - 1);
+}
+
+/* The first @n buckets of a latency histogram, up to the last one used */
+intList *router_latency_list(const uint64_t *buckets, int n);
 
 typedef struct {
     Object parent_obj;
@@ -19,16 +145,11 @@ typedef struct {
     int thread_id;
 } IORouter;
 
-struct io_router_loop_arg {
-    QEMUFile *req_file;
-    QEMUFile *rsp_file;
-    QIOChannel *channel;
-};
-
 void start_io_router(void);
 
-void mmio_forwarding(hwaddr addr, MemTxAttrs attrs, uint8_t *buf, int len, bool is_write);
-void pio_forwarding(uint16_t port, MemTxAttrs attrs, void *data, int direction, int size, uint32_t count, bool broadcast);
+/* @target: the instance that owns the device; PIO also takes ROUTER_BROADCAST */
+void mmio_forwarding(int target, hwaddr addr, MemTxAttrs attrs, uint8_t *buf, int len, bool is_write);
+void pio_forwarding(int target, uint16_t port, MemTxAttrs attrs, void *data, int direction, int size, uint32_t count);
 void lapic_forwarding(int cpu_index, hwaddr addr, uint32_t val);
 void special_interrupt_forwarding(int cpu_index, int mask);
 void startup_forwarding(int cpu_index, int vector_num);
@@ -39,6 +160,19 @@ void shutdown_forwarding(void);
 void reset_forwarding(void);
 void exit_forwarding(void);
 void kvmclock_fetching(uint64_t *kvmclock);
+void kvmclock_step_forwarding(uint32_t generation);
+void device_place_forwarding(const char *id, int instance);
+void vm_stop_forwarding(void);
+void vm_cont_forwarding(void);
+void migrate_forwarding(int instance, const char *uri);
+void migration_status_forwarding(int status, bool incoming);
+void vcpu_owner_forwarding(int cpu_index, int instance);
+int vcpu_state_forwarding(int cpu_index, int instance, const void *state,
+                          uint32_t len);
+void vcpu_move_forwarding(int cpu_index, int instance);
+void coalesced_mmio_forwarding(int target, hwaddr addr, const void *data,
+                               int len);
+void coalesced_mmio_flush(void);
 
 void disconnect_io_router(void);
 
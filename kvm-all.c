@@ -74,6 +74,7 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -96,6 +97,16 @@ struct KVMState
 #endif
     int many_ioeventfds;
     int intx_set_mask;
+    bool dsm_vec;
+    /* KVM_GET_DIRTY_LOG leaves the log armed until KVM_CLEAR_DIRTY_LOG */
+    bool manual_dirty_log_protect;
+    /* the slots of every address space; the log is cleared without the BQL */
+    QemuMutex slots_lock;
+    /* entries of the dirty ring of each vCPU, 0 for the dirty bitmap */
+    uint32_t dirty_ring_size;
+    uint64_t dirty_ring_bytes;
+    /* the listener of each address space id, to look up ring entries */
+    KVMMemoryListener *as_kml[2];
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -263,6 +274,8 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+static void kvm_dirty_ring_reap(KVMState *s);
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -284,15 +297,27 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* the ring stays with the parked vCPU, empty it first */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -302,11 +327,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -318,7 +345,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -348,6 +375,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing the dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -384,6 +424,10 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
         return 0;
     }
 
+    /* the kernel starts a new log, whatever is left of the old one is stale */
+    g_free(mem->dirty_bmap);
+    mem->dirty_bmap = NULL;
+
     return kvm_set_user_memory_region(kml, mem);
 }
 
@@ -392,13 +436,16 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
 {
     hwaddr phys_addr = section->offset_within_address_space;
     ram_addr_t size = int128_get64(section->size);
-    KVMSlot *mem = kvm_lookup_matching_slot(kml, phys_addr, phys_addr + size);
+    KVMSlot *mem;
+    int ret = 0;
 
-    if (mem == NULL)  {
-        return 0;
-    } else {
-        return kvm_slot_update_flags(kml, mem, section->mr);
+    qemu_mutex_lock(&kvm_state->slots_lock);
+    mem = kvm_lookup_matching_slot(kml, phys_addr, phys_addr + size);
+    if (mem) {
+        ret = kvm_slot_update_flags(kml, mem, section->mr);
     }
+    qemu_mutex_unlock(&kvm_state->slots_lock);
+    return ret;
 }
 
 static void kvm_log_start(MemoryListener *listener,
@@ -447,8 +494,91 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     return 0;
 }
 
+/*
+ * With the dirty ring, each vCPU logs the pages it dirties in a ring of
+ * its own, which also tells how fast every vCPU dirties guest RAM.  The
+ * rings replace the dirty bitmap of every slot: a sync collects them all.
+ */
+
+/* Called with the slots lock */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+    ram_addr_t ram_addr;
+
+    if (as_id >= ARRAY_SIZE(s->as_kml) || !s->as_kml[as_id] ||
+        slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->as_kml[as_id];
+    mem = &kml->slots[slot_id];
+    if (offset >= (mem->memory_size >> TARGET_PAGE_BITS)) {
+        return;
+    }
+
+    ram_addr = qemu_ram_addr_from_host(mem->ram +
+                                       (offset << TARGET_PAGE_BITS));
+    if (ram_addr != RAM_ADDR_INVALID) {
+        cpu_physical_memory_set_dirty_range(ram_addr, TARGET_PAGE_SIZE,
+                                            DIRTY_CLIENTS_NOCODE);
+    }
+}
+
+/* Called with the slots lock */
+static uint64_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfn;
+    uint64_t count = 0;
+
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index &
+                                   (s->dirty_ring_size - 1)];
+        if (!(atomic_read(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        /* KVM fills the entry in before it sets the flag */
+        smp_rmb();
+        kvm_dirty_ring_mark_page(s, gfn->slot >> 16, gfn->slot & 0xffff,
+                                 gfn->offset);
+        atomic_mb_set(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+    cpu->kvm_dirty_pages += count;
+    return count;
+}
+
+/* Called with the BQL and the slots lock */
+static void kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t count = 0;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            count += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+    if (count && kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS) < 0) {
+        DPRINTF("ioctl failed %d\n", errno);
+    }
+}
+
+/* Called with the BQL */
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    qemu_mutex_lock(&s->slots_lock);
+    kvm_dirty_ring_reap_locked(s);
+    qemu_mutex_unlock(&s->slots_lock);
+}
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+static int kvm_physical_log_clear(KVMMemoryListener *kml,
+                                  MemoryRegionSection *section);
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
@@ -462,14 +592,18 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
                                           MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
-    d.dirty_bitmap = NULL;
+    if (s->dirty_ring_size) {
+        kvm_dirty_ring_reap_locked(s);
+        return 0;
+    }
+
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -490,17 +624,17 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        /* kept for kvm_physical_log_clear(), a slot never changes size */
+        if (!mem->dirty_bmap) {
+            mem->dirty_bmap = g_malloc0(size);
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
+        d.dirty_bitmap = mem->dirty_bmap;
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
             DPRINTF("ioctl failed %d\n", errno);
+            /* nothing was reported, so nothing may be cleared */
+            memset(mem->dirty_bmap, 0, size);
             ret = -1;
             break;
         }
@@ -508,7 +642,78 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+
+    /*
+     * Migration clears the log itself, chunk by chunk right before it sends
+     * the pages; the other users of the dirty log (e.g. VGA) expect it to be
+     * re-armed by every sync.
+     */
+    if (!ret && s->manual_dirty_log_protect &&
+        memory_region_get_dirty_log_mask(section->mr) !=
+        (1 << DIRTY_MEMORY_MIGRATION)) {
+        ret = kvm_physical_log_clear(kml, section);
+    }
+
+    return ret;
+}
+
+/**
+ * kvm_physical_log_clear - Re-arm the dirty log of the pages of @section
+ * that the last KVM_GET_DIRTY_LOG reported, with manual dirty log protect
+ *
+ * The kernel clears the log of 64 pages at a time, so the range is widened
+ * to that; clearing the log of a page whose dirtiness was already reported
+ * is always safe.
+ */
+static int kvm_physical_log_clear(KVMMemoryListener *kml,
+                                  MemoryRegionSection *section)
+{
+    KVMState *s = kvm_state;
+    struct kvm_clear_dirty_log d = {};
+    uint64_t start, end, end_word, slot_pages;
+    KVMSlot *mem;
+    int ret = 0;
+    hwaddr start_addr = section->offset_within_address_space;
+    hwaddr end_addr = start_addr + int128_get64(section->size);
+
+    if (!s->manual_dirty_log_protect) {
+        return 0;
+    }
+
+    while (start_addr < end_addr) {
+        mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
+        if (mem == NULL) {
+            break;
+        }
+        if (!mem->dirty_bmap || !(mem->flags & KVM_MEM_LOG_DIRTY_PAGES)) {
+            start_addr = mem->start_addr + mem->memory_size;
+            continue;
+        }
+
+        slot_pages = mem->memory_size >> TARGET_PAGE_BITS;
+        start = (MAX(start_addr, mem->start_addr) - mem->start_addr)
+                >> TARGET_PAGE_BITS;
+        end = (MIN(end_addr, mem->start_addr + mem->memory_size) -
+               mem->start_addr) >> TARGET_PAGE_BITS;
+        start = QEMU_ALIGN_DOWN(start, 64);
+        /* the bitmap of the slot is padded to 64 pages with zeroes */
+        end_word = QEMU_ALIGN_UP(end, 64);
+        end = MIN(end_word, slot_pages);
+
+        if (find_next_bit(mem->dirty_bmap, end_word, start) < end_word) {
+            d.slot = mem->slot | (kml->as_id << 16);
+            d.first_page = start;
+            d.num_pages = end - start;
+            d.dirty_bitmap = mem->dirty_bmap + BIT_WORD(start);
+            if (kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d) == -1) {
+                DPRINTF("ioctl failed %d\n", errno);
+                ret = -1;
+                break;
+            }
+            bitmap_clear(mem->dirty_bmap, start, end_word - start);
+        }
+        start_addr = mem->start_addr + mem->memory_size;
+    }
 
     return ret;
 }
@@ -770,6 +975,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                     __func__, strerror(-err));
             abort();
         }
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
 
         /* Workaround for older KVM versions: we can't join slots, even not by
          * unregistering the previous ones and then registering the larger
@@ -868,7 +1075,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -876,7 +1085,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -886,7 +1097,24 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
+    if (r < 0) {
+        abort();
+    }
+}
+
+/* Called by migration, which may not hold the BQL */
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    int r;
+
+    qemu_mutex_lock(&kvm_state->slots_lock);
+    r = kvm_physical_log_clear(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -968,6 +1196,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    if (as_id < ARRAY_SIZE(s->as_kml)) {
+        s->as_kml[as_id] = kml;
+    }
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -978,6 +1209,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1707,6 +1939,32 @@ static int kvm_init(MachineState *ms)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    s->dsm_vec = kvm_check_extension(s, KVM_CAP_X86_DSM_VEC) > 0;
+    qemu_mutex_init(&s->slots_lock);
+
+    s->dirty_ring_size = machine_kvm_dirty_ring(ms);
+    if (s->dirty_ring_size) {
+        s->dirty_ring_bytes = (uint64_t)s->dirty_ring_size *
+                              sizeof(struct kvm_dirty_gfn);
+        ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+        if (ret <= 0 || ret < s->dirty_ring_bytes) {
+            fprintf(stderr, "kvm does not support a dirty ring of %u entries"
+                    "\n", s->dirty_ring_size);
+            ret = -EINVAL;
+            goto err;
+        }
+        ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0,
+                                s->dirty_ring_bytes);
+        if (ret < 0) {
+            fprintf(stderr, "kvm: cannot enable the dirty ring: %s\n",
+                    strerror(-ret));
+            goto err;
+        }
+    } else if (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) > 0) {
+        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                                KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+        s->manual_dirty_log_protect = ret == 0;
+    }
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1803,22 +2061,38 @@ void kvm_set_sigmask_len(KVMState *s, unsigned int sigmask_len)
     s->sigmask_len = sigmask_len;
 }
 
+/*
+ * Accesses forwarded to another instance skip prepare_mmio_access(), so
+ * push out what KVM coalesced before them, as that would have done.
+ */
+static void kvm_flush_coalesced_mmio_remote(void)
+{
+    struct kvm_coalesced_mmio_ring *ring = kvm_state->coalesced_mmio_ring;
+
+    if (ring && ring->first != ring->last) {
+        qemu_mutex_lock_iothread();
+        qemu_flush_coalesced_mmio_buffer();
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static void kvm_handle_io(uint16_t port, MemTxAttrs attrs, void *data, int direction,
                           int size, uint32_t count)
 {
-    int i;
+    int i, owner;
     uint8_t *ptr = data;
 
     if (local_cpus != smp_cpus)
     {
-        // AP PIO redirect
-        if (local_cpu_start_index != 0)
+        // PIO redirect to the instance that owns the device
+        owner = router_io_owner(true, port);
+        if (owner != router_local_index())
         {
-            pio_forwarding(port, attrs, data, direction, size, count, false);
+            kvm_flush_coalesced_mmio_remote();
+            pio_forwarding(owner, port, attrs, data, direction, size, count);
             return;
         }
 
-        // BSP
         for (i = 0; i < count; i++) {
             address_space_rw(&address_space_io, port, attrs,
                              ptr, size,
@@ -1841,8 +2115,10 @@ static void kvm_handle_io(uint16_t port, MemTxAttrs attrs, void *data, int direc
          *  The `KVM_EXIT_IO_OUT` means writes to these ports, the "out" here
          *  means the data flows out from guest (and thus KVM).
          */
-        if ((port == 0xCF8 || port == 0xCFC || port == 0xCFE || port == 126) && direction == KVM_EXIT_IO_OUT) {
-            pio_forwarding(port, attrs, data, direction, size, count, true);
+        if (router_local_index() == 0 && router_broadcast_port(port) &&
+            direction == KVM_EXIT_IO_OUT) {
+            pio_forwarding(ROUTER_BROADCAST, port, attrs, data, direction,
+                           size, count);
         }
         return;
     }
@@ -1898,13 +2174,24 @@ void kvm_flush_coalesced_mmio_buffer(void)
         struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
         while (ring->first != ring->last) {
             struct kvm_coalesced_mmio *ent;
+            int owner;
 
             ent = &ring->coalesced_mmio[ring->first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            if (local_cpus != smp_cpus &&
+                (owner = router_io_owner(false, ent->phys_addr)) !=
+                    router_local_index()) {
+                coalesced_mmio_forwarding(owner, ent->phys_addr, ent->data,
+                                          ent->len);
+            } else {
+                cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            }
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
+        if (local_cpus != smp_cpus) {
+            coalesced_mmio_flush();
+        }
     }
 
     s->coalesced_flush_in_progress = false;
@@ -1950,7 +2237,7 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
-    int ret, run_ret;
+    int ret, run_ret, owner;
     struct APICCommonState *apic = APIC_COMMON(X86_CPU(cpu)->apic_state);
 
     DPRINTF("kvm_cpu_exec()\n");
@@ -2019,26 +2306,31 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         case KVM_EXIT_MMIO:
             DPRINTF("handle_mmio\n");
-            if (local_cpus != smp_cpus && local_cpu_start_index != 0) {
+            if (local_cpus != smp_cpus) {
                 /* MMIOs of APIC should be resolved in apic_io_ops
                  * Case 1: GPA is in [0xfee00000, 0xfeefffff], this is the
                  * address space for MSIs, and APIC MMIO space resides in this
                  * region by default
                  * Case 2: GPA is in [apicbase, apicbase + 0x1000], this is the
                  * configurable APIC MMIO space
+                 * Everything else goes to the instance that owns the device,
+                 * which is QEMU 0 unless it was placed elsewhere
                  */
 
                 if (((APIC_DEFAULT_ADDRESS <= run->mmio.phys_addr) &&
                             (run->mmio.phys_addr < APIC_DEFAULT_ADDRESS + APIC_SPACE_SIZE)) ||
                         (((apic->apicbase & MSR_IA32_APICBASE_BASE) <= run->mmio.phys_addr) &&
-                            (run->mmio.phys_addr < ((apic->apicbase & MSR_IA32_APICBASE_BASE) + 0x1000)))) {
+                            (run->mmio.phys_addr < ((apic->apicbase & MSR_IA32_APICBASE_BASE) + 0x1000))) ||
+                        (owner = router_io_owner(false, run->mmio.phys_addr)) ==
+                            router_local_index()) {
                     address_space_rw(&address_space_memory,
                                      run->mmio.phys_addr, attrs,
                                      run->mmio.data,
                                      run->mmio.len,
                                      run->mmio.is_write);
                 } else {
-                    mmio_forwarding(run->mmio.phys_addr, attrs,
+                    kvm_flush_coalesced_mmio_remote();
+                    mmio_forwarding(owner, run->mmio.phys_addr, attrs,
                                  run->mmio.data,
                                  run->mmio.len,
                                  run->mmio.is_write);
@@ -2058,6 +2350,13 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            DPRINTF("dirty ring full\n");
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             printf("shutdown\n");
             DPRINTF("shutdown\n");
@@ -2264,6 +2563,11 @@ int kvm_has_many_ioeventfds(void)
     return kvm_state->many_ioeventfds;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->dirty_ring_size;
+}
+
 int kvm_has_gsi_routing(void)
 {
 #ifdef KVM_CAP_IRQ_ROUTING
@@ -2278,6 +2582,69 @@ int kvm_has_intx_set_mask(void)
     return kvm_state->intx_set_mask;
 }
 
+static int kvm_dsm_vec(int vec_type, int type, void *entries, size_t size,
+                       int n)
+{
+    KVMState *s = kvm_state;
+    struct kvm_dsm_vec vec = {
+        .nr = n,
+        .entries = (__u64)(uintptr_t)entries,
+    };
+    int i, ret;
+
+    if (s->dsm_vec && n > 1) {
+        ret = kvm_vm_ioctl(s, vec_type, &vec);
+        return ret < 0 ? ret : 1;
+    }
+    for (i = 0; i < n; i++) {
+        ret = kvm_vm_ioctl(s, type, (uint8_t *)entries + i * size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return n;
+}
+
+int kvm_dsm_mempin_vec(struct kvm_dsm_mempin *pins, int n)
+{
+    return kvm_dsm_vec(KVM_DSM_MEMPIN_VEC, KVM_DSM_MEMPIN, pins,
+                       sizeof(*pins), n);
+}
+
+int kvm_dsm_memcpy_vec(struct kvm_dsm_memcpy *cpys, int n)
+{
+    return kvm_dsm_vec(KVM_DSM_MEMCPY_VEC, KVM_DSM_MEMCPY, cpys,
+                       sizeof(*cpys), n);
+}
+
+int kvm_dsm_revoke_notify(int fd)
+{
+    struct kvm_dsm_revoke revoke = {
+        .fd = fd,
+    };
+
+    if (kvm_vm_check_extension(kvm_state, KVM_CAP_X86_DSM_REVOKE) <= 0) {
+        return -ENOSYS;
+    }
+    return kvm_vm_ioctl(kvm_state, KVM_DSM_REVOKE_NOTIFY, &revoke);
+}
+
+int kvm_dsm_get_stats(struct kvm_dsm_stats *stats)
+{
+    if (kvm_vm_check_extension(kvm_state, KVM_CAP_X86_DSM_STATS) <= 0) {
+        return -ENOSYS;
+    }
+    return kvm_vm_ioctl(kvm_state, KVM_DSM_GET_STATS, stats);
+}
+
+int kvm_dsm_get_vcpu_stats(struct kvm_dsm_vcpu_stats *stats)
+{
+    if (kvm_vm_check_extension(kvm_state, KVM_CAP_X86_DSM_VCPU_STATS) <= 0) {
+        return -ENOSYS;
+    }
+    return kvm_vm_ioctl(kvm_state, KVM_DSM_GET_VCPU_STATS, stats);
+}
+
 #ifdef KVM_CAP_SET_GUEST_DEBUG
 struct kvm_sw_breakpoint *kvm_find_sw_breakpoint(CPUState *cpu,
                                                  target_ulong pc)
@@ -74,6 +74,36 @@ int kvm_has_many_ioeventfds(void)
     return 0;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+int kvm_dsm_mempin_vec(struct kvm_dsm_mempin *pins, int n)
+{
+    return -ENOSYS;
+}
+
+int kvm_dsm_memcpy_vec(struct kvm_dsm_memcpy *cpys, int n)
+{
+    return -ENOSYS;
+}
+
+int kvm_dsm_revoke_notify(int fd)
+{
+    return -ENOSYS;
+}
+
+int kvm_dsm_get_stats(struct kvm_dsm_stats *stats)
+{
+    return -ENOSYS;
+}
+
+int kvm_dsm_get_vcpu_stats(struct kvm_dsm_vcpu_stats *stats)
+{
+    return -ENOSYS;
+}
+
 int kvm_update_guest_debug(CPUState *cpu, unsigned long reinject_trap)
 {
     return -ENOSYS;
@@ -205,6 +205,7 @@ struct kvm_hyperv_exit {
 #define KVM_EXIT_S390_STSI        25
 #define KVM_EXIT_IOAPIC_EOI       26
 #define KVM_EXIT_HYPERV           27
+#define KVM_EXIT_DIRTY_RING_FULL  31
 
 /* For KVM_EXIT_INTERNAL_ERROR */
 /* Emulate instruction failed. */
@@ -451,6 +452,37 @@ struct kvm_dirty_log {
 	};
 };
 
+/* for KVM_CLEAR_DIRTY_LOG */
+struct kvm_clear_dirty_log {
+	__u32 slot;
+	__u32 num_pages;
+	__u64 first_page;
+	union {
+		void *dirty_bitmap; /* one bit per page */
+		__u64 padding2;
+	};
+};
+
+#define KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE    (1 << 0)
+
+/*
+ * With KVM_CAP_DIRTY_LOG_RING, every vCPU logs the pages it dirties in a
+ * ring of these, mmap'ed from the vCPU fd at KVM_DIRTY_LOG_PAGE_OFFSET
+ * pages.  Userspace marks the entries it collected with
+ * KVM_DIRTY_GFN_F_RESET, then calls KVM_RESET_DIRTY_RINGS.
+ */
+#define KVM_DIRTY_LOG_PAGE_OFFSET 64
+
+#define KVM_DIRTY_GFN_F_DIRTY           (1 << 0)
+#define KVM_DIRTY_GFN_F_RESET           (1 << 1)
+#define KVM_DIRTY_GFN_F_MASK            0x3
+
+struct kvm_dirty_gfn {
+	__u32 flags;
+	__u32 slot;
+	__u64 offset;
+};
+
 /* for KVM_SET_SIGNAL_MASK */
 struct kvm_signal_mask {
 	__u32 len;
@@ -871,6 +903,12 @@ struct kvm_ppc_smmu_info {
 #define KVM_CAP_MSI_DEVID 131
 #define KVM_CAP_PPC_HTM 132
 #define KVM_CAP_X86_DSM 133
+#define KVM_CAP_X86_DSM_VEC 134
+#define KVM_CAP_X86_DSM_REVOKE 135
+#define KVM_CAP_X86_DSM_STATS 136
+#define KVM_CAP_X86_DSM_VCPU_STATS 137
+#define KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 168
+#define KVM_CAP_DIRTY_LOG_RING 192
 
 #ifdef KVM_CAP_IRQ_ROUTING
 
@@ -1215,6 +1253,53 @@ struct kvm_dsm_mempin {
 };
 #define KVM_DSM_MEMPIN            _IOW(KVMIO,  0xf2, struct kvm_dsm_mempin)
 
+/* Pin/unpin or copy a whole scatter-gather list with a single ioctl. */
+struct kvm_dsm_vec {
+	__u32 nr;
+	__u32 pad;
+	__u64 entries;	/* struct kvm_dsm_mempin[nr] or kvm_dsm_memcpy[nr] */
+};
+#define KVM_DSM_MEMPIN_VEC        _IOW(KVMIO,  0xf3, struct kvm_dsm_vec)
+#define KVM_DSM_MEMCPY_VEC        _IOW(KVMIO,  0xf4, struct kvm_dsm_vec)
+
+/* Signal an eventfd when another node waits for a page pinned by this VM. */
+struct kvm_dsm_revoke {
+	__s32 fd;
+	__u32 flags;
+};
+#define KVM_DSM_REVOKE_NOTIFY     _IOW(KVMIO,  0xf5, struct kvm_dsm_revoke)
+
+/* Coherence statistics of the DSM, since it was enabled. */
+#define KVM_DSM_LATENCY_BUCKETS 24
+struct kvm_dsm_node_stats {
+	__u64 read_faults;
+	__u64 write_faults;
+	__u64 pages_in;
+	__u64 pages_out;
+	__u64 revoked;
+};
+struct kvm_dsm_hot_page {
+	__u64 gfn;
+	__u64 transfers;
+};
+struct kvm_dsm_stats {
+	__u32 nr_nodes;		/* in: room in nodes, out: entries filled */
+	__u32 nr_hot;		/* in: room in hot, out: entries filled */
+	__u64 nodes;		/* struct kvm_dsm_node_stats[nr_nodes] */
+	__u64 hot;		/* struct kvm_dsm_hot_page[nr_hot], hottest first */
+	__u64 faults;
+	__u64 latency_us[KVM_DSM_LATENCY_BUCKETS];	/* log2 buckets */
+	__u64 bytes_in;
+	__u64 bytes_out;
+};
+#define KVM_DSM_GET_STATS         _IOWR(KVMIO, 0xf6, struct kvm_dsm_stats)
+struct kvm_dsm_vcpu_stats {
+	__u32 nr_vcpus;		/* in: room in faults, out: entries filled */
+	__u32 pad;
+	__u64 faults;		/* __u64[nr_vcpus], by vcpu_id */
+};
+#define KVM_DSM_GET_VCPU_STATS    _IOWR(KVMIO, 0xf7, struct kvm_dsm_vcpu_stats)
+
 /*
  * ioctls for vcpu fds
  */
@@ -1300,6 +1385,10 @@ struct kvm_dsm_mempin {
 #define KVM_S390_GET_IRQ_STATE	  _IOW(KVMIO, 0xb6, struct kvm_s390_irq_state)
 /* Available with KVM_CAP_X86_SMM */
 #define KVM_SMI                   _IO(KVMIO,   0xb7)
+/* Available with KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 */
+#define KVM_CLEAR_DIRTY_LOG       _IOWR(KVMIO, 0xc0, struct kvm_clear_dirty_log)
+/* Available with KVM_CAP_DIRTY_LOG_RING */
+#define KVM_RESET_DIRTY_RINGS     _IO(KVMIO, 0xc7)
 
 #define KVM_DEV_ASSIGN_ENABLE_IOMMU	(1 << 0)
 #define KVM_DEV_ASSIGN_PCI_2_3		(1 << 1)
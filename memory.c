@@ -1784,6 +1784,45 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryRegionSection mrs;
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+    hwaddr sec_start, sec_end, sec_size;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (!listener->log_clear) {
+            continue;
+        }
+        as = listener->address_space;
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            if (fr->mr != mr || !fr->dirty_log_mask) {
+                continue;
+            }
+            mrs = section_from_flat_range(fr, as);
+            /* only the part of the section that is within [start, len) */
+            sec_start = MAX(mrs.offset_within_region, start);
+            sec_end = MIN(mrs.offset_within_region + int128_get64(mrs.size),
+                          start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+            sec_size = sec_end - sec_start;
+            mrs.offset_within_address_space += sec_start -
+                                               mrs.offset_within_region;
+            mrs.offset_within_region = sec_start;
+            mrs.size = int128_make64(sec_size);
+            listener->log_clear(listener, &mrs);
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1865,6 +1904,33 @@ MemoryRegion *memory_region_from_host(void *ptr, ram_addr_t *offset)
     return block->mr;
 }
 
+bool address_space_addr_from_host(AddressSpace *as, void *ptr, hwaddr *addr)
+{
+    MemoryRegion *mr;
+    ram_addr_t offset;
+    FlatView *view;
+    FlatRange *fr;
+    bool found = false;
+
+    rcu_read_lock();
+    mr = memory_region_from_host(ptr, &offset);
+    if (mr) {
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            if (fr->mr == mr && offset >= fr->offset_in_region &&
+                offset - fr->offset_in_region < int128_get64(fr->addr.size)) {
+                *addr = int128_get64(fr->addr.start) + offset -
+                        fr->offset_in_region;
+                found = true;
+                break;
+            }
+        }
+        flatview_unref(view);
+    }
+    rcu_read_unlock();
+    return found;
+}
+
 ram_addr_t memory_region_get_ram_addr(MemoryRegion *mr)
 {
     return mr->ram_block ? mr->ram_block->offset : RAM_ADDR_INVALID;
@@ -2424,6 +2490,9 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
+    memset(&as->dsm_pin, 0, sizeof(as->dsm_pin));
+    dsm_pin_counters_register(&as->dsm_pin, as->name);
+    as->dsm_pin_cache = NULL;
     address_space_init_dispatch(as);
     memory_region_update_pending |= root->enabled;
     memory_region_transaction_commit();
@@ -2437,6 +2506,7 @@ static void do_address_space_destroy(AddressSpace *as)
     assert(QTAILQ_EMPTY(&as->listeners));
 
     flatview_unref(as->current_map);
+    dsm_pin_cache_destroy(as);
     g_free(as->name);
     g_free(as->ioeventfds);
     memory_region_unref(as->root);
@@ -2475,6 +2545,7 @@ void address_space_destroy(AddressSpace *as)
     as->root = NULL;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
+    dsm_pin_counters_unregister(&as->dsm_pin);
     address_space_unregister(as);
 
     /* At this point, as->dispatch and as->current_map are dummy
@@ -0,0 +1,353 @@
+/*
+ * Migration compression: codecs and the job queue of the compression
+ * threads
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "migration/compress.h"
+
+#ifdef CONFIG_ZSTD
+/* zstd contexts are expensive to set up, every worker keeps its own */
+static __thread ZSTD_CCtx *zstd_cctx;
+static __thread ZSTD_DCtx *zstd_dctx;
+#endif
+
+bool migration_codec_available(MigrationCompressCodec codec)
+{
+    switch (codec) {
+    case MIGRATION_COMPRESS_CODEC_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_CODEC_ZSTD:
+        return true;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_CODEC_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+int migration_codec_max_level(MigrationCompressCodec codec)
+{
+    /* lz4 has no levels and ignores it */
+    return codec == MIGRATION_COMPRESS_CODEC_ZSTD ? 19 : 9;
+}
+
+size_t migration_compress_bound(MigrationCompressCodec codec, size_t len)
+{
+    switch (codec) {
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_CODEC_ZSTD:
+        return ZSTD_compressBound(len);
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_CODEC_LZ4:
+        return LZ4_compressBound(len);
+#endif
+    default:
+        return compressBound(len);
+    }
+}
+
+ssize_t migration_compress(MigrationCompressCodec codec, int level,
+                           const uint8_t *src, size_t len,
+                           uint8_t *dst, size_t dst_len)
+{
+    uLongf zlen = dst_len;
+    ssize_t ret;
+
+    switch (codec) {
+    case MIGRATION_COMPRESS_CODEC_ZLIB:
+        if (compress2(dst, &zlen, src, len, level) != Z_OK) {
+            return -1;
+        }
+        return zlen;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_CODEC_ZSTD:
+        if (!zstd_cctx) {
+            return -1;
+        }
+        ret = ZSTD_compressCCtx(zstd_cctx, dst, dst_len, src, len,
+                                level ? level : 1);
+        return ZSTD_isError(ret) ? -1 : ret;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_CODEC_LZ4:
+        ret = LZ4_compress_default((const char *)src, (char *)dst, len,
+                                   dst_len);
+        return ret > 0 ? ret : -1;
+#endif
+    default:
+        return -1;
+    }
+}
+
+ssize_t migration_decompress(MigrationCompressCodec codec,
+                             const uint8_t *src, size_t len,
+                             uint8_t *dst, size_t dst_len)
+{
+    uLongf zlen = dst_len;
+    ssize_t ret;
+
+    switch (codec) {
+    case MIGRATION_COMPRESS_CODEC_ZLIB:
+        if (uncompress(dst, &zlen, src, len) != Z_OK) {
+            return -1;
+        }
+        return zlen;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_CODEC_ZSTD:
+        if (!zstd_dctx) {
+            return -1;
+        }
+        ret = ZSTD_decompressDCtx(zstd_dctx, dst, dst_len, src, len);
+        return ZSTD_isError(ret) ? -1 : ret;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_CODEC_LZ4:
+        ret = LZ4_decompress_safe((const char *)src, (char *)dst, len,
+                                  dst_len);
+        return ret >= 0 ? ret : -1;
+#endif
+    default:
+        return -1;
+    }
+}
+
+int migration_compress_thread_init(Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    /* the codec can change during the migration, so always */
+    zstd_cctx = ZSTD_createCCtx();
+    if (!zstd_cctx) {
+        error_setg(errp, "Cannot allocate a zstd compression context");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int migration_decompress_thread_init(Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    /* the source picks the codec of every frame */
+    zstd_dctx = ZSTD_createDCtx();
+    if (!zstd_dctx) {
+        error_setg(errp, "Cannot allocate a zstd decompression context");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void migration_codec_thread_cleanup(void)
+{
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(zstd_cctx);
+    ZSTD_freeDCtx(zstd_dctx);
+    zstd_cctx = NULL;
+    zstd_dctx = NULL;
+#endif
+}
+
+/*
+ * Jobs go through the slots of the ring in order. The filling thread
+ * writes a job and moves @head past it; the workers claim the jobs between
+ * @claimed and @head with a cmpxchg on @claimed, and set the done flag of
+ * the slot when they are through; the filling thread takes the jobs back
+ * at @tail, once they are done. The counters only grow, a job is in slot
+ * counter % depth.
+ */
+struct CompressQueue {
+    int depth;
+    size_t job_size;
+    CompressThreadInit *init;
+    CompressJobFunc *func;
+    uint8_t *jobs;
+    bool *done;
+
+    unsigned head;
+    unsigned claimed;
+    unsigned tail;
+    bool quit;
+
+    /* set when a job is queued, and to stop the workers */
+    QemuEvent work;
+    /* set when a job is done */
+    QemuEvent done_ev;
+
+    int threads;
+    QemuThread *thread;
+
+    /* the workers that ran @init, and the first error it returned */
+    QemuSemaphore started;
+    QemuMutex init_lock;
+    Error *init_err;
+};
+
+void *compress_queue_job(CompressQueue *q, int i)
+{
+    return q->jobs + i * q->job_size;
+}
+
+static void *compress_queue_worker(void *opaque)
+{
+    CompressQueue *q = opaque;
+    Error *local_err = NULL;
+    unsigned job;
+
+    if (q->init && q->init(&local_err) < 0) {
+        qemu_mutex_lock(&q->init_lock);
+        if (!q->init_err) {
+            q->init_err = local_err;
+        } else {
+            error_free(local_err);
+        }
+        qemu_mutex_unlock(&q->init_lock);
+        qemu_sem_post(&q->started);
+        migration_codec_thread_cleanup();
+        return NULL;
+    }
+    qemu_sem_post(&q->started);
+
+    while (true) {
+        job = atomic_read(&q->claimed);
+        if (job == atomic_mb_read(&q->head)) {
+            if (atomic_read(&q->quit)) {
+                break;
+            }
+            qemu_event_reset(&q->work);
+            if (job == atomic_mb_read(&q->head) && !atomic_read(&q->quit)) {
+                qemu_event_wait(&q->work);
+            }
+            continue;
+        }
+        if (atomic_cmpxchg(&q->claimed, job, job + 1) != job) {
+            continue;
+        }
+
+        q->func(compress_queue_job(q, job % q->depth));
+        atomic_mb_set(&q->done[job % q->depth], true);
+        qemu_event_set(&q->done_ev);
+    }
+
+    migration_codec_thread_cleanup();
+    return NULL;
+}
+
+CompressQueue *compress_queue_new(const char *name, int threads, int depth,
+                                  size_t job_size, CompressThreadInit *init,
+                                  CompressJobFunc *func, Error **errp)
+{
+    CompressQueue *q = g_new0(CompressQueue, 1);
+    int i;
+
+    q->depth = depth;
+    q->job_size = job_size;
+    q->init = init;
+    q->func = func;
+    q->jobs = g_malloc0(depth * job_size);
+    q->done = g_new0(bool, depth);
+    qemu_event_init(&q->work, false);
+    qemu_event_init(&q->done_ev, false);
+    qemu_sem_init(&q->started, 0);
+    qemu_mutex_init(&q->init_lock);
+
+    q->threads = threads;
+    q->thread = g_new0(QemuThread, threads);
+    for (i = 0; i < threads; i++) {
+        qemu_thread_create(q->thread + i, name, compress_queue_worker, q,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < threads; i++) {
+        qemu_sem_wait(&q->started);
+    }
+    if (q->init_err) {
+        error_propagate(errp, q->init_err);
+        q->init_err = NULL;
+        compress_queue_free(q, NULL);
+        return NULL;
+    }
+    return q;
+}
+
+void compress_queue_free(CompressQueue *q, CompressJobFunc *cleanup)
+{
+    int i;
+
+    if (!q) {
+        return;
+    }
+    atomic_mb_set(&q->quit, true);
+    qemu_event_set(&q->work);
+    for (i = 0; i < q->threads; i++) {
+        qemu_thread_join(q->thread + i);
+    }
+    for (i = 0; cleanup && i < q->depth; i++) {
+        cleanup(compress_queue_job(q, i));
+    }
+    qemu_event_destroy(&q->work);
+    qemu_event_destroy(&q->done_ev);
+    qemu_sem_destroy(&q->started);
+    qemu_mutex_destroy(&q->init_lock);
+    g_free(q->thread);
+    g_free(q->done);
+    g_free(q->jobs);
+    g_free(q);
+}
+
+void *compress_queue_reserve(CompressQueue *q)
+{
+    if (q->head - q->tail == q->depth) {
+        return NULL;
+    }
+    return compress_queue_job(q, q->head % q->depth);
+}
+
+void compress_queue_submit(CompressQueue *q)
+{
+    q->done[q->head % q->depth] = false;
+    atomic_mb_set(&q->head, q->head + 1);
+    qemu_event_set(&q->work);
+}
+
+void *compress_queue_oldest(CompressQueue *q, bool wait)
+{
+    bool *done = &q->done[q->tail % q->depth];
+
+    if (q->tail == q->head) {
+        return NULL;
+    }
+    while (!atomic_mb_read(done)) {
+        if (!wait) {
+            return NULL;
+        }
+        qemu_event_reset(&q->done_ev);
+        if (!atomic_mb_read(done)) {
+            qemu_event_wait(&q->done_ev);
+        }
+    }
+    return compress_queue_job(q, q->tail % q->depth);
+}
+
+void compress_queue_release(CompressQueue *q)
+{
+    assert(q->tail != q->head);
+    q->tail++;
+}
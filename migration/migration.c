@@ -37,6 +37,9 @@
 #include "io/channel-buffer.h"
 #include "io/channel-tls.h"
 #include "migration/colo.h"
+#include "migration/compress.h"
+#include "interrupt-router.h"
+#include "sysemu/kvm.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -68,6 +71,11 @@
  */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
+/* Guest RAM goes on the migration stream by default */
+#define DEFAULT_MIGRATE_RAM_CHANNELS 1
+/* No per-vCPU dirty rate limit */
+#define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT 0
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -101,6 +109,9 @@ MigrationState *migrate_get_current(void)
             .max_bandwidth = MAX_THROTTLE,
             .downtime_limit = DEFAULT_MIGRATE_SET_DOWNTIME,
             .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .ram_channels = DEFAULT_MIGRATE_RAM_CHANNELS,
+            .compress_codec = MIGRATION_COMPRESS_CODEC_ZLIB,
+            .vcpu_dirty_limit = DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT,
         },
     };
 
@@ -359,7 +370,7 @@ static void process_incoming_migration_bh(void *opaque)
 
     if (!global_state_received() ||
         global_state_get_runstate() == RUN_STATE_RUNNING) {
-        if (autostart) {
+        if (autostart && !router_migration_defer_start()) {
             vm_start();
         } else {
             runstate_set(RUN_STATE_PAUSED);
@@ -427,6 +438,9 @@ static void process_incoming_migration_co(void *opaque)
 
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
+    socket_incoming_migration_end();
+    migrate_ram_channels_recv_join();
+    ram_dsm_unpin();
 
     if (ret < 0) {
         migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
@@ -442,9 +456,14 @@ static void process_incoming_migration_co(void *opaque)
 
 void migration_fd_process_incoming(QEMUFile *f)
 {
-    Coroutine *co = qemu_coroutine_create(process_incoming_migration_co, f);
+    Coroutine *co;
+    Error *local_err = NULL;
 
-    migrate_decompress_threads_create();
+    if (migrate_decompress_threads_create(&local_err) < 0) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    co = qemu_coroutine_create(process_incoming_migration_co, f);
     qemu_file_set_blocking(f, false);
     qemu_coroutine_enter(co);
 }
@@ -595,6 +614,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->downtime_limit = s->parameters.downtime_limit;
     params->has_x_checkpoint_delay = true;
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->has_ram_channels = true;
+    params->ram_channels = s->parameters.ram_channels;
+    params->has_compress_codec = true;
+    params->compress_codec = s->parameters.compress_codec;
+    params->has_vcpu_dirty_limit = true;
+    params->vcpu_dirty_limit = s->parameters.vcpu_dirty_limit;
 
     return params;
 }
@@ -628,6 +653,21 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->blocks = xbzrle_mig_block_stats();
+        info->xbzrle_cache->has_blocks = info->xbzrle_cache->blocks != NULL;
+    }
+}
+
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->codec = migrate_compress_codec();
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_compression_rate();
+        info->compression->compress_time = compress_mig_time_ns() / SCALE_MS;
     }
 }
 
@@ -690,7 +730,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->cpu_throttle_percentage = cpu_throttle_get_percentage();
         }
 
+        info->vcpu_dirty_rates = vcpu_dirty_rates();
+        info->has_vcpu_dirty_rates = info->vcpu_dirty_rates != NULL;
+
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
         /* Mostly the same as active; TODO add some postcopy stats */
@@ -714,6 +758,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIGRATION_STATUS_COLO:
         info->has_status = true;
@@ -721,6 +766,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->has_total_time = true;
@@ -804,10 +850,22 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
-    if (params->has_compress_level &&
-        (params->compress_level < 0 || params->compress_level > 9)) {
-        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
-                   "is invalid, it should be in the range of 0 to 9");
+    MigrationCompressCodec codec = params->has_compress_codec ?
+                                   params->compress_codec :
+                                   s->parameters.compress_codec;
+    int64_t level = params->has_compress_level ? params->compress_level :
+                                                 s->parameters.compress_level;
+
+    if (params->has_compress_codec && !migration_codec_available(codec)) {
+        error_setg(errp, "QEMU was built without %s support",
+                   MigrationCompressCodec_lookup[codec]);
+        return;
+    }
+    if (level < 0 || level > migration_codec_max_level(codec)) {
+        error_setg(errp, "Parameter 'compress_level' is invalid, it should "
+                   "be in the range of 0 to %d for %s",
+                   migration_codec_max_level(codec),
+                   MigrationCompressCodec_lookup[codec]);
         return;
     }
     if (params->has_compress_threads &&
@@ -858,6 +916,25 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
                     "x_checkpoint_delay",
                     "is invalid, it should be positive");
     }
+    if (params->has_ram_channels &&
+        (params->ram_channels < 1 || params->ram_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "ram_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (params->has_vcpu_dirty_limit && params->vcpu_dirty_limit < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "vcpu_dirty_limit",
+                   "is invalid, it should be positive");
+        return;
+    }
+    if (params->has_vcpu_dirty_limit && params->vcpu_dirty_limit &&
+        !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "vcpu_dirty_limit needs the kvm-dirty-ring "
+                   "machine property");
+        return;
+    }
 
     if (params->has_compress_level) {
         s->parameters.compress_level = params->compress_level;
@@ -896,6 +973,15 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
     if (params->has_x_checkpoint_delay) {
         s->parameters.x_checkpoint_delay = params->x_checkpoint_delay;
     }
+    if (params->has_ram_channels) {
+        s->parameters.ram_channels = params->ram_channels;
+    }
+    if (params->has_compress_codec) {
+        s->parameters.compress_codec = params->compress_codec;
+    }
+    if (params->has_vcpu_dirty_limit) {
+        s->parameters.vcpu_dirty_limit = params->vcpu_dirty_limit;
+    }
 }
 
 
@@ -928,6 +1014,8 @@ void migrate_set_state(int *state, int old_state, int new_state)
     if (atomic_cmpxchg(state, old_state, new_state) == old_state) {
         trace_migrate_set_state(new_state);
         migrate_generate_event(new_state);
+        router_migration_set_state(new_state,
+                                   state != &migrate_get_current()->state);
     }
 }
 
@@ -950,6 +1038,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        migrate_ram_channels_join();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -1005,6 +1094,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        migrate_ram_channels_shutdown();
     }
 }
 
@@ -1159,6 +1249,26 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     if (migration_is_blocked(errp)) {
         return;
     }
+    if (migrate_use_compression() && !migrate_use_compress_frames() &&
+        migrate_compress_codec() != MIGRATION_COMPRESS_CODEC_ZLIB) {
+        error_setg(errp, "compress-codec %s needs the compress-frames "
+                   "capability",
+                   MigrationCompressCodec_lookup[migrate_compress_codec()]);
+        return;
+    }
+    if (migrate_ram_channels() > 1) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "ram-channels needs a tcp: or unix: URI");
+            return;
+        }
+        if (migrate_use_compression() || migrate_use_xbzrle() ||
+            migrate_postcopy_ram() || migrate_colo_enabled() ||
+            s->parameters.tls_creds) {
+            error_setg(errp, "ram-channels cannot be used with compression, "
+                       "xbzrle, postcopy-ram, x-colo or TLS");
+            return;
+        }
+    }
 
     s = migrate_init(&params);
 
@@ -1287,6 +1397,15 @@ bool migrate_use_compression(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
 }
 
+bool migrate_use_compress_frames(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS_FRAMES];
+}
+
 int migrate_compress_level(void)
 {
     MigrationState *s;
@@ -1296,6 +1415,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+MigrationCompressCodec migrate_compress_codec(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_codec;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1314,6 +1442,24 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+int migrate_ram_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.ram_channels;
+}
+
+int64_t migrate_vcpu_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.vcpu_dirty_limit;
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1944,6 +2090,8 @@ static void *migration_thread(void *opaque)
 
 void migrate_fd_connect(MigrationState *s)
 {
+    Error *local_err = NULL;
+
     s->expected_downtime = s->parameters.downtime_limit;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
 
@@ -1968,7 +2116,14 @@ void migrate_fd_connect(MigrationState *s)
         }
     }
 
-    migrate_compress_threads_create();
+    if (migrate_compress_threads_create(&local_err) < 0) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+    migrate_ram_channels_create();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
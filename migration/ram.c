@@ -39,11 +39,15 @@
 #include "migration/postcopy-ram.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
+#include "migration/compress.h"
+#include "qemu/host-utils.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
+#include "dsm_backend.h"
+#include "sysemu/kvm.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -69,6 +73,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_CHANNEL_SYNC     0x200
+#define RAM_SAVE_FLAG_COMPRESS_FRAME   0x400
 
 static uint8_t *ZERO_TARGET_PAGE;
 
@@ -155,6 +161,9 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t compress_time_ns;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -214,11 +223,61 @@ double xbzrle_mig_cache_miss_rate(void)
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+XBZRLEBlockStatsList *xbzrle_mig_block_stats(void)
+{
+    XBZRLEBlockStatsList *head = NULL, **tail = &head;
+    XBZRLEBlockStatsList *elem;
+    XBZRLEBlockStats *stats;
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!block->xbzrle_hits && !block->xbzrle_misses) {
+            continue;
+        }
+        stats = g_new0(XBZRLEBlockStats, 1);
+        stats->block = g_strdup(block->idstr);
+        stats->cache_hit = block->xbzrle_hits;
+        stats->cache_miss = block->xbzrle_misses;
+
+        elem = g_new0(XBZRLEBlockStatsList, 1);
+        elem->value = stats;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    rcu_read_unlock();
+    return head;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+double compress_mig_compression_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)(acct_info.compress_pages * TARGET_PAGE_SIZE) /
+           acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_time_ns(void)
+{
+    return acct_info.compress_time_ns;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -253,141 +312,207 @@ static struct BitmapRcu {
     unsigned long *unsentmap;
 } *migration_bitmap_rcu;
 
-struct CompressParam {
-    bool done;
-    bool quit;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
+/*
+ * The compression threads compress frames of up to COMPRESS_FRAME_PAGES
+ * contiguous pages of a RAMBlock, which the migration thread queues in a
+ * CompressQueue and writes out in the order it queued them, each as a
+ * RAM_SAVE_FLAG_COMPRESS_FRAME: the codec, the number of pages, a bitmap
+ * of the zero pages and the compressed data of the others. A frame always
+ * carries the name of its RAMBlock.
+ *
+ * Without the compress-frames capability, which a destination that does
+ * not know RAM_SAVE_FLAG_COMPRESS_FRAME cannot have, a frame is one page
+ * compressed with zlib, sent as a RAM_SAVE_FLAG_COMPRESS_PAGE.
+ */
+#define COMPRESS_FRAME_PAGES    64
+#define COMPRESS_FRAME_SIZE     (COMPRESS_FRAME_PAGES * TARGET_PAGE_SIZE)
+
+struct CompressJob {
     RAMBlock *block;
     ram_addr_t offset;
+    int pages;
+    MigrationCompressCodec codec;
+    int level;
+    /* set by the compression thread */
+    uint64_t zero_mask;
+    ssize_t len;
+    int64_t ns;
+    /* kept from one job in the slot to the next */
+    uint8_t *buf;
+    size_t size;
+    uint8_t *scratch;
 };
-typedef struct CompressParam CompressParam;
+typedef struct CompressJob CompressJob;
 
-struct DecompressParam {
-    bool done;
-    bool quit;
-    QemuMutex mutex;
-    QemuCond cond;
-    void *des;
-    uint8_t *compbuf;
+struct DecompressJob {
+    void *host;
+    int pages;
+    MigrationCompressCodec codec;
+    uint64_t zero_mask;
     int len;
+    /* set by the decompression thread */
+    bool failed;
+    /* kept from one job in the slot to the next */
+    uint8_t *compbuf;
+    size_t size;
+    uint8_t *scratch;
 };
-typedef struct DecompressParam DecompressParam;
+typedef struct DecompressJob DecompressJob;
 
-static CompressParam *comp_param;
-static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
+/*
+ * With the ram-channels parameter above 1, the migration thread does not
+ * send the pages itself: it hands them in batches to a sender thread per
+ * channel, each with its own socket to the destination, where a receive
+ * thread per channel writes them straight into the RAMBlocks. A batch
+ * covers one aligned chunk of ram_addr_t space, and a chunk always goes to
+ * the same channel, so the copies of a page arrive in the order they were
+ * sent. After each sync of the dirty bitmap, every channel and the
+ * migration stream carry a RAM_SAVE_FLAG_CHANNEL_SYNC; the destination
+ * does not read past it on the migration stream until every channel has
+ * delivered the pages in front of it, so each round is complete there
+ * before the next starts, and all pages are before the devices.
  */
-static QemuMutex comp_done_lock;
-static QemuCond comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+#define RAM_CHANNEL_BATCH_BITS  6
+#define RAM_CHANNEL_BATCH       (1 << RAM_CHANNEL_BATCH_BITS)
 
-static bool compression_switch;
-static DecompressParam *decomp_param;
-static QemuThread *decompress_threads;
-static QemuMutex decomp_done_lock;
-static QemuCond decomp_done_cond;
+struct RamChannelBatch {
+    RAMBlock *block;
+    int pages;
+    ram_addr_t offset[RAM_CHANNEL_BATCH];
+};
+typedef struct RamChannelBatch RamChannelBatch;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+struct RamSendChannel {
+    int id;
+    bool quit;
+    bool sync;
+    bool failed;
+    /* the sender flushed its RAM_SAVE_FLAG_EOS, or gave up */
+    bool done;
+    QEMUFile *file;
+    QemuThread thread;
+    QemuMutex mutex;
+    /* work was handed over, or the sender took it */
+    QemuCond cond;
+    RamChannelBatch batch;
+};
+typedef struct RamSendChannel RamSendChannel;
 
-static void *do_data_compress(void *opaque)
-{
-    CompressParam *param = opaque;
-    RAMBlock *block;
-    ram_addr_t offset;
+struct RamRecvChannel {
+    int id;
+    uint64_t syncs;
+    QEMUFile *file;
+    QIOChannel *ioc;
+    QemuThread thread;
+};
+typedef struct RamRecvChannel RamRecvChannel;
+
+static CompressQueue *comp_queue;
+/* the frame the migration thread is filling, not submitted yet */
+static CompressJob *comp_job;
+
+static RamSendChannel *ram_send;
+/* number of sender threads, 0 if the pages go on the migration stream */
+static int ram_send_count;
+/* the batch the migration thread is filling, and its chunk */
+static RamChannelBatch ram_send_batch;
+static ram_addr_t ram_send_chunk;
+/* the dirty bitmap was synced since the last RAM_SAVE_FLAG_CHANNEL_SYNC */
+static bool ram_send_round;
+/* sent by the channels and not yet accounted to the migration stream */
+static int64_t ram_send_bytes;
+
+static RamRecvChannel *ram_recv;
+static int ram_recv_count;
+/* RAM_SAVE_FLAG_CHANNEL_SYNC seen on the migration stream */
+static uint64_t ram_recv_syncs;
+static bool ram_recv_failed;
+static bool ram_recv_closing;
+/* ram_recv_lock protects the above; ram_load waits in ram_recv_co */
+static QemuMutex ram_recv_lock;
+static Coroutine *ram_recv_co;
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->block) {
-            block = param->block;
-            offset = param->offset;
-            param->block = NULL;
-            qemu_mutex_unlock(&param->mutex);
+static bool compression_switch;
+static CompressQueue *decomp_queue;
 
-            do_compress_ram_page(param->file, block, offset);
+static void do_compress_job(void *opaque)
+{
+    CompressJob *job = opaque;
+    uint8_t *p = job->block->host + job->offset;
+    size_t bound = migration_compress_bound(job->codec, COMPRESS_FRAME_SIZE);
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint8_t *src = p;
+    size_t len = 0;
+    int i;
 
-            qemu_mutex_lock(&comp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&comp_done_cond);
-            qemu_mutex_unlock(&comp_done_lock);
+    if (job->size < bound) {
+        g_free(job->buf);
+        job->buf = g_malloc(bound);
+        job->size = bound;
+    }
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+    job->zero_mask = 0;
+    for (i = 0; i < job->pages; i++) {
+        if (is_zero_range(p + i * TARGET_PAGE_SIZE, TARGET_PAGE_SIZE)) {
+            job->zero_mask |= 1ULL << i;
+        }
+    }
+    if (job->zero_mask) {
+        /* only the other pages are compressed, one after the other */
+        if (!job->scratch) {
+            job->scratch = g_malloc(COMPRESS_FRAME_SIZE);
         }
+        for (i = 0; i < job->pages; i++) {
+            if (!(job->zero_mask & (1ULL << i))) {
+                memcpy(job->scratch + len, p + i * TARGET_PAGE_SIZE,
+                       TARGET_PAGE_SIZE);
+                len += TARGET_PAGE_SIZE;
+            }
+        }
+        src = job->scratch;
+    } else {
+        len = job->pages * TARGET_PAGE_SIZE;
     }
-    qemu_mutex_unlock(&param->mutex);
 
-    return NULL;
+    job->len = len ? migration_compress(job->codec, job->level, src, len,
+                                        job->buf, job->size) : 0;
+    job->ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
 }
 
-static inline void terminate_compression_threads(void)
+static void compress_job_cleanup(void *opaque)
 {
-    int idx, thread_count;
+    CompressJob *job = opaque;
 
-    thread_count = migrate_compress_threads();
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        comp_param[idx].quit = true;
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
-    }
+    g_free(job->buf);
+    g_free(job->scratch);
 }
 
 void migrate_compress_threads_join(void)
 {
-    int i, thread_count;
-
     if (!migrate_use_compression()) {
         return;
     }
-    terminate_compression_threads();
-    thread_count = migrate_compress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
-    }
-    qemu_mutex_destroy(&comp_done_lock);
-    qemu_cond_destroy(&comp_done_cond);
-    g_free(compress_threads);
-    g_free(comp_param);
-    compress_threads = NULL;
-    comp_param = NULL;
+    compress_queue_free(comp_queue, compress_job_cleanup);
+    comp_queue = NULL;
+    comp_job = NULL;
 }
 
-void migrate_compress_threads_create(void)
+int migrate_compress_threads_create(Error **errp)
 {
-    int i, thread_count;
+    int thread_count;
 
     if (!migrate_use_compression()) {
-        return;
+        return 0;
     }
     compression_switch = true;
     thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
-    comp_param = g_new0(CompressParam, thread_count);
-    qemu_cond_init(&comp_done_cond);
-    qemu_mutex_init(&comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        comp_param[i].quit = false;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
-        qemu_thread_create(compress_threads + i, "compress",
-                           do_data_compress, comp_param + i,
-                           QEMU_THREAD_JOINABLE);
-    }
+    /* a frame waiting for every thread, besides the one it compresses */
+    comp_queue = compress_queue_new("compress", thread_count, 2 * thread_count,
+                                    sizeof(CompressJob),
+                                    migration_compress_thread_init,
+                                    do_compress_job, errp);
+    comp_job = NULL;
+    return comp_queue ? 0 : -1;
 }
 
 /**
@@ -439,6 +564,77 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/*
+ * The dirty rate of each vCPU, from the count of the KVM dirty ring, by
+ * cpu_index; NULL without a dirty ring.  Updated every dirty pages rate
+ * period, under the BQL.
+ */
+typedef struct VcpuDirtyState {
+    uint64_t pages_prev;
+    uint64_t rate;
+} VcpuDirtyState;
+
+static VcpuDirtyState *vcpu_dirty;
+
+/*
+ * Unlike mig_throttle_guest_down(), only throttle the vCPUs that dirty
+ * more than vcpu-dirty-limit, each one until it dirties less than that,
+ * and let it go again as soon as it dirties less than half of it.
+ */
+static void mig_throttle_vcpus(int64_t period_ms)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t limit = migrate_vcpu_dirty_limit() << 20;
+    VcpuDirtyState *v;
+    CPUState *cpu;
+    uint64_t pages;
+    int pct;
+
+    CPU_FOREACH(cpu) {
+        v = &vcpu_dirty[cpu->cpu_index];
+        pages = cpu->kvm_dirty_pages;
+        v->rate = (pages - v->pages_prev) * TARGET_PAGE_SIZE * 1000 /
+                  period_ms;
+        v->pages_prev = pages;
+
+        pct = cpu_throttle_get_vcpu_percentage(cpu);
+        if (limit && v->rate > limit) {
+            pct = pct ? pct + s->parameters.cpu_throttle_increment :
+                        s->parameters.cpu_throttle_initial;
+        } else if (pct && (!limit || v->rate < limit / 2)) {
+            pct -= s->parameters.cpu_throttle_increment;
+        } else {
+            continue;
+        }
+        trace_migration_throttle_vcpu(cpu->cpu_index, v->rate, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+}
+
+VcpuDirtyRateList *vcpu_dirty_rates(void)
+{
+    VcpuDirtyRateList *head = NULL, **tail = &head;
+    VcpuDirtyRateList *elem;
+    VcpuDirtyRate *rate;
+    CPUState *cpu;
+
+    if (!vcpu_dirty) {
+        return NULL;
+    }
+    CPU_FOREACH(cpu) {
+        rate = g_new0(VcpuDirtyRate, 1);
+        rate->cpu_index = cpu->cpu_index;
+        rate->dirty_rate = vcpu_dirty[cpu->cpu_index].rate;
+        rate->throttle_percentage = cpu_throttle_get_vcpu_percentage(cpu);
+
+        elem = g_new0(VcpuDirtyRateList, 1);
+        elem->value = rate;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    return head;
+}
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -484,6 +680,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
 
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
+        block->xbzrle_misses++;
         if (!last_stage) {
             if (cache_insert(XBZRLE.cache, current_addr, *current_data,
                              bitmap_sync_count) == -1) {
@@ -497,6 +694,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         return -1;
     }
 
+    block->xbzrle_hits++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -584,12 +782,236 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
-{
+/*
+ * The bitmap sync only fetches the dirty log, which is merged into the
+ * migration bitmap in chunks of RAM_SYNC_CHUNK_PAGES pages by up to
+ * RAM_SYNC_THREADS threads, without the BQL when the caller allows it.
+ * Where the accelerator supports it (KVM with manual dirty log protect),
+ * the log is not re-armed by the sync either: it is cleared a chunk at a
+ * time, right before the first page of the chunk is sent.  Either way the
+ * BQL is held for as long as it takes to copy the log, not to scan or to
+ * write protect the whole guest.
+ */
+#define RAM_SYNC_CHUNK_SHIFT 18
+#define RAM_SYNC_CHUNK_PAGES (1UL << RAM_SYNC_CHUNK_SHIFT)
+#define RAM_SYNC_THREADS 8
+/* do not start a thread for fewer chunks than this */
+#define RAM_SYNC_THREAD_CHUNKS 4
+
+typedef struct RamSyncChunk {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t length;
+    /* merged by the same thread, right after this one */
+    struct RamSyncChunk *next;
+} RamSyncChunk;
+
+typedef struct RamSyncState {
     unsigned long *bitmap;
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    RamSyncChunk *chunks;
+    int n_chunks;
+    int next;
+} RamSyncState;
+
+typedef struct RamSyncThread {
+    QemuThread thread;
+    RamSyncState *state;
+    int64_t dirty;
+} RamSyncThread;
+
+/*
+ * A distributed VM is migrated by all of its instances at once, each one
+ * with its own share of the guest RAM, see dsm_migration_sends(): leave
+ * the pages the other instances send out of the bitmap.
+ */
+/* Clear @nr bits of @bitmap from @start; returns how many were set */
+static uint64_t migration_bitmap_clear_range(unsigned long *bitmap,
+                                             unsigned long start,
+                                             unsigned long nr)
+{
+    unsigned long end = start + nr, bit;
+    uint64_t cleared = 0;
+
+    for (bit = find_next_bit(bitmap, end, start); bit < end;
+         bit = find_next_bit(bitmap, end, bit + 1)) {
+        cleared++;
+    }
+    bitmap_clear(bitmap, start, nr);
+    return cleared;
+}
+
+static uint64_t migration_bitmap_dsm_filter(unsigned long *bitmap,
+                                            RAMBlock *block,
+                                            ram_addr_t offset,
+                                            ram_addr_t length)
+{
+    unsigned long base = block->offset >> TARGET_PAGE_BITS;
+    uint64_t pages = block->used_length >> TARGET_PAGE_BITS;
+    uint64_t i, start = offset >> TARGET_PAGE_BITS;
+    uint64_t end = (offset + length) >> TARGET_PAGE_BITS;
+    uint64_t first, last, cleared = 0;
+
+    /* the kernel DSM shares out stripes: clear around ours in one go */
+    if (dsm_migration_stripe(pages, &first, &last)) {
+        first = MAX(first, start);
+        last = MIN(last, end);
+        if (first >= last) {
+            return migration_bitmap_clear_range(bitmap, base + start,
+                                                end - start);
+        }
+        if (first > start) {
+            cleared += migration_bitmap_clear_range(bitmap, base + start,
+                                                    first - start);
+        }
+        if (end > last) {
+            cleared += migration_bitmap_clear_range(bitmap, base + last,
+                                                    end - last);
+        }
+        return cleared;
+    }
+
+    for (i = start; i < end; i++) {
+        if (!dsm_migration_sends(block->host, pages, i) &&
+            test_and_clear_bit(base + i, bitmap)) {
+            cleared++;
+        }
+    }
+    return cleared;
+}
+
+/* Re-arm the dirty log of @chunk, now or right before it is sent */
+static void migration_bitmap_sync_rearm(RamSyncChunk *chunk)
+{
+    RAMBlock *block = chunk->block;
+
+    if (block->clear_bmap) {
+        bitmap_set_atomic(block->clear_bmap,
+                          chunk->offset >> (TARGET_PAGE_BITS +
+                                            RAM_SYNC_CHUNK_SHIFT),
+                          DIV_ROUND_UP(chunk->length >> TARGET_PAGE_BITS,
+                                       RAM_SYNC_CHUNK_PAGES));
+    } else {
+        /* added after the start of the migration */
+        memory_region_clear_dirty_bitmap(block->mr, chunk->offset,
+                                         chunk->length);
+    }
+}
+
+/* Returns: the change in the number of dirty pages */
+static int64_t migration_bitmap_sync_chunks(RamSyncState *state)
+{
+    RamSyncChunk *first, *chunk;
+    ram_addr_t start;
+    int64_t dirty = 0;
+    int i;
+
+    while ((i = atomic_fetch_inc(&state->next)) < state->n_chunks) {
+        first = &state->chunks[i];
+        for (chunk = first; chunk; chunk = chunk->next) {
+            start = chunk->block->offset + chunk->offset;
+            dirty += cpu_physical_memory_sync_dirty_bitmap(state->bitmap,
+                                                           start,
+                                                           chunk->length);
+        }
+        /*
+         * Merging a block can set the bits of another block that shares
+         * its last word: filter once the whole list is merged.
+         */
+        for (chunk = first; chunk; chunk = chunk->next) {
+            if (dsm_mode != DSM_MODE_NONE) {
+                dirty -= migration_bitmap_dsm_filter(state->bitmap,
+                                                     chunk->block,
+                                                     chunk->offset,
+                                                     chunk->length);
+            }
+            migration_bitmap_sync_rearm(chunk);
+        }
+    }
+    return dirty;
+}
+
+static void *migration_bitmap_sync_thread(void *opaque)
+{
+    RamSyncThread *thread = opaque;
+
+    rcu_register_thread();
+    rcu_read_lock();
+    thread->dirty = migration_bitmap_sync_chunks(thread->state);
+    rcu_read_unlock();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Clear the dirty log of the chunk of @block that @offset is in, if the
+ * last bitmap sync left it armed; called before a page of it is read.
+ */
+static void migration_clear_dirty_log(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long chunk = offset >> (TARGET_PAGE_BITS + RAM_SYNC_CHUNK_SHIFT);
+
+    if (block->clear_bmap && test_and_clear_bit(chunk, block->clear_bmap)) {
+        memory_region_clear_dirty_bitmap(block->mr,
+                                         (ram_addr_t)chunk <<
+                                         (TARGET_PAGE_BITS +
+                                          RAM_SYNC_CHUNK_SHIFT),
+                                         RAM_SYNC_CHUNK_PAGES <<
+                                         TARGET_PAGE_BITS);
+    }
+}
+
+/*
+ * The kernel DSM only lets QEMU access guest RAM directly while it is
+ * pinned, so the share of this instance stays pinned, for reading on the
+ * source and for writing on the destination, until the migration is over.
+ * These pins bypass the DSM pin caches, which are suspended meanwhile and
+ * pin again what they hold after the unpin at the end: otherwise that
+ * would leave the caches counting pages as pinned that are not.
+ */
+static bool ram_dsm_pinned;
+static bool ram_dsm_pinned_write;
+
+static void ram_dsm_pin_share(bool unpin, bool is_write)
+{
+    DSMPinList pins;
+    RAMBlock *block;
+    uint64_t pages, i, first, end;
+
+    dsm_pin_list_init(&pins, NULL, unpin, NULL);
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        pages = block->used_length >> TARGET_PAGE_BITS;
+        if (!dsm_migration_stripe(pages, &first, &end)) {
+            continue;
+        }
+        for (i = first; i < end; i++) {
+            dsm_pin_list_add(&pins,
+                             block->offset + (i << TARGET_PAGE_BITS),
+                             block->host + (i << TARGET_PAGE_BITS),
+                             TARGET_PAGE_SIZE, is_write);
+        }
+    }
+    rcu_read_unlock();
+    dsm_pin_list_flush(&pins);
+}
+
+static void ram_dsm_pin(bool is_write)
+{
+    if (dsm_mode == DSM_MODE_KERNEL && !ram_dsm_pinned) {
+        dsm_pin_cache_suspend();
+        ram_dsm_pin_share(false, is_write);
+        ram_dsm_pinned = true;
+        ram_dsm_pinned_write = is_write;
+    }
+}
+
+void ram_dsm_unpin(void)
+{
+    if (ram_dsm_pinned) {
+        ram_dsm_pin_share(true, ram_dsm_pinned_write);
+        ram_dsm_pinned = false;
+        dsm_pin_cache_resume();
+    }
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -608,14 +1030,9 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
-static void migration_bitmap_sync(void)
+/* Fetch the dirty log; called with the BQL */
+static void migration_bitmap_sync_begin(void)
 {
-    RAMBlock *block;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
-    MigrationState *s = migrate_get_current();
-    int64_t end_time;
-    int64_t bytes_xfer_now;
-
     bitmap_sync_count++;
 
     if (!bytes_xfer_prev) {
@@ -628,23 +1045,109 @@ static void migration_bitmap_sync(void)
 
     trace_migration_bitmap_sync_start();
     memory_global_dirty_log_sync();
+}
+
+/*
+ * Merge the dirty log into the migration bitmap; called with the RCU read
+ * lock, the BQL is not needed.
+ *
+ * Returns: the change in the number of dirty pages
+ */
+static int64_t migration_bitmap_sync_merge(void)
+{
+    RamSyncThread threads[RAM_SYNC_THREADS];
+    RamSyncState state = {};
+    RamSyncChunk *shared = NULL;
+    RAMBlock *block;
+    ram_addr_t offset, length;
+    int64_t dirty;
+    int i, j, n_threads;
 
     qemu_mutex_lock(&migration_bitmap_mutex);
-    rcu_read_lock();
+    state.bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+        state.n_chunks += DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS,
+                                       RAM_SYNC_CHUNK_PAGES);
     }
-    rcu_read_unlock();
+    state.chunks = g_new0(RamSyncChunk, state.n_chunks);
+    i = 0;
+    j = state.n_chunks;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        /*
+         * Chunks that share a word of the migration bitmap cannot be merged
+         * concurrently: cpu_physical_memory_sync_dirty_bitmap() does not
+         * update the words atomically.  That only happens for blocks that
+         * do not start or end at a multiple of BITS_PER_LONG pages, so all
+         * of those go in one list, merged by a single thread; the list is
+         * claimed through its first chunk, the others are at the end of
+         * the array.
+         */
+        if ((block->offset >> TARGET_PAGE_BITS) % BITS_PER_LONG ||
+            ((block->offset + block->used_length) >> TARGET_PAGE_BITS) %
+            BITS_PER_LONG) {
+            if (i >= j) {
+                break;
+            }
+            if (!shared) {
+                shared = &state.chunks[i++];
+            } else {
+                shared->next = &state.chunks[--j];
+                shared = shared->next;
+            }
+            shared->block = block;
+            shared->length = block->used_length;
+            continue;
+        }
+        length = RAM_SYNC_CHUNK_PAGES << TARGET_PAGE_BITS;
+        for (offset = 0; offset < block->used_length && i < j;
+             offset += length) {
+            state.chunks[i].block = block;
+            state.chunks[i].offset = offset;
+            state.chunks[i].length = MIN(length, block->used_length - offset);
+            i++;
+        }
+    }
+    state.n_chunks = i;
+
+    n_threads = MIN(RAM_SYNC_THREADS, state.n_chunks / RAM_SYNC_THREAD_CHUNKS);
+    for (i = 1; i < n_threads; i++) {
+        threads[i].state = &state;
+        qemu_thread_create(&threads[i].thread, "ram-sync",
+                           migration_bitmap_sync_thread, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    dirty = migration_bitmap_sync_chunks(&state);
+    for (i = 1; i < n_threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+        dirty += threads[i].dirty;
+    }
+    migration_dirty_pages += dirty;
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
-    trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
-    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
+    g_free(state.chunks);
+    return dirty;
+}
+
+/* Account for @dirty new dirty pages; called with the BQL */
+static void migration_bitmap_sync_end(int64_t dirty)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t end_time;
+    int64_t bytes_xfer_now;
+
+    ram_send_round = ram_send_count > 0;
+
+    trace_migration_bitmap_sync_end(dirty);
+    num_dirty_pages_period += dirty;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
+        if (vcpu_dirty) {
+            mig_throttle_vcpus(end_time - start_time);
+        }
+        /* a per-vCPU dirty rate limit replaces auto-converge */
+        if (migrate_auto_converge() && !migrate_vcpu_dirty_limit()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -685,6 +1188,18 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/* Called with the BQL */
+static void migration_bitmap_sync(void)
+{
+    int64_t dirty;
+
+    migration_bitmap_sync_begin();
+    rcu_read_lock();
+    dirty = migration_bitmap_sync_merge();
+    rcu_read_unlock();
+    migration_bitmap_sync_end(dirty);
+}
+
 /**
  * save_zero_page: Send the zero page to the stream
  *
@@ -805,95 +1320,132 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+static uint64_t bytes_transferred;
+
+/* A one page frame, in the format of destinations without compress-frames */
+static int compress_job_write_page(QEMUFile *f, CompressJob *job)
 {
-    int bytes_sent, blen;
-    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+    ram_addr_t offset = job->offset;
+    int bytes_sent;
 
-    bytes_sent = save_page_header(f, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    if (blen < 0) {
-        bytes_sent = 0;
-        qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
-        error_report("compressed data failed!");
-    } else {
-        bytes_sent += blen;
+    if (job->block == last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
     }
+    last_sent_block = job->block;
 
-    return bytes_sent;
+    if (job->zero_mask) {
+        bytes_sent = save_page_header(f, job->block,
+                                      offset | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        return bytes_sent + 1;
+    }
+    bytes_sent = save_page_header(f, job->block,
+                                  offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, job->len);
+    qemu_put_buffer(f, job->buf, job->len);
+    return bytes_sent + 4 + job->len;
 }
 
-static uint64_t bytes_transferred;
-
-static void flush_compressed_data(QEMUFile *f)
+/* Write out the frame of @job, which the compression threads are done with */
+static void compress_job_write(QEMUFile *f, CompressJob *job,
+                               uint64_t *bytes_transferred)
 {
-    int idx, len, thread_count;
+    int bytes_sent, zero_pages;
 
-    if (!migrate_use_compression()) {
+    if (job->len < 0) {
+        qemu_file_set_error(f, -EIO);
+        error_report("compressed data failed!");
         return;
     }
-    thread_count = migrate_compress_threads();
 
-    qemu_mutex_lock(&comp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!comp_param[idx].done) {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
+    if (!migrate_use_compress_frames()) {
+        bytes_sent = compress_job_write_page(f, job);
+        goto account;
     }
-    qemu_mutex_unlock(&comp_done_lock);
 
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        if (!comp_param[idx].quit) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
-        }
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+    bytes_sent = save_page_header(f, job->block, job->offset |
+                                  RAM_SAVE_FLAG_COMPRESS_FRAME);
+    qemu_put_byte(f, job->codec);
+    qemu_put_byte(f, job->pages);
+    qemu_put_be64(f, job->zero_mask);
+    qemu_put_be32(f, job->len);
+    qemu_put_buffer(f, job->buf, job->len);
+    bytes_sent += 1 + 1 + 8 + 4 + job->len;
+    /* the header carried the name of the block, the next page can CONTINUE */
+    last_sent_block = job->block;
+
+account:
+    *bytes_transferred += bytes_sent;
+    zero_pages = ctpop64(job->zero_mask);
+    acct_info.dup_pages += zero_pages;
+    acct_info.norm_pages += job->pages - zero_pages;
+    acct_info.compress_pages += job->pages - zero_pages;
+    acct_info.compress_bytes += job->len;
+    acct_info.compress_time_ns += job->ns;
+}
+
+/* Write out the done frames in order, all of them if @wait */
+static void compress_collect(QEMUFile *f, bool wait,
+                             uint64_t *bytes_transferred)
+{
+    CompressJob *job;
+
+    while ((job = compress_queue_oldest(comp_queue, wait))) {
+        compress_job_write(f, job, bytes_transferred);
+        compress_queue_release(comp_queue);
     }
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
+static void compress_submit(void)
+{
+    compress_queue_submit(comp_queue);
+    comp_job = NULL;
+}
+
+static void flush_compressed_data(QEMUFile *f)
 {
-    param->block = block;
-    param->offset = offset;
+    if (!migrate_use_compression() || !comp_queue) {
+        return;
+    }
+    if (comp_job) {
+        compress_submit();
+    }
+    compress_collect(f, true, &bytes_transferred);
 }
 
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
                                            uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    CompressJob *job;
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                comp_param[idx].done = false;
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                qemu_mutex_lock(&comp_param[idx].mutex);
-                set_compress_params(&comp_param[idx], block, offset);
-                qemu_cond_signal(&comp_param[idx].cond);
-                qemu_mutex_unlock(&comp_param[idx].mutex);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+    if (comp_job && (comp_job->block != block ||
+                     comp_job->offset + comp_job->pages * TARGET_PAGE_SIZE !=
+                     offset)) {
+        compress_submit();
+    }
+    if (!comp_job) {
+        while (!(comp_job = compress_queue_reserve(comp_queue))) {
+            /* every slot is busy: wait for the oldest frame */
+            job = compress_queue_oldest(comp_queue, true);
+            compress_job_write(f, job, bytes_transferred);
+            compress_queue_release(comp_queue);
         }
+        comp_job->block = block;
+        comp_job->offset = offset;
+        comp_job->pages = 0;
+        comp_job->codec = migrate_use_compress_frames() ?
+                          migrate_compress_codec() :
+                          MIGRATION_COMPRESS_CODEC_ZLIB;
+        comp_job->level = migrate_compress_level();
     }
-    qemu_mutex_unlock(&comp_done_lock);
+    if (++comp_job->pages == COMPRESS_FRAME_PAGES ||
+        !migrate_use_compress_frames()) {
+        compress_submit();
+    }
+    compress_collect(f, false, bytes_transferred);
 
-    return pages;
+    return 1;
 }
 
 /**
@@ -913,13 +1465,10 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
 {
     int pages = -1;
     uint64_t bytes_xmit = 0;
-    uint8_t *p;
-    int ret, blen;
+    int ret;
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
 
-    p = block->host + offset;
-
     ret = ram_control_save_page(f, block->offset,
                                 offset, TARGET_PAGE_SIZE, &bytes_xmit);
     if (bytes_xmit) {
@@ -935,38 +1484,9 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             }
         }
     } else {
-        /* When starting the process of a new block, the first page of
-         * the block should be sent out before other pages in the same
-         * block, and all the pages in last block should have been sent
-         * out, keeping this order is important, because the 'cont' flag
-         * is used to avoid resending the block name.
-         */
-        if (block != last_sent_block) {
-            flush_compressed_data(f);
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                /* Make sure the first page is sent out before other pages */
-                bytes_xmit = save_page_header(f, block, offset |
-                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
-                if (blen > 0) {
-                    *bytes_transferred += bytes_xmit + blen;
-                    acct_info.norm_pages++;
-                    pages = 1;
-                } else {
-                    qemu_file_set_error(f, blen);
-                    error_report("compressed data failed!");
-                }
-            }
-        } else {
-            offset |= RAM_SAVE_FLAG_CONTINUE;
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
-            }
-        }
+        /* the compression threads look for the zero pages too */
+        pages = compress_page_with_multi_thread(f, block, offset,
+                                                bytes_transferred);
     }
 
     return pages;
@@ -1125,93 +1645,372 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
         pss->offset = offset;
     }
 
-    return !!block;
+    return !!block;
+}
+
+/**
+ * flush_page_queue: Flush any remaining pages in the ram request queue
+ *    it should be empty at the end anyway, but in error cases there may be
+ *    some left.
+ *
+ * ms: MigrationState
+ */
+void flush_page_queue(MigrationState *ms)
+{
+    struct MigrationSrcPageRequest *mspr, *next_mspr;
+    /* This queue generally should be empty - but in the case of a failed
+     * migration might have some droppings in.
+     */
+    rcu_read_lock();
+    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_requests, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+        g_free(mspr);
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Queue the pages for transmission, e.g. a request from postcopy destination
+ *   ms: MigrationStatus in which the queue is held
+ *   rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
+ *   start: Offset from the start of the RAMBlock
+ *   len: Length (in bytes) to send
+ *   Return: 0 on success
+ */
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len)
+{
+    RAMBlock *ramblock;
+
+    ms->postcopy_requests++;
+    rcu_read_lock();
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = ms->last_req_rb;
+
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        ramblock = qemu_ram_block_by_name(rbname);
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        ms->last_req_rb = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (start+len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    struct MigrationSrcPageRequest *new_entry =
+        g_malloc0(sizeof(struct MigrationSrcPageRequest));
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
+static void ram_channel_send_batch(RamSendChannel *ch, RamChannelBatch *batch,
+                                   RAMBlock **last_block)
+{
+    QEMUFile *f = ch->file;
+    RAMBlock *block = batch->block;
+    int64_t pos = qemu_ftell_fast(f);
+    uint8_t *p;
+    int i;
+
+    for (i = 0; i < batch->pages; i++) {
+        ram_addr_t offset = batch->offset[i];
+
+        if (block == *last_block) {
+            offset |= RAM_SAVE_FLAG_CONTINUE;
+        }
+        *last_block = block;
+
+        p = block->host + batch->offset[i];
+        if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+            save_page_header(f, block, offset | RAM_SAVE_FLAG_COMPRESS);
+            qemu_put_byte(f, 0);
+            atomic_inc(&acct_info.dup_pages);
+        } else {
+            save_page_header(f, block, offset | RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+            atomic_inc(&acct_info.norm_pages);
+        }
+    }
+    qemu_fflush(f);
+    atomic_add(&ram_send_bytes, qemu_ftell_fast(f) - pos);
+}
+
+static void *ram_channel_send_thread(void *opaque)
+{
+    RamSendChannel *ch = opaque;
+    RamChannelBatch batch;
+    RAMBlock *last_block = NULL;
+    QIOChannel *ioc;
+    Error *err = NULL;
+    bool sync, quit;
+
+    ioc = socket_send_channel_create(&err);
+    qemu_mutex_lock(&ch->mutex);
+    if (ioc) {
+        ch->file = qemu_fopen_channel_output(ioc);
+        object_unref(OBJECT(ioc));
+        qemu_put_be32(ch->file, RAM_CHANNEL_MAGIC);
+        qemu_put_be32(ch->file, ch->id);
+        /* the destination tells the channels by it, see migration/socket.c */
+        qemu_fflush(ch->file);
+    } else {
+        error_reportf_err(err, "RAM channel %d: ", ch->id);
+        ch->failed = true;
+    }
+
+    while (true) {
+        if (!ch->batch.pages && !ch->sync && !ch->quit) {
+            qemu_cond_wait(&ch->cond, &ch->mutex);
+            continue;
+        }
+        batch = ch->batch;
+        sync = ch->sync;
+        quit = ch->quit;
+        ch->batch.pages = 0;
+        ch->sync = false;
+        qemu_cond_signal(&ch->cond);
+        qemu_mutex_unlock(&ch->mutex);
+
+        /* after a failure the work is dropped, the migration fails */
+        if (!atomic_read(&ch->failed)) {
+            if (batch.pages) {
+                ram_channel_send_batch(ch, &batch, &last_block);
+            }
+            if (sync) {
+                qemu_put_be64(ch->file, RAM_SAVE_FLAG_CHANNEL_SYNC);
+            }
+            if (quit) {
+                qemu_put_be64(ch->file, RAM_SAVE_FLAG_EOS);
+            }
+            qemu_fflush(ch->file);
+            if (qemu_file_get_error(ch->file)) {
+                atomic_set(&ch->failed, true);
+            }
+        }
+        qemu_mutex_lock(&ch->mutex);
+        if (quit) {
+            ch->done = true;
+            qemu_cond_signal(&ch->cond);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&ch->mutex);
+
+    return NULL;
+}
+
+void migrate_ram_channels_create(void)
+{
+    int i, count = migrate_ram_channels();
+
+    if (count < 2) {
+        return;
+    }
+    ram_send = g_new0(RamSendChannel, count);
+    ram_send_count = count;
+    ram_send_batch.pages = 0;
+    ram_send_round = false;
+    ram_send_bytes = 0;
+    for (i = 0; i < count; i++) {
+        ram_send[i].id = i;
+        qemu_mutex_init(&ram_send[i].mutex);
+        qemu_cond_init(&ram_send[i].cond);
+        qemu_thread_create(&ram_send[i].thread, "ram channel",
+                           ram_channel_send_thread, ram_send + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Unblock the sender threads of a cancelled migration */
+void migrate_ram_channels_shutdown(void)
+{
+    int i;
+
+    for (i = 0; i < ram_send_count; i++) {
+        qemu_mutex_lock(&ram_send[i].mutex);
+        if (ram_send[i].file) {
+            qemu_file_shutdown(ram_send[i].file);
+        }
+        qemu_mutex_unlock(&ram_send[i].mutex);
+    }
+}
+
+void migrate_ram_channels_join(void)
+{
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    if (!ram_send_count) {
+        return;
+    }
+    if (s->state != MIGRATION_STATUS_COMPLETED) {
+        migrate_ram_channels_shutdown();
+    }
+    for (i = 0; i < ram_send_count; i++) {
+        qemu_mutex_lock(&ram_send[i].mutex);
+        ram_send[i].quit = true;
+        qemu_cond_signal(&ram_send[i].cond);
+        qemu_mutex_unlock(&ram_send[i].mutex);
+    }
+    for (i = 0; i < ram_send_count; i++) {
+        qemu_thread_join(&ram_send[i].thread);
+        if (ram_send[i].file) {
+            qemu_fclose(ram_send[i].file);
+        }
+        qemu_mutex_destroy(&ram_send[i].mutex);
+        qemu_cond_destroy(&ram_send[i].cond);
+    }
+    g_free(ram_send);
+    ram_send = NULL;
+    ram_send_count = 0;
+}
+
+/* Count what the channels sent against the migration stream */
+static void ram_channels_account(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    int64_t sent = atomic_xchg(&ram_send_bytes, 0);
+    int i;
+
+    qemu_update_position(f, sent);
+    qemu_file_update_transfer(f, sent);
+    *bytes_transferred += sent;
+
+    for (i = 0; i < ram_send_count; i++) {
+        if (atomic_read(&ram_send[i].failed)) {
+            qemu_file_set_error(f, -EIO);
+        }
+    }
+}
+
+/* Hand the batch being filled over to the sender thread of its chunk */
+static void ram_channels_flush(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    RamSendChannel *ch;
+
+    if (!ram_send_batch.pages) {
+        return;
+    }
+    ch = &ram_send[ram_send_chunk % ram_send_count];
+
+    qemu_mutex_lock(&ch->mutex);
+    while (ch->batch.pages) {
+        qemu_cond_wait(&ch->cond, &ch->mutex);
+    }
+    ch->batch = ram_send_batch;
+    qemu_cond_signal(&ch->cond);
+    qemu_mutex_unlock(&ch->mutex);
+
+    ram_send_batch.pages = 0;
+    ram_channels_account(f, bytes_transferred);
+}
+
+/* End the round of pages on every channel and on the migration stream */
+static void ram_channels_sync(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    RamSendChannel *ch;
+    int i;
+
+    ram_channels_flush(f, bytes_transferred);
+    for (i = 0; i < ram_send_count; i++) {
+        ch = &ram_send[i];
+        qemu_mutex_lock(&ch->mutex);
+        while (ch->sync) {
+            qemu_cond_wait(&ch->cond, &ch->mutex);
+        }
+        ch->sync = true;
+        qemu_cond_signal(&ch->cond);
+        qemu_mutex_unlock(&ch->mutex);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL_SYNC);
+    *bytes_transferred += 8;
+    ram_send_round = false;
 }
 
-/**
- * flush_page_queue: Flush any remaining pages in the ram request queue
- *    it should be empty at the end anyway, but in error cases there may be
- *    some left.
- *
- * ms: MigrationState
+/*
+ * End every channel and wait until its last pages, RAM_SAVE_FLAG_CHANNEL_SYNC
+ * and RAM_SAVE_FLAG_EOS are flushed, so that a failure to send them fails
+ * the migration stream before the source declares the migration completed.
  */
-void flush_page_queue(MigrationState *ms)
+static void ram_channels_finish(QEMUFile *f, uint64_t *bytes_transferred)
 {
-    struct MigrationSrcPageRequest *mspr, *next_mspr;
-    /* This queue generally should be empty - but in the case of a failed
-     * migration might have some droppings in.
-     */
-    rcu_read_lock();
-    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_requests, next_req, next_mspr) {
-        memory_region_unref(mspr->rb->mr);
-        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
-        g_free(mspr);
+    RamSendChannel *ch;
+    int i;
+
+    for (i = 0; i < ram_send_count; i++) {
+        ch = &ram_send[i];
+        qemu_mutex_lock(&ch->mutex);
+        ch->quit = true;
+        qemu_cond_signal(&ch->cond);
+        while (!ch->done) {
+            qemu_cond_wait(&ch->cond, &ch->mutex);
+        }
+        qemu_mutex_unlock(&ch->mutex);
     }
-    rcu_read_unlock();
+    ram_channels_account(f, bytes_transferred);
 }
 
 /**
- * Queue the pages for transmission, e.g. a request from postcopy destination
- *   ms: MigrationStatus in which the queue is held
- *   rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
- *   start: Offset from the start of the RAMBlock
- *   len: Length (in bytes) to send
- *   Return: 0 on success
+ * ram_channels_queue_page: queue a page for the RAM channels
+ *
+ * Returns: Number of pages queued.
+ *
+ * @f: QEMUFile of the migration stream
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ * @bytes_transferred: increase it with the bytes the channels sent
  */
-int ram_save_queue_pages(MigrationState *ms, const char *rbname,
-                         ram_addr_t start, ram_addr_t len)
+static int ram_channels_queue_page(QEMUFile *f, RAMBlock *block,
+                                   ram_addr_t offset,
+                                   uint64_t *bytes_transferred)
 {
-    RAMBlock *ramblock;
-
-    ms->postcopy_requests++;
-    rcu_read_lock();
-    if (!rbname) {
-        /* Reuse last RAMBlock */
-        ramblock = ms->last_req_rb;
-
-        if (!ramblock) {
-            /*
-             * Shouldn't happen, we can't reuse the last RAMBlock if
-             * it's the 1st request.
-             */
-            error_report("ram_save_queue_pages no previous block");
-            goto err;
-        }
-    } else {
-        ramblock = qemu_ram_block_by_name(rbname);
+    ram_addr_t chunk = (block->offset + offset) >>
+                       (TARGET_PAGE_BITS + RAM_CHANNEL_BATCH_BITS);
 
-        if (!ramblock) {
-            /* We shouldn't be asked for a non-existent RAMBlock */
-            error_report("ram_save_queue_pages no block '%s'", rbname);
-            goto err;
-        }
-        ms->last_req_rb = ramblock;
+    if (ram_send_batch.pages &&
+        (ram_send_batch.block != block || ram_send_chunk != chunk)) {
+        ram_channels_flush(f, bytes_transferred);
     }
-    trace_ram_save_queue_pages(ramblock->idstr, start, len);
-    if (start+len > ramblock->used_length) {
-        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
-                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
-                     __func__, start, len, ramblock->used_length);
-        goto err;
+    if (!ram_send_batch.pages) {
+        ram_send_batch.block = block;
+        ram_send_chunk = chunk;
     }
-
-    struct MigrationSrcPageRequest *new_entry =
-        g_malloc0(sizeof(struct MigrationSrcPageRequest));
-    new_entry->rb = ramblock;
-    new_entry->offset = start;
-    new_entry->len = len;
-
-    memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&ms->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
-    qemu_mutex_unlock(&ms->src_page_req_mutex);
-    rcu_read_unlock();
-
-    return 0;
-
-err:
-    rcu_read_unlock();
-    return -1;
+    ram_send_batch.offset[ram_send_batch.pages++] = offset;
+    if (ram_send_batch.pages == RAM_CHANNEL_BATCH) {
+        ram_channels_flush(f, bytes_transferred);
+    }
+    return 1;
 }
 
 /**
@@ -1238,7 +2037,12 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     /* Check the pages is dirty and if it is send it */
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
         unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
+
+        migration_clear_dirty_log(pss->block, pss->offset);
+        if (ram_send_count) {
+            res = ram_channels_queue_page(f, pss->block, pss->offset,
+                                          bytes_transferred);
+        } else if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
@@ -1421,12 +2225,24 @@ static void ram_migration_cleanup(void *opaque)
      * no writing race against this migration_bitmap
      */
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
+    RAMBlock *block;
+
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
 
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->clear_bmap);
+        block->clear_bmap = NULL;
+    }
+    rcu_read_unlock();
+    g_free(vcpu_dirty);
+    vcpu_dirty = NULL;
+    ram_dsm_unpin();
+
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
@@ -1462,7 +2278,7 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         bitmap->bmap = bitmap_new(new);
 
         /* prevent migration_bitmap content from being set bit
-         * by migration_bitmap_sync_range() at the same time.
+         * by migration_bitmap_sync_merge() at the same time.
          * it is safe to migration if migration_bitmap is cleared bit
          * at the same time.
          */
@@ -1477,8 +2293,8 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         bitmap->unsentmap = NULL;
 
         atomic_rcu_set(&migration_bitmap_rcu, bitmap);
-        qemu_mutex_unlock(&migration_bitmap_mutex);
         migration_dirty_pages += new - old;
+        qemu_mutex_unlock(&migration_bitmap_mutex);
         call_rcu(old_bitmap, migration_bitmap_free, rcu);
     }
 }
@@ -1875,6 +2691,8 @@ err:
 static int ram_save_init_globals(void)
 {
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    RAMBlock *block;
+    CPUState *cpu;
 
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
@@ -1915,10 +2733,26 @@ static int ram_save_init_globals(void)
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
 
+    if (kvm_dirty_ring_enabled()) {
+        g_free(vcpu_dirty);
+        vcpu_dirty = g_new0(VcpuDirtyState, max_cpus);
+        CPU_FOREACH(cpu) {
+            vcpu_dirty[cpu->cpu_index].pages_prev = cpu->kvm_dirty_pages;
+        }
+    }
+
     qemu_mutex_lock_ramlist();
     rcu_read_lock();
     bytes_transferred = 0;
     reset_ram_globals();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->xbzrle_hits = 0;
+        block->xbzrle_misses = 0;
+        g_free(block->clear_bmap);
+        block->clear_bmap = bitmap_new(DIV_ROUND_UP(block->max_length >>
+                                                    TARGET_PAGE_BITS,
+                                                    RAM_SYNC_CHUNK_PAGES));
+    }
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
@@ -1938,6 +2772,7 @@ static int ram_save_init_globals(void)
 
     memory_global_dirty_log_start();
     migration_bitmap_sync();
+    ram_dsm_pin(false);
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
     rcu_read_unlock();
@@ -1999,6 +2834,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (ram_send_round) {
+        ram_channels_sync(f, &bytes_transferred);
+    }
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -2028,6 +2867,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (ram_send_count) {
+        ram_channels_flush(f, &bytes_transferred);
+    }
     rcu_read_unlock();
 
     /*
@@ -2073,6 +2915,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (ram_send_count) {
+        ram_channels_sync(f, &bytes_transferred);
+        ram_channels_finish(f, &bytes_transferred);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2092,10 +2938,17 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     if (!migration_in_postcopy(migrate_get_current()) &&
         remaining_size < max_size) {
+        int64_t dirty;
+
+        /* only fetching the log and the accounting need the BQL */
         qemu_mutex_lock_iothread();
+        migration_bitmap_sync_begin();
+        qemu_mutex_unlock_iothread();
         rcu_read_lock();
-        migration_bitmap_sync();
+        dirty = migration_bitmap_sync_merge();
         rcu_read_unlock();
+        qemu_mutex_lock_iothread();
+        migration_bitmap_sync_end(dirty);
         qemu_mutex_unlock_iothread();
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
@@ -2199,134 +3052,132 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
-static void *do_data_decompress(void *opaque)
+static void do_decompress_job(void *opaque)
 {
-    DecompressParam *param = opaque;
-    unsigned long pagesize;
-    uint8_t *des;
-    int len;
-
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->des) {
-            des = param->des;
-            len = param->len;
-            param->des = 0;
-            qemu_mutex_unlock(&param->mutex);
-
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
-             * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
-             */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
-
-            qemu_mutex_lock(&decomp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&decomp_done_cond);
-            qemu_mutex_unlock(&decomp_done_lock);
+    DecompressJob *job = opaque;
+    size_t len = (job->pages - ctpop64(job->zero_mask)) * TARGET_PAGE_SIZE;
+    uint8_t *des = job->host;
+    uint8_t *page;
+    int i;
 
-            qemu_mutex_lock(&param->mutex);
+    if (job->zero_mask && len) {
+        if (!job->scratch) {
+            job->scratch = g_malloc(COMPRESS_FRAME_SIZE);
+        }
+        des = job->scratch;
+    }
+    /*
+     * A page dirtied while it was compressed only makes the data stale,
+     * and is sent again; a frame that does not decompress to its pages is
+     * corrupt.
+     */
+    job->failed = len &&
+        migration_decompress(job->codec, job->compbuf, job->len, des,
+                             len) != (ssize_t)len;
+    if (job->failed) {
+        error_report("Corrupt compressed frame of %d pages at %p",
+                     job->pages, job->host);
+        return;
+    }
+    if (!job->zero_mask) {
+        return;
+    }
+    for (i = 0; i < job->pages; i++) {
+        page = (uint8_t *)job->host + i * TARGET_PAGE_SIZE;
+        if (job->zero_mask & (1ULL << i)) {
+            ram_handle_compressed(page, 0, TARGET_PAGE_SIZE);
         } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+            memcpy(page, des, TARGET_PAGE_SIZE);
+            des += TARGET_PAGE_SIZE;
         }
     }
-    qemu_mutex_unlock(&param->mutex);
+}
 
-    return NULL;
+static void decompress_job_cleanup(void *opaque)
+{
+    DecompressJob *job = opaque;
+
+    g_free(job->compbuf);
+    g_free(job->scratch);
 }
 
-static void wait_for_decompress_done(void)
+/*
+ * Take back the done decompression jobs, waiting for them if @wait;
+ * Returns: -EIO if one of them failed
+ */
+static int decompress_collect(bool wait)
 {
-    int idx, thread_count;
+    DecompressJob *job;
+    int ret = 0;
 
-    if (!migrate_use_compression()) {
-        return;
+    while ((job = compress_queue_oldest(decomp_queue, wait))) {
+        if (job->failed) {
+            ret = -EIO;
+        }
+        compress_queue_release(decomp_queue);
     }
+    return ret;
+}
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!decomp_param[idx].done) {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
-        }
+static int wait_for_decompress_done(void)
+{
+    if (!decomp_queue) {
+        return 0;
     }
-    qemu_mutex_unlock(&decomp_done_lock);
+    return decompress_collect(true);
 }
 
-void migrate_decompress_threads_create(void)
+int migrate_decompress_threads_create(Error **errp)
 {
-    int i, thread_count;
+    int thread_count;
 
     thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    qemu_mutex_init(&decomp_done_lock);
-    qemu_cond_init(&decomp_done_cond);
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        decomp_param[i].done = true;
-        decomp_param[i].quit = false;
-        qemu_thread_create(decompress_threads + i, "decompress",
-                           do_data_decompress, decomp_param + i,
-                           QEMU_THREAD_JOINABLE);
-    }
+    decomp_queue = compress_queue_new("decompress", thread_count,
+                                      2 * thread_count,
+                                      sizeof(DecompressJob),
+                                      migration_decompress_thread_init,
+                                      do_decompress_job, errp);
+    return decomp_queue ? 0 : -1;
 }
 
 void migrate_decompress_threads_join(void)
 {
-    int i, thread_count;
-
-    thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        decomp_param[i].quit = true;
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
-    }
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
-    }
-    g_free(decompress_threads);
-    g_free(decomp_param);
-    decompress_threads = NULL;
-    decomp_param = NULL;
+    compress_queue_free(decomp_queue, decompress_job_cleanup);
+    decomp_queue = NULL;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+/* Returns: -EIO if a frame queued before this one was corrupt */
+static int decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                              MigrationCompressCodec codec,
+                                              int pages, uint64_t zero_mask,
+                                              int len)
 {
-    int idx, thread_count;
+    DecompressJob *job;
+    int ret;
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
-                break;
-            }
-        }
-        if (idx < thread_count) {
-            break;
-        } else {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    /* take back what is done already, and wait if nothing is free */
+    ret = decompress_collect(false);
+    while (!(job = compress_queue_reserve(decomp_queue))) {
+        job = compress_queue_oldest(decomp_queue, true);
+        if (job->failed) {
+            ret = -EIO;
         }
+        compress_queue_release(decomp_queue);
+    }
+
+    if (job->size < len) {
+        g_free(job->compbuf);
+        job->compbuf = g_malloc(len);
+        job->size = len;
     }
-    qemu_mutex_unlock(&decomp_done_lock);
+    qemu_get_buffer(f, job->compbuf, len);
+    job->host = host;
+    job->codec = codec;
+    job->pages = pages;
+    job->zero_mask = zero_mask;
+    job->len = len;
+    compress_queue_submit(decomp_queue);
+    return ret;
 }
 
 /*
@@ -2462,6 +3313,203 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/* Whether every RAM channel delivered the pages of the rounds ram_load saw */
+static int ram_channels_synced(void)
+{
+    int i;
+
+    if (ram_recv_failed) {
+        return -EIO;
+    }
+    if (ram_recv_count < migrate_ram_channels()) {
+        return 0;
+    }
+    for (i = 0; i < ram_recv_count; i++) {
+        if (ram_recv[i].syncs < ram_recv_syncs) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void ram_channels_wake_bh(void *opaque)
+{
+    qemu_coroutine_enter(opaque);
+}
+
+/* Called with ram_recv_lock held */
+static void ram_channels_wake(void)
+{
+    if (ram_recv_co && ram_channels_synced()) {
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                ram_channels_wake_bh, ram_recv_co);
+        ram_recv_co = NULL;
+    }
+}
+
+static int ram_channel_recv_page(QEMUFile *f, RAMBlock **block,
+                                 ram_addr_t addr, int flags)
+{
+    char id[256];
+    uint8_t len;
+    void *host;
+
+    if (!(flags & RAM_SAVE_FLAG_CONTINUE)) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        *block = qemu_ram_block_by_name(id);
+        if (!*block) {
+            error_report("RAM channel: can't find block %s", id);
+            return -EINVAL;
+        }
+    }
+    host = *block ? host_from_ram_block_offset(*block, addr) : NULL;
+    if (!host) {
+        error_report("RAM channel: illegal RAM offset " RAM_ADDR_FMT, addr);
+        return -EINVAL;
+    }
+
+    switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+    case RAM_SAVE_FLAG_COMPRESS:
+        ram_handle_compressed(host, qemu_get_byte(f), TARGET_PAGE_SIZE);
+        break;
+    case RAM_SAVE_FLAG_PAGE:
+        qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        break;
+    default:
+        error_report("RAM channel: unknown combination of migration flags: "
+                     "%#x", flags);
+        return -EINVAL;
+    }
+    return qemu_file_get_error(f);
+}
+
+static void *ram_channel_recv_thread(void *opaque)
+{
+    RamRecvChannel *ch = opaque;
+    QEMUFile *f = ch->file;
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    int flags, ret = 0;
+
+    rcu_register_thread();
+
+    if (qemu_get_be32(f) != RAM_CHANNEL_MAGIC) {
+        error_report("RAM channel: bad magic");
+        ret = -EINVAL;
+    } else {
+        ch->id = qemu_get_be32(f);
+        ret = qemu_file_get_error(f);
+    }
+
+    while (!ret) {
+        addr = qemu_get_be64(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        if (flags & RAM_SAVE_FLAG_CHANNEL_SYNC) {
+            qemu_mutex_lock(&ram_recv_lock);
+            ch->syncs++;
+            ram_channels_wake();
+            qemu_mutex_unlock(&ram_recv_lock);
+            continue;
+        }
+
+        rcu_read_lock();
+        ret = ram_channel_recv_page(f, &block, addr, flags);
+        rcu_read_unlock();
+    }
+
+    qemu_mutex_lock(&ram_recv_lock);
+    if (ret && !ram_recv_closing) {
+        error_report("RAM channel %d failed: %s", ch->id, strerror(-ret));
+        ram_recv_failed = true;
+        ram_channels_wake();
+    }
+    qemu_mutex_unlock(&ram_recv_lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* A RAM channel of the incoming migration was accepted */
+void ram_channel_process_incoming(QIOChannel *ioc)
+{
+    int count = migrate_ram_channels();
+    RamRecvChannel *ch;
+
+    qemu_mutex_lock(&ram_recv_lock);
+    if (!ram_recv) {
+        ram_recv = g_new0(RamRecvChannel, count);
+    }
+    if (ram_recv_count == count) {
+        qemu_mutex_unlock(&ram_recv_lock);
+        error_report("RAM channel: more channels than ram-channels");
+        return;
+    }
+    ch = &ram_recv[ram_recv_count];
+    ch->id = ram_recv_count;
+    ch->ioc = ioc;
+    ch->file = qemu_fopen_channel_input(ioc);
+    qemu_file_set_blocking(ch->file, true);
+    qemu_thread_create(&ch->thread, "ram channel", ram_channel_recv_thread,
+                       ch, QEMU_THREAD_JOINABLE);
+    ram_recv_count++;
+    ram_channels_wake();
+    qemu_mutex_unlock(&ram_recv_lock);
+}
+
+/* RAM_SAVE_FLAG_CHANNEL_SYNC on the migration stream */
+static int ram_channels_wait_sync(void)
+{
+    int ret;
+
+    assert(qemu_in_coroutine());
+
+    qemu_mutex_lock(&ram_recv_lock);
+    ram_recv_syncs++;
+    /* the channels are accepted, and ram_load woken, in the main loop */
+    while (!(ret = ram_channels_synced())) {
+        ram_recv_co = qemu_coroutine_self();
+        qemu_mutex_unlock(&ram_recv_lock);
+        qemu_coroutine_yield();
+        qemu_mutex_lock(&ram_recv_lock);
+    }
+    qemu_mutex_unlock(&ram_recv_lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+void migrate_ram_channels_recv_join(void)
+{
+    int i;
+
+    qemu_mutex_lock(&ram_recv_lock);
+    ram_recv_closing = true;
+    qemu_mutex_unlock(&ram_recv_lock);
+
+    /* the last round is in, whatever is still coming is of no use */
+    for (i = 0; i < ram_recv_count; i++) {
+        qio_channel_shutdown(ram_recv[i].ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        qemu_thread_join(&ram_recv[i].thread);
+        qemu_fclose(ram_recv[i].file);
+    }
+    g_free(ram_recv);
+    ram_recv = NULL;
+    ram_recv_count = 0;
+    ram_recv_syncs = 0;
+    ram_recv_failed = false;
+    ram_recv_closing = false;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -2472,6 +3520,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      * be atomic
      */
     bool postcopy_running = postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING;
+    MigrationCompressCodec codec;
+    uint64_t zero_mask;
+    int pages;
 
     seq_iter++;
 
@@ -2492,6 +3543,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        RAMBlock *block = NULL;
         void *host = NULL;
         uint8_t ch;
 
@@ -2500,8 +3552,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         addr &= TARGET_PAGE_MASK;
 
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_COMPRESS_FRAME)) {
+            block = ram_block_from_stream(f, flags);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2546,6 +3599,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            /* with their final sizes, this instance's share can be pinned */
+            if (!ret) {
+                ram_dsm_pin(true);
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
@@ -2564,7 +3621,41 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            ret = decompress_data_with_multi_threads(f, host,
+                                                MIGRATION_COMPRESS_CODEC_ZLIB,
+                                                1, 0, len);
+            break;
+
+        case RAM_SAVE_FLAG_COMPRESS_FRAME:
+            codec = qemu_get_byte(f);
+            pages = qemu_get_byte(f);
+            zero_mask = qemu_get_be64(f);
+            len = qemu_get_be32(f);
+            if (codec >= MIGRATION_COMPRESS_CODEC__MAX ||
+                !migration_codec_available(codec)) {
+                error_report("Unsupported compression codec: %d", codec);
+                ret = -EINVAL;
+                break;
+            }
+            if (pages < 1 || pages > COMPRESS_FRAME_PAGES ||
+                !host_from_ram_block_offset(block, addr +
+                                            pages * TARGET_PAGE_SIZE - 1)) {
+                error_report("Invalid compressed frame at " RAM_ADDR_FMT
+                             ": %d pages", addr, pages);
+                ret = -EINVAL;
+                break;
+            }
+            if (len < 0 || len > migration_compress_bound(codec,
+                                                 COMPRESS_FRAME_SIZE)) {
+                error_report("Invalid compressed data length: %d", len);
+                ret = -EINVAL;
+                break;
+            }
+            if (pages < COMPRESS_FRAME_PAGES) {
+                zero_mask &= (1ULL << pages) - 1;
+            }
+            ret = decompress_data_with_multi_threads(f, host, codec, pages,
+                                                     zero_mask, len);
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
@@ -2575,6 +3666,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_CHANNEL_SYNC:
+            ret = ram_channels_wait_sync();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2592,7 +3686,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
-    wait_for_decompress_done();
+    if (wait_for_decompress_done() < 0 && !ret) {
+        ret = -EIO;
+    }
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -2612,5 +3708,6 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&ram_recv_lock);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
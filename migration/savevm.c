@@ -54,6 +54,7 @@
 #include "qemu/cutils.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
+#include "interrupt-router.h"
 
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
@@ -1117,6 +1118,11 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
             trace_savevm_section_skip(se->idstr, se->section_id);
             continue;
         }
+        /* a vCPU of a distributed VM that runs on another instance */
+        if (!router_migration_sends_state(se->opaque)) {
+            trace_savevm_section_skip(se->idstr, se->section_id);
+            continue;
+        }
 
         trace_savevm_section_start(se->idstr, se->section_id);
 
@@ -22,6 +22,8 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "io/channel-socket.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
 #include "trace.h"
 
 
@@ -55,6 +57,18 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Where the RAM channels of the current outgoing migration connect to */
+static SocketAddress *outgoing_saddr;
+
+/*
+ * The listener of the current incoming migration, and the connections it
+ * took so far: the migration stream and the RAM channels.
+ */
+static QIOChannel *incoming_listener;
+static guint incoming_watch;
+static bool incoming_stream;
+static int incoming_ram_channels;
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -96,6 +110,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
     struct SocketConnectData *data = g_new0(struct SocketConnectData, 1);
 
     data->s = s;
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = QAPI_CLONE(SocketAddress, saddr);
     if (saddr->type == SOCKET_ADDRESS_KIND_INET) {
         data->hostname = g_strdup(saddr->u.inet.data->host);
     }
@@ -129,6 +145,79 @@ void unix_start_outgoing_migration(MigrationState *s,
     socket_start_outgoing_migration(s, saddr, errp);
 }
 
+/*
+ * Open one more connection to the destination of the current migration,
+ * for a RAM channel; called by its sender thread.
+ */
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc = qio_channel_socket_new();
+
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-ram-channel");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+
+/* Close the listener of the incoming migration, once it is over */
+void socket_incoming_migration_end(void)
+{
+    if (!incoming_listener) {
+        return;
+    }
+    qio_channel_close(incoming_listener, NULL);
+    /* drops the reference of the watch */
+    g_source_remove(incoming_watch);
+    incoming_listener = NULL;
+}
+
+/*
+ * A connection of an incoming migration with ram-channels above 1: the
+ * migration stream or a RAM channel, told apart by their first word rather
+ * than by the order they are accepted in.
+ */
+static gboolean socket_incoming_classify(QIOChannel *ioc,
+                                         GIOCondition condition,
+                                         gpointer opaque)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    uint32_t magic;
+    ssize_t len;
+
+    len = recv(sioc->fd, &magic, sizeof(magic), MSG_PEEK);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return TRUE;
+    }
+    if (len > 0 && len < (ssize_t)sizeof(magic)) {
+        return TRUE; /* the rest of the word is on its way */
+    }
+    if (len <= 0 || !incoming_listener) {
+        /* the migration is over, or the peer went away */
+        return FALSE;
+    }
+
+    if (be32_to_cpu(magic) == RAM_CHANNEL_MAGIC) {
+        qio_channel_set_name(ioc, "migration-socket-ram-channel");
+        ram_channel_process_incoming(ioc);
+        incoming_ram_channels++;
+    } else if (!incoming_stream) {
+        qio_channel_set_name(ioc, "migration-socket-incoming");
+        migration_channel_process_incoming(migrate_get_current(), ioc);
+        incoming_stream = true;
+    } else {
+        error_report("unexpected connection to the incoming migration");
+    }
+
+    if (incoming_stream &&
+        incoming_ram_channels >= migrate_ram_channels()) {
+        /* everything is there */
+        socket_incoming_migration_end();
+    }
+    return FALSE; /* unregister */
+}
 
 static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
                                                  GIOCondition condition,
@@ -147,6 +236,14 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
+    if (migrate_ram_channels() > 1) {
+        /* holds a reference to @sioc until it is classified */
+        qio_channel_add_watch(QIO_CHANNEL(sioc), G_IO_IN,
+                              socket_incoming_classify, sioc,
+                              (GDestroyNotify)object_unref);
+        return TRUE; /* wait for the other connections */
+    }
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-incoming");
     migration_channel_process_incoming(migrate_get_current(),
                                        QIO_CHANNEL(sioc));
@@ -155,6 +252,7 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
+    incoming_listener = NULL;
     return FALSE; /* unregister */
 }
 
@@ -173,11 +271,14 @@ static void socket_start_incoming_migration(SocketAddress *saddr,
         return;
     }
 
-    qio_channel_add_watch(QIO_CHANNEL(listen_ioc),
-                          G_IO_IN,
-                          socket_accept_incoming_migration,
-                          listen_ioc,
-                          (GDestroyNotify)object_unref);
+    incoming_listener = QIO_CHANNEL(listen_ioc);
+    incoming_stream = false;
+    incoming_ram_channels = 0;
+    incoming_watch = qio_channel_add_watch(QIO_CHANNEL(listen_ioc),
+                                           G_IO_IN,
+                                           socket_accept_incoming_migration,
+                                           listen_ioc,
+                                           (GDestroyNotify)object_unref);
     qapi_free_SocketAddress(saddr);
 }
 
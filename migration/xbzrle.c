@@ -12,8 +12,286 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+/*
+ * The encoder looks for where the runs end with the widest compare the
+ * host has, chosen at startup like util/bufferiszero.c does. Both return
+ * the first index from @i on, or @slen, where the bytes of @old_buf and
+ * @new_buf are equal (xbzrle_nzrun_*) or differ (xbzrle_zrun_*).
+ */
+typedef int XbzrleScanFn(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen);
+
+static int xbzrle_zrun_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed */
+    if (!(i % sizeof(long))) {
+        while (i < slen &&
+               *(long *)(old_buf + i) == *(long *)(new_buf + i)) {
+            i += sizeof(long);
+        }
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!(i % sizeof(long))) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static int xbzrle_zrun_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return xbzrle_zrun_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return xbzrle_nzrun_int(old_buf, new_buf, i, slen);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/* As in util/bufferiszero.c, the regions go by increasing ISA */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_zrun_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return xbzrle_zrun_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return xbzrle_nzrun_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_zrun_avx512(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (eq != -1ULL) {
+            return i + ctz64(~eq);
+        }
+    }
+    return xbzrle_zrun_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_avx512(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    return xbzrle_nzrun_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* For xbzrle_test_next_accel, the most preferred ISA has the lowest bit */
+#define CACHE_AVX512  1
+#define CACHE_AVX2    2
+#define CACHE_SSE2    4
+
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ZRUN  xbzrle_zrun_int
+# define INIT_NZRUN xbzrle_nzrun_int
+#else
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ZRUN  xbzrle_zrun_sse2
+# define INIT_NZRUN xbzrle_nzrun_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static XbzrleScanFn *xbzrle_zrun = INIT_ZRUN;
+static XbzrleScanFn *xbzrle_nzrun = INIT_NZRUN;
+
+static void init_accel(unsigned cache)
+{
+    XbzrleScanFn *zrun = xbzrle_zrun_int;
+    XbzrleScanFn *nzrun = xbzrle_nzrun_int;
+
+    if (cache & CACHE_SSE2) {
+        zrun = xbzrle_zrun_sse2;
+        nzrun = xbzrle_nzrun_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        zrun = xbzrle_zrun_avx2;
+        nzrun = xbzrle_nzrun_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512) {
+        zrun = xbzrle_zrun_avx512;
+        nzrun = xbzrle_nzrun_avx512;
+    }
+#endif
+    xbzrle_zrun = zrun;
+    xbzrle_nzrun = nzrun;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+#ifdef CONFIG_AVX512BW_OPT
+            /* ... and that the OS saves the opmask and ZMM registers */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512;
+            }
+#endif
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool xbzrle_test_next_accel(void)
+{
+    /* If no bits set, we just tested the word at a time encoder */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define xbzrle_zrun  xbzrle_zrun_int
+#define xbzrle_nzrun xbzrle_nzrun_int
+bool xbzrle_test_next_accel(void)
+{
+    return false;
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,10 +305,8 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +317,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = xbzrle_zrun(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,51 +333,22 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = xbzrle_nzrun(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = end;
     }
 
     return d;
@@ -42,6 +42,7 @@
 #include "hw/mem/pc-dimm.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "interrupt-router.h"
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -253,6 +254,32 @@ end:
     return 0;
 }
 
+/*
+ * Without -numa, a VM distributed with -local-cpu gets one node per
+ * instance, made of the vCPUs that run there; CPUs above smp_cpus go to
+ * the last one. Memory is split evenly like for any node without mem=.
+ */
+static void numa_instance_nodes(void)
+{
+    int instances = router_instances();
+    int i;
+
+    if (instances > MAX_NODES) {
+        error_report("warning: %d instances but at most %d NUMA nodes, "
+                     "not describing instances as NUMA nodes",
+                     instances, MAX_NODES);
+        return;
+    }
+
+    for (i = 0; i < max_cpus; i++) {
+        set_bit(i, numa_info[router_cpu_home(i)].node_cpu);
+    }
+    for (i = 0; i < instances; i++) {
+        numa_info[i].present = true;
+    }
+    nb_numa_nodes = max_numa_nodeid = instances;
+}
+
 static char *enumerate_cpus(unsigned long *cpus, int max_cpus)
 {
     int cpu;
@@ -306,6 +333,10 @@ void parse_numa_opts(MachineClass *mc)
         exit(1);
     }
 
+    if (!nb_numa_nodes && local_cpus != smp_cpus && router_numa) {
+        numa_instance_nodes();
+    }
+
     assert(max_numa_nodeid <= MAX_NODES);
 
     /* No support for sparse NUMA node IDs yet: */
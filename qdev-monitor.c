@@ -28,7 +28,9 @@
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qemu/help_option.h"
+#include "qemu/cutils.h"
 #include "sysemu/block-backend.h"
+#include "interrupt-router.h"
 
 /*
  * Aliases were a bad idea from the start.  Let's keep them
@@ -179,6 +181,8 @@ static int set_property(void *opaque, const char *name, const char *value,
         return 0;
     if (strcmp(name, "bus") == 0)
         return 0;
+    if (strcmp(name, "instance") == 0)
+        return 0;
 
     object_property_parse(obj, value, name, &err);
     if (err != NULL) {
@@ -560,10 +564,11 @@ void qdev_set_id(DeviceState *dev, const char *id)
 DeviceState *qdev_device_add(QemuOpts *opts, Error **errp)
 {
     DeviceClass *dc;
-    const char *driver, *path;
+    const char *driver, *path, *instance;
     DeviceState *dev;
     BusState *bus = NULL;
     Error *err = NULL;
+    long value;
 
     driver = qemu_opt_get(opts, "driver");
     if (!driver) {
@@ -611,6 +616,24 @@ DeviceState *qdev_device_add(QemuOpts *opts, Error **errp)
 
     qdev_set_id(dev, qemu_opts_id(opts));
 
+    /* GiantVM instance that handles the I/O of the device */
+    instance = qemu_opt_get(opts, "instance");
+    if (instance) {
+        if (qemu_strtol(instance, NULL, 10, &value) || value < 0 ||
+            value > INT_MAX) {
+            error_setg(&err, QERR_INVALID_PARAMETER_VALUE, "instance",
+                       "an instance index");
+        } else {
+            router_place_device(dev, value, &err);
+        }
+        if (err) {
+            error_propagate(errp, err);
+            object_unparent(OBJECT(dev));
+            object_unref(OBJECT(dev));
+            return NULL;
+        }
+    }
+
     /* set properties */
     if (qemu_opt_foreach(opts, set_property, dev, &err)) {
         error_propagate(errp, err);
@@ -20,19 +20,118 @@ show debug log
 ETEXI
 
 DEF("local-cpu", HAS_ARG, QEMU_OPTION_local_cpu,
-    "-local-cpu [cpus=]n[,start=start][,iplist=\"ip1[ ip2]...\"]\n"
+    "-local-cpu [cpus=]n[,start=start][,iplist=\"ip1[ ip2]...\"][,batch-window=us]\n"
+    "           [,topology=file][,index=n]\n"
+    "           [,transport=tcp|unix|shm][,socket-dir=path][,poll=us][,io-threads=n]\n"
+    "           [,broadcast-tree=n]\n"
+    "           [,clock-sync=ms][,numa=on|off][,pin-cache=pages]\n"
+    "           [,dsm=kernel|user][,dsm-port=port][,dsm-prefetch=pages]\n"
     "                set the number of local CPUs to 'n' [default=1]\n"
     "                start= the start index of local CPUs\n"
-    "                iplist= ip of each node hosting the distributed VM\n",
+    "                iplist= ip of each node hosting the distributed VM\n"
+    "                topology= JSON file with the CPUs and address of every node\n"
+    "                index= the index of this node in the topology file\n"
+    "                batch-window= how long (in us) posted forwarding messages\n"
+    "                may wait to be batched with others [default=0]\n"
+    "                transport= how the nodes talk to each other [default=tcp]\n"
+    "                socket-dir= where unix and shm transports rendezvous\n"
+    "                poll= how long (in us) a shm receiver busy-polls\n"
+    "                io-threads= threads handling forwarded device I/O [default=4]\n"
+    "                broadcast-tree= nodes from which broadcasts are relayed [default=16]\n"
+    "                clock-sync= kvmclock sync interval in ms, 0 disables [default=1000]\n"
+    "                numa= one NUMA node per node of the VM [default=on]\n"
+    "                pin-cache= idle pages kept pinned for DMA [default=4096]\n"
+    "                dsm= DSM of the KVM module or of QEMU [default=kernel if any]\n"
+    "                dsm-port= port of node 0's userspace DSM [default=7100]\n"
+    "                dsm-prefetch= pages fetched along on a read fault [default=8]\n",
         QEMU_ARCH_ALL)
 STEXI
-@item -local-cpu [cpus=]@var{n}[,start=@var{start}][,iplist="@var{ip1}[ @var{ip2}]..."]
+@item -local-cpu [cpus=]@var{n}[,start=@var{start}][,iplist="@var{ip1}[ @var{ip2}]..."][,topology=@var{file}][,index=@var{n}][,batch-window=@var{us}][,transport=tcp|unix|shm][,socket-dir=@var{path}][,poll=@var{us}][,io-threads=@var{n}][,broadcast-tree=@var{n}][,clock-sync=@var{ms}][,numa=on|off][,pin-cache=@var{pages}][,dsm=kernel|user][,dsm-port=@var{port}][,dsm-prefetch=@var{pages}]
 @findex -local-cpu
 Enable the distributed QEMU feature. CPUs are divided into two groups, local
 and remote respectively. CPUs from @var{start} to (@var{start} + @var{n} - 1)
 are local, while others are remote. @var{iplist} is the IP of each node of the
-distributed VM. Currently, the local CPU number on each node must be the same,
-otherwise the guest would not start.
+distributed VM. Every node runs @var{n} CPUs, but the last one may run fewer,
+and node I listens on TCP port 40000 + I.
+
+Nodes of different sizes are described by a @var{topology} file instead,
+which every node is given along with its own @var{index}:
+
+@example
+@{ "instances": [
+    @{ "cpus": "0-7", "host": "10.0.0.1" @},
+    @{ "cpus": "8-71", "host": "10.0.0.2", "port": 40100 @},
+    @{ "cpus": 32, "host": "10.0.0.3" @} ] @}
+@end example
+
+@var{cpus} is a range of CPUs, or a number of CPUs following those of the
+previous node. Node 0 must run CPU 0 and every CPU of @option{-smp} must run
+on exactly one node; hotplugged CPUs go to the last one. @var{port} defaults
+to 40000 + the index of the node. The hosts replace @var{iplist}, and must be
+IP addresses with the DSM of the KVM module. Without @var{index}, the node is
+the one whose CPUs begin at @var{start}.
+
+Forwarded writes and interrupts do not wait for the remote node and are sent
+in batches. @var{batch-window} lets the sender wait up to @var{us}
+microseconds for more of them before sending a batch, trading latency for
+fewer and larger writes. Requests that wait for a reply are never delayed.
+
+@var{transport} selects how the nodes talk to each other. @option{tcp} (the
+default) connects to the nodes in @var{iplist}. When all nodes run on one
+host, @option{unix} uses Unix domain sockets and @option{shm} uses a pair of
+shared memory rings per connection, with eventfd doorbells; neither needs
+@var{iplist}. Both rendezvous on sockets in @var{socket-dir}, which defaults
+to the temporary directory and must be the same for every node. With
+@option{shm}, a receiver that runs out of messages busy-polls for up to
+@var{poll} microseconds before going to sleep, which saves the wakeup on a
+busy link at the cost of CPU time.
+
+Forwarded interrupts are queued straight to the target vCPU. Forwarded PIO
+and MMIO are handled by a pool of @var{io-threads} threads, so that slow
+device emulation does not hold up interrupt delivery.
+
+Broadcasts, such as shadow APIC updates and PCI configuration writes, are
+queued to all nodes at once, and those that wait for replies wait for all
+of them together. A VM of at least @var{broadcast-tree} nodes relays the
+others, such as reset and shutdown, over a tree instead: the sender sends
+4 copies, to nodes that pass them on to 4 more each, so that a broadcast
+takes O(log N) hops and no node sends more than 4 copies of it. Shadow APIC
+updates, PCI configuration writes, device placement and resuming the VM
+always go directly, so that no message sent after them can overtake them.
+@var{broadcast-tree}=0 sends every broadcast directly to every node.
+
+Every node but the first keeps an estimate of the kvmclock of the first node,
+refreshed by a timestamp exchange every @var{clock-sync} milliseconds, and
+reads it locally as long as the estimate is good to 250 microseconds. With
+@var{clock-sync}=0 every read is a round trip to the first node. The state of
+the estimate is shown by the @code{query-router-clock} QMP command.
+
+Unless @option{-numa} is given or @var{numa} is off, each node of the VM is
+described to the guest as a NUMA node, with the CPUs that run there and an
+even share of RAM. Each node starts out owning its share of RAM in the
+distributed shared memory, so a guest that keeps threads and their memory
+on one NUMA node causes few page faults over the network.
+
+Guest RAM that a device maps for DMA is pinned on this node for the duration
+of the mapping. Up to @var{pages} pages per address space stay pinned after
+they are unmapped, so that virtqueues and other buffers that are mapped
+again and again do not move between nodes each time. They are released
+when another node asks for them, if the kernel can report that, and after
+10 milliseconds of disuse otherwise. @var{pin-cache}=0 unpins at once. The
+@code{query-dsm-pin-cache} QMP command shows how well the cache works.
+
+@var{dsm} selects what keeps guest RAM coherent between the nodes. By default
+it is the DSM of the GiantVM KVM module if the kernel has one, and QEMU
+itself otherwise; @option{kernel} and @option{user} insist on either. The
+userspace DSM catches accesses to missing pages and writes to shared ones
+with userfaultfd, which needs Linux 5.7 or later, and guest RAM that is
+anonymous and private, so it does not work with @option{-mem-path} or
+@option{-shm-path}. Node N listens on TCP port @var{dsm-port} + N and reaches
+the other nodes at their address in @var{iplist}, or on 127.0.0.1 without
+one, so several nodes can be tried on one host. A read fault also fetches up
+to @var{dsm-prefetch} following pages that no other node is writing. The
+kernel DSM is needed to pin guest memory for DMA, so the pin cache is unused
+with the userspace one.
 ETEXI
 
 
@@ -71,6 +170,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
+    "                kvm-dirty-ring=entries of the KVM dirty ring of each vCPU (default=0)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
@@ -101,6 +201,11 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring=entries
+Logs the pages each vCPU dirties in a ring of this many entries, a power of
+2, instead of the dirty bitmap of KVM; this is what lets migration measure
+and limit the dirty rate of every vCPU, see the vcpu-dirty-limit migration
+parameter. The default, 0, uses the dirty bitmap.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -409,7 +514,8 @@ DEF("device", HAS_ARG, QEMU_OPTION_device,
     "                add device (based on driver)\n"
     "                prop=value,... sets driver properties\n"
     "                use '-device help' to print all possible drivers\n"
-    "                use '-device driver,help' to print all possible properties\n",
+    "                use '-device driver,help' to print all possible properties\n"
+    "                instance=n lets instance n of a distributed VM handle its I/O\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -device @var{driver}[,@var{prop}[=@var{value}][,...]]
@@ -419,6 +525,11 @@ properties.  Valid properties depend on the driver.  To get help on
 possible drivers and properties, use @code{-device help} and
 @code{-device @var{driver},help}.
 
+In a VM distributed with @option{-local-cpu}, @option{instance=@var{n}}
+makes instance @var{n} handle the I/O of the device instead of QEMU 0.
+All instances must be given the same placement, and instance @var{n}
+needs access to the device's backend.
+
 Some drivers are:
 @item -device ipmi-bmc-sim,id=@var{id}[,slave_addr=@var{val}]
 
@@ -0,0 +1,136 @@
+/*
+ * io-router forwarded device accesses: write semantics and statistics
+ *
+ * A vCPU whose access is handled by another instance only has to wait for
+ * it when the guest could tell the difference. Every instance has the
+ * same device models, so the forwarding side looks the MemoryRegion up
+ * locally and classifies the write:
+ *
+ * - coalesced: the region asked for MMIO coalescing, so KVM already
+ *   buffers its writes without an exit; the few that do exit are posted
+ * - posted: a doorbell (the region has ioeventfds), or any other MMIO
+ *   write, which is posted on PCIe as well
+ * - sync: the region wants coalesced MMIO flushed before it is accessed,
+ *   i.e. it cares about ordering, or an x86 OUT, which does not complete
+ *   before the device has seen it
+ *
+ * Reads always wait for their reply. Frames to a peer are sent and
+ * handled in order, so a read still sees every write posted before it.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "interrupt-router.h"
+
+typedef struct RouterIORegionStats {
+    char *name;
+    bool pio;
+    uint64_t base;
+    RouterIOSemantics cls;
+    uint64_t reads;
+    uint64_t sync_writes;
+    uint64_t posted_writes;
+    uint64_t coalesced_writes;
+} RouterIORegionStats;
+
+static QemuMutex router_io_lock;
+/* MemoryRegion * -> RouterIORegionStats, never shrinks */
+static GHashTable *router_io_regions;
+
+void router_io_init(void)
+{
+    qemu_mutex_init(&router_io_lock);
+    router_io_regions = g_hash_table_new(NULL, NULL);
+}
+
+static RouterIOSemantics router_io_class(MemoryRegion *mr, bool pio)
+{
+    if (memory_region_has_coalescing(mr)) {
+        return ROUTERIO_SEMANTICS_COALESCED;
+    }
+    if (memory_region_has_ioeventfds(mr)) {
+        return ROUTERIO_SEMANTICS_POSTED;
+    }
+    if (memory_region_get_flush_coalesced(mr) || pio) {
+        return ROUTERIO_SEMANTICS_SYNC;
+    }
+    return ROUTERIO_SEMANTICS_POSTED;
+}
+
+RouterIOSemantics router_io_classify(bool pio, hwaddr addr, bool is_write,
+                                     bool coalesced)
+{
+    AddressSpace *as = pio ? &address_space_io : &address_space_memory;
+    RouterIORegionStats *stats;
+    RouterIOSemantics cls;
+    MemoryRegion *mr;
+    hwaddr xlat, len = 1;
+
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &xlat, &len, is_write);
+    cls = router_io_class(mr, pio);
+
+    qemu_mutex_lock(&router_io_lock);
+    stats = g_hash_table_lookup(router_io_regions, mr);
+    if (!stats) {
+        stats = g_new0(RouterIORegionStats, 1);
+        stats->name = g_strdup(memory_region_name(mr) ?: "");
+        stats->pio = pio;
+        stats->base = addr - xlat;
+        g_hash_table_insert(router_io_regions, mr, stats);
+    }
+    stats->cls = cls;
+    if (!is_write) {
+        stats->reads++;
+    } else if (coalesced) {
+        stats->coalesced_writes++;
+    } else if (cls == ROUTERIO_SEMANTICS_SYNC) {
+        stats->sync_writes++;
+    } else {
+        stats->posted_writes++;
+    }
+    qemu_mutex_unlock(&router_io_lock);
+    rcu_read_unlock();
+
+    return cls;
+}
+
+RouterIORegionInfoList *qmp_query_router_io_stats(Error **errp)
+{
+    RouterIORegionInfoList *head = NULL, *elem;
+    RouterIORegionInfo *info;
+    RouterIORegionStats *stats;
+    GHashTableIter iter;
+
+    if (!router_io_regions) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&router_io_lock);
+    g_hash_table_iter_init(&iter, router_io_regions);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+        info = g_new0(RouterIORegionInfo, 1);
+        info->region = g_strdup(stats->name);
+        info->io = stats->pio;
+        info->base = stats->base;
+        info->semantics = stats->cls;
+        info->reads = stats->reads;
+        info->sync_writes = stats->sync_writes;
+        info->posted_writes = stats->posted_writes;
+        info->coalesced_writes = stats->coalesced_writes;
+
+        elem = g_new0(RouterIORegionInfoList, 1);
+        elem->value = info;
+        elem->next = head;
+        head = elem;
+    }
+    qemu_mutex_unlock(&router_io_lock);
+    return head;
+}
@@ -0,0 +1,257 @@
+/*
+ * io-router: coordinated migration of a distributed VM
+ *
+ * A distributed VM is migrated, or snapshotted, by all of its instances at
+ * once, each one to its own destination instance. QEMU 0 pauses every
+ * instance through the router first, so that the guest RAM stops moving
+ * between them; then each instance runs an ordinary migration with its own
+ * share of the guest RAM, the pages it has the latest copy of (see
+ * dsm_migration_sends()), and with the state of the vCPUs it runs. The
+ * instances send in parallel, so the time it takes goes down with the
+ * number of instances rather than up with the size of the guest RAM.
+ *
+ * Every instance reports the state of its migration, incoming or outgoing,
+ * to QEMU 0. On the destination, QEMU 0 starts all instances once all of
+ * them have loaded their stream.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qom/cpu.h"
+#include "sysemu/sysemu.h"
+#include "interrupt-router.h"
+
+typedef struct RouterMigrationState {
+    int status;             /* MigrationStatus */
+    bool incoming;
+} RouterMigrationState;
+
+/* on QEMU 0, the last state each instance reported */
+static RouterMigrationState *router_migration;
+static QemuMutex router_migration_lock;
+
+void router_migration_init(void)
+{
+    qemu_mutex_init(&router_migration_lock);
+    router_migration = g_new0(RouterMigrationState, router_instances());
+}
+
+static bool router_migration_check(Error **errp)
+{
+    if (local_cpus == smp_cpus) {
+        error_setg(errp, "the VM is not distributed");
+        return false;
+    }
+    if (router_local_index() != 0) {
+        error_setg(errp, "only QEMU 0 can do this for the whole VM");
+        return false;
+    }
+    return true;
+}
+
+/* VM_STOP from QEMU 0; the I/O worker that calls this holds the BQL */
+void router_migration_stop(void)
+{
+    vm_stop(RUN_STATE_PAUSED);
+}
+
+/* VM_CONT from QEMU 0; the I/O worker that calls this holds the BQL */
+void router_migration_cont(void)
+{
+    Error *err = NULL;
+
+    qmp_cont(&err);
+    if (err) {
+        error_report_err(err);
+    }
+}
+
+static void router_migration_start_bh(void *opaque)
+{
+    char *uri = opaque;
+    Error *err = NULL;
+
+    qmp_migrate(uri, false, false, false, false, false, false, &err);
+    if (err) {
+        error_reportf_err(err, "cannot migrate to '%s': ", uri);
+        migration_status_forwarding(MIGRATION_STATUS_FAILED, false);
+    }
+    g_free(uri);
+}
+
+/* MIGRATE from QEMU 0, once every instance is paused */
+void router_migration_start(const char *uri)
+{
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            router_migration_start_bh, g_strdup(uri));
+}
+
+static void router_migration_resume_bh(void *opaque)
+{
+    /* unless the destination was started with -S */
+    if (autostart && runstate_check(RUN_STATE_PAUSED)) {
+        vm_cont_forwarding();
+        vm_start();
+    }
+}
+
+/* On QEMU 0: @instance, maybe QEMU 0 itself, changed state */
+void router_migration_status(int instance, int status, bool incoming)
+{
+    bool loaded = incoming && status == MIGRATION_STATUS_COMPLETED;
+    int i;
+
+    if (instance < 0 || instance >= router_instances() ||
+        router_local_index() != 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&router_migration_lock);
+    router_migration[instance].status = status;
+    router_migration[instance].incoming = incoming;
+    for (i = 0; loaded && i < router_instances(); i++) {
+        loaded = router_migration[i].incoming &&
+                 router_migration[i].status == MIGRATION_STATUS_COMPLETED;
+    }
+    qemu_mutex_unlock(&router_migration_lock);
+
+    if (loaded) {
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                router_migration_resume_bh, NULL);
+    }
+}
+
+void router_migration_set_state(int status, bool incoming)
+{
+    /* nothing to tell before the router is up */
+    if (local_cpus == smp_cpus || !router_migration) {
+        return;
+    }
+    if (router_local_index() == 0) {
+        router_migration_status(0, status, incoming);
+    } else {
+        migration_status_forwarding(status, incoming);
+    }
+}
+
+/*
+ * Every instance has every vCPU, but the registers of those that run
+ * elsewhere are stale: only the instance that runs a vCPU sends it. The
+ * shadow APICs and the devices are sent by every instance, as they carry
+ * the interrupt routing and the PCI configuration that each instance
+ * routes its own accesses with.
+ */
+bool router_migration_sends_state(void *opaque)
+{
+    CPUState *cpu;
+
+    if (local_cpus == smp_cpus) {
+        return true;
+    }
+    CPU_FOREACH(cpu) {
+        if (opaque == cpu) {
+            return cpu->local;
+        }
+    }
+    return true;
+}
+
+/* The incoming instances are started together, by QEMU 0 */
+bool router_migration_defer_start(void)
+{
+    return local_cpus != smp_cpus;
+}
+
+void qmp_cluster_migrate(strList *uris, Error **errp)
+{
+    Error *err = NULL;
+    CPUState *cpu;
+    strList *uri;
+    int i, n;
+
+    if (!router_migration_check(errp)) {
+        return;
+    }
+    for (n = 0, uri = uris; uri; uri = uri->next) {
+        n++;
+    }
+    if (n != router_instances()) {
+        error_setg(errp, "%d URIs are needed, one per instance",
+                   router_instances());
+        return;
+    }
+
+    /* the destination instances start with the vCPUs -local-cpu gives them */
+    CPU_FOREACH(cpu) {
+        if (router_cpu_owner(cpu->cpu_index) !=
+            router_cpu_home(cpu->cpu_index)) {
+            error_setg(errp, "vCPU %d has moved, move it back to instance %d "
+                       "first", cpu->cpu_index,
+                       router_cpu_home(cpu->cpu_index));
+            return;
+        }
+    }
+
+    qemu_mutex_lock(&router_migration_lock);
+    memset(router_migration, 0, n * sizeof(*router_migration));
+    qemu_mutex_unlock(&router_migration_lock);
+
+    /* no vCPU may touch guest RAM while it is being sent */
+    vm_stop(RUN_STATE_PAUSED);
+    /* the other instances may need our BQL to pause their vCPUs */
+    qemu_mutex_unlock_iothread();
+    vm_stop_forwarding();
+    qemu_mutex_lock_iothread();
+
+    qmp_migrate(uris->value, false, false, false, false, false, false, &err);
+    if (err) {
+        error_propagate(errp, err);
+        vm_cont_forwarding();
+        vm_start();
+        return;
+    }
+    for (i = 1, uri = uris->next; uri; i++, uri = uri->next) {
+        migrate_forwarding(i, uri->value);
+    }
+}
+
+ClusterMigrationInfoList *qmp_query_cluster_migrate(Error **errp)
+{
+    ClusterMigrationInfoList *head = NULL, **tail = &head;
+    ClusterMigrationInfoList *elem;
+    ClusterMigrationInfo *info;
+    int i;
+
+    if (!router_migration_check(errp)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&router_migration_lock);
+    for (i = 0; i < router_instances(); i++) {
+        info = g_new0(ClusterMigrationInfo, 1);
+        info->instance = i;
+        info->status = router_migration[i].status;
+        info->incoming = router_migration[i].incoming;
+
+        elem = g_new0(ClusterMigrationInfoList, 1);
+        elem->value = info;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    qemu_mutex_unlock(&router_migration_lock);
+    return head;
+}
+
+void qmp_cluster_cont(Error **errp)
+{
+    if (!router_migration_check(errp)) {
+        return;
+    }
+    vm_cont_forwarding();
+    qmp_cont(errp);
+}
@@ -0,0 +1,324 @@
+/*
+ * io-router device placement: the distributed virtual PCIe bus
+ *
+ * Every instance creates every device, but only one instance, the owner,
+ * handles its I/O; by default that is QEMU 0. A device can be given to
+ * another instance with -device ...,instance=N or the device-place QMP
+ * command. Writes to the PCI configuration space are broadcast, so every
+ * instance agrees on where the BARs of all devices are mapped; a pair of
+ * memory listeners turn that into a sorted table of placed address ranges,
+ * which vCPU threads look up under RCU on every PIO and MMIO exit.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qmp-commands.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "hw/qdev-core.h"
+#include "sysemu/sysemu.h"
+#include "interrupt-router.h"
+
+#define ROUTER_PLACEMENT_PROP "instance"
+
+typedef struct RouterIORange {
+    uint64_t start;
+    uint64_t last;
+    int instance;
+    /* for query-device-placement only, valid under the BQL */
+    DeviceState *dev;
+} RouterIORange;
+
+typedef struct RouterIOTable {
+    struct rcu_head rcu;
+    int n;
+    RouterIORange ranges[];
+} RouterIOTable;
+
+typedef struct RouterIOListener {
+    MemoryListener listener;
+    AddressSpace *as;
+    bool registered;
+    /* the table being built between begin and commit */
+    GArray *building;
+    RouterIOTable *table;
+} RouterIOListener;
+
+static RouterIOListener router_io_listeners[2];    /* memory, io */
+static int router_placed_devices;
+/* instances that own devices, and so have an IOAPIC that wants EOIs */
+static unsigned long router_owner_map[BITS_TO_LONGS(ROUTER_MAX_INSTANCES)] = {
+    1
+};
+
+static void router_placement_get(Object *obj, Visitor *v, const char *name,
+                                 void *opaque, Error **errp)
+{
+    int64_t value = *(int *)opaque;
+
+    visit_type_int(v, name, &value, errp);
+}
+
+static void router_placement_release(Object *obj, const char *name,
+                                     void *opaque)
+{
+    g_free(opaque);
+}
+
+/*
+ * The instance that owns @obj: that of the closest device, going up the
+ * qdev tree, that was placed explicitly. -1 if there is none.
+ */
+static int router_owner_instance(Object *obj, DeviceState **placed)
+{
+    ObjectProperty *prop;
+    DeviceState *dev;
+
+    while (obj && (dev = (DeviceState *)object_dynamic_cast(obj,
+                                                            TYPE_DEVICE))) {
+        prop = object_property_find(obj, ROUTER_PLACEMENT_PROP, NULL);
+        if (prop && prop->release == router_placement_release) {
+            *placed = dev;
+            return *(int *)prop->opaque;
+        }
+        obj = dev->parent_bus ? OBJECT(dev->parent_bus->parent) : NULL;
+    }
+    return -1;
+}
+
+static void router_io_begin(MemoryListener *listener)
+{
+    RouterIOListener *l = container_of(listener, RouterIOListener, listener);
+
+    l->building = g_array_new(false, false, sizeof(RouterIORange));
+}
+
+static void router_io_region_add(MemoryListener *listener,
+                                 MemoryRegionSection *section)
+{
+    RouterIOListener *l = container_of(listener, RouterIOListener, listener);
+    RouterIORange range;
+
+    if (!router_placed_devices || int128_eq(section->size, int128_zero()) ||
+        int128_gt(section->size, int128_make64(UINT64_MAX))) {
+        return;
+    }
+    range.instance = router_owner_instance(memory_region_owner(section->mr),
+                                           &range.dev);
+    if (range.instance < 0) {
+        return;
+    }
+    range.start = section->offset_within_address_space;
+    range.last = range.start + int128_get64(section->size) - 1;
+    g_array_append_val(l->building, range);
+}
+
+static int router_io_range_cmp(const void *a, const void *b)
+{
+    const RouterIORange *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static void router_io_commit(MemoryListener *listener)
+{
+    RouterIOListener *l = container_of(listener, RouterIOListener, listener);
+    RouterIOTable *old = l->table;
+    RouterIOTable *table = NULL;
+    GArray *ranges = l->building;
+
+    l->building = NULL;
+    if (!ranges->len && !old) {
+        g_array_free(ranges, true);
+        return;
+    }
+
+    /* flat ranges never overlap, so sorting them is enough */
+    g_array_sort(ranges, router_io_range_cmp);
+    if (ranges->len) {
+        table = g_malloc(sizeof(*table) + ranges->len * sizeof(RouterIORange));
+        table->n = ranges->len;
+        memcpy(table->ranges, ranges->data,
+               ranges->len * sizeof(RouterIORange));
+    }
+    g_array_free(ranges, true);
+
+    atomic_rcu_set(&l->table, table);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+/* Register the listeners, or replay the address spaces into them */
+static void router_placement_refresh(void)
+{
+    RouterIOListener *l;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(router_io_listeners); i++) {
+        l = &router_io_listeners[i];
+        if (l->registered) {
+            memory_listener_unregister(&l->listener);
+        } else {
+            l->as = i ? &address_space_io : &address_space_memory;
+            l->listener.begin = router_io_begin;
+            l->listener.region_add = router_io_region_add;
+            l->listener.region_nop = router_io_region_add;
+            l->listener.commit = router_io_commit;
+            l->registered = true;
+        }
+        memory_listener_register(&l->listener, l->as);
+    }
+}
+
+int router_io_owner(bool pio, uint64_t addr)
+{
+    RouterIOTable *table;
+    RouterIORange *r;
+    int lo, hi, mid;
+    int owner = 0;
+
+    rcu_read_lock();
+    table = atomic_rcu_read(&router_io_listeners[pio].table);
+    if (table) {
+        lo = 0;
+        hi = table->n - 1;
+        while (lo <= hi) {
+            mid = (lo + hi) / 2;
+            r = &table->ranges[mid];
+            if (addr < r->start) {
+                hi = mid - 1;
+            } else if (addr > r->last) {
+                lo = mid + 1;
+            } else {
+                owner = r->instance;
+                break;
+            }
+        }
+    }
+    rcu_read_unlock();
+    return owner;
+}
+
+bool router_device_owner(int instance)
+{
+    return test_bit(instance, router_owner_map);
+}
+
+void router_place_device(DeviceState *dev, int instance, Error **errp)
+{
+    ObjectProperty *prop;
+
+    if (instance < 0 || instance >= router_instances()) {
+        error_setg(errp, "device instance must be between 0 and %d",
+                   router_instances() - 1);
+        return;
+    }
+    prop = object_property_find(OBJECT(dev), ROUTER_PLACEMENT_PROP, NULL);
+    if (prop && prop->release != router_placement_release) {
+        error_setg(errp, "device already has a property named '%s'",
+                   ROUTER_PLACEMENT_PROP);
+        return;
+    }
+    if (!prop) {
+        int *opaque = g_new(int, 1);
+
+        prop = object_property_add(OBJECT(dev), ROUTER_PLACEMENT_PROP, "int",
+                                   router_placement_get, NULL,
+                                   router_placement_release, opaque, errp);
+        if (!prop) {
+            g_free(opaque);
+            return;
+        }
+        router_placed_devices++;
+    }
+    *(int *)prop->opaque = instance;
+    set_bit_atomic(instance, router_owner_map);
+
+    router_placement_refresh();
+}
+
+static void router_place_device_id(const char *id, int instance,
+                                   Error **errp)
+{
+    Object *obj;
+    char *path;
+
+    /* like device_del, take an ID or a QOM path */
+    if (id[0] == '/') {
+        path = g_strdup(id);
+    } else {
+        path = g_strdup_printf("/machine/peripheral/%s", id);
+    }
+    obj = object_resolve_path_type(path, TYPE_DEVICE, NULL);
+    g_free(path);
+    if (!obj) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", id);
+        return;
+    }
+    router_place_device(DEVICE(obj), instance, errp);
+}
+
+/* DEVICE_PLACE from a peer; the I/O worker that calls this holds the BQL */
+void router_place_device_remote(const char *id, int instance)
+{
+    Error *err = NULL;
+
+    router_place_device_id(id, instance, &err);
+    if (err) {
+        error_report_err(err);
+    }
+}
+
+void qmp_device_place(const char *id, int64_t instance, Error **errp)
+{
+    Error *err = NULL;
+
+    router_place_device_id(id, instance, &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+    /* every instance must agree on who owns what */
+    if (local_cpus != smp_cpus) {
+        device_place_forwarding(id, instance);
+    }
+}
+
+DevicePlacementList *qmp_query_device_placement(Error **errp)
+{
+    DevicePlacementList *head = NULL, **tail = &head;
+    DevicePlacementList *elem;
+    DevicePlacement *info;
+    RouterIOTable *table;
+    RouterIORange *r;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(router_io_listeners); i++) {
+        table = router_io_listeners[i].table;
+        for (j = 0; table && j < table->n; j++) {
+            r = &table->ranges[j];
+            info = g_new0(DevicePlacement, 1);
+            info->device = r->dev->id ? g_strdup(r->dev->id) :
+                           object_get_canonical_path(OBJECT(r->dev));
+            info->instance = r->instance;
+            info->io = i;
+            info->base = r->start;
+            info->size = r->last - r->start + 1;
+
+            elem = g_new0(DevicePlacementList, 1);
+            elem->value = info;
+            *tail = elem;
+            tail = &elem->next;
+        }
+    }
+    return head;
+}
@@ -0,0 +1,220 @@
+/*
+ * io-router wire protocol: framing, receive arena and batched send
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "router-proto.h"
+
+RouterFrame *router_frame_new(uint8_t type, int32_t cpu_index,
+                              uint32_t body_len)
+{
+    RouterFrame *frame = g_malloc(sizeof(RouterFrame) + body_len);
+
+    router_hdr_init(&frame->hdr, type, cpu_index, 0, body_len);
+    return frame;
+}
+
+uint32_t router_args_size(uint8_t type)
+{
+    switch (type) {
+    case PIO:
+        return sizeof(RouterPioArgs);
+    case MMIO:
+        return sizeof(RouterMmioArgs);
+    case LAPIC:
+        return sizeof(RouterLapicArgs);
+    case SPECIAL_INT:
+    case SIPI:
+    case FIXED_INT:
+    case IOAPIC:
+    case CLOCK_STEP:
+    case DEVICE_PLACE:
+    case VCPU_OWNER:
+    case VCPU_STATE:
+    case VCPU_MOVE:
+        return sizeof(RouterIntArgs);
+    case MIGRATION_STATUS:
+        return sizeof(RouterMigrationStatusArgs);
+    default:
+        return 0;
+    }
+}
+
+typedef struct RouterConnFd {
+    RouterConn conn;
+    int fd;
+} RouterConnFd;
+
+static ssize_t router_conn_fd_read(RouterConn *conn, uint8_t *buf,
+                                   size_t min, size_t max)
+{
+    RouterConnFd *c = container_of(conn, RouterConnFd, conn);
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < min) {
+        ret = read(c->fd, buf + done, max - done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return 0;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static int router_conn_fd_writev(RouterConn *conn, struct iovec *iov,
+                                 int iovcnt)
+{
+    RouterConnFd *c = container_of(conn, RouterConnFd, conn);
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        ret = writev(c->fd, iov, MIN(iovcnt, IOV_MAX));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        /* skip what went out; a short write leaves a partial iov */
+        while (iovcnt > 0 && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+static void router_conn_fd_shutdown(RouterConn *conn)
+{
+    RouterConnFd *c = container_of(conn, RouterConnFd, conn);
+
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+RouterConn *router_conn_new_fd(int fd)
+{
+    RouterConnFd *c = g_new0(RouterConnFd, 1);
+
+    c->fd = fd;
+    c->conn.read = router_conn_fd_read;
+    c->conn.writev = router_conn_fd_writev;
+    c->conn.shutdown = router_conn_fd_shutdown;
+    return &c->conn;
+}
+
+void router_arena_init(RouterArena *arena, size_t size)
+{
+    arena->size = MAX(size, 2 * ROUTER_FRAME_MAX);
+    arena->buf = g_malloc(arena->size);
+    arena->head = 0;
+    arena->tail = 0;
+}
+
+void router_arena_destroy(RouterArena *arena)
+{
+    g_free(arena->buf);
+    arena->buf = NULL;
+}
+
+/*
+ * bytes still missing before the frame at arena->head is complete; 0 for
+ * a frame too large to ever be, which router_arena_next() then rejects
+ */
+static size_t router_arena_missing(RouterArena *arena)
+{
+    size_t avail = arena->tail - arena->head;
+    RouterWireHdr *hdr;
+
+    if (avail < sizeof(*hdr)) {
+        return sizeof(*hdr) - avail;
+    }
+    hdr = (RouterWireHdr *)(arena->buf + arena->head);
+    if (!router_frame_len_ok(hdr)) {
+        return 0;
+    }
+    if (router_frame_size(hdr) > avail) {
+        return router_frame_size(hdr) - avail;
+    }
+    return 0;
+}
+
+ssize_t router_arena_fill(RouterArena *arena, RouterConn *conn)
+{
+    size_t avail = arena->tail - arena->head;
+    size_t missing;
+    ssize_t ret;
+
+    /*
+     * Everything before head has been handed out by a previous
+     * router_arena_next() and the caller is done with it, so move the
+     * partial frame (if any) to the front and receive behind it.
+     */
+    if (arena->head) {
+        memmove(arena->buf, arena->buf + arena->head, avail);
+        arena->head = 0;
+        arena->tail = avail;
+    }
+
+    missing = router_arena_missing(arena);
+    if (avail >= sizeof(RouterWireHdr) &&
+        !router_frame_len_ok((RouterWireHdr *)arena->buf)) {
+        return -EPROTO;
+    }
+    if (!missing) {
+        return avail;
+    }
+
+    ret = conn->read(conn, arena->buf + arena->tail, missing,
+                     arena->size - arena->tail);
+    if (ret <= 0) {
+        return ret;
+    }
+    arena->tail += ret;
+    return ret;
+}
+
+int router_arena_next(RouterArena *arena, RouterWireHdr **hdr)
+{
+    RouterWireHdr *h;
+    uint32_t size;
+
+    if (router_arena_missing(arena)) {
+        return 0;
+    }
+
+    h = (RouterWireHdr *)(arena->buf + arena->head);
+    if (h->version != ROUTER_PROTO_VERSION || !router_frame_len_ok(h)) {
+        return -EPROTO;
+    }
+    size = router_frame_size(h);
+
+    arena->head += size;
+    *hdr = h;
+    return 1;
+}
+
+int router_batch_send(RouterBatch *batch, RouterConn *conn)
+{
+    int ret = 0;
+
+    if (batch->n) {
+        ret = conn->writev(conn, batch->iov, batch->n);
+    }
+    router_batch_init(batch);
+    return ret;
+}
@@ -0,0 +1,305 @@
+#ifndef ROUTER_PROTO_H
+#define ROUTER_PROTO_H
+
+#include "qemu/bswap.h"
+#include "exec/memattrs.h"
+
+/*
+ * io-router wire protocol
+ *
+ * Every message is a frame: a fixed 16 byte RouterWireHdr followed by
+ * hdr.len bytes of body. The body starts with the fixed argument block of
+ * the message type and is followed by the variable payload, if any. All
+ * multi-byte fields are little endian.
+ *
+ * A sender may put any number of frames back to back in a single write;
+ * the receiver decodes them in place from its RouterArena without any
+ * per-message allocation.
+ */
+
+/*
+ * Bumped on every incompatible change; all instances must agree:
+ * 1: binary frames
+ * 2: kvmclock sync
+ * 3: device placement
+ * 4: classified writes, coalesced MMIO
+ * 5: cluster migration and snapshots
+ * 6: vCPU move
+ * 7: tree-relayed broadcasts, topology
+ * 8: VCPU_STATE is a tagged request with a reply
+ */
+#define ROUTER_PROTO_VERSION 8
+/* no single frame can be larger than this */
+#define ROUTER_FRAME_MAX (64 * 1024)
+
+enum forward_type {
+    PIO = 1,
+    MMIO,
+    LAPIC,
+    SPECIAL_INT,
+    SIPI,
+    INIT_LEVEL_DEASSERT,
+    FIXED_INT,
+    IOAPIC,
+    KVMCLOCK,
+    CLOCK_STEP,
+    /* RouterIntArgs with the instance, then the NUL terminated device ID */
+    DEVICE_PLACE,
+    /* a run of RouterCoalescedWrite, flushed from the KVM coalesced ring */
+    COALESCED_MMIO,
+    /* pause the instance, reply once its vCPUs are stopped */
+    VM_STOP,
+    VM_CONT,
+    /* the NUL terminated URI to migrate the instance to */
+    MIGRATE,
+    /* RouterMigrationStatusArgs, to QEMU 0 */
+    MIGRATION_STATUS,
+    /* RouterIntArgs with the instance that runs the vCPU from now on */
+    VCPU_OWNER,
+    /*
+     * RouterIntArgs with the instance it comes from, then the vmstate of a
+     * vCPU and of its APIC, to the instance that runs it; the reply is a
+     * RouterIntArgs with 0 or a negative errno
+     */
+    VCPU_STATE,
+    /* RouterIntArgs with the instance to move the vCPU to, to its owner */
+    VCPU_MOVE,
+    /* IO_ROUTER_EXIT */
+    SHUTDOWN,
+    RESET,
+    EXIT,
+    /* reply to a tagged request, travels on the return path */
+    REPLY = 0x80,
+};
+
+typedef struct QEMU_PACKED RouterWireHdr {
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    int32_t cpu_index;
+    uint32_t tag;
+    uint32_t len;
+} RouterWireHdr;
+
+/*
+ * hdr.flags: a broadcast sent over the spanning tree rooted at instance
+ * (flags & ROUTER_FLAG_ROOT_MASK); the receiver passes it on to its own
+ * children before handling it.
+ */
+#define ROUTER_FLAG_TREE        0x8000
+#define ROUTER_FLAG_ROOT_MASK   0x00ff
+
+/* Argument blocks, one per forward_type that has arguments */
+typedef struct QEMU_PACKED RouterPioArgs {
+    uint16_t port;
+    uint8_t direction;
+    uint8_t size;
+    uint32_t count;
+    uint32_t attrs;
+} RouterPioArgs;
+
+typedef struct QEMU_PACKED RouterMmioArgs {
+    uint64_t addr;
+    uint32_t attrs;
+    uint8_t is_write;
+    uint8_t pad[3];
+} RouterMmioArgs;
+
+typedef struct QEMU_PACKED RouterLapicArgs {
+    uint64_t addr;
+    uint32_t val;
+} RouterLapicArgs;
+
+typedef struct QEMU_PACKED RouterIntArgs {
+    int32_t arg0;   /* mask, vector_num or isrv */
+    int32_t arg1;   /* trigger_mode */
+} RouterIntArgs;
+
+/* One posted write of a COALESCED_MMIO frame */
+typedef struct QEMU_PACKED RouterCoalescedWrite {
+    uint64_t addr;
+    uint32_t len;
+    uint32_t pad;
+    uint8_t data[8];
+} RouterCoalescedWrite;
+
+/* Body of the reply to KVMCLOCK */
+typedef struct QEMU_PACKED RouterClockReply {
+    uint64_t clock;
+    uint32_t generation;    /* bumped every time the clock is set */
+    uint32_t pad;
+} RouterClockReply;
+
+/* Body of MIGRATION_STATUS */
+typedef struct QEMU_PACKED RouterMigrationStatusArgs {
+    int32_t instance;
+    int32_t status;         /* MigrationStatus */
+    uint8_t incoming;
+    uint8_t pad[3];
+} RouterMigrationStatusArgs;
+
+/* size of the fixed argument block of @type, 0 for unknown types */
+uint32_t router_args_size(uint8_t type);
+
+/* A frame as it is laid out on the wire */
+typedef struct RouterFrame {
+    RouterWireHdr hdr;
+    uint8_t body[];
+} RouterFrame;
+
+/* whether hdr.len fits a frame; check before router_frame_size() */
+static inline bool router_frame_len_ok(const RouterWireHdr *hdr)
+{
+    return le32_to_cpu(hdr->len) <= ROUTER_FRAME_MAX - sizeof(*hdr);
+}
+
+static inline uint32_t router_frame_size(const RouterWireHdr *hdr)
+{
+    return sizeof(*hdr) + le32_to_cpu(hdr->len);
+}
+
+static inline void *router_frame_body(const RouterWireHdr *hdr)
+{
+    return (uint8_t *)hdr + sizeof(*hdr);
+}
+
+static inline uint32_t router_attrs_to_wire(MemTxAttrs attrs)
+{
+    uint32_t v;
+
+    QEMU_BUILD_BUG_ON(sizeof(attrs) != sizeof(v));
+    memcpy(&v, &attrs, sizeof(v));
+    return cpu_to_le32(v);
+}
+
+static inline MemTxAttrs router_attrs_from_wire(uint32_t v)
+{
+    MemTxAttrs attrs;
+
+    v = le32_to_cpu(v);
+    memcpy(&attrs, &v, sizeof(attrs));
+    return attrs;
+}
+
+static inline void router_hdr_init(RouterWireHdr *hdr, uint8_t type,
+                                   int32_t cpu_index, uint32_t tag,
+                                   uint32_t body_len)
+{
+    hdr->version = ROUTER_PROTO_VERSION;
+    hdr->type = type;
+    hdr->flags = 0;
+    hdr->cpu_index = cpu_to_le32(cpu_index);
+    hdr->tag = cpu_to_le32(tag);
+    hdr->len = cpu_to_le32(body_len);
+}
+
+/**
+ * router_frame_new: allocate a frame with room for @body_len bytes of body
+ *
+ * The header is filled in; the tag is left as 0 (no reply expected).
+ */
+RouterFrame *router_frame_new(uint8_t type, int32_t cpu_index,
+                              uint32_t body_len);
+
+/*
+ * A byte stream connection between two instances. Implementations only
+ * have to be safe for one reader and one writer running concurrently.
+ */
+typedef struct RouterConn RouterConn;
+struct RouterConn {
+    /* read at least @min and at most @max bytes; 0 on EOF, -errno on error */
+    ssize_t (*read)(RouterConn *conn, uint8_t *buf, size_t min, size_t max);
+    /* write all of @iov; 0 on success, -errno on error */
+    int (*writev)(RouterConn *conn, struct iovec *iov, int iovcnt);
+    void (*shutdown)(RouterConn *conn);
+};
+
+/**
+ * router_conn_new_fd: wrap a connected, blocking stream socket
+ */
+RouterConn *router_conn_new_fd(int fd);
+
+/* a shared memory connection is a memfd plus four eventfd doorbells */
+#define ROUTER_SHM_NFDS 5
+
+/**
+ * router_conn_shm_new: create a shared memory connection
+ *
+ * Allocates rings of at least @ring_size bytes per direction and returns
+ * the creator's end. The file descriptors in @fds must be passed to the
+ * other instance, which calls router_conn_shm_attach() on them. A reader
+ * or writer that has to wait busy-polls for up to @poll_ns before going
+ * to sleep.
+ */
+RouterConn *router_conn_shm_new(size_t ring_size, int64_t poll_ns,
+                                int fds[ROUTER_SHM_NFDS], Error **errp);
+
+/**
+ * router_conn_shm_attach: open the other end of a shared memory connection
+ */
+RouterConn *router_conn_shm_attach(int fds[ROUTER_SHM_NFDS], int64_t poll_ns,
+                                   Error **errp);
+
+/*
+ * Receive buffer. Frames are decoded in place and stay valid until the
+ * next router_arena_fill().
+ */
+typedef struct RouterArena {
+    uint8_t *buf;
+    size_t size;
+    size_t head;        /* first byte not yet handed out */
+    size_t tail;        /* end of received data */
+} RouterArena;
+
+void router_arena_init(RouterArena *arena, size_t size);
+void router_arena_destroy(RouterArena *arena);
+
+/**
+ * router_arena_fill: receive until at least one complete frame is buffered
+ *
+ * Returns the number of bytes received, 0 on EOF, or -errno.
+ */
+ssize_t router_arena_fill(RouterArena *arena, RouterConn *conn);
+
+/**
+ * router_arena_next: take the next complete frame out of @arena
+ *
+ * Returns 1 and sets *@hdr if a frame is available, 0 if more data must be
+ * received first, or -EPROTO if the stream is not a valid frame sequence.
+ */
+int router_arena_next(RouterArena *arena, RouterWireHdr **hdr);
+
+/*
+ * Send side batch. Frames are referenced, not copied, until
+ * router_batch_send() has written them all in one go.
+ */
+#define ROUTER_BATCH_MAX 64
+
+typedef struct RouterBatch {
+    struct iovec iov[ROUTER_BATCH_MAX];
+    int n;
+    size_t bytes;
+} RouterBatch;
+
+static inline void router_batch_init(RouterBatch *batch)
+{
+    batch->n = 0;
+    batch->bytes = 0;
+}
+
+static inline bool router_batch_full(RouterBatch *batch)
+{
+    return batch->n == ROUTER_BATCH_MAX;
+}
+
+static inline void router_batch_add(RouterBatch *batch, RouterWireHdr *hdr)
+{
+    batch->iov[batch->n].iov_base = hdr;
+    batch->iov[batch->n].iov_len = router_frame_size(hdr);
+    batch->bytes += batch->iov[batch->n].iov_len;
+    batch->n++;
+}
+
+int router_batch_send(RouterBatch *batch, RouterConn *conn);
+
+#endif /* ROUTER_PROTO_H */
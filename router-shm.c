@@ -0,0 +1,312 @@
+/*
+ * io-router shared memory transport
+ *
+ * Two instances on the same host talk through a pair of single-producer,
+ * single-consumer byte rings in one memfd, one ring per direction. Each ring
+ * has two eventfd doorbells: "data" wakes a consumer sleeping on an empty
+ * ring and "space" wakes a producer sleeping on a full one. A side only
+ * rings a doorbell when the other side has said it is about to sleep, so in
+ * the common case a message costs two memcpy()s and no system call.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/eventfd.h>
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qemu/processor.h"
+#include "qemu/timer.h"
+#include "router-proto.h"
+
+/* Shared ring header; head and tail are free running byte counters */
+typedef struct RouterShmRing {
+    uint32_t size;
+    uint32_t closed;
+    uint64_t head QEMU_ALIGNED(64);
+    uint32_t consumer_waiting;
+    uint64_t tail QEMU_ALIGNED(64);
+    uint32_t producer_waiting;
+    uint8_t data[] QEMU_ALIGNED(64);
+} RouterShmRing;
+
+enum {
+    SHM_FD_MEM,
+    SHM_FD_A2B_DATA,
+    SHM_FD_A2B_SPACE,
+    SHM_FD_B2A_DATA,
+    SHM_FD_B2A_SPACE,
+};
+
+typedef struct RouterConnShm {
+    RouterConn conn;
+    void *mem;
+    size_t mem_size;
+    int fds[ROUTER_SHM_NFDS];
+
+    RouterShmRing *tx;
+    int tx_data_fd;     /* we ring it */
+    int tx_space_fd;    /* we wait on it */
+    RouterShmRing *rx;
+    int rx_data_fd;     /* we wait on it */
+    int rx_space_fd;    /* we ring it */
+
+    int64_t poll_ns;
+} RouterConnShm;
+
+static void shm_ring_doorbell(uint32_t *waiting, int fd)
+{
+    uint64_t v = 1;
+
+    /* pairs with the smp_mb() in shm_ring_wait() */
+    smp_mb();
+    if (atomic_read(waiting) && atomic_xchg(waiting, 0)) {
+        if (write(fd, &v, sizeof(v)) < 0) {
+            /* the counter cannot overflow with one pending wakeup */
+        }
+    }
+}
+
+/*
+ * Wait until *@counter moves away from @seen or the ring is closed.
+ * Busy-poll for up to poll_ns first, then sleep on @fd.
+ */
+static void shm_ring_wait(RouterConnShm *c, RouterShmRing *ring,
+                          uint64_t *counter, uint64_t seen,
+                          uint32_t *waiting, int fd)
+{
+    int64_t deadline;
+    uint64_t v;
+
+    if (c->poll_ns) {
+        deadline = get_clock() + c->poll_ns;
+        do {
+            if (atomic_read(counter) != seen || atomic_read(&ring->closed)) {
+                return;
+            }
+            cpu_relax();
+        } while (get_clock() < deadline);
+    }
+
+    atomic_set(waiting, 1);
+    smp_mb();
+    if (atomic_read(counter) != seen || atomic_read(&ring->closed)) {
+        atomic_set(waiting, 0);
+        return;
+    }
+    while (read(fd, &v, sizeof(v)) < 0 && errno == EINTR) {
+        /* retry */
+    }
+}
+
+static ssize_t router_conn_shm_read(RouterConn *conn, uint8_t *buf,
+                                    size_t min, size_t max)
+{
+    RouterConnShm *c = container_of(conn, RouterConnShm, conn);
+    RouterShmRing *ring = c->rx;
+    uint32_t mask = ring->size - 1;
+    uint64_t head = ring->head;
+    uint64_t tail;
+    size_t done = 0;
+    size_t n, off, chunk;
+
+    while (done < min) {
+        tail = atomic_load_acquire(&ring->tail);
+        if (tail == head) {
+            if (atomic_read(&ring->closed)) {
+                return 0;
+            }
+            shm_ring_wait(c, ring, &ring->tail, tail,
+                          &ring->consumer_waiting, c->rx_data_fd);
+            continue;
+        }
+
+        n = MIN(tail - head, max - done);
+        off = head & mask;
+        chunk = MIN(n, ring->size - off);
+        memcpy(buf + done, ring->data + off, chunk);
+        memcpy(buf + done + chunk, ring->data, n - chunk);
+        head += n;
+        done += n;
+        atomic_store_release(&ring->head, head);
+        shm_ring_doorbell(&ring->producer_waiting, c->rx_space_fd);
+    }
+    return done;
+}
+
+static int router_conn_shm_writev(RouterConn *conn, struct iovec *iov,
+                                  int iovcnt)
+{
+    RouterConnShm *c = container_of(conn, RouterConnShm, conn);
+    RouterShmRing *ring = c->tx;
+    uint32_t mask = ring->size - 1;
+    uint64_t tail = ring->tail;
+    uint64_t head;
+    size_t len, n, off, chunk;
+    uint8_t *src;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        src = iov[i].iov_base;
+        len = iov[i].iov_len;
+        while (len) {
+            if (atomic_read(&ring->closed)) {
+                return -EPIPE;
+            }
+            head = atomic_load_acquire(&ring->head);
+            if (tail - head == ring->size) {
+                /* full: publish what we have so the consumer can drain it */
+                atomic_store_release(&ring->tail, tail);
+                shm_ring_doorbell(&ring->consumer_waiting, c->tx_data_fd);
+                shm_ring_wait(c, ring, &ring->head, head,
+                              &ring->producer_waiting, c->tx_space_fd);
+                continue;
+            }
+
+            n = MIN(len, ring->size - (tail - head));
+            off = tail & mask;
+            chunk = MIN(n, ring->size - off);
+            memcpy(ring->data + off, src, chunk);
+            memcpy(ring->data, src + chunk, n - chunk);
+            tail += n;
+            src += n;
+            len -= n;
+        }
+    }
+
+    /* one doorbell for the whole batch */
+    atomic_store_release(&ring->tail, tail);
+    shm_ring_doorbell(&ring->consumer_waiting, c->tx_data_fd);
+    return 0;
+}
+
+static void router_conn_shm_shutdown(RouterConn *conn)
+{
+    RouterConnShm *c = container_of(conn, RouterConnShm, conn);
+    uint64_t v = 1;
+
+    atomic_set(&c->tx->closed, 1);
+    atomic_set(&c->rx->closed, 1);
+    smp_mb();
+    /* wake up everybody, on both sides */
+    if (write(c->fds[SHM_FD_A2B_DATA], &v, sizeof(v)) < 0 ||
+        write(c->fds[SHM_FD_A2B_SPACE], &v, sizeof(v)) < 0 ||
+        write(c->fds[SHM_FD_B2A_DATA], &v, sizeof(v)) < 0 ||
+        write(c->fds[SHM_FD_B2A_SPACE], &v, sizeof(v)) < 0) {
+        /* nothing else we can do */
+    }
+}
+
+static size_t shm_ring_bytes(size_t ring_size)
+{
+    return ROUND_UP(sizeof(RouterShmRing) + ring_size, 64);
+}
+
+static RouterConn *router_conn_shm_setup(void *mem, size_t mem_size,
+                                         int fds[ROUTER_SHM_NFDS],
+                                         size_t ring_size, bool creator,
+                                         int64_t poll_ns)
+{
+    RouterConnShm *c = g_new0(RouterConnShm, 1);
+    RouterShmRing *a2b = mem;
+    RouterShmRing *b2a = (RouterShmRing *)((uint8_t *)mem +
+                                           shm_ring_bytes(ring_size));
+
+    c->mem = mem;
+    c->mem_size = mem_size;
+    memcpy(c->fds, fds, sizeof(c->fds));
+    c->poll_ns = poll_ns;
+    if (creator) {
+        c->tx = a2b;
+        c->tx_data_fd = fds[SHM_FD_A2B_DATA];
+        c->tx_space_fd = fds[SHM_FD_A2B_SPACE];
+        c->rx = b2a;
+        c->rx_data_fd = fds[SHM_FD_B2A_DATA];
+        c->rx_space_fd = fds[SHM_FD_B2A_SPACE];
+    } else {
+        c->tx = b2a;
+        c->tx_data_fd = fds[SHM_FD_B2A_DATA];
+        c->tx_space_fd = fds[SHM_FD_B2A_SPACE];
+        c->rx = a2b;
+        c->rx_data_fd = fds[SHM_FD_A2B_DATA];
+        c->rx_space_fd = fds[SHM_FD_A2B_SPACE];
+    }
+
+    c->conn.read = router_conn_shm_read;
+    c->conn.writev = router_conn_shm_writev;
+    c->conn.shutdown = router_conn_shm_shutdown;
+    return &c->conn;
+}
+
+RouterConn *router_conn_shm_new(size_t ring_size, int64_t poll_ns,
+                                int fds[ROUTER_SHM_NFDS], Error **errp)
+{
+    RouterShmRing *ring;
+    size_t mem_size;
+    void *mem;
+    int i;
+
+    /* a ring must hold at least one frame of each size */
+    ring_size = pow2ceil(MAX(ring_size, ROUTER_FRAME_MAX));
+    mem_size = 2 * shm_ring_bytes(ring_size);
+
+    mem = qemu_memfd_alloc("io-router", mem_size, 0, &fds[SHM_FD_MEM]);
+    if (!mem) {
+        error_setg(errp, "io router: cannot allocate shared ring");
+        return NULL;
+    }
+    for (i = SHM_FD_A2B_DATA; i < ROUTER_SHM_NFDS; i++) {
+        fds[i] = eventfd(0, EFD_CLOEXEC);
+        if (fds[i] < 0) {
+            error_setg_errno(errp, errno, "io router: cannot create eventfd");
+            while (--i > SHM_FD_MEM) {
+                close(fds[i]);
+            }
+            qemu_memfd_free(mem, mem_size, fds[SHM_FD_MEM]);
+            return NULL;
+        }
+    }
+
+    ring = mem;
+    ring->size = ring_size;
+    ring = (RouterShmRing *)((uint8_t *)mem + shm_ring_bytes(ring_size));
+    ring->size = ring_size;
+    smp_wmb();
+
+    return router_conn_shm_setup(mem, mem_size, fds, ring_size, true,
+                                 poll_ns);
+}
+
+RouterConn *router_conn_shm_attach(int fds[ROUTER_SHM_NFDS], int64_t poll_ns,
+                                   Error **errp)
+{
+    RouterShmRing *ring;
+    struct stat st;
+    void *mem;
+    uint32_t ring_size;
+
+    if (fstat(fds[SHM_FD_MEM], &st) < 0) {
+        error_setg_errno(errp, errno, "io router: bad shared ring fd");
+        return NULL;
+    }
+    mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fds[SHM_FD_MEM], 0);
+    if (mem == MAP_FAILED) {
+        error_setg_errno(errp, errno, "io router: cannot map shared ring");
+        return NULL;
+    }
+
+    ring = mem;
+    ring_size = ring->size;
+    if (!is_power_of_2(ring_size) ||
+        2 * shm_ring_bytes(ring_size) != st.st_size) {
+        error_setg(errp, "io router: shared ring has an invalid layout");
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+
+    return router_conn_shm_setup(mem, st.st_size, fds, ring_size, false,
+                                 poll_ns);
+}
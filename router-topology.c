@@ -0,0 +1,345 @@
+/*
+ * io-router: the topology of a distributed VM
+ *
+ * Which vCPUs each instance runs, and where it listens. By default every
+ * instance runs -local-cpu cpus=N vCPUs, instance I those from I * N on,
+ * and listens on ROUTER_DEFAULT_PORT + I at the Ith address of iplist. A
+ * topology file lifts both restrictions, for clusters of hosts of
+ * different sizes:
+ *
+ *   { "instances": [
+ *       { "cpus": "0-7", "host": "10.0.0.1" },
+ *       { "cpus": "8-71", "host": "10.0.0.2", "port": 40100 },
+ *       { "cpus": 32, "host": "node3.example.com" } ] }
+ *
+ * "cpus" is a range of vCPUs, or a number of vCPUs following those of the
+ * previous instance. Instance 0 must run vCPU 0, the BSP, and the ranges
+ * must cover every vCPU of -smp exactly once; vCPUs hotplugged above that
+ * go to the last instance, like their NUMA node. "port" defaults to
+ * ROUTER_DEFAULT_PORT + the index of the instance.
+ *
+ * Every instance is given the same file and its own index. The instance
+ * a vCPU starts on, and the address of an instance, are then a table
+ * lookup away.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qstring.h"
+#include "qapi/qmp/qint.h"
+#include "qemu/cutils.h"
+#include "exec/memory.h"
+#include "sysemu/sysemu.h"
+#include "interrupt-router.h"
+
+typedef struct RouterInstance {
+    int cpu_start;
+    int cpus;
+    char *host;
+    int port;
+} RouterInstance;
+
+const char *router_topology_file;
+int router_topology_index = -1;
+int router_index;
+
+static RouterInstance *router_topology;
+static int router_topology_n = 1;
+/* the instance each of the max_cpus vCPUs starts on */
+static int *router_homes;
+
+/* -local-cpu iplist, or the hosts of the topology file */
+static char **router_hosts = NULL;
+static uint32_t router_hosts_num = 0;
+
+int parse_cluster_iplist(const char *cluster_iplist)
+{
+    int ret = 0, ip_num = 0, i;
+
+    if (cluster_iplist == NULL) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for (i = 0; cluster_iplist[i] != '\0'; i++) {
+        if (isspace(cluster_iplist[i]))
+            ip_num++;
+        else if (!(isdigit(cluster_iplist[i]) || cluster_iplist[i] == '.')) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+    router_hosts_num = ++ip_num;
+
+    router_hosts = (char **)g_malloc0(sizeof(char *) * ip_num);
+
+    char *temp_iplist = (char *)g_malloc(strlen(cluster_iplist) + 1);
+    strcpy(temp_iplist, cluster_iplist);
+    char *parse_ip = strtok(temp_iplist, " ");
+    i = 0;
+    while (parse_ip != NULL) {
+        char *ip = (char *)g_malloc(20);
+        strcpy(ip, parse_ip);
+        router_hosts[i++] = ip;
+        parse_ip = strtok(NULL, " ");
+    }
+    g_free(temp_iplist);
+
+out:
+    return ret;
+}
+
+char **get_cluster_iplist(uint32_t *len)
+{
+    *len = router_hosts_num;
+    return router_hosts;
+}
+
+/* "first-last" or "first" */
+static bool router_parse_cpu_range(const char *str, int *first, int *last)
+{
+    unsigned long a, b;
+    const char *end;
+
+    if (qemu_strtoul(str, &end, 10, &a) < 0) {
+        return false;
+    }
+    b = a;
+    if (*end == '-' && qemu_strtoul(end + 1, &end, 10, &b) < 0) {
+        return false;
+    }
+    if (*end || a > b || b > INT_MAX) {
+        return false;
+    }
+    *first = a;
+    *last = b;
+    return true;
+}
+
+static bool router_topology_load(Error **errp)
+{
+    GError *gerr = NULL;
+    QObject *obj = NULL;
+    QDict *dict = NULL, *entry;
+    QList *list;
+    QListEntry *e;
+    QObject *cpus;
+    char *json;
+    int first, last, next = 0, n = 0;
+    bool ok = false;
+
+    if (!g_file_get_contents(router_topology_file, &json, NULL, &gerr)) {
+        error_setg(errp, "cannot read topology '%s': %s",
+                   router_topology_file, gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+    obj = qobject_from_json(json);
+    g_free(json);
+    dict = obj ? qobject_to_qdict(obj) : NULL;
+    list = dict ? qdict_get_qlist(dict, "instances") : NULL;
+    if (!list || qlist_empty(list)) {
+        error_setg(errp, "topology '%s' has no \"instances\" list",
+                   router_topology_file);
+        goto out;
+    }
+
+    router_topology_n = qlist_size(list);
+    if (router_topology_n > ROUTER_MAX_INSTANCES) {
+        error_setg(errp, "topology '%s' has %d instances, at most %d "
+                   "are supported", router_topology_file, router_topology_n,
+                   ROUTER_MAX_INSTANCES);
+        goto out;
+    }
+    router_topology = g_new0(RouterInstance, router_topology_n);
+    router_hosts = g_new0(char *, router_topology_n);
+    router_hosts_num = router_topology_n;
+
+    QLIST_FOREACH_ENTRY(list, e) {
+        RouterInstance *inst = &router_topology[n];
+
+        entry = qobject_to_qdict(qlist_entry_obj(e));
+        cpus = entry ? qdict_get(entry, "cpus") : NULL;
+        if (cpus && qobject_type(cpus) == QTYPE_QINT &&
+            qint_get_int(qobject_to_qint(cpus)) > 0) {
+            first = next;
+            last = next + qint_get_int(qobject_to_qint(cpus)) - 1;
+        } else if (!cpus || qobject_type(cpus) != QTYPE_QSTRING ||
+                   !router_parse_cpu_range(qstring_get_str(
+                                           qobject_to_qstring(cpus)),
+                                           &first, &last)) {
+            error_setg(errp, "instance %d of topology '%s' needs \"cpus\", "
+                       "a range or a number of vCPUs", n,
+                       router_topology_file);
+            goto out;
+        }
+        inst->cpu_start = first;
+        inst->cpus = last - first + 1;
+        next = last + 1;
+
+        if (qdict_haskey(entry, "host")) {
+            inst->host = g_strdup(qdict_get_try_str(entry, "host"));
+            router_hosts[n] = g_strdup(inst->host);
+        }
+        inst->port = qdict_get_try_int(entry, "port",
+                                       ROUTER_DEFAULT_PORT + n);
+        if (inst->port <= 0 || inst->port > 65535) {
+            error_setg(errp, "instance %d of topology '%s' has an invalid "
+                       "port", n, router_topology_file);
+            goto out;
+        }
+        n++;
+    }
+    ok = true;
+
+out:
+    qobject_decref(obj);
+    return ok;
+}
+
+/* One instance per -local-cpu cpus=N vCPUs, the last one may have fewer */
+static bool router_topology_even(Error **errp)
+{
+    int i;
+
+    if (local_cpus == -1) {
+        local_cpus = smp_cpus;
+    }
+    if (local_cpus > smp_cpus) {
+        error_setg(errp, "Number of local SMP CPUs requested (%d) exceeds "
+                   "smp CPUs (%d) ", local_cpus, smp_cpus);
+        return false;
+    }
+    if (local_cpu_start_index + local_cpus > smp_cpus) {
+        error_setg(errp, "Last Index of local SMP CPUs requested (%d) exceeds "
+                   "Last Index of smp CPUs (%d) ",
+                   local_cpu_start_index + local_cpus - 1, smp_cpus - 1);
+        return false;
+    }
+    if (local_cpu_start_index % local_cpus != 0) {
+        error_setg(errp, "Start Index of local SMP CPUs requested (%d) not "
+                   "aligned with Local CPU Number requested (%d)",
+                   local_cpu_start_index, local_cpus);
+        return false;
+    }
+
+    router_topology_n = (smp_cpus + local_cpus - 1) / local_cpus;
+    if (router_topology_n > ROUTER_MAX_INSTANCES) {
+        error_setg(errp, "%d instances, at most %d are supported",
+                   router_topology_n, ROUTER_MAX_INSTANCES);
+        return false;
+    }
+    router_topology = g_new0(RouterInstance, router_topology_n);
+    for (i = 0; i < router_topology_n; i++) {
+        router_topology[i].cpu_start = i * local_cpus;
+        router_topology[i].cpus = MIN(local_cpus, smp_cpus - i * local_cpus);
+        router_topology[i].host = i < router_hosts_num ?
+                                  g_strdup(router_hosts[i]) : NULL;
+        router_topology[i].port = ROUTER_DEFAULT_PORT + i;
+    }
+    router_topology_index = local_cpu_start_index / local_cpus;
+    return true;
+}
+
+bool router_topology_init(Error **errp)
+{
+    RouterInstance *inst;
+    int i, j;
+
+    if (!router_topology_file) {
+        if (!router_topology_even(errp)) {
+            return false;
+        }
+    } else {
+        if (!router_topology_load(errp)) {
+            return false;
+        }
+        if (router_topology_index < 0) {
+            /* the instance whose vCPUs start at -local-cpu start= */
+            for (i = 0; i < router_topology_n; i++) {
+                if (router_topology[i].cpu_start == local_cpu_start_index) {
+                    router_topology_index = i;
+                }
+            }
+        }
+        if (router_topology_index < 0 ||
+            router_topology_index >= router_topology_n) {
+            error_setg(errp, "-local-cpu index= must be between 0 and %d",
+                       router_topology_n - 1);
+            return false;
+        }
+        if (router_topology[0].cpu_start != 0) {
+            error_setg(errp, "instance 0 must run vCPU 0");
+            return false;
+        }
+    }
+
+    router_homes = g_new(int, max_cpus);
+    for (i = 0; i < max_cpus; i++) {
+        router_homes[i] = i < smp_cpus ? -1 : router_topology_n - 1;
+    }
+    for (i = 0; i < router_topology_n; i++) {
+        inst = &router_topology[i];
+        if (inst->cpu_start + inst->cpus > smp_cpus) {
+            error_setg(errp, "instance %d runs vCPUs up to %d, but there "
+                       "are %d", i, inst->cpu_start + inst->cpus - 1,
+                       smp_cpus);
+            return false;
+        }
+        for (j = inst->cpu_start; j < inst->cpu_start + inst->cpus; j++) {
+            if (router_homes[j] >= 0) {
+                error_setg(errp, "vCPU %d is given to instances %d and %d",
+                           j, router_homes[j], i);
+                return false;
+            }
+            router_homes[j] = i;
+        }
+    }
+    for (i = 0; i < smp_cpus; i++) {
+        if (router_homes[i] < 0) {
+            error_setg(errp, "vCPU %d is not given to any instance", i);
+            return false;
+        }
+    }
+    if (router_topology_n > 1 && router_transport == ROUTER_TRANSPORT_TCP) {
+        for (i = 0; i < router_topology_n; i++) {
+            if (!router_topology[i].host) {
+                error_setg(errp, "instance %d has no host address", i);
+                return false;
+            }
+        }
+    }
+
+    router_index = router_topology_index;
+    local_cpu_start_index = router_topology[router_index].cpu_start;
+    local_cpus = router_topology[router_index].cpus;
+    return true;
+}
+
+int router_instances(void)
+{
+    return router_topology_n;
+}
+
+int router_cpu_home(int cpu_index)
+{
+    if (!router_homes || cpu_index < 0 || cpu_index >= max_cpus) {
+        return 0;
+    }
+    return router_homes[cpu_index];
+}
+
+const char *router_instance_host(int instance)
+{
+    return router_topology[instance].host;
+}
+
+int router_instance_port(int instance)
+{
+    return router_topology[instance].port;
+}
@@ -0,0 +1,400 @@
+/*
+ * io-router: moving vCPUs between the instances of a distributed VM
+ *
+ * Every instance creates every vCPU but runs only those it owns; the
+ * threads of the others are parked, see qemu_kvm_cpu_thread_fn(). At
+ * startup the owner of a vCPU is given by -local-cpu, afterwards a vCPU can
+ * be moved to another instance while the guest runs, with the vcpu-move
+ * QMP command or by a placement policy. The owner of the vCPU:
+ *
+ * - broadcasts the new owner, so that every instance sends the interrupts
+ *   for the vCPU there from now on; the new owner queues them on the
+ *   parked vCPU until its state arrives;
+ * - waits for an RCU grace period, after which no interrupt can still be
+ *   delivered to its own copy of the vCPU;
+ * - has the vCPU thread save its registers and its APIC, and park itself;
+ * - sends that to the new owner, which loads it, puts it into KVM and
+ *   wakes the vCPU thread up.
+ *
+ * If the new owner cannot load the state, both instances point the vCPU
+ * back at the old owner, which wakes its own copy of the vCPU up again; the
+ * interrupts the new owner queued meanwhile follow it back.
+ *
+ * The kvmclock MSRs of the vCPU are part of its registers. The kvmclock
+ * itself stays where it is: the clock sync service keeps that of every
+ * instance in step with QEMU 0, and writing the system time MSR makes KVM
+ * refresh the pvclock page of the vCPU on the new instance.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/error-report.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qom/cpu.h"
+#include "hw/qdev-core.h"
+#include "hw/i386/apic.h"
+#include "io/channel-buffer.h"
+#include "migration/vmstate.h"
+#include "migration/qemu-file.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/kvm.h"
+#include "interrupt-router.h"
+
+#define ROUTER_VCPU_POLICY_INTERVAL_MS 1000
+
+/* The owner of every vCPU, replaced as a whole and read under RCU */
+typedef struct RouterCpuTable {
+    struct rcu_head rcu;
+    int owner[];
+} RouterCpuTable;
+
+static RouterCpuTable *router_cpus;
+/* serializes the updates of router_cpus */
+static QemuMutex router_cpus_lock;
+/* a vCPU is moving out of this instance, under the BQL */
+static bool router_vcpu_moving;
+
+static RouterVcpuPolicy router_vcpu_policy;
+static void *router_vcpu_policy_opaque;
+static QEMUTimer *router_vcpu_policy_timer;
+
+void router_vcpu_init(void)
+{
+    RouterCpuTable *table;
+    int i;
+
+    qemu_mutex_init(&router_cpus_lock);
+    table = g_malloc(sizeof(*table) + max_cpus * sizeof(int));
+    for (i = 0; i < max_cpus; i++) {
+        table->owner[i] = router_cpu_home(i);
+    }
+    atomic_rcu_set(&router_cpus, table);
+}
+
+int router_cpu_owner(int cpu_index)
+{
+    RouterCpuTable *table;
+    int owner;
+
+    rcu_read_lock();
+    table = atomic_rcu_read(&router_cpus);
+    if (table && cpu_index >= 0 && cpu_index < max_cpus) {
+        owner = table->owner[cpu_index];
+    } else {
+        owner = router_cpu_home(cpu_index);
+    }
+    rcu_read_unlock();
+    return owner;
+}
+
+void router_set_cpu_owner(int cpu_index, int instance)
+{
+    RouterCpuTable *old, *table;
+
+    if (cpu_index < 0 || cpu_index >= max_cpus || instance < 0 ||
+        instance >= router_instances() || !router_cpus) {
+        return;
+    }
+
+    qemu_mutex_lock(&router_cpus_lock);
+    old = router_cpus;
+    table = g_malloc(sizeof(*table) + max_cpus * sizeof(int));
+    memcpy(table->owner, old->owner, max_cpus * sizeof(int));
+    table->owner[cpu_index] = instance;
+    atomic_rcu_set(&router_cpus, table);
+    qemu_mutex_unlock(&router_cpus_lock);
+
+    g_free_rcu(old, rcu);
+}
+
+/* The same sections as cpu_exec_realizefn() registers, then the APIC */
+static void router_vcpu_save_state(CPUState *cpu, QEMUFile *f)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+
+    if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
+        vmstate_save_state(f, &vmstate_cpu_common, cpu, NULL);
+    }
+    if (cc->vmsd != NULL) {
+        vmstate_save_state(f, cc->vmsd, cpu, NULL);
+    }
+    apic_save_cpu_state(cpu, f);
+}
+
+static int router_vcpu_load_state(CPUState *cpu, QEMUFile *f)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    int ret;
+
+    if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
+        ret = vmstate_load_state(f, &vmstate_cpu_common, cpu,
+                                 vmstate_cpu_common.version_id);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (cc->vmsd != NULL) {
+        ret = vmstate_load_state(f, cc->vmsd, cpu, cc->vmsd->version_id);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ret = apic_load_cpu_state(cpu, f);
+    return ret < 0 ? ret : qemu_file_get_error(f);
+}
+
+/* Run by the vCPU thread, which parks as soon as this returns */
+static void router_vcpu_save(CPUState *cpu, run_on_cpu_data data)
+{
+    cpu_synchronize_state(cpu);
+    router_vcpu_save_state(cpu, data.host_ptr);
+    cpu->local = false;
+}
+
+/*
+ * Wake the parked thread of @cpu up again after a failed move; its state
+ * is still in CPUState, where router_vcpu_save() left it.
+ */
+static void router_vcpu_take_back(CPUState *cpu)
+{
+    router_set_cpu_owner(cpu->cpu_index, router_local_index());
+    vcpu_owner_forwarding(cpu->cpu_index, router_local_index());
+
+    cpu->stopped = !runstate_is_running();
+    atomic_mb_set(&cpu->local, true);
+    wake_remote_cpu();
+}
+
+/* Move @cpu, which this instance runs, to @instance; called with the BQL */
+static void router_vcpu_move(CPUState *cpu, int instance, Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    if (router_vcpu_moving) {
+        error_setg(errp, "another vCPU is moving out of this instance");
+        return;
+    }
+    router_vcpu_moving = true;
+
+    vcpu_owner_forwarding(cpu->cpu_index, instance);
+    router_set_cpu_owner(cpu->cpu_index, instance);
+    /*
+     * The router threads look up the owner and queue an interrupt in the
+     * same critical section, so after this every interrupt that was routed
+     * here is in the work queue of the vCPU, in front of router_vcpu_save.
+     * Those from the vCPUs of this instance are delivered under the BQL,
+     * and see cpu->local go down. Other RCU readers may be waiting for
+     * the BQL.
+     */
+    qemu_mutex_unlock_iothread();
+    synchronize_rcu();
+    qemu_mutex_lock_iothread();
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "router-vcpu-buffer");
+    f = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    run_on_cpu(cpu, router_vcpu_save, RUN_ON_CPU_HOST_PTR(f));
+    qemu_fflush(f);
+    /*
+     * @instance loads the state under its own BQL, and may be waiting for
+     * a reply from us with it held.
+     */
+    qemu_mutex_unlock_iothread();
+    ret = vcpu_state_forwarding(cpu->cpu_index, instance, bioc->data,
+                                bioc->usage);
+    qemu_mutex_lock_iothread();
+    qemu_fclose(f);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "vCPU %d cannot move to instance %d",
+                         cpu->cpu_index, instance);
+        router_vcpu_take_back(cpu);
+    }
+    router_vcpu_moving = false;
+}
+
+static void router_vcpu_move_index(int cpu_index, int instance, Error **errp)
+{
+    CPUState *cpu;
+    int owner;
+
+    if (local_cpus == smp_cpus) {
+        error_setg(errp, "the VM is not distributed");
+        return;
+    }
+    cpu = qemu_get_cpu(cpu_index);
+    if (!cpu) {
+        error_setg(errp, "vCPU %d does not exist", cpu_index);
+        return;
+    }
+    if (instance < 0 || instance >= router_instances()) {
+        error_setg(errp, "instance must be between 0 and %d",
+                   router_instances() - 1);
+        return;
+    }
+
+    owner = router_cpu_owner(cpu_index);
+    if (owner == instance) {
+        return;
+    }
+    if (owner != router_local_index()) {
+        /* the instance that runs it moves it */
+        vcpu_move_forwarding(cpu_index, instance);
+        return;
+    }
+    if (!cpu->local) {
+        error_setg(errp, "vCPU %d is still moving in", cpu_index);
+        return;
+    }
+    router_vcpu_move(cpu, instance, errp);
+}
+
+/* VCPU_MOVE from a peer; the I/O worker that calls this holds the BQL */
+void router_vcpu_move_remote(int cpu_index, int instance)
+{
+    Error *err = NULL;
+
+    router_vcpu_move_index(cpu_index, instance, &err);
+    if (err) {
+        error_report_err(err);
+    }
+}
+
+/*
+ * VCPU_STATE from the old owner, @from; the I/O worker that calls this
+ * holds the BQL.
+ *
+ * Returns: 0, or a negative errno if the vCPU stays with @from
+ */
+int router_vcpu_arrive(int cpu_index, int from, const void *state,
+                       uint32_t len)
+{
+    CPUState *cpu = qemu_get_cpu(cpu_index);
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    if (cpu->local || !cpu->created) {
+        error_report("io router: unexpected state for vCPU %d", cpu_index);
+        return -EINVAL;
+    }
+
+    bioc = qio_channel_buffer_new(len);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "router-vcpu-buffer");
+    memcpy(bioc->data, state, len);
+    bioc->usage = len;
+    f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    /* the thread is parked, nothing else touches the vCPU */
+    ret = router_vcpu_load_state(cpu, f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("io router: cannot load the state of vCPU %d: %s",
+                     cpu_index, strerror(-ret));
+        /*
+         * @from takes it back: once no router thread can queue more work
+         * for the vCPU here, send it what was queued, see router_cpu_work().
+         */
+        router_set_cpu_owner(cpu_index, from);
+        qemu_mutex_unlock_iothread();
+        synchronize_rcu();
+        qemu_mutex_lock_iothread();
+        process_queued_cpu_work(cpu);
+        return ret;
+    }
+
+    /* the vCPU thread puts the state into KVM once it is out of the park */
+    cpu->stopped = !runstate_is_running();
+    atomic_mb_set(&cpu->local, true);
+    wake_remote_cpu();
+    return 0;
+}
+
+static void router_vcpu_policy_tick(void *opaque)
+{
+    Error *err = NULL;
+    CPUState *cpu;
+    int instance;
+
+    CPU_FOREACH(cpu) {
+        if (!cpu->local) {
+            continue;
+        }
+        instance = router_vcpu_policy(cpu, router_vcpu_policy_opaque);
+        if (instance < 0 || instance >= router_instances() ||
+            instance == router_local_index()) {
+            continue;
+        }
+        /* one at a time: a move drops the BQL */
+        router_vcpu_move(cpu, instance, &err);
+        if (err) {
+            error_report_err(err);
+        }
+        break;
+    }
+
+    timer_mod(router_vcpu_policy_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              ROUTER_VCPU_POLICY_INTERVAL_MS);
+}
+
+void router_vcpu_set_policy(RouterVcpuPolicy policy, void *opaque)
+{
+    router_vcpu_policy = policy;
+    router_vcpu_policy_opaque = opaque;
+
+    if (!policy || local_cpus == smp_cpus) {
+        if (router_vcpu_policy_timer) {
+            timer_del(router_vcpu_policy_timer);
+        }
+        return;
+    }
+    if (!router_vcpu_policy_timer) {
+        router_vcpu_policy_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                                router_vcpu_policy_tick,
+                                                NULL);
+    }
+    timer_mod(router_vcpu_policy_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              ROUTER_VCPU_POLICY_INTERVAL_MS);
+}
+
+void qmp_vcpu_move(int64_t cpu_index, int64_t instance, Error **errp)
+{
+    router_vcpu_move_index(cpu_index, instance, errp);
+}
+
+VcpuPlacementList *qmp_query_vcpu_placement(Error **errp)
+{
+    VcpuPlacementList *head = NULL, **tail = &head;
+    VcpuPlacementList *elem;
+    VcpuPlacement *info;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        info = g_new0(VcpuPlacement, 1);
+        info->cpu_index = cpu->cpu_index;
+        info->instance = local_cpus == smp_cpus ? 0 :
+                         router_cpu_owner(cpu->cpu_index);
+        info->home = local_cpus == smp_cpus ? 0 :
+                     router_cpu_home(cpu->cpu_index);
+
+        elem = g_new0(VcpuPlacementList, 1);
+        elem->value = info;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    return head;
+}
@@ -121,4 +121,14 @@ COMPARISONS = [
         Scenario("compr-xbzrle-cache-50",
                  compression_xbzrle=True, compression_xbzrle_cache=50),
     ]),
+
+
+    # Looking at effect of sending the RAM over several
+    # sockets, each with its own thread
+    Comparison("ram-channels", scenarios = [
+        Scenario("ram-channels-1", ram_channels=1),
+        Scenario("ram-channels-2", ram_channels=2),
+        Scenario("ram-channels-4", ram_channels=4),
+        Scenario("ram-channels-8", ram_channels=8),
+    ]),
 ]
@@ -185,6 +185,12 @@ class Engine(object):
                                value=(hardware._mem * 1024 * 1024 * 1024 / 100 *
                                       scenario._compression_xbzrle_cache))
 
+        if scenario._ram_channels > 1:
+            resp = src.command("migrate-set-parameters",
+                               ram_channels=scenario._ram_channels)
+            resp = dst.command("migrate-set-parameters",
+                               ram_channels=scenario._ram_channels)
+
         resp = src.command("migrate", uri=connect_uri)
 
         post_copy = False
@@ -0,0 +1,559 @@
+/*
+ * Benchmark of the forwarding paths of a distributed VM
+ *
+ * Splits a VM over several QEMU instances on this host, one vCPU each, and
+ * boots its BSP, on instance 0, into a tiny guest that loops over the
+ * accesses the router forwards: PIO and MMIO to a pc-testdev placed on
+ * instance 1, and fixed IPIs to vCPU 1. After a warm-up the message
+ * counters and round trip histograms of every instance (query-dsm-stats)
+ * are sampled twice, and what happened in between is printed as JSON,
+ * with the DSM fault rate of each vCPU, to be kept as a baseline and
+ * compared across changes to the router.
+ *
+ * The "bar" access checks ordering instead: the guest moves BAR 0 of a
+ * pci-testdev placed on the last instance with a PCI configuration write,
+ * which QEMU 0 broadcasts, then reads the device at its new address. An
+ * instance that gets the read before the write answers from the old map;
+ * the guest counts these, and any makes the run fail. Run it with at least
+ * 16 instances, so that broadcasts would otherwise be relayed.
+ *
+ * Needs KVM; the QEMU binary is taken from QTEST_QEMU_BINARY.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qint.h"
+#include "qemu/sockets.h"
+#include "libqtest.h"
+
+#define BOOT_IMAGE_SIZE (1024 * 1024)
+/* where the guest counts its loops, and reads of a BAR that had not moved */
+#define LOOP_COUNTER 0x7e00
+#define BAR_ERRORS   0x7e04
+/* offset and length of each access in the boot sector, see below */
+#define OP_BAR_SETUP_OFFSET 0x27
+#define OP_BAR_SETUP_LEN    25
+#define OP_PIO_OFFSET   0x40
+#define OP_PIO_LEN      4
+#define OP_MMIO_OFFSET  0x44
+#define OP_MMIO_LEN     10
+#define OP_IPI_OFFSET   0x4e
+#define OP_IPI_LEN      20
+#define OP_BAR_OFFSET   0x62
+#define OP_BAR_LEN      39
+#define GDT_OFFSET      0x180
+
+static unsigned int n_instances = 2;
+static unsigned int duration = 5;
+static unsigned int warmup = 1;
+static const char *transport = "unix";
+static const char *ops = "pio,mmio,ipi";
+static const char *output;
+static const char *qemu_binary;
+
+static char *dir;
+static pid_t *pids;
+static int *qmp_fds;
+
+/*
+ * Switches to flat 32-bit protected mode and enables the memory BAR of the
+ * pci-testdev in slot 4, then loops over: a PIO write and read of port 0xe8
+ * and an MMIO write and read of 0xff000000, both of pc-testdev; a fixed
+ * IPI, vector 0x40, to APIC ID 1; a move of the pci-testdev BAR between
+ * 0xe0000000 and 0xe0001000, and a read of the data byte of its first test
+ * there, which is 0xfa; and an increment of the loop counter. Accesses left
+ * out of the run are overwritten by NOPs.
+ */
+static const uint8_t boot_code[] = {
+    /* 7c00: cli; xor %ax,%ax; mov %ax,%ds */
+    0xfa, 0x31, 0xc0, 0x8e, 0xd8,
+    /* 7c05: lgdt 0x7d98 */
+    0x0f, 0x01, 0x16, 0x98, 0x7d,
+    /* 7c0a: mov %cr0,%eax; or $1,%eax; mov %eax,%cr0 */
+    0x0f, 0x20, 0xc0, 0x66, 0x83, 0xc8, 0x01, 0x0f, 0x22, 0xc0,
+    /* 7c14: ljmpl $0x08,$0x7c1c */
+    0x66, 0xea, 0x1c, 0x7c, 0x00, 0x00, 0x08, 0x00,
+    /* 7c1c: mov $0x10,%eax; mov %ax,%ds; mov %ax,%es; mov %ax,%ss */
+    0xb8, 0x10, 0x00, 0x00, 0x00, 0x8e, 0xd8, 0x8e, 0xc0, 0x8e, 0xd0,
+    /* 7c27: mov $0xe0000000,%ebx */
+    0xbb, 0x00, 0x00, 0x00, 0xe0,
+    /* 7c2c: mov $0x80002004,%eax; mov $0xcf8,%dx; out %eax,(%dx) */
+    0xb8, 0x04, 0x20, 0x00, 0x80, 0x66, 0xba, 0xf8, 0x0c, 0xef,
+    /* 7c36: mov $0xcfc,%dx; mov $2,%eax; out %eax,(%dx) */
+    0x66, 0xba, 0xfc, 0x0c, 0xb8, 0x02, 0x00, 0x00, 0x00, 0xef,
+    /* 7c40: out %al,$0xe8; in $0xe8,%al */
+    0xe6, 0xe8, 0xe4, 0xe8,
+    /* 7c44: mov %eax,0xff000000; mov 0xff000000,%eax */
+    0xa3, 0x00, 0x00, 0x00, 0xff, 0xa1, 0x00, 0x00, 0x00, 0xff,
+    /* 7c4e: movl $0x01000000,0xfee00310; movl $0x40,0xfee00300 */
+    0xc7, 0x05, 0x10, 0x03, 0xe0, 0xfe, 0x00, 0x00, 0x00, 0x01,
+    0xc7, 0x05, 0x00, 0x03, 0xe0, 0xfe, 0x40, 0x00, 0x00, 0x00,
+    /* 7c62: mov $0x80002010,%eax; mov $0xcf8,%dx; out %eax,(%dx) */
+    0xb8, 0x10, 0x20, 0x00, 0x80, 0x66, 0xba, 0xf8, 0x0c, 0xef,
+    /* 7c6c: xor $0x1000,%ebx; mov %ebx,%eax */
+    0x81, 0xf3, 0x00, 0x10, 0x00, 0x00, 0x89, 0xd8,
+    /* 7c74: mov $0xcfc,%dx; out %eax,(%dx) */
+    0x66, 0xba, 0xfc, 0x0c, 0xef,
+    /* 7c79: movb $0,(%ebx); mov 8(%ebx),%al; cmp $0xfa,%al; je 7c89 */
+    0xc6, 0x03, 0x00, 0x8a, 0x43, 0x08, 0x3c, 0xfa, 0x74, 0x06,
+    /* 7c83: incl 0x7e04 */
+    0xff, 0x05, 0x04, 0x7e, 0x00, 0x00,
+    /* 7c89: incl 0x7e00 */
+    0xff, 0x05, 0x00, 0x7e, 0x00, 0x00,
+    /* 7c8f: jmp 0x7c40 */
+    0xeb, 0xaf,
+};
+
+static const uint8_t boot_gdt[] = {
+    /* 7d80: null, 4 GiB code at 0x08, 4 GiB data at 0x10 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0xff, 0x00, 0x00, 0x00, 0x9a, 0xcf, 0x00,
+    0xff, 0xff, 0x00, 0x00, 0x00, 0x92, 0xcf, 0x00,
+    /* 7d98: the GDT descriptor */
+    0x17, 0x00, 0x80, 0x7d, 0x00, 0x00,
+};
+
+static const char commands_string[] =
+    " -n = number of instances, one vCPU each (at least 2)\n"
+    " -d = duration of the measurement in seconds\n"
+    " -w = seconds the guest runs before the measurement\n"
+    " -t = transport: tcp, unix or shm\n"
+    " -x = accesses the guest makes: any of pio,mmio,ipi,bar\n"
+    " -o = file to write the results to, instead of stdout";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    fprintf(stderr, "QTEST_QEMU_BINARY must point to qemu-system-x86_64\n");
+}
+
+static bool op_enabled(const char *op)
+{
+    char **list = g_strsplit(ops, ",", 0);
+    bool found = false;
+    int i;
+
+    for (i = 0; list[i]; i++) {
+        found |= !strcmp(list[i], op);
+    }
+    g_strfreev(list);
+    return found;
+}
+
+static void write_boot_image(const char *path)
+{
+    uint8_t *image = g_malloc0(BOOT_IMAGE_SIZE);
+    GError *err = NULL;
+
+    memcpy(image, boot_code, sizeof(boot_code));
+    memcpy(image + GDT_OFFSET, boot_gdt, sizeof(boot_gdt));
+    if (!op_enabled("pio")) {
+        memset(image + OP_PIO_OFFSET, 0x90, OP_PIO_LEN);
+    }
+    if (!op_enabled("mmio")) {
+        memset(image + OP_MMIO_OFFSET, 0x90, OP_MMIO_LEN);
+    }
+    if (!op_enabled("ipi")) {
+        memset(image + OP_IPI_OFFSET, 0x90, OP_IPI_LEN);
+    }
+    if (!op_enabled("bar")) {
+        memset(image + OP_BAR_SETUP_OFFSET, 0x90, OP_BAR_SETUP_LEN);
+        memset(image + OP_BAR_OFFSET, 0x90, OP_BAR_LEN);
+    }
+    image[0x1fe] = 0x55;
+    image[0x1ff] = 0xaa;
+
+    if (!g_file_set_contents(path, (char *)image, BOOT_IMAGE_SIZE, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        exit(1);
+    }
+    g_free(image);
+}
+
+static void start_instance(int index, const char *iplist)
+{
+    char *pcidev = NULL;
+    char *command;
+
+    if (op_enabled("bar")) {
+        pcidev = g_strdup_printf("-device pci-testdev,addr=04.0,instance=%u ",
+                                 n_instances - 1);
+    }
+    command = g_strdup_printf("exec %s -enable-kvm "
+                              "-machine pc,kernel-irqchip=off "
+                              "-smp %u -m 256 -display none -vga none "
+                              "-net none -S "
+                              "-qmp unix:%s/qmp-%d.sock,server,nowait "
+                              "-drive file=%s/boot.img,format=raw,if=ide "
+                              "-device pc-testdev,instance=1 %s"
+                              "-local-cpu cpus=1,start=%d,transport=%s,"
+                              "socket-dir=%s%s "
+                              "2>%s/qemu-%d.log",
+                              qemu_binary, n_instances, dir, index, dir,
+                              pcidev ? pcidev : "", index, transport, dir,
+                              iplist, dir, index);
+    pids[index] = fork();
+    if (pids[index] == 0) {
+        setenv("QEMU_AUDIO_DRV", "none", true);
+        execlp("/bin/sh", "sh", "-c", command, NULL);
+        exit(1);
+    }
+    g_free(command);
+    g_free(pcidev);
+}
+
+/* Send a command and wait for its answer, skipping events */
+static QDict *bench_qmp(int index, const char *fmt, ...)
+{
+    QDict *rsp;
+    va_list ap;
+
+    va_start(ap, fmt);
+    qmp_fd_sendv(qmp_fds[index], fmt, ap);
+    va_end(ap);
+
+    for (;;) {
+        rsp = qmp_fd_receive(qmp_fds[index]);
+        if (!qdict_haskey(rsp, "event")) {
+            break;
+        }
+        QDECREF(rsp);
+    }
+    if (qdict_haskey(rsp, "error")) {
+        fprintf(stderr, "instance %d: %s\n", index,
+                qdict_get_str(qdict_get_qdict(rsp, "error"), "desc"));
+        exit(1);
+    }
+    return rsp;
+}
+
+static void connect_instance(int index)
+{
+    char *path = g_strdup_printf("%s/qmp-%d.sock", dir, index);
+    int i;
+
+    /* QEMU needs a while to create the socket */
+    for (i = 0; i < 300; i++) {
+        qmp_fds[index] = unix_connect(path, NULL);
+        if (qmp_fds[index] >= 0) {
+            break;
+        }
+        g_usleep(100 * 1000);
+    }
+    if (qmp_fds[index] < 0) {
+        fprintf(stderr, "cannot connect to instance %d, see %s/qemu-%d.log\n",
+                index, dir, index);
+        exit(1);
+    }
+    g_free(path);
+
+    /* the greeting comes once the instance has joined the router */
+    QDECREF(qmp_fd_receive(qmp_fds[index]));
+    QDECREF(bench_qmp(index, "{ 'execute': 'qmp_capabilities' }"));
+}
+
+static uint32_t read_guest_word(uint32_t addr)
+{
+    char *cmd = g_strdup_printf("xp /1wx %#x", addr);
+    QDict *rsp;
+    const char *out;
+    uint32_t val = 0;
+
+    rsp = bench_qmp(0, "{ 'execute': 'human-monitor-command',"
+                    "  'arguments': { 'command-line': %s } }", cmd);
+    out = strstr(qdict_get_str(rsp, "return"), ": ");
+    if (out) {
+        val = strtoul(out + 2, NULL, 16);
+    }
+    QDECREF(rsp);
+    g_free(cmd);
+    return val;
+}
+
+/*
+ * The DSM statistics of every instance: the router messages by type, and
+ * the faults of each vCPU with their rate since the previous sample
+ */
+static QDict **sample_stats(void)
+{
+    QDict **stats = g_new0(QDict *, n_instances);
+    QDict *rsp;
+    int i;
+
+    for (i = 0; i < n_instances; i++) {
+        rsp = bench_qmp(i, "{ 'execute': 'query-dsm-stats',"
+                        "  'arguments': { 'top': 0 } }");
+        stats[i] = qdict_get_qdict(rsp, "return");
+        QINCREF(stats[i]);
+        QDECREF(rsp);
+    }
+    return stats;
+}
+
+static QDict *find_type(QList *list, const char *type)
+{
+    QListEntry *e;
+    QDict *msg;
+
+    QLIST_FOREACH_ENTRY(list, e) {
+        msg = qobject_to_qdict(qlist_entry_obj(e));
+        if (!strcmp(qdict_get_str(msg, "type"), type)) {
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+static int64_t histogram_bucket(QList *list, int n)
+{
+    QListEntry *e;
+
+    QLIST_FOREACH_ENTRY(list, e) {
+        if (n-- == 0) {
+            return qint_get_int(qobject_to_qint(qlist_entry_obj(e)));
+        }
+    }
+    return 0;
+}
+
+/* What changed between @before and @after, per second */
+static QList *diff_router(QList *before, QList *after, double secs)
+{
+    QList *result = qlist_new();
+    QList *latency, *lat_before, *lat_after;
+    QListEntry *e;
+    QDict *msg, *old, *out;
+    const char *type;
+    int64_t sent, received, bucket;
+    int i, n;
+
+    QLIST_FOREACH_ENTRY(after, e) {
+        msg = qobject_to_qdict(qlist_entry_obj(e));
+        type = qdict_get_str(msg, "type");
+        old = find_type(before, type);
+        sent = qdict_get_int(msg, "sent") -
+               (old ? qdict_get_int(old, "sent") : 0);
+        received = qdict_get_int(msg, "received") -
+                   (old ? qdict_get_int(old, "received") : 0);
+        if (!sent && !received) {
+            continue;
+        }
+
+        lat_after = qdict_get_qlist(msg, "latency-us");
+        lat_before = old ? qdict_get_qlist(old, "latency-us") : NULL;
+        latency = qlist_new();
+        n = qlist_size(lat_after);
+        for (i = 0; i < n; i++) {
+            bucket = histogram_bucket(lat_after, i);
+            if (lat_before) {
+                bucket -= histogram_bucket(lat_before, i);
+            }
+            qlist_append(latency, qint_from_int(bucket));
+        }
+
+        out = qdict_new();
+        qdict_put(out, "type", qstring_from_str(type));
+        qdict_put(out, "sent", qint_from_int(sent));
+        qdict_put(out, "received", qint_from_int(received));
+        qdict_put(out, "sent-per-sec", qint_from_int(sent / secs));
+        qdict_put(out, "received-per-sec", qint_from_int(received / secs));
+        qdict_put(out, "latency-us", latency);
+        qlist_append(result, out);
+    }
+    return result;
+}
+
+/* Also run at exit, so that a failed run leaves no QEMU behind */
+static void stop_instances(void)
+{
+    int i;
+
+    for (i = 0; i < n_instances; i++) {
+        if (qmp_fds[i] >= 0) {
+            close(qmp_fds[i]);
+            qmp_fds[i] = -1;
+        }
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+            pids[i] = 0;
+        }
+    }
+}
+
+static void remove_dir(void)
+{
+    const char *name;
+    char *file;
+    GDir *d = g_dir_open(dir, 0, NULL);
+
+    while (d && (name = g_dir_read_name(d)) != NULL) {
+        file = g_build_filename(dir, name, NULL);
+        unlink(file);
+        g_free(file);
+    }
+    if (d) {
+        g_dir_close(d);
+    }
+    rmdir(dir);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hn:d:w:t:x:o:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'n':
+            n_instances = MAX(2, atoi(optarg));
+            break;
+        case 'd':
+            duration = MAX(1, atoi(optarg));
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 't':
+            transport = optarg;
+            break;
+        case 'x':
+            ops = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QDict **before, **after;
+    QDict *report, *inst;
+    QList *results, *vcpus;
+    QString *json;
+    GString *iplist;
+    GError *err = NULL;
+    uint32_t loops0, loops1, bar_errors;
+    int64_t t0, t1;
+    double secs;
+    char *path;
+    int i;
+
+    parse_args(argc, argv);
+    qemu_binary = getenv("QTEST_QEMU_BINARY");
+    if (!qemu_binary) {
+        usage_complete(argv);
+        return 1;
+    }
+    if (access("/dev/kvm", R_OK | W_OK)) {
+        fprintf(stderr, "KVM is not available\n");
+        return 1;
+    }
+
+    dir = g_dir_make_tmp("router-bench-XXXXXX", &err);
+    if (!dir) {
+        fprintf(stderr, "%s\n", err->message);
+        return 1;
+    }
+    path = g_strdup_printf("%s/boot.img", dir);
+    write_boot_image(path);
+
+    /* TCP instances listen on 127.0.0.1, each on its own port */
+    iplist = g_string_new("");
+    if (!strcmp(transport, "tcp")) {
+        g_string_append(iplist, ",iplist=\"127.0.0.1");
+        for (i = 1; i < n_instances; i++) {
+            g_string_append(iplist, " 127.0.0.1");
+        }
+        g_string_append(iplist, "\"");
+    }
+
+    pids = g_new0(pid_t, n_instances);
+    qmp_fds = g_new(int, n_instances);
+    for (i = 0; i < n_instances; i++) {
+        qmp_fds[i] = -1;
+    }
+    atexit(stop_instances);
+    for (i = 0; i < n_instances; i++) {
+        start_instance(i, iplist->str);
+    }
+    for (i = 0; i < n_instances; i++) {
+        connect_instance(i);
+    }
+
+    /* QEMU 0 last, so that the BSP finds everybody running */
+    for (i = n_instances - 1; i >= 0; i--) {
+        QDECREF(bench_qmp(i, "{ 'execute': 'cont' }"));
+    }
+    g_usleep(warmup * G_USEC_PER_SEC);
+
+    t0 = g_get_monotonic_time();
+    loops0 = read_guest_word(LOOP_COUNTER);
+    before = sample_stats();
+    g_usleep(duration * G_USEC_PER_SEC);
+    after = sample_stats();
+    loops1 = read_guest_word(LOOP_COUNTER);
+    bar_errors = read_guest_word(BAR_ERRORS);
+    t1 = g_get_monotonic_time();
+    secs = (double)(t1 - t0) / G_USEC_PER_SEC;
+
+    report = qdict_new();
+    qdict_put(report, "instances", qint_from_int(n_instances));
+    qdict_put(report, "transport", qstring_from_str(transport));
+    qdict_put(report, "accesses", qstring_from_str(ops));
+    qdict_put(report, "duration-ms", qint_from_int((t1 - t0) / 1000));
+    qdict_put(report, "guest-loops-per-sec",
+              qint_from_int((uint32_t)(loops1 - loops0) / secs));
+    if (op_enabled("bar")) {
+        qdict_put(report, "stale-bar-reads", qint_from_int(bar_errors));
+    }
+    results = qlist_new();
+    for (i = 0; i < n_instances; i++) {
+        inst = qdict_new();
+        qdict_put(inst, "instance", qint_from_int(i));
+        qdict_put(inst, "messages",
+                  diff_router(qdict_get_qlist(before[i], "router"),
+                              qdict_get_qlist(after[i], "router"), secs));
+        vcpus = qdict_get_qlist(after[i], "vcpus");
+        QINCREF(vcpus);
+        qdict_put(inst, "dsm-vcpus", vcpus);
+        qlist_append(results, inst);
+        QDECREF(before[i]);
+        QDECREF(after[i]);
+    }
+    qdict_put(report, "results", results);
+
+    stop_instances();
+
+    json = qobject_to_json_pretty(QOBJECT(report));
+    if (output) {
+        if (!g_file_set_contents(output, qstring_get_str(json), -1, &err)) {
+            fprintf(stderr, "%s\n", err->message);
+            return 1;
+        }
+    } else {
+        printf("%s\n", qstring_get_str(json));
+    }
+    QDECREF(json);
+    QDECREF(report);
+
+    /* the logs of the instances stay around if anything failed */
+    remove_dir();
+    g_free(path);
+    g_string_free(iplist, true);
+    return bar_errors ? 1 : 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * io-router wire protocol and transport microbenchmark
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include <netinet/tcp.h>
+#include "router-proto.h"
+
+#define MAX_SAMPLES (1 << 20)
+
+static unsigned int duration = 1;
+static unsigned int batch_size = ROUTER_BATCH_MAX;
+static unsigned int payload = 8;
+static const char *transport = "tcp";
+static unsigned int poll_us;
+
+static unsigned long long n_received;
+static int64_t *samples;
+static unsigned long n_samples;
+
+static const char commands_string[] =
+    " -d = duration of each test in seconds\n"
+    " -b = frames per write in the throughput test (max 64)\n"
+    " -s = payload bytes per frame\n"
+    " -t = transport: tcp, unix or shm\n"
+    " -p = microseconds a shm reader busy-polls before sleeping";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void set_nodelay(int fd)
+{
+    int v = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+}
+
+/* connect a pair of TCP sockets over 127.0.0.1 */
+static void tcp_pair(int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int lfd;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(lfd, 1) || getsockname(lfd, (struct sockaddr *)&addr, &len)) {
+        perror("listen");
+        exit(1);
+    }
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("connect");
+        exit(1);
+    }
+    fds[1] = accept(lfd, NULL, NULL);
+    if (fds[1] < 0) {
+        perror("accept");
+        exit(1);
+    }
+    close(lfd);
+    set_nodelay(fds[0]);
+    set_nodelay(fds[1]);
+}
+
+static void conn_pair(RouterConn *conns[2])
+{
+    Error *err = NULL;
+    int fds[ROUTER_SHM_NFDS];
+    int i;
+
+    if (!strcmp(transport, "shm")) {
+        conns[0] = router_conn_shm_new(1024 * 1024, poll_us * SCALE_US, fds,
+                                       &err);
+        if (conns[0]) {
+            conns[1] = router_conn_shm_attach(fds, poll_us * SCALE_US, &err);
+        }
+        if (err) {
+            error_report_err(err);
+            exit(1);
+        }
+        return;
+    }
+
+    if (!strcmp(transport, "unix")) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            perror("socketpair");
+            exit(1);
+        }
+    } else {
+        tcp_pair(fds);
+    }
+    for (i = 0; i < 2; i++) {
+        conns[i] = router_conn_new_fd(fds[i]);
+    }
+}
+
+/*
+ * Count every frame received and echo the ones that carry a tag, one
+ * header + body writev per reply as io_router_reply does
+ */
+static void *server_func(void *arg)
+{
+    RouterConn *conn = arg;
+    RouterArena arena;
+    RouterWireHdr *hdr, reply;
+    struct iovec iov[2];
+    uint32_t len;
+
+    router_arena_init(&arena, 256 * 1024);
+    while (router_arena_fill(&arena, conn) > 0) {
+        while (router_arena_next(&arena, &hdr) > 0) {
+            atomic_set(&n_received, n_received + 1);
+            if (hdr->tag) {
+                len = le32_to_cpu(hdr->len);
+                router_hdr_init(&reply, REPLY, -1, le32_to_cpu(hdr->tag), len);
+                iov[0].iov_base = &reply;
+                iov[0].iov_len = sizeof(reply);
+                iov[1].iov_base = router_frame_body(hdr);
+                iov[1].iov_len = len;
+                conn->writev(conn, iov, 2);
+            }
+        }
+    }
+    router_arena_destroy(&arena);
+    return NULL;
+}
+
+static double test_throughput(RouterConn *conn)
+{
+    RouterFrame *frames[ROUTER_BATCH_MAX];
+    RouterBatch batch;
+    unsigned long long sent = 0;
+    int64_t start, end;
+    unsigned int i;
+
+    for (i = 0; i < batch_size; i++) {
+        frames[i] = router_frame_new(FIXED_INT, i, payload);
+        memset(frames[i]->body, i, payload);
+    }
+
+    atomic_set(&n_received, 0);
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    router_batch_init(&batch);
+    while (get_clock() < end) {
+        for (i = 0; i < batch_size; i++) {
+            router_batch_add(&batch, &frames[i]->hdr);
+        }
+        if (router_batch_send(&batch, conn) < 0) {
+            perror("send");
+            exit(1);
+        }
+        sent += batch_size;
+    }
+    /* wait for the receiver to drain the socket */
+    while (atomic_read(&n_received) < sent) {
+        g_usleep(1000);
+    }
+    end = get_clock();
+
+    for (i = 0; i < batch_size; i++) {
+        g_free(frames[i]);
+    }
+    return (double)sent * NANOSECONDS_PER_SECOND / (end - start);
+}
+
+static void test_latency(RouterConn *conn)
+{
+    RouterFrame *frame = router_frame_new(MMIO, 0, payload);
+    RouterArena arena;
+    RouterBatch batch;
+    RouterWireHdr *hdr;
+    int64_t t0, end;
+    uint32_t tag = 1;
+
+    memset(frame->body, 0, payload);
+    router_arena_init(&arena, 256 * 1024);
+    router_batch_init(&batch);
+    n_samples = 0;
+    end = get_clock() + duration * NANOSECONDS_PER_SECOND;
+    while (n_samples < MAX_SAMPLES && get_clock() < end) {
+        frame->hdr.tag = cpu_to_le32(tag);
+        t0 = get_clock();
+        router_batch_add(&batch, &frame->hdr);
+        if (router_batch_send(&batch, conn) < 0) {
+            perror("send");
+            exit(1);
+        }
+        while (router_arena_next(&arena, &hdr) == 0) {
+            if (router_arena_fill(&arena, conn) <= 0) {
+                perror("recv");
+                exit(1);
+            }
+        }
+        samples[n_samples++] = get_clock() - t0;
+        g_assert(le32_to_cpu(hdr->tag) == tag);
+        tag = tag % 0xffff + 1;
+    }
+    router_arena_destroy(&arena);
+    g_free(frame);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" transport:         %s\n", transport);
+    printf(" busy-poll:         %u us\n", poll_us);
+    printf(" duration:          %u\n", duration);
+    printf(" frames per write:  %u\n", batch_size);
+    printf(" payload:           %u\n", payload);
+    printf(" frame size:        %zu\n", sizeof(RouterWireHdr) + payload);
+}
+
+static void pr_stats(double tput)
+{
+    qsort(samples, n_samples, sizeof(*samples), cmp_int64);
+
+    printf("Results:\n");
+    printf(" Throughput:         %.2f Mmsgs/s\n", tput / 1e6);
+    printf(" Bandwidth:          %.2f MB/s\n",
+           tput * (sizeof(RouterWireHdr) + payload) / 1e6);
+    printf(" Round trips:        %lu\n", n_samples);
+    if (n_samples) {
+        printf(" RTT p50:            %.2f us\n",
+               samples[n_samples / 2] / 1e3);
+        printf(" RTT p99:            %.2f us\n",
+               samples[n_samples * 99 / 100] / 1e3);
+    }
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:b:s:t:p:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = MAX(1, MIN(atoi(optarg), ROUTER_BATCH_MAX));
+            break;
+        case 's':
+            payload = MIN(atoi(optarg),
+                          ROUTER_FRAME_MAX - sizeof(RouterWireHdr));
+            break;
+        case 't':
+            transport = optarg;
+            break;
+        case 'p':
+            poll_us = atoi(optarg);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QemuThread server;
+    RouterConn *conns[2];
+    double tput;
+
+    parse_args(argc, argv);
+    pr_params();
+
+    conn_pair(conns);
+    qemu_thread_create(&server, "server", server_func, conns[1],
+                       QEMU_THREAD_JOINABLE);
+
+    samples = g_new(int64_t, MAX_SAMPLES);
+    tput = test_throughput(conns[0]);
+    test_latency(conns[0]);
+
+    conns[0]->shutdown(conns[0]);
+    qemu_thread_join(&server);
+    pr_stats(tput);
+    return 0;
+}
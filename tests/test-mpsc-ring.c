@@ -0,0 +1,105 @@
+/*
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/mpsc-ring.h"
+
+#define N_PRODUCERS 4
+#define N_ITEMS 20000
+
+static MPSCRing ring;
+static bool start;
+
+static void test_fifo(void)
+{
+    uintptr_t i;
+
+    mpsc_ring_init(&ring, 5);
+    g_assert_cmpuint(ring.mask, ==, 7);
+    g_assert(mpsc_ring_empty(&ring));
+    g_assert(mpsc_ring_pop(&ring) == NULL);
+
+    for (i = 1; i <= 8; i++) {
+        g_assert(mpsc_ring_push(&ring, (void *)i));
+    }
+    g_assert(!mpsc_ring_push(&ring, (void *)i));
+
+    for (i = 1; i <= 8; i++) {
+        g_assert(mpsc_ring_pop(&ring) == (void *)i);
+    }
+    g_assert(mpsc_ring_empty(&ring));
+
+    /* wrap around a few times */
+    for (i = 1; i <= 100; i++) {
+        g_assert(mpsc_ring_push(&ring, (void *)i));
+        g_assert(mpsc_ring_pop(&ring) == (void *)i);
+    }
+    mpsc_ring_destroy(&ring);
+}
+
+static void *producer(void *arg)
+{
+    uintptr_t id = (uintptr_t)arg;
+    uintptr_t i;
+
+    while (!atomic_read(&start)) {
+        cpu_relax();
+    }
+    for (i = 0; i < N_ITEMS; i++) {
+        /* encode producer and sequence; never zero */
+        void *p = (void *)((i << 8) | (id + 1));
+
+        while (!mpsc_ring_push(&ring, p)) {
+            g_thread_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    QemuThread threads[N_PRODUCERS];
+    uintptr_t next[N_PRODUCERS] = { 0 };
+    unsigned long received = 0;
+    uintptr_t i;
+
+    mpsc_ring_init(&ring, 64);
+    atomic_set(&start, false);
+    for (i = 0; i < N_PRODUCERS; i++) {
+        qemu_thread_create(&threads[i], "mpsc-producer", producer, (void *)i,
+                           QEMU_THREAD_JOINABLE);
+    }
+    atomic_set(&start, true);
+
+    while (received < N_PRODUCERS * N_ITEMS) {
+        uintptr_t p = (uintptr_t)mpsc_ring_pop(&ring);
+        uintptr_t id;
+
+        if (!p) {
+            g_thread_yield();
+            continue;
+        }
+        id = (p & 0xff) - 1;
+        g_assert_cmpuint(id, <, N_PRODUCERS);
+        /* items from one producer come out in the order they went in */
+        g_assert_cmpuint(p >> 8, ==, next[id]);
+        next[id]++;
+        received++;
+    }
+
+    for (i = 0; i < N_PRODUCERS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_assert(mpsc_ring_empty(&ring));
+    mpsc_ring_destroy(&ring);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/mpsc-ring/fifo", test_fifo);
+    g_test_add_func("/mpsc-ring/concurrent", test_concurrent);
+    return g_test_run();
+}
@@ -0,0 +1,198 @@
+/*
+ * Decoding of the io-router wire protocol
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "router-proto.h"
+
+/* A connection that hands out a fixed byte stream, @chunk bytes at a time */
+typedef struct FakeConn {
+    RouterConn conn;
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t chunk;
+} FakeConn;
+
+static ssize_t fake_read(RouterConn *conn, uint8_t *buf, size_t min,
+                         size_t max)
+{
+    FakeConn *c = container_of(conn, FakeConn, conn);
+    size_t n = MIN(MAX(min, c->chunk), max);
+
+    n = MIN(n, c->len - c->pos);
+    memcpy(buf, c->data + c->pos, n);
+    c->pos += n;
+    return n;
+}
+
+static void fake_conn_init(FakeConn *c, const void *data, size_t len,
+                           size_t chunk)
+{
+    memset(c, 0, sizeof(*c));
+    c->conn.read = fake_read;
+    c->data = data;
+    c->len = len;
+    c->chunk = chunk;
+}
+
+/* The next frame, as the receive thread gets it: 1, 0 on EOF, or -errno */
+static int decode(FakeConn *c, RouterArena *arena, RouterWireHdr **hdr)
+{
+    ssize_t n;
+    int ret;
+
+    for (;;) {
+        ret = router_arena_next(arena, hdr);
+        if (ret) {
+            return ret;
+        }
+        n = router_arena_fill(arena, &c->conn);
+        if (n <= 0) {
+            return n;
+        }
+    }
+}
+
+/* Append a frame of @type with @body_len bytes of body, all set to @type */
+static void append_frame(GByteArray *stream, uint8_t type, uint32_t body_len)
+{
+    RouterWireHdr hdr;
+    uint8_t *body = g_malloc(body_len);
+
+    router_hdr_init(&hdr, type, 1, 0, body_len);
+    memset(body, type, body_len);
+    g_byte_array_append(stream, (uint8_t *)&hdr, sizeof(hdr));
+    g_byte_array_append(stream, body, body_len);
+    g_free(body);
+}
+
+static void test_frames(void)
+{
+    static const size_t chunks[] = { 1, 7, 4096, ROUTER_FRAME_MAX * 4 };
+    static const uint32_t lens[] = {
+        0, sizeof(RouterIntArgs), 1000, ROUTER_FRAME_MAX - sizeof(RouterWireHdr)
+    };
+    GByteArray *stream = g_byte_array_new();
+    RouterArena arena;
+    RouterWireHdr *hdr;
+    FakeConn c;
+    uint8_t *body;
+    int i, j, k;
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        append_frame(stream, FIXED_INT + i, lens[i]);
+    }
+
+    /* however the stream is cut, the same frames come out */
+    for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+        fake_conn_init(&c, stream->data, stream->len, chunks[i]);
+        router_arena_init(&arena, 0);
+        for (j = 0; j < ARRAY_SIZE(lens); j++) {
+            g_assert_cmpint(decode(&c, &arena, &hdr), ==, 1);
+            g_assert_cmpint(hdr->version, ==, ROUTER_PROTO_VERSION);
+            g_assert_cmpint(hdr->type, ==, FIXED_INT + j);
+            g_assert_cmpint(le32_to_cpu(hdr->cpu_index), ==, 1);
+            g_assert_cmpuint(le32_to_cpu(hdr->len), ==, lens[j]);
+            body = router_frame_body(hdr);
+            for (k = 0; k < lens[j]; k++) {
+                g_assert_cmpint(body[k], ==, FIXED_INT + j);
+            }
+        }
+        g_assert_cmpint(decode(&c, &arena, &hdr), ==, 0);
+        router_arena_destroy(&arena);
+    }
+    g_byte_array_free(stream, true);
+}
+
+static void test_truncated(void)
+{
+    GByteArray *stream = g_byte_array_new();
+    RouterArena arena;
+    RouterWireHdr *hdr;
+    FakeConn c;
+
+    append_frame(stream, PIO, 100);
+
+    /* the body stops short */
+    fake_conn_init(&c, stream->data, stream->len - 50, 7);
+    router_arena_init(&arena, 0);
+    g_assert_cmpint(decode(&c, &arena, &hdr), ==, 0);
+    router_arena_destroy(&arena);
+
+    /* so does the header */
+    fake_conn_init(&c, stream->data, sizeof(RouterWireHdr) - 1, 7);
+    router_arena_init(&arena, 0);
+    g_assert_cmpint(decode(&c, &arena, &hdr), ==, 0);
+    router_arena_destroy(&arena);
+
+    g_byte_array_free(stream, true);
+}
+
+static void test_oversized(void)
+{
+    static const uint32_t lens[] = {
+        ROUTER_FRAME_MAX - sizeof(RouterWireHdr) + 1,
+        ROUTER_FRAME_MAX,
+        /* sizeof(RouterWireHdr) + len wraps around to a small size */
+        UINT32_MAX - sizeof(RouterWireHdr) + 9,
+        UINT32_MAX,
+    };
+    RouterArena arena;
+    RouterWireHdr hdr, *h;
+    FakeConn c;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        router_hdr_init(&hdr, MMIO, 0, 0, 0);
+        hdr.len = cpu_to_le32(lens[i]);
+        g_assert(!router_frame_len_ok(&hdr));
+
+        fake_conn_init(&c, &hdr, sizeof(hdr), sizeof(hdr));
+        router_arena_init(&arena, 0);
+        g_assert_cmpint(decode(&c, &arena, &h), ==, -EPROTO);
+        router_arena_destroy(&arena);
+    }
+}
+
+static void test_wrong_version(void)
+{
+    GByteArray *stream = g_byte_array_new();
+    RouterArena arena;
+    RouterWireHdr *hdr;
+    FakeConn c;
+
+    append_frame(stream, LAPIC, sizeof(RouterLapicArgs));
+    append_frame(stream, LAPIC, sizeof(RouterLapicArgs));
+    ((RouterWireHdr *)stream->data)->version = ROUTER_PROTO_VERSION - 1;
+
+    fake_conn_init(&c, stream->data, stream->len, 4096);
+    router_arena_init(&arena, 0);
+    g_assert_cmpint(decode(&c, &arena, &hdr), ==, -EPROTO);
+    router_arena_destroy(&arena);
+
+    /* a bad frame after a good one */
+    ((RouterWireHdr *)stream->data)->version = ROUTER_PROTO_VERSION;
+    ((RouterWireHdr *)(stream->data + sizeof(RouterWireHdr) +
+                       sizeof(RouterLapicArgs)))->version =
+        ROUTER_PROTO_VERSION + 1;
+    fake_conn_init(&c, stream->data, stream->len, 4096);
+    router_arena_init(&arena, 0);
+    g_assert_cmpint(decode(&c, &arena, &hdr), ==, 1);
+    g_assert_cmpint(decode(&c, &arena, &hdr), ==, -EPROTO);
+    router_arena_destroy(&arena);
+
+    g_byte_array_free(stream, true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/router-proto/frames", test_frames);
+    g_test_add_func("/router-proto/truncated", test_truncated);
+    g_test_add_func("/router-proto/oversized", test_oversized);
+    g_test_add_func("/router-proto/wrong-version", test_wrong_version);
+    return g_test_run();
+}
@@ -0,0 +1,118 @@
+/*
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/thread-barrier.h"
+
+#define N_THREADS 4
+#define N_ROUNDS 2000
+
+static QemuBarrier barrier;
+static unsigned arrivals;
+static unsigned openers;
+
+static void *round_thread(void *arg)
+{
+    unsigned spin = (uintptr_t)arg;
+    unsigned i;
+
+    for (i = 0; i < N_ROUNDS; i++) {
+        atomic_inc(&arrivals);
+        if (qemu_barrier_wait(&barrier)) {
+            atomic_inc(&openers);
+        }
+        /* nobody gets through before everybody has arrived */
+        g_assert_cmpuint(atomic_read(&arrivals), >=, (i + 1) * N_THREADS);
+        if (spin) {
+            g_thread_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_rounds(unsigned spin)
+{
+    QemuThread threads[N_THREADS];
+    uintptr_t i;
+
+    qemu_barrier_init(&barrier, N_THREADS, spin);
+    atomic_set(&arrivals, 0);
+    atomic_set(&openers, 0);
+    for (i = 0; i < N_THREADS; i++) {
+        qemu_thread_create(&threads[i], "barrier", round_thread,
+                           (void *)(uintptr_t)spin, QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < N_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_assert_cmpuint(arrivals, ==, N_ROUNDS * N_THREADS);
+    g_assert_cmpuint(openers, ==, N_ROUNDS);
+    qemu_barrier_destroy(&barrier);
+}
+
+static void test_sleep(void)
+{
+    test_rounds(0);
+}
+
+static void test_spin(void)
+{
+    test_rounds(QEMU_BARRIER_SPIN_DEFAULT);
+}
+
+static void *wait_thread(void *arg)
+{
+    qemu_barrier_wait(&barrier);
+    atomic_inc(&arrivals);
+    return NULL;
+}
+
+static void test_join_leave(void)
+{
+    QemuThread threads[2];
+    int i;
+
+    qemu_barrier_init(&barrier, 1, 0);
+    atomic_set(&arrivals, 0);
+
+    /* a single participant never blocks */
+    g_assert(qemu_barrier_wait(&barrier));
+    g_assert(qemu_barrier_wait(&barrier));
+
+    qemu_barrier_join(&barrier);
+    qemu_barrier_join(&barrier);
+    for (i = 0; i < 2; i++) {
+        qemu_thread_create(&threads[i], "barrier", wait_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    /* the two waiters are released by the third participant leaving */
+    while ((atomic_read(&barrier.state) & QEMU_BARRIER_MAX_THREADS) < 2) {
+        g_thread_yield();
+    }
+    g_assert_cmpuint(atomic_read(&arrivals), ==, 0);
+    qemu_barrier_leave(&barrier);
+    for (i = 0; i < 2; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_assert_cmpuint(arrivals, ==, 2);
+
+    /* and the remaining two keep working as a pair */
+    qemu_thread_create(&threads[0], "barrier", wait_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    qemu_barrier_wait(&barrier);
+    qemu_thread_join(&threads[0]);
+    g_assert_cmpuint(arrivals, ==, 3);
+    qemu_barrier_destroy(&barrier);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/thread-barrier/sleep", test_sleep);
+    g_test_add_func("/thread-barrier/spin", test_spin);
+    g_test_add_func("/thread-barrier/join-leave", test_join_leave);
+    return g_test_run();
+}
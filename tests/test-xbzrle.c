@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +175,52 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_accel(void)
+{
+    do {
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode();
+    } while (xbzrle_test_next_accel());
+}
+
+static void test_page_cache(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t i;
+
+    /* pages that map to the same set do not evict each other */
+    for (i = 0; i < 4; i++) {
+        page[0] = i;
+        g_assert(cache_insert(cache, i * 64 * PAGE_SIZE, page, 0) == 0);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * 64 * PAGE_SIZE, 0));
+        g_assert(get_cached_data(cache, i * 64 * PAGE_SIZE)[0] == i);
+    }
+    g_assert(!get_cached_data(cache, 4 * 64 * PAGE_SIZE));
+
+    /* they stay when the cache shrinks to a single set */
+    g_assert(cache_resize(cache, 8) == 8);
+    for (i = 0; i < 4; i++) {
+        g_assert(get_cached_data(cache, i * 64 * PAGE_SIZE)[0] == i);
+    }
+
+    /* a full set keeps its fresh pages, and replaces the stale ones */
+    for (i = 1; i <= 4; i++) {
+        g_assert(cache_insert(cache, i * PAGE_SIZE, page, 0) == 0);
+    }
+    g_assert(cache_insert(cache, 5 * PAGE_SIZE, page, 1) == -1);
+    g_assert(cache_is_cached(cache, 0, 2));
+    g_assert(cache_insert(cache, 5 * PAGE_SIZE, page, 2) == 0);
+    g_assert(cache_is_cached(cache, 0, 2));
+    g_assert(!cache_is_cached(cache, PAGE_SIZE, 2));
+
+    cache_fini(cache);
+    g_free(page);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +233,9 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/page_cache", test_page_cache);
+    /* last: it leaves the encoder on the word at a time version */
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
@@ -0,0 +1,231 @@
+/*
+ * XBZRLE encoder, decoder and page cache microbenchmark
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
+#include "migration/migration.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static unsigned int n_pages = 16384;
+static unsigned int n_writes = 8;
+static unsigned int write_len = 16;
+static unsigned int cache_pages = 4096;
+static unsigned int rounds = 10;
+
+static uint8_t *old_ram;
+static uint8_t *new_ram;
+static uint64_t seed = 1;
+
+static const char commands_string[] =
+    " -p = guest pages\n"
+    " -w = writes per page between two rounds\n"
+    " -l = the most bytes a write changes\n"
+    " -c = page cache size in pages (will be rounded down to pow2)\n"
+    " -r = rounds";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+static unsigned int rnd(unsigned int range)
+{
+    seed = xorshift64star(seed);
+    return (seed >> 16) % range;
+}
+
+/* new_ram is old_ram with n_writes small writes in every page */
+static void dirty_pages(void)
+{
+    unsigned int i, j, off, len;
+
+    for (i = 0; i < n_pages * PAGE_SIZE; i++) {
+        old_ram[i] = rnd(4) ? 0 : rnd(256);
+    }
+    memcpy(new_ram, old_ram, n_pages * PAGE_SIZE);
+    for (i = 0; i < n_pages; i++) {
+        for (j = 0; j < n_writes; j++) {
+            off = rnd(PAGE_SIZE);
+            len = MIN(1 + rnd(write_len), PAGE_SIZE - off);
+            while (len--) {
+                new_ram[i * PAGE_SIZE + off++] ^= 1 + rnd(255);
+            }
+        }
+    }
+}
+
+static void test_codec(void)
+{
+    uint8_t *encoded = g_malloc0(n_pages * PAGE_SIZE);
+    uint8_t *decoded = g_malloc(n_pages * PAGE_SIZE);
+    int *len = g_new(int, n_pages);
+    uint64_t bytes, overflows;
+    int64_t start, enc_ns, dec_ns;
+    unsigned int i, r;
+
+    printf("Encoder and decoder, fastest ISA first:\n");
+    do {
+        bytes = overflows = 0;
+        start = get_clock();
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < n_pages; i++) {
+                len[i] = xbzrle_encode_buffer(old_ram + i * PAGE_SIZE,
+                                              new_ram + i * PAGE_SIZE,
+                                              PAGE_SIZE,
+                                              encoded + i * PAGE_SIZE,
+                                              PAGE_SIZE);
+            }
+        }
+        enc_ns = get_clock() - start;
+
+        for (i = 0; i < n_pages; i++) {
+            if (len[i] < 0) {
+                overflows++;
+            } else {
+                bytes += len[i];
+            }
+        }
+
+        memcpy(decoded, old_ram, n_pages * PAGE_SIZE);
+        start = get_clock();
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < n_pages; i++) {
+                if (len[i] > 0) {
+                    xbzrle_decode_buffer(encoded + i * PAGE_SIZE, len[i],
+                                         decoded + i * PAGE_SIZE, PAGE_SIZE);
+                }
+            }
+        }
+        dec_ns = get_clock() - start;
+
+        printf(" encode:             %.2f GB/s of pages\n",
+               (double)rounds * n_pages * PAGE_SIZE / enc_ns);
+        printf(" decode:             %.2f GB/s of pages\n",
+               (double)rounds * n_pages * PAGE_SIZE / dec_ns);
+        printf(" encoded size:       %.2f%% of the pages, %" PRIu64
+               " overflows\n", 100.0 * bytes /
+               ((double)(n_pages - overflows) * PAGE_SIZE), overflows);
+    } while (xbzrle_test_next_accel());
+
+    g_free(len);
+    g_free(decoded);
+    g_free(encoded);
+}
+
+/*
+ * Four lookups in five go to a hot fifth of the guest pages, picked at
+ * random, as after a bitmap sync of a guest that writes mostly to its
+ * working set; the cache is looked up and filled as save_xbzrle_page()
+ * does, one age per round.
+ */
+static void test_cache(void)
+{
+    PageCache *cache = cache_init(cache_pages, PAGE_SIZE);
+    uint64_t hits = 0, misses = 0, lookups = 0;
+    unsigned int hot = MAX(n_pages / 5, 1);
+    unsigned int *hot_pages = g_new(unsigned int, hot);
+    unsigned int i, r, page;
+    int64_t start, ns;
+
+    for (i = 0; i < hot; i++) {
+        hot_pages[i] = rnd(n_pages);
+    }
+
+    start = get_clock();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n_pages / 2; i++) {
+            page = rnd(5) ? hot_pages[rnd(hot)] : rnd(n_pages);
+            lookups++;
+            if (cache_is_cached(cache, (uint64_t)page * PAGE_SIZE, r)) {
+                hits++;
+            } else {
+                misses++;
+                cache_insert(cache, (uint64_t)page * PAGE_SIZE,
+                             new_ram + page * PAGE_SIZE, r);
+            }
+        }
+    }
+    ns = get_clock() - start;
+    cache_fini(cache);
+    g_free(hot_pages);
+
+    printf("Page cache:\n");
+    printf(" hit rate:           %.2f%%\n", 100.0 * hits / lookups);
+    printf(" misses:             %" PRIu64 "\n", misses);
+    printf(" lookups:            %.2f M/s\n", lookups * 1e3 / ns);
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" pages:              %u\n", n_pages);
+    printf(" writes per page:    %u\n", n_writes);
+    printf(" write length:       1-%u\n", write_len);
+    printf(" cache pages:        %u\n", cache_pages);
+    printf(" rounds:             %u\n", rounds);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hp:w:l:c:r:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'p':
+            n_pages = MAX(atoi(optarg), 1);
+            break;
+        case 'w':
+            n_writes = atoi(optarg);
+            break;
+        case 'l':
+            write_len = MAX(atoi(optarg), 1);
+            break;
+        case 'c':
+            cache_pages = MAX(atoi(optarg), 1);
+            break;
+        case 'r':
+            rounds = MAX(atoi(optarg), 1);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    pr_params();
+
+    /* xbzrle_encode_buffer wants the pages aligned to a long */
+    old_ram = qemu_memalign(PAGE_SIZE, n_pages * PAGE_SIZE);
+    new_ram = qemu_memalign(PAGE_SIZE, n_pages * PAGE_SIZE);
+    dirty_pages();
+
+    test_codec();
+    test_cache();
+
+    qemu_vfree(old_ram);
+    qemu_vfree(new_ram);
+    return 0;
+}
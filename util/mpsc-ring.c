@@ -0,0 +1,30 @@
+/*
+ * Bounded lock-free multi-producer/single-consumer ring of pointers
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/mpsc-ring.h"
+
+void mpsc_ring_init(MPSCRing *ring, size_t size)
+{
+    unsigned long i;
+
+    size = pow2ceil(MAX(size, 2));
+    ring->slots = g_new0(MPSCRingSlot, size);
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    for (i = 0; i < size; i++) {
+        ring->slots[i].seq = i;
+    }
+    smp_wmb();
+}
+
+void mpsc_ring_destroy(MPSCRing *ring)
+{
+    g_free(ring->slots);
+    ring->slots = NULL;
+}
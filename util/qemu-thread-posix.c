@@ -314,6 +314,27 @@ static inline void futex_wait(QemuEvent *ev, unsigned val)
         }
     }
 }
+
+static inline void futex_timedwait(QemuEvent *ev, unsigned val, int64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000LL,
+        .tv_nsec = ns % 1000000000LL,
+    };
+
+    /* the timeout is relative, an interrupted wait starts it over */
+    while (futex(ev, FUTEX_WAIT, (int) val, &ts, NULL, 0)) {
+        switch (errno) {
+        case EWOULDBLOCK:
+        case ETIMEDOUT:
+            return;
+        case EINTR:
+            break; /* get out of switch and retry */
+        default:
+            abort();
+        }
+    }
+}
 #else
 static inline void futex_wake(QemuEvent *ev, int n)
 {
@@ -334,6 +355,22 @@ static inline void futex_wait(QemuEvent *ev, unsigned val)
     }
     pthread_mutex_unlock(&ev->lock);
 }
+
+static inline void futex_timedwait(QemuEvent *ev, unsigned val, int64_t ns)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns += ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+
+    pthread_mutex_lock(&ev->lock);
+    if (ev->value == val) {
+        pthread_cond_timedwait(&ev->cond, &ev->lock, &ts);
+    }
+    pthread_mutex_unlock(&ev->lock);
+}
 #endif
 
 /* Valid transitions:
@@ -423,6 +460,23 @@ void qemu_event_wait(QemuEvent *ev)
     }
 }
 
+void qemu_event_timedwait(QemuEvent *ev, int64_t ns)
+{
+    unsigned value;
+
+    value = atomic_read(&ev->value);
+    smp_mb_acquire();
+    if (value != EV_SET) {
+        if (value == EV_FREE) {
+            /* see qemu_event_wait */
+            if (atomic_cmpxchg(&ev->value, EV_FREE, EV_BUSY) == EV_SET) {
+                return;
+            }
+        }
+        futex_timedwait(ev, EV_BUSY, ns);
+    }
+}
+
 static pthread_key_t exit_key;
 
 union NotifierThreadData {
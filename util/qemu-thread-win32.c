@@ -355,6 +355,28 @@ void qemu_event_wait(QemuEvent *ev)
     }
 }
 
+void qemu_event_timedwait(QemuEvent *ev, int64_t ns)
+{
+    unsigned value;
+
+    value = atomic_read(&ev->value);
+    smp_mb_acquire();
+    if (value != EV_SET) {
+        if (value == EV_FREE) {
+            /* see qemu_event_wait */
+            ResetEvent(ev->event);
+            if (atomic_cmpxchg(&ev->value, EV_FREE, EV_BUSY) == EV_SET) {
+                value = EV_SET;
+            } else {
+                value = EV_BUSY;
+            }
+        }
+        if (value == EV_BUSY) {
+            WaitForSingleObject(ev->event, (ns + 999999) / 1000000);
+        }
+    }
+}
+
 struct QemuThreadData {
     /* Passed to win32_start_routine.  */
     void             *(*start_routine)(void *);
@@ -0,0 +1,164 @@
+/*
+ * Sense-reversing thread barrier with a spin-then-sleep wait policy
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/processor.h"
+#include "qemu/thread-barrier.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define ARRIVED_BITS    12
+#define COUNT_SHIFT     ARRIVED_BITS
+#define GEN_SHIFT       (2 * ARRIVED_BITS)
+#define FIELD_MASK      QEMU_BARRIER_MAX_THREADS
+#define GEN_MASK        0xff
+
+#define STATE_ARRIVED(s)    ((s) & FIELD_MASK)
+#define STATE_COUNT(s)      (((s) >> COUNT_SHIFT) & FIELD_MASK)
+#define STATE_GEN(s)        ((s) >> GEN_SHIFT)
+#define STATE(gen, count, arrived) \
+    (((gen) & GEN_MASK) << GEN_SHIFT | (count) << COUNT_SHIFT | (arrived))
+
+#ifdef __linux__
+#define futex(...)              syscall(__NR_futex, __VA_ARGS__)
+
+static void barrier_publish(QemuBarrier *b, unsigned gen)
+{
+    atomic_store_release(&b->phase, gen);
+    futex(&b->phase, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void barrier_sleep(QemuBarrier *b, unsigned gen)
+{
+    unsigned cur;
+
+    while ((cur = atomic_load_acquire(&b->phase)) != gen) {
+        if (futex(&b->phase, FUTEX_WAIT, (int) cur, NULL, NULL, 0)) {
+            switch (errno) {
+            case EWOULDBLOCK:
+            case EINTR:
+                break;
+            default:
+                abort();
+            }
+        }
+    }
+}
+#else
+static void barrier_publish(QemuBarrier *b, unsigned gen)
+{
+    qemu_mutex_lock(&b->lock);
+    atomic_store_release(&b->phase, gen);
+    qemu_cond_broadcast(&b->cond);
+    qemu_mutex_unlock(&b->lock);
+}
+
+static void barrier_sleep(QemuBarrier *b, unsigned gen)
+{
+    qemu_mutex_lock(&b->lock);
+    while (atomic_read(&b->phase) != gen) {
+        qemu_cond_wait(&b->cond, &b->lock);
+    }
+    qemu_mutex_unlock(&b->lock);
+}
+#endif
+
+/*
+ * Apply @delta to the participant count and @arrive to the arrived count.
+ * If that completes the phase, reset the arrived count and move on to the
+ * next generation.  Returns the generation the caller has to wait for and
+ * sets *@opened if the caller is the one that has to publish it.
+ */
+static unsigned barrier_update(QemuBarrier *b, int delta, unsigned arrive,
+                               bool *opened)
+{
+    unsigned old, new, count, arrived, gen;
+
+    old = atomic_read(&b->state);
+    for (;;) {
+        count = STATE_COUNT(old) + delta;
+        arrived = STATE_ARRIVED(old) + arrive;
+        gen = STATE_GEN(old);
+        assert(count <= QEMU_BARRIER_MAX_THREADS && arrived <= count);
+
+        *opened = count && arrived == count;
+        new = *opened ? STATE(gen + 1, count, 0) : STATE(gen, count, arrived);
+        new = atomic_cmpxchg(&b->state, old, new);
+        if (new == old) {
+            return (gen + 1) & GEN_MASK;
+        }
+        old = new;
+    }
+}
+
+void qemu_barrier_init(QemuBarrier *b, unsigned count, unsigned spin)
+{
+    assert(count <= QEMU_BARRIER_MAX_THREADS);
+    b->state = STATE(0, count, 0);
+    b->phase = 0;
+    b->spin = spin;
+#ifndef __linux__
+    qemu_mutex_init(&b->lock);
+    qemu_cond_init(&b->cond);
+#endif
+}
+
+void qemu_barrier_destroy(QemuBarrier *b)
+{
+    assert(STATE_ARRIVED(b->state) == 0);
+#ifndef __linux__
+    qemu_cond_destroy(&b->cond);
+    qemu_mutex_destroy(&b->lock);
+#endif
+}
+
+bool qemu_barrier_wait(QemuBarrier *b)
+{
+    bool opened;
+    unsigned gen = barrier_update(b, 0, 1, &opened);
+    unsigned i;
+
+    if (opened) {
+        barrier_publish(b, gen);
+        return true;
+    }
+
+    /*
+     * The phase word only ever moves to our generation from the one just
+     * before it, and cannot move past it until we arrive again, so
+     * comparing for equality is enough even though it wraps around.
+     */
+    for (i = 0; i < b->spin; i++) {
+        if (atomic_load_acquire(&b->phase) == gen) {
+            return false;
+        }
+        cpu_relax();
+    }
+    barrier_sleep(b, gen);
+    return false;
+}
+
+void qemu_barrier_join(QemuBarrier *b)
+{
+    bool opened;
+
+    barrier_update(b, 1, 0, &opened);
+    assert(!opened);
+}
+
+void qemu_barrier_leave(QemuBarrier *b)
+{
+    bool opened;
+    unsigned gen = barrier_update(b, -1, 0, &opened);
+
+    if (opened) {
+        barrier_publish(b, gen);
+    }
+}
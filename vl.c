@@ -580,6 +580,67 @@ static QemuOptsList qemu_local_cpu_opts = {
             .name = "iplist",
             .type = QEMU_OPT_STRING,
             .help = "list of cluster node ip address (seperated by space)",
+        },{
+            .name = "topology",
+            .type = QEMU_OPT_STRING,
+            .help = "JSON file with the vCPUs and the address of every "
+                    "instance",
+        },{
+            .name = "index",
+            .type = QEMU_OPT_NUMBER,
+            .help = "index of this instance in the topology file",
+        },{
+            .name = "batch-window",
+            .type = QEMU_OPT_NUMBER,
+            .help = "microseconds posted forwarding messages may be held "
+                    "back to batch them",
+        },{
+            .name = "transport",
+            .type = QEMU_OPT_STRING,
+            .help = "how instances talk to each other (tcp, unix or shm)",
+        },{
+            .name = "socket-dir",
+            .type = QEMU_OPT_STRING,
+            .help = "directory of the unix and shm rendezvous sockets",
+        },{
+            .name = "poll",
+            .type = QEMU_OPT_NUMBER,
+            .help = "microseconds a shm receiver busy-polls before sleeping",
+        },{
+            .name = "io-threads",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of threads handling forwarded device I/O",
+        },{
+            .name = "broadcast-tree",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of instances from which broadcasts are relayed "
+                    "over a tree, 0 to never",
+        },{
+            .name = "clock-sync",
+            .type = QEMU_OPT_NUMBER,
+            .help = "milliseconds between kvmclock sync samples, 0 to "
+                    "always ask QEMU 0",
+        },{
+            .name = "numa",
+            .type = QEMU_OPT_BOOL,
+            .help = "describe each instance as a NUMA node",
+        },{
+            .name = "pin-cache",
+            .type = QEMU_OPT_NUMBER,
+            .help = "idle pages each address space keeps pinned for DMA, "
+                    "0 to unpin at once",
+        },{
+            .name = "dsm",
+            .type = QEMU_OPT_STRING,
+            .help = "distributed shared memory (kernel or user)",
+        },{
+            .name = "dsm-port",
+            .type = QEMU_OPT_NUMBER,
+            .help = "TCP port of the first instance's userspace DSM",
+        },{
+            .name = "dsm-prefetch",
+            .type = QEMU_OPT_NUMBER,
+            .help = "pages the userspace DSM fetches along on a read fault",
         },
         { /* end of list */ }
     },
@@ -4107,10 +4168,39 @@ int main(int argc, char **argv, char **envp)
                 local_cpus = qemu_opt_get_number(opts, "cpus", 1);
                 local_cpu_start_index = qemu_opt_get_number(opts, "start", 0);
                 cluster_iplist = qemu_opt_get(opts, "iplist");
-                if (parse_cluster_iplist(cluster_iplist)) {
+                router_topology_file = qemu_opt_get(opts, "topology");
+                router_topology_index = qemu_opt_get_number(opts, "index", -1);
+                router_batch_window_us = qemu_opt_get_number(opts,
+                                                             "batch-window", 0);
+                if (parse_router_transport(qemu_opt_get(opts, "transport"))) {
+                    exit(1);
+                }
+                /* the topology file has the address of every instance */
+                if (!router_topology_file &&
+                    (cluster_iplist ||
+                     router_transport == ROUTER_TRANSPORT_TCP) &&
+                    parse_cluster_iplist(cluster_iplist)) {
                     error_report("iplist parse failed");
                     exit(1);
                 }
+                router_socket_dir = qemu_opt_get(opts, "socket-dir");
+                router_poll_us = qemu_opt_get_number(opts, "poll", 0);
+                router_io_threads = qemu_opt_get_number(opts, "io-threads",
+                                                ROUTER_IO_THREADS_DEFAULT);
+                router_broadcast_tree = qemu_opt_get_number(opts,
+                                "broadcast-tree", ROUTER_BROADCAST_TREE_DEFAULT);
+                router_clock_interval_ms = qemu_opt_get_number(opts,
+                                "clock-sync", ROUTER_CLOCK_INTERVAL_DEFAULT);
+                router_numa = qemu_opt_get_bool(opts, "numa", true);
+                dsm_pin_cache_pages = qemu_opt_get_number(opts, "pin-cache",
+                                                DSM_PIN_CACHE_PAGES_DEFAULT);
+                if (parse_dsm_mode(qemu_opt_get(opts, "dsm"))) {
+                    exit(1);
+                }
+                dsm_port = qemu_opt_get_number(opts, "dsm-port",
+                                               DSM_PORT_DEFAULT);
+                dsm_prefetch = qemu_opt_get_number(opts, "dsm-prefetch",
+                                                   DSM_PREFETCH_DEFAULT);
                 break;
             case QEMU_OPTION_debug:
                 pr_debug_log = 1;
@@ -4240,27 +4330,10 @@ int main(int argc, char **argv, char **envp)
 
     smp_parse(qemu_opts_find(qemu_find_opts("smp-opts"), NULL));
 
-    if (local_cpus > smp_cpus) {
-        error_report("Number of local SMP CPUs requested (%d) exceeds "
-				"smp CPUs (%d) ",
-                     local_cpus, smp_cpus);
-        exit(1);
-    }
-    if (local_cpu_start_index + local_cpus > smp_cpus) {
-        error_report("Last Index of local SMP CPUs requested (%d) exceeds "
-				"Last Index of smp CPUs (%d) ",
-                     local_cpu_start_index + local_cpus - 1, smp_cpus - 1);
-        exit(1);
-    }
-    if (local_cpu_start_index % local_cpus != 0) {
-        error_report("Start Index of local SMP CPUs requested (%d) not aligned "
-				"with Local CPU Number requested (%d)",
-                     local_cpu_start_index, local_cpus);
+    if (!router_topology_init(&err)) {
+        error_report_err(err);
         exit(1);
     }
-    if (local_cpus == -1) {
-        local_cpus = smp_cpus;
-    }
 
     printf("CPU Info\nTotal: %d\nLocal: %d [%d-%d]\nRemote: %d[ ",
            smp_cpus, local_cpus, local_cpu_start_index, local_cpu_start_index +
@@ -4463,7 +4536,6 @@ int main(int argc, char **argv, char **envp)
 
     configure_accelerator(current_machine);
 
-	/* [GiantVM Universal] 自动检测与初始化 */
     dsm_universal_init();
 
     if (qtest_chrdev) {